@@ -1,6 +1,61 @@
 #define GPIO_RECORD_PIN 2   // GPIO Pin für Aufnahme-Taste (Im Schaltplan das Signal: "KC87_REC_PICO")
 #define GPIO_PLAY_PIN 3     // GPIO Pin für Wiedergabe-Taste (Im Schaltplan das Signal: "KC87_PLAY_PICO")
 
+// Capture channels: channel 0 = tape signal, channels 1-3 = optional control lines
+// (e.g. play line, motor/remote control), enabled at runtime via PARAM_CHANNEL_MASK
+#define GPIO_MOTOR_PIN 4    // GPIO Pin für Motor-/Fernsteuerleitung (optional)
+#define GPIO_AUX_PIN 5      // GPIO Pin für weitere Steuerleitung (optional)
+#define CAPTURE_CHANNEL_PINS { GPIO_RECORD_PIN, GPIO_PLAY_PIN, GPIO_MOTOR_PIN, GPIO_AUX_PIN }
+
+// Default recording parameters (can be changed at runtime by the host, see PROTOCOL.md)
+#define RECORDING_TIMEOUT_MS_DEFAULT 5000   // Inactivity timeout until End of Stream
+#define GLITCH_FILTER_US_DEFAULT 0          // Minimum pulse width in µs, shorter pulses are dropped (0 = off)
+#define DECODE_MODE_DEFAULT 0               // 0 = raw edges, 1 = on-device KC87 tape decoding
+#define SYNC_INTERVAL_SAMPLES_DEFAULT 4096  // Sync Block at least every N samples (0 = off)
+#define SYNC_INTERVAL_MS_DEFAULT 1000       // Sync Block at least every N ms (0 = off)
+#define CHANNEL_MASK_DEFAULT 0x01           // Captured channels (Bit n = channel n), 0x01 = tape only
+#define TRIGGER_EDGES_DEFAULT 16            // Tape edges in a row that start a session (1 = first edge)
+#define PRETRIGGER_SAMPLES_DEFAULT 256      // Pre-trigger history: samples a session starts with at most
+#define TRIGGER_GAP_US 5000                 // A longer gap between tape edges restarts trigger run and history
+
+// Sample blocks: largest block in samples (PARAM_BLOCK_SAMPLES, 1 - 1024). Above 255 the session
+// announces header version 0x02 and sends Long Sample Blocks; the default 255 keeps streams at
+// version 0x01, a host asks for longer blocks explicitly.
+// Within that limit the block size follows the edge rate (see the protocol header comment).
+#define BLOCK_SAMPLES_DEFAULT 255
+#define BLOCK_SAMPLES_MIN 16                // Smallest adaptive block size
+#define BLOCK_WINDOW_MS 200                 // A block collects the samples of about this time span
+
+// Output of the session stream: Bit 0 = live over UART, Bit 1 = store in flash (PARAM_OUTPUT).
+// Also set by CMake with -DKC87_FLASH_STORE=ON (0x03) for bench operation without a host.
+#ifndef OUTPUT_MODE_DEFAULT
+#define OUTPUT_MODE_DEFAULT 0x01
+#endif
+
+// Flash session store (kc87_flash_store.h): circular log at the end of the on-board flash
+#define FLASH_STORE_SIZE (3u * 1024u * 1024u)      // Reserved flash, multiple of 4 KB (Pico 2: 4 MB flash)
+#define FLASH_STORE_SESSIONS 128                    // Stored sessions at most, the oldest is deleted beyond
+#define FLASH_STORE_ERASE_AHEAD (64u * 1024u)       // Kept erased ahead of the write position between sessions
+
+// Interrupt priority of the capture path (GPIO, timeout alarm, UART RX). Above all other
+// interrupts, so it keeps running from RAM while a flash operation holds back the rest.
+#define CAPTURE_IRQ_PRIORITY 0x00
+
+// KC87 tape decoder: full period thresholds in µs (nominal: 0-Bit 417, 1-Bit 833, separator 1667)
+#define KC87_PERIOD_MIN_US 280              // Shorter periods are invalid
+#define KC87_PERIOD_ZERO_ONE_US 625         // Boundary 0-Bit / 1-Bit
+#define KC87_PERIOD_ONE_SEP_US 1250         // Boundary 1-Bit / separator
+#define KC87_PERIOD_MAX_US 2500             // Longer periods are invalid (gap)
+#define KC87_LEADER_MIN 64                  // Minimum leader periods in front of a block
+#define KC87_LEADER_KEEP 64                 // Raw leader samples kept in front of a block attempt
+
+// Hot-path instrumentation: latency histograms dumped via CMD_HISTOGRAMS (kc87_instrument.h).
+// 0 compiles it out completely; also set by CMake with -DKC87_INSTRUMENTATION=ON
+#ifndef INSTRUMENTATION
+#define INSTRUMENTATION 0
+#endif
+#define INSTRUMENTATION_PROBE_US 1000       // Interval of the SysTick interrupt latency probe
+
 // Firmware Version (defined via CMake)
 #ifndef FW_VERSION_MAJOR
 #define FW_VERSION_MAJOR 0
@@ -0,0 +1,491 @@
+#include "kc87_flash_store.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#define STORE_MAGIC         0x5353434Bu     // "KCSS" little-endian
+#define STORE_CLEARED       0x00000000u     // Magic of a deleted session
+#define STORE_ERASED        0xFFFFFFFFu
+#define STORE_HEADER_SIZE   16
+#define STORE_OFFSET        (PICO_FLASH_SIZE_BYTES - FLASH_STORE_SIZE)
+#define STORE_PAGES         (FLASH_STORE_SIZE / FLASH_PAGE_SIZE)
+#define STORE_READ_CHUNK    4096
+
+// Interrupts at this priority or below wait during flash operations (USB and all others)
+#define STORE_MASK_PRIORITY (CAPTURE_IRQ_PRIORITY + 0x40)
+
+// Erasing during a session needs the capture interrupts to keep running (BASEPRI), elsewhere
+// a session only uses the sectors erased before it started
+#if defined(__ARM_ARCH_8M_MAIN__)
+#define STORE_ERASE_IN_SESSION 1
+#else
+#define STORE_ERASE_IN_SESSION 0
+#endif
+
+_Static_assert(FLASH_STORE_SIZE % FLASH_SECTOR_SIZE == 0, "FLASH_STORE_SIZE must be a multiple of the sector size");
+_Static_assert(FLASH_STORE_SIZE < PICO_FLASH_SIZE_BYTES, "FLASH_STORE_SIZE exceeds the flash size");
+_Static_assert(FLASH_STORE_ERASE_AHEAD < FLASH_STORE_SIZE / 2, "FLASH_STORE_ERASE_AHEAD too large");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t length;
+    uint32_t seq_check;
+} store_header_t;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t offset;    // Region offset of the record header
+    uint32_t length;    // Stream bytes
+} store_session_t;
+
+extern char __flash_binary_end;     // End of the firmware image (linker script)
+
+static bool available;              // Region is clear of the firmware image
+static store_session_t sessions[FLASH_STORE_SESSIONS]; // Stored sessions, oldest first
+static uint32_t session_count;
+static uint32_t next_seq;
+
+// Write position: the page buffer belongs to the page at page_offset. Sectors from there
+// up to erased_end are known to be erased.
+static uint8_t page[FLASH_PAGE_SIZE];
+static uint32_t page_offset;
+static uint32_t page_fill;
+static uint32_t erased_end;
+
+// Session being recorded
+static bool active;
+static bool full;
+static uint32_t active_offset;
+static uint32_t active_seq;
+static uint32_t active_length;
+static uint32_t active_dropped;     // Stream bytes not stored after the session was truncated
+
+static inline const uint8_t *region(uint32_t offset)
+{
+    return (const uint8_t *)(uintptr_t)(XIP_BASE + STORE_OFFSET + offset);
+}
+
+static inline uint32_t wrap(uint32_t offset)
+{
+    return offset % FLASH_STORE_SIZE;
+}
+
+// Flash span of a session: header and stream in whole pages
+static inline uint32_t session_span(uint32_t length)
+{
+    return (STORE_HEADER_SIZE + length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+}
+
+static bool is_erased(uint32_t offset, uint32_t len)
+{
+    const uint32_t *words = (const uint32_t *)region(offset);
+    for (uint32_t i = 0; i < len / 4; i++)
+    {
+        if (words[i] != STORE_ERASED)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Flash operations stall XIP: keep the RAM-resident capture interrupts running, hold back the rest
+static inline uint32_t flash_op_begin(void)
+{
+#if defined(__ARM_ARCH_8M_MAIN__)
+    uint32_t basepri = STORE_MASK_PRIORITY;
+    __asm volatile ("msr basepri, %0" : : "r" (basepri) : "memory");
+    return 0;
+#else
+    // No BASEPRI (Cortex-M0+, RISC-V): edges during a flash operation are delayed
+    return save_and_disable_interrupts();
+#endif
+}
+
+static inline void flash_op_end(uint32_t state)
+{
+#if defined(__ARM_ARCH_8M_MAIN__)
+    (void)state;
+    uint32_t basepri = 0;
+    __asm volatile ("msr basepri, %0" : : "r" (basepri) : "memory");
+#else
+    restore_interrupts(state);
+#endif
+}
+
+static void program_page(uint32_t offset, const uint8_t *data)
+{
+    uint32_t state = flash_op_begin();
+    flash_range_program(STORE_OFFSET + offset, data, FLASH_PAGE_SIZE);
+    flash_op_end(state);
+}
+
+// Programming can only clear bits: rewrite one header field of an already programmed page
+static void patch_header(uint32_t offset, size_t field, uint32_t value)
+{
+    static uint8_t buf[FLASH_PAGE_SIZE];
+    memcpy(buf, region(offset), FLASH_PAGE_SIZE);
+    memcpy(buf + field, &value, sizeof(value));
+    program_page(offset, buf);
+}
+
+static void remove_session(uint32_t index)
+{
+    memmove(&sessions[index], &sessions[index + 1], (session_count - index - 1) * sizeof(sessions[0]));
+    session_count--;
+}
+
+// Insert in sequence order; a full table drops (and deletes) its oldest session
+static void insert_session(uint32_t seq, uint32_t offset, uint32_t length)
+{
+    if (session_count == FLASH_STORE_SESSIONS)
+    {
+        if (seq < sessions[0].seq)
+        {
+            patch_header(offset, offsetof(store_header_t, magic), STORE_CLEARED);
+            return;
+        }
+        patch_header(sessions[0].offset, offsetof(store_header_t, magic), STORE_CLEARED);
+        remove_session(0);
+    }
+    uint32_t i = session_count;
+    while (i > 0 && sessions[i - 1].seq > seq)
+    {
+        sessions[i] = sessions[i - 1];
+        i--;
+    }
+    sessions[i] = (store_session_t){ .seq = seq, .offset = offset, .length = length };
+    session_count++;
+}
+
+static bool overlaps(const store_session_t *s, uint32_t sector)
+{
+    return wrap(sector + FLASH_STORE_SIZE - s->offset) < session_span(s->length) ||
+           wrap(s->offset + FLASH_STORE_SIZE - sector) < FLASH_SECTOR_SIZE;
+}
+
+// Erase a sector for reuse. Sessions stored in it are deleted first, so a session whose
+// tail is lost never shows up with its header intact.
+static void erase_sector(uint32_t sector)
+{
+    for (uint32_t i = 0; i < session_count;)
+    {
+        if (overlaps(&sessions[i], sector))
+        {
+            patch_header(sessions[i].offset, offsetof(store_header_t, magic), STORE_CLEARED);
+            remove_session(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    if (is_erased(sector, FLASH_SECTOR_SIZE))
+    {
+        return; // Spare the erase cycle
+    }
+    uint32_t state = flash_op_begin();
+    flash_range_erase(STORE_OFFSET + sector, FLASH_SECTOR_SIZE);
+    flash_op_end(state);
+}
+
+// Whether the page at page_offset is writable. Never erases: a sector erase takes up to
+// 400 ms and must not stall the main loop of a session, kc87_store_idle erases ahead instead.
+static bool prepare_page(void)
+{
+    if (page_offset % FLASH_SECTOR_SIZE != 0)
+    {
+        return true; // Rest of the current sector is erased
+    }
+    return page_offset != erased_end;
+}
+
+static void advance_page(void)
+{
+    memset(page, 0xFF, sizeof(page));
+    page_fill = 0;
+    page_offset = wrap(page_offset + FLASH_PAGE_SIZE);
+}
+
+// Stream length of a session without LENGTH: up to the last programmed byte before an erased
+// page. A session that stopped exactly at a sector end may pick up stale pages behind it.
+static uint32_t recover_length(uint32_t offset)
+{
+    uint32_t used = STORE_HEADER_SIZE;
+    for (uint32_t n = 0; n < STORE_PAGES; n++)
+    {
+        uint32_t p = wrap(offset + n * FLASH_PAGE_SIZE);
+        if (n > 0 && is_erased(p, FLASH_PAGE_SIZE))
+        {
+            break;
+        }
+        const uint8_t *data = region(p);
+        for (uint32_t i = FLASH_PAGE_SIZE; i > 0; i--)
+        {
+            if (data[i - 1] != 0xFF)
+            {
+                used = n * FLASH_PAGE_SIZE + i;
+                break;
+            }
+        }
+    }
+    return used > STORE_HEADER_SIZE ? used - STORE_HEADER_SIZE : 0;
+}
+
+void kc87_store_init(void)
+{
+    uint32_t binary_end = (uint32_t)((uintptr_t)&__flash_binary_end - XIP_BASE);
+    available = binary_end <= STORE_OFFSET;
+    if (!available)
+    {
+        printf("[DEBUG] Flash store disabled: firmware image overlaps the store region\n");
+        return;
+    }
+
+    // Deleted headers keep their sequence number: the newest header of any kind is the
+    // end of the log, writing continues behind it (also after kc87_store_clear)
+    bool have_last = false;
+    store_header_t last = { 0 };
+    uint32_t last_offset = 0;
+    for (uint32_t offset = 0; offset < FLASH_STORE_SIZE; offset += FLASH_PAGE_SIZE)
+    {
+        const store_header_t *h = (const store_header_t *)region(offset);
+        if ((h->magic != STORE_MAGIC && h->magic != STORE_CLEARED) || h->seq_check != ~h->seq)
+        {
+            continue;
+        }
+        if (!have_last || h->seq > last.seq)
+        {
+            have_last = true;
+            last = *h;
+            last_offset = offset;
+        }
+        if (h->magic == STORE_MAGIC)
+        {
+            insert_session(h->seq, offset, h->length);
+        }
+    }
+
+    // Session cut short by a power loss (the newest one)
+    if (have_last && last.length == STORE_ERASED)
+    {
+        last.length = recover_length(last_offset);
+        patch_header(last_offset, offsetof(store_header_t, length), last.length);
+        for (uint32_t i = 0; i < session_count; i++)
+        {
+            if (sessions[i].offset == last_offset)
+            {
+                sessions[i].length = last.length;
+            }
+        }
+    }
+
+    next_seq = have_last ? last.seq + 1 : 0;
+    page_offset = have_last ? wrap(last_offset + session_span(last.length)) : 0;
+    uint32_t sector_rest = FLASH_SECTOR_SIZE - page_offset % FLASH_SECTOR_SIZE;
+    if (sector_rest != FLASH_SECTOR_SIZE && !is_erased(page_offset, sector_rest))
+    {
+        page_offset = wrap(page_offset + sector_rest); // Stale data behind the log end
+    }
+    erased_end = page_offset % FLASH_SECTOR_SIZE ? wrap(page_offset + FLASH_SECTOR_SIZE - page_offset % FLASH_SECTOR_SIZE)
+                                                 : page_offset;
+    memset(page, 0xFF, sizeof(page));
+    page_fill = 0;
+
+    printf("[DEBUG] Flash store: %lu sessions, %lu KB at offset 0x%06lx\n", (unsigned long)session_count,
+           (unsigned long)(FLASH_STORE_SIZE / 1024), (unsigned long)STORE_OFFSET);
+}
+
+bool kc87_store_begin(void)
+{
+    if (!available || active)
+    {
+        return false;
+    }
+    // Sessions start on a page boundary, the page buffer is empty
+    if (!prepare_page())
+    {
+        printf("[DEBUG] Flash store has no erased sector ready\n");
+        return false;
+    }
+    active = true;
+    full = false;
+    active_offset = page_offset;
+    active_seq = next_seq++;
+    active_length = 0;
+    active_dropped = 0;
+    store_header_t header = {
+        .magic = STORE_MAGIC,
+        .seq = active_seq,
+        .length = STORE_ERASED,
+        .seq_check = ~active_seq,
+    };
+    memcpy(page, &header, sizeof(header));
+    page_fill = STORE_HEADER_SIZE;
+    printf("[DEBUG] Storing session %lu in flash\n", (unsigned long)active_seq);
+    return true;
+}
+
+void kc87_store_write(const uint8_t *data, size_t len)
+{
+    if (active && full)
+    {
+        active_dropped += len;
+        return;
+    }
+    while (active && !full && len > 0)
+    {
+        size_t n = FLASH_PAGE_SIZE - page_fill;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(page + page_fill, data, n);
+        page_fill += n;
+        active_length += n;
+        data += n;
+        len -= n;
+
+        if (page_fill == FLASH_PAGE_SIZE)
+        {
+            program_page(page_offset, page);
+            advance_page();
+            if (!prepare_page())
+            {
+                // Erase-ahead did not keep up or the region is full: the rest is counted, not stored
+                full = true;
+                active_dropped += len;
+                printf("[DEBUG] Flash store full, session %lu truncated after %lu bytes\n",
+                       (unsigned long)active_seq, (unsigned long)active_length);
+            }
+        }
+    }
+}
+
+void kc87_store_end(void)
+{
+    if (!active)
+    {
+        return;
+    }
+    active = false;
+
+    // Short session: the header is still in the page buffer
+    bool header_buffered = page_fill > 0 && page_offset == active_offset;
+    if (header_buffered)
+    {
+        memcpy(page + offsetof(store_header_t, length), &active_length, sizeof(active_length));
+    }
+    if (page_fill > 0)
+    {
+        program_page(page_offset, page);
+        advance_page();
+    }
+    if (!header_buffered)
+    {
+        patch_header(active_offset, offsetof(store_header_t, length), active_length);
+    }
+    insert_session(active_seq, active_offset, active_length);
+    printf("[DEBUG] Stored session %lu (%lu bytes, %lu bytes truncated)\n", (unsigned long)active_seq,
+           (unsigned long)active_length, (unsigned long)active_dropped);
+}
+
+bool kc87_store_idle(void)
+{
+    if (!available || (active && (full || !STORE_ERASE_IN_SESSION)))
+    {
+        return false;
+    }
+    // Erased reserve ahead of the write position, sessions never wait for an erase
+    if (wrap(erased_end + FLASH_STORE_SIZE - page_offset) >= FLASH_STORE_ERASE_AHEAD)
+    {
+        return false;
+    }
+    if (active)
+    {
+        if (erased_end == active_offset - active_offset % FLASH_SECTOR_SIZE)
+        {
+            return false; // The active session would overwrite itself
+        }
+    }
+    else if (session_count > 0 && overlaps(&sessions[session_count - 1], erased_end))
+    {
+        return false; // Newest session fills the region, only the next session may overwrite it
+    }
+    erase_sector(erased_end);
+    erased_end = wrap(erased_end + FLASH_SECTOR_SIZE);
+    return true;
+}
+
+void kc87_store_list(void)
+{
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < session_count; i++)
+    {
+        printf("[STORE] SESSION %lu %lu\n", (unsigned long)sessions[i].seq, (unsigned long)sessions[i].length);
+        used += session_span(sessions[i].length);
+    }
+    printf("[STORE] LIST %lu %lu %lu\n", (unsigned long)session_count, (unsigned long)used,
+           (unsigned long)(available ? FLASH_STORE_SIZE : 0));
+}
+
+// Raw bytes on USB stdio, bypassing the CR/LF translation of printf
+static void send_raw(const uint8_t *data, uint32_t len)
+{
+    while (len > 0)
+    {
+        uint32_t n = len < STORE_READ_CHUNK ? len : STORE_READ_CHUNK;
+        stdio_usb.out_chars((const char *)data, (int)n);
+        data += n;
+        len -= n;
+    }
+}
+
+bool kc87_store_read(uint32_t seq)
+{
+    const store_session_t *s = NULL;
+    for (uint32_t i = 0; i < session_count; i++)
+    {
+        if (sessions[i].seq == seq)
+        {
+            s = &sessions[i];
+        }
+    }
+    if (s == NULL)
+    {
+        printf("[STORE] ERROR %lu\n", (unsigned long)seq);
+        return false;
+    }
+
+    // Straight from XIP, in two parts if the session wraps around the region end
+    uint32_t start = wrap(s->offset + STORE_HEADER_SIZE);
+    uint32_t first = FLASH_STORE_SIZE - start < s->length ? FLASH_STORE_SIZE - start : s->length;
+    printf("[STORE] DATA %lu %lu\n", (unsigned long)seq, (unsigned long)s->length);
+    stdio_flush();
+    send_raw(region(start), first);
+    send_raw(region(0), s->length - first);
+    printf("[STORE] END %lu\n", (unsigned long)seq);
+    return true;
+}
+
+void kc87_store_clear(void)
+{
+    // Every valid header in the region, also sessions the table no longer holds
+    uint32_t cleared = 0;
+    for (uint32_t offset = 0; offset < FLASH_STORE_SIZE && available; offset += FLASH_PAGE_SIZE)
+    {
+        const store_header_t *h = (const store_header_t *)region(offset);
+        if (h->magic == STORE_MAGIC && h->seq_check == ~h->seq)
+        {
+            patch_header(offset, offsetof(store_header_t, magic), STORE_CLEARED);
+            cleared++;
+        }
+    }
+    session_count = 0;
+    printf("[STORE] CLEARED %lu\n", (unsigned long)cleared);
+}
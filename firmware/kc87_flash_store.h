@@ -0,0 +1,41 @@
+#ifndef KC87_FLASH_STORE_H
+#define KC87_FLASH_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+// Store-and-forward capture: sessions are written to the last FLASH_STORE_SIZE bytes of the
+// on-board flash and downloaded over USB later (CMD_STORE, see PROTOCOL.md).
+//
+// The region is a circular log. Every session starts on a page boundary with a 16-byte
+// record header, followed by the block stream exactly as it is sent over UART:
+//   MAGIC "KCSS" (4 Bytes), SEQ (uint32 LE), LENGTH (uint32 LE, stream bytes), ~SEQ (uint32 LE)
+// LENGTH stays erased (0xFFFFFFFF) while recording and is programmed at session end; a session
+// cut short by a power loss gets its length at the next start. Sectors are erased in log order
+// up to FLASH_STORE_ERASE_AHEAD ahead of the write position, so all sectors wear evenly. Writing
+// never erases: a session that catches up with the erased reserve is truncated (the bytes lost
+// are counted). The oldest sessions are overwritten as the log wraps around. Deleting a session
+// only clears its magic and needs no erase.
+//
+// All functions are called from the main loop. Flash operations stall code execution from
+// flash; only the capture interrupts (CAPTURE_IRQ_PRIORITY, RAM-resident) keep running.
+
+void kc87_store_init(void);
+
+// Session recording: begin returns false if no session can be stored (region unavailable)
+bool kc87_store_begin(void);
+void kc87_store_write(const uint8_t *data, size_t len);
+void kc87_store_end(void);
+
+// Erase ahead, one sector per call; returns true while work is left. Between sessions, and
+// during a stored session with the ring buffer drained (only with BASEPRI, see flash_op_begin).
+bool kc87_store_idle(void);
+
+// Host commands, replies as "[STORE] ..." lines (and raw stream bytes) on USB stdio
+void kc87_store_list(void);
+bool kc87_store_read(uint32_t seq);
+void kc87_store_clear(void);
+
+#endif // KC87_FLASH_STORE_H
@@ -0,0 +1,96 @@
+#include "kc87_instrument.h"
+
+#if INSTRUMENTATION
+
+#include <stdio.h>
+#include <string.h>
+#include "hardware/clocks.h"
+#include "hardware/exception.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/structs/systick.h"
+
+// The GPIO interrupt carries no timestamp of the edge that raised it, so its entry
+// latency cannot be taken directly. Instead SysTick runs as a probe at the priority of
+// the GPIO interrupt: it pends at a known instant (counter reload) and its handler reads
+// how far the counter has run down since. The result is the delay an edge arriving at
+// the same instant would see (interrupts disabled, other handlers of equal or higher
+// priority, exception entry), in CPU cycles. Like the capture path it runs from RAM, so it
+// keeps measuring during flash operations of the session store.
+
+#define SYSTICK_CSR_ENABLE      (1u << 0)
+#define SYSTICK_CSR_TICKINT     (1u << 1)
+#define SYSTICK_CSR_CLKSOURCE   (1u << 2)   // Processor clock
+
+instr_data_t instr_data[INSTR_HISTOGRAMS];
+
+static const char *const instr_names[INSTR_HISTOGRAMS] = {
+    "ISR entry latency (cycles)",
+    "ISR duration (cycles)",
+    "Ring buffer depth (samples)",
+    "UART write stall (cycles)",
+    "Main loop iteration (cycles)",
+};
+
+static void __not_in_flash_func(systick_probe_irq)(void)
+{
+    instr_record(INSTR_ISR_LATENCY, systick_hw->rvr - systick_hw->cvr);
+}
+
+void instr_init(void)
+{
+    // DWT cycle counter
+    hw_set_bits(&m33_hw->demcr, M33_DEMCR_TRCENA_BITS);
+    m33_hw->dwt_cyccnt = 0;
+    hw_set_bits(&m33_hw->dwt_ctrl, M33_DWT_CTRL_CYCCNTENA_BITS);
+
+    // SysTick latency probe
+    exception_set_exclusive_handler(SYSTICK_EXCEPTION, systick_probe_irq);
+    exception_set_priority(SYSTICK_EXCEPTION, CAPTURE_IRQ_PRIORITY);
+    systick_hw->rvr = clock_get_hz(clk_sys) / 1000000u * INSTRUMENTATION_PROBE_US - 1;
+    systick_hw->cvr = 0;
+    systick_hw->csr = SYSTICK_CSR_CLKSOURCE | SYSTICK_CSR_TICKINT | SYSTICK_CSR_ENABLE;
+}
+
+void instr_reset(void)
+{
+    uint32_t irq_state = save_and_disable_interrupts();
+    memset(instr_data, 0, sizeof(instr_data));
+    restore_interrupts(irq_state);
+}
+
+void instr_dump(void)
+{
+    // Consistent snapshot, printing is far too slow to run with interrupts disabled
+    static instr_data_t snapshot[INSTR_HISTOGRAMS];
+    uint32_t irq_state = save_and_disable_interrupts();
+    memcpy(snapshot, instr_data, sizeof(snapshot));
+    restore_interrupts(irq_state);
+
+    uint32_t cycles_per_us = clock_get_hz(clk_sys) / 1000000u;
+    printf("[DEBUG] Histograms (%lu cycles per us)\n", (unsigned long)cycles_per_us);
+    for (int h = 0; h < INSTR_HISTOGRAMS; h++)
+    {
+        const instr_data_t *data = &snapshot[h];
+        uint32_t count = 0;
+        for (int b = 0; b < INSTR_BUCKETS; b++)
+        {
+            count += data->count[b];
+        }
+        printf("[DEBUG] %s: %lu values, mean %lu, max %lu\n", instr_names[h], (unsigned long)count,
+               (unsigned long)(count ? data->sum / count : 0), (unsigned long)data->max);
+        for (int b = 0; b < INSTR_BUCKETS; b++)
+        {
+            if (data->count[b] == 0)
+            {
+                continue;
+            }
+            uint32_t low = b ? 1u << (b - 1) : 0;
+            uint32_t high = (b == INSTR_BUCKETS - 1) ? UINT32_MAX : b ? (1u << b) - 1 : 0;
+            printf("[DEBUG]   %10lu - %10lu: %lu\n", (unsigned long)low, (unsigned long)high,
+                   (unsigned long)data->count[b]);
+        }
+    }
+}
+
+#endif // INSTRUMENTATION
@@ -0,0 +1,77 @@
+#ifndef KC87_INSTRUMENT_H
+#define KC87_INSTRUMENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+// Hot-path instrumentation (INSTRUMENTATION in config.h, cmake -DKC87_INSTRUMENTATION=ON):
+// fixed-bucket histograms in RAM, dumped over USB stdio on request (CMD_HISTOGRAMS).
+// Times are CPU cycles from the DWT cycle counter (RP2350). Bucket 0 counts the value 0,
+// bucket k the values 2^(k-1) .. 2^k - 1, the last bucket everything above.
+// With INSTRUMENTATION 0 all INSTR_* macros expand to nothing and no data is kept.
+
+typedef enum {
+    INSTR_ISR_LATENCY = 0,  // Interrupt entry latency (SysTick probe at the GPIO IRQ priority)
+    INSTR_ISR_DURATION,     // Run time of gpio_callback
+    INSTR_RING_DEPTH,       // Ring buffer fill level in samples after each committed edge
+    INSTR_UART_STALL,       // Time blocked in uart_write_blocking per call
+    INSTR_LOOP_TIME,        // Main loop iteration, sleep in __wfi() excluded
+    INSTR_HISTOGRAMS
+} instr_histogram_t;
+
+#if INSTRUMENTATION
+
+#if !PICO_RP2350
+#error "INSTRUMENTATION needs the DWT cycle counter of the RP2350 (Cortex-M33)"
+#endif
+
+#include "hardware/structs/m33.h"
+
+#define INSTR_BUCKETS 32
+
+typedef struct {
+    uint32_t count[INSTR_BUCKETS];
+    uint32_t max;
+    uint64_t sum;
+} instr_data_t;
+
+// Each histogram is written from one context only (ISR or main loop)
+extern instr_data_t instr_data[INSTR_HISTOGRAMS];
+
+static inline uint32_t instr_cycles(void)
+{
+    return m33_hw->dwt_cyccnt;
+}
+
+static __force_inline void instr_record(instr_histogram_t histogram, uint32_t value)
+{
+    instr_data_t *data = &instr_data[histogram];
+    uint32_t bucket = value ? 32u - (uint32_t)__builtin_clz(value) : 0;
+    data->count[bucket < INSTR_BUCKETS ? bucket : INSTR_BUCKETS - 1]++;
+    data->sum += value;
+    if (value > data->max)
+    {
+        data->max = value;
+    }
+}
+
+void instr_init(void);
+void instr_dump(void);
+void instr_reset(void);
+
+#define INSTR_INIT()                    instr_init()
+#define INSTR_START(name)               uint32_t name = instr_cycles()
+#define INSTR_RECORD(histogram, value)  instr_record((histogram), (value))
+#define INSTR_RECORD_SINCE(histogram, start) instr_record((histogram), instr_cycles() - (start))
+
+#else
+
+#define INSTR_INIT()
+#define INSTR_START(name)
+#define INSTR_RECORD(histogram, value)
+#define INSTR_RECORD_SINCE(histogram, start)
+
+#endif // INSTRUMENTATION
+
+#endif // KC87_INSTRUMENT_H
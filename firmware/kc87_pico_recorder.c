@@ -1,10 +1,17 @@
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "pico/stdio_usb.h"
 #include "hardware/gpio.h"
 #include "hardware/timer.h"
 #include "hardware/uart.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/structs/io_bank0.h"
 #include "config.h"
+#include "kc87_tape_decoder.h"
+#include "kc87_instrument.h"
+#include "kc87_flash_store.h"
 
 // UART Configuration (Debug Probe UART Bridge)
 // UART0: TX = GPIO0, RX = GPIO1
@@ -16,14 +23,14 @@
 // Serial Data Encoding
 // Data format: 16-bit sample where MSB is edge type (1=Rising, 0=Falling) and lower 15 bits are delta in microseconds
 // Example: 0x800A = Rising edge with 10 μs delta, 0x0005 = Falling edge with 5 μs delta
-// Data sent in an Block-Format with max 255 samples per block (510 bytes + 5 bytes overhead) for efficient transmission.
+// Data sent in an Block-Format with up to PARAM_BLOCK_SAMPLES samples per block for efficient transmission.
 // Block format: [START-BLOCK][SAMPLE_COUNT][SAMPLE0][SAMPLE1][SAMPLE2]...[SAMPLEN][END-BLOCK]
 // START-BLOCK = 0x0000, END-BLOCK = 0x8000
 
 // Header Block structure:
 // 0x0000 - 0x0000 [2 Bytes] START-BLOCK
 // 0x0002 - 0x00   [1 Byte]  BLOCK_TYPE (0x00 = Header-Block)
-// 0x0003 - 0x01   [1 Byte]  VERSION (0x01)
+// 0x0003 - 0x01   [1 Byte]  VERSION (0x01, or 0x02 when the session may send Long Sample Blocks)
 // 0x0004 - 0x8000 [2 Bytes] END-BLOCK (0x8000)
 
 // Sample Block structure (version 0x01):
@@ -33,79 +40,1004 @@
 // 0x0004 - 0x..   [2*N Bytes] SAMPLE0, SAMPLE1, ..., SAMPLEN-1
 // 0x..   - 0x8000 [2 Bytes] END-BLOCK (0x8000)
 
+// Long Sample Block structure (version 0x02 only, blocks with more than 255 samples):
+// 0x0000 - 0x0000 [2 Bytes] START-BLOCK
+// 0x0002 - 0x81   [1 Byte] BLOCK_TYPE (0x81 = Long Sample-Block)
+// 0x0003 - 0x..   [2 Bytes] SAMPLE_COUNT (N, uint16 LE, 256 - 4096)
+// 0x0005 - 0x..   [2*N Bytes] SAMPLE0, SAMPLE1, ..., SAMPLEN-1
+// 0x..   - 0x8000 [2 Bytes] END-BLOCK (0x8000)
+// Block size adapts to the edge rate: a block is sent once it holds the samples expected within
+// BLOCK_WINDOW_MS (at most PARAM_BLOCK_SAMPLES) or its first sample waited BLOCK_WINDOW_MS, so
+// sustained signals go out in large blocks and sparse ones in small blocks without delay.
+
+// Extended blocks (BLOCK_TYPE 0x02 - 0x7F) all share one layout, so older hosts can skip them:
+// 0x0000 - 0x0000 [2 Bytes] START-BLOCK
+// 0x0002 - 0x..   [1 Byte] BLOCK_TYPE
+// 0x0003 - 0x..   [1 Byte] PAYLOAD_LENGTH (L)
+// 0x0004 - 0x..   [L Bytes] PAYLOAD
+// 0x..   - 0x8000 [2 Bytes] END-BLOCK (0x8000)
+
+// Statistics Block (BLOCK_TYPE 0x02), sent once per session right before End of Stream:
+// PAYLOAD: GLITCH_COUNT (uint32 LE) - pulses suppressed by the glitch filter
+//          DROP_COUNT   (uint32 LE) - samples lost due to ring buffer overflow
+
+// Tape Block (BLOCK_TYPE 0x03), decoded KC87 tape block (decode mode only):
+// PAYLOAD: STATUS (1 Byte, 0x00 = OK, 0x01 = checksum error), BLOCK_NR (1 Byte),
+//          LEADER_PERIODS (uint16 LE), DATA (128 Bytes), CHECKSUM (1 Byte, as read from tape)
+// In decode mode only sections that could not be decoded are sent as Sample Blocks.
+// Blocks with a checksum error are sent as Tape Block and additionally as raw samples (before the Tape Block).
+
+// Sync Block (BLOCK_TYPE 0x04), absolute time reference (raw mode only):
+// PAYLOAD: SAMPLE_INDEX (uint32 LE) - index of the next sample in the stream, counted from session start
+//                                     (including samples lost by ring buffer overflow)
+//          TIMESTAMP_US (uint64 LE) - time_us_64() of that sample
+// Sent in front of the first Sample Block of a session and then in front of the next Sample Block
+// after every PARAM_SYNC_SAMPLES samples or PARAM_SYNC_MS milliseconds, whichever comes first.
+
+// Channel Block (BLOCK_TYPE 0x05), multi-channel capture:
+// PAYLOAD: CHANNEL_MASK (1 Byte) - enabled channels (Bit n = channel n, see CAPTURE_CHANNEL_PINS)
+// Sent after the Header Block when more than one channel is enabled and valid for all following
+// Sample Blocks of the session. With K enabled channels every sample carries C = ceil(log2(K)) channel
+// bits below the edge bit: Bit 15 = edge, Bits 14..15-C = channel ordinal within CHANNEL_MASK,
+// remaining bits = delta to the previous sample of any channel (shared timebase).
+
+// Session start and pre-trigger history:
+// While no session runs, tape edges are kept in the ring buffer as history. A session starts once
+// PARAM_TRIGGER_EDGES tape edges arrived with gaps below TRIGGER_GAP_US (or on any control line edge)
+// and begins with that run of edges, at most PARAM_PRETRIGGER samples, so decoders see the leader
+// from its start. The first sample of a session always has delta 0: its time is the session start
+// (see the Sync Block for the absolute time). A gap of TRIGGER_GAP_US or more starts a new run.
+
 // End of Block is always signaled by the fixed END-BLOCK marker (0x8000). The number of samples is specified in the SAMPLE_COUNT field.
 // End of Stream is signaled by consecutive 0x8000 marker 0x8000 
 
+// Host Commands (Host -> Pico, UART RX or USB stdio)
+// Commands are sent as SLIP frames (0xC0 framing, same encoding as serial_transmit).
+// Frame payload: [CMD (1 Byte)][PARAMETERS...]
+// 2-byte frames are reserved for playback samples, commands never have exactly 2 bytes.
+//
+// CMD_SET_PARAM (0x01): [0x01][PARAM_ID (1 Byte)][VALUE (4 Bytes, little-endian)]
+//   PARAM_TIMEOUT_MS (0x01): Inactivity timeout in milliseconds until End of Stream (10 - 60000)
+//   PARAM_EDGE_MASK  (0x02): Captured edge types (Bit 0 = falling, Bit 1 = rising)
+//   PARAM_GLITCH_US  (0x03): Glitch filter, minimum pulse width in microseconds (0 = off, max 1000)
+//   PARAM_DECODE_MODE (0x04): 0 = raw edges, 1 = KC87 tape decoding (applies from the next session)
+//   PARAM_SYNC_SAMPLES (0x05): Sync Block interval in samples (0 = off)
+//   PARAM_SYNC_MS    (0x06): Sync Block interval in milliseconds (0 = off)
+//   PARAM_CHANNEL_MASK (0x07): Captured channels, Bit n = channel n (0x01 - 0x0F, applies from the next session)
+//   PARAM_TRIGGER_EDGES (0x08): Tape edges in a row (gaps below TRIGGER_GAP_US) that start a session (1 - 1000)
+//   PARAM_PRETRIGGER  (0x09): Pre-trigger history, samples a session starts with at most (1 - 512)
+//   PARAM_OUTPUT     (0x0A): Session output, Bit 0 = live over UART, Bit 1 = store in flash (applies from the next session)
+//   PARAM_BLOCK_SAMPLES (0x0B): Largest Sample Block (1 - 1024, applies from the next session);
+//                              up to 255 the stream keeps header version 0x01 for older hosts
+// Parameters are kept in RAM and reset to the defaults from config.h on power-up.
+//
+// CMD_HISTOGRAMS (0x02): [0x02][ACTION (1 Byte)][0x00]
+//   Bit 0 = print the hot-path histograms on the USB debug output, Bit 1 = clear them (after printing).
+//   Only available in firmware built with INSTRUMENTATION (see kc87_instrument.h).
+//
+// CMD_STORE (0x03): [0x03][OP (1 Byte)][SEQ (4 Bytes, little-endian)]
+//   Flash session store (kc87_flash_store.h), replies as "[STORE] ..." lines on USB stdio:
+//   STORE_LIST (0x01): one "SESSION <seq> <bytes>" line per stored session, then "LIST <count> <used> <size>"
+//   STORE_READ (0x02): "DATA <seq> <bytes>", the stored block stream as raw bytes, then "END <seq>"
+//   STORE_CLEAR (0x03): deletes all stored sessions, then "CLEARED <count>"
+//   SEQ is only used by STORE_READ. Reading and clearing are refused ("BUSY") while a session runs.
+#define CMD_SET_PARAM       0x01
+#define CMD_HISTOGRAMS      0x02
+#define CMD_STORE           0x03
+#define PARAM_TIMEOUT_MS    0x01
+#define PARAM_EDGE_MASK     0x02
+#define PARAM_GLITCH_US     0x03
+#define PARAM_DECODE_MODE   0x04
+#define PARAM_SYNC_SAMPLES  0x05
+#define PARAM_SYNC_MS       0x06
+#define PARAM_CHANNEL_MASK  0x07
+#define PARAM_TRIGGER_EDGES 0x08
+#define PARAM_PRETRIGGER    0x09
+#define PARAM_OUTPUT        0x0A
+#define PARAM_BLOCK_SAMPLES 0x0B
+
+#define HISTOGRAMS_DUMP     0x01
+#define HISTOGRAMS_CLEAR    0x02
+
+#define STORE_LIST          0x01
+#define STORE_READ          0x02
+#define STORE_CLEAR         0x03
+
+#define OUTPUT_UART         0x01
+#define OUTPUT_FLASH        0x02
+
+#define BLOCK_TYPE_STATS    0x02
+#define BLOCK_TYPE_TAPE     0x03
+#define BLOCK_TYPE_SYNC     0x04
+#define BLOCK_TYPE_CHANNELS 0x05
+#define BLOCK_TYPE_SAMPLES_LONG 0x81
+
+#define BLOCK_SAMPLES_SHORT 255             // Largest (short) Sample Block of version 0x01
+#define BLOCK_SAMPLES_LIMIT 1024            // Largest Long Sample Block (block_buf size)
+#define BLOCK_HEAD_MAX      5               // START, TYPE and 16-bit SAMPLE_COUNT
+
+// Capture channels: channel 0 is the tape signal, the others are optional control lines
+// (not const: the capture path must not read from flash, see kc87_flash_store.h)
+#define CAPTURE_CHANNELS    4
+static uint capture_channel_pins[CAPTURE_CHANNELS] = CAPTURE_CHANNEL_PINS;
+
+#define EDGE_MASK_FALL      0x01
+#define EDGE_MASK_RISE      0x02
+
+#define SLIP_END            0xC0
+#define SLIP_ESC            0xDB
+#define SLIP_ESC_END        0xDC
+#define SLIP_ESC_ESC        0xDD
+
+#define CMD_FRAME_MAX       16
+
+// Runtime recording parameters (set by the host via CMD_SET_PARAM)
+typedef struct {
+    uint32_t timeout_us;    // Inactivity timeout until End of Stream
+    uint32_t edge_events;   // GPIO_IRQ_EDGE_RISE / GPIO_IRQ_EDGE_FALL
+    uint32_t glitch_us;     // Minimum pulse width, shorter pulses are suppressed (0 = off)
+    uint32_t decode_mode;   // 0 = raw edges, 1 = KC87 tape decoding
+    uint32_t sync_samples;  // Sync Block interval in samples (0 = off)
+    uint32_t sync_us;       // Sync Block interval in microseconds (0 = off)
+    uint32_t channel_mask;  // Captured channels (Bit n = channel n)
+    uint32_t trigger_edges; // Tape edges in a row that start a session
+    uint32_t pretrigger;    // Pre-trigger history length in samples
+    uint32_t output;        // OUTPUT_UART / OUTPUT_FLASH
+    uint32_t block_samples; // Largest Sample Block
+} recorder_config_t;
+
+static volatile recorder_config_t config = {
+    .timeout_us = RECORDING_TIMEOUT_MS_DEFAULT * 1000u,
+    .edge_events = GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL,
+    .glitch_us = GLITCH_FILTER_US_DEFAULT,
+    .decode_mode = DECODE_MODE_DEFAULT,
+    .sync_samples = SYNC_INTERVAL_SAMPLES_DEFAULT,
+    .sync_us = SYNC_INTERVAL_MS_DEFAULT * 1000u,
+    .channel_mask = CHANNEL_MASK_DEFAULT,
+    .trigger_edges = TRIGGER_EDGES_DEFAULT,
+    .pretrigger = PRETRIGGER_SAMPLES_DEFAULT,
+    .output = OUTPUT_MODE_DEFAULT,
+    .block_samples = BLOCK_SAMPLES_DEFAULT,
+};
+
 // Recording variables
 volatile uint32_t last_timestamp = 0;
 volatile uint32_t timestamp = 0;
 volatile bool recording = false;
 volatile bool send_header_flag = false;
+volatile bool timeout_flag = false;
 volatile uint16_t sample_count = 0;
-volatile uint16_t sample_buffer[256]; // Buffer for 256 samples (512 bytes)
 volatile uint16_t ring_buffer[1024]; // Ring buffer for 1024 samples
+volatile uint32_t ring_time[1024]; // Capture time (time_us_32) of each ring buffer sample
 volatile uint16_t ring_head = 0;
 volatile uint16_t ring_tail = 0;
 
-#define RECORDING_TIMEOUT_US 5 * 1000 * 1000 // 5s inactivity timeout
+// Glitch filter: the most recent edge is held back until the next edge proves that
+// the pulse between them is at least config.glitch_us wide. A shorter pulse drops both edges.
+static bool pending_valid = false;
+static uint32_t pending_timestamp;
+static uint16_t pending_edge_bit;
+
+// Channel encoding, latched by the capture path at session start
+static volatile uint8_t session_channel_mask = 0x01;
+static uint8_t session_channel_bits = 0;       // Channel bits per sample (0 = single channel)
+static uint16_t session_delta_max = 0x7FFF;    // Largest delta that fits next to the channel bits
+static uint16_t channel_code[CAPTURE_CHANNELS]; // Channel ordinal, already shifted into place
+
+// Pre-trigger history (capture path): oldest kept edge of the current run and the run length
+static uint16_t history_start = 0;
+static uint32_t trigger_run = 0;
+
+// Session statistics (reset on session start, reported in the statistics block)
+volatile uint32_t glitch_count = 0;
+volatile uint32_t drop_count = 0;
+
+// Hardware alarm used for the session inactivity timeout.
+// The alarm is re-armed by the capture path on every edge, so it only fires after
+// config.timeout_us without any edge. It is driven directly via the timer registers
+// to keep re-arming in the GPIO interrupt down to a single register write.
+static uint timeout_alarm_num;
+
+// Hardware alarm that wakes the main loop BLOCK_WINDOW_MS after the first sample of a block,
+// so a started block of a sparse stream goes out without waiting for another interrupt.
+static uint block_alarm_num;
+
+// On-device tape decoder (main loop only), enabled per session
+static kc87_decoder_t decoder;
+static volatile bool session_decode = false;   // Latched by the capture path at session start
+
+// Session output, latched by the main loop at session start
+static uint32_t session_output = OUTPUT_MODE_DEFAULT;
+
+// Sample Block under construction (main loop only). Samples are queued behind room for the
+// longest block header, so the block goes out with a single write and no copy.
+static uint8_t block_buf[BLOCK_HEAD_MAX + 2 * BLOCK_SAMPLES_LIMIT + 2];
+static uint16_t session_block_max = BLOCK_SAMPLES_DEFAULT;  // Latched at session start
+static uint16_t block_target;       // Adaptive block size, follows the edge rate
+static uint32_t block_start_us;     // Queue time of the first sample of the block
+
+// Sync Block bookkeeping (main loop only)
+static uint32_t processed_count;    // Samples taken from the ring in this session
+static uint32_t last_sync_index;
+static uint64_t last_sync_time;
+
+// UART receive ring for host commands (filled by the UART RX interrupt)
+static volatile uint8_t rx_ring[64];
+static volatile uint8_t rx_head = 0;
+static volatile uint8_t rx_tail = 0;
+
+// SLIP command decoder, one per command source (UART, USB)
+typedef struct {
+    uint8_t frame[CMD_FRAME_MAX];
+    uint len;
+    bool escaped;
+    bool overflow;
+} slip_decoder_t;
+
+static slip_decoder_t uart_slip;
+static slip_decoder_t usb_slip;
+
+// Interrupt handlers and everything they call run from RAM at CAPTURE_IRQ_PRIORITY:
+// they keep capturing while the flash store programs or erases (kc87_flash_store.h)
+static void __not_in_flash_func(timeout_alarm_irq)(void)
+{
+    timer_hw->intr = 1u << timeout_alarm_num; // Acknowledge alarm interrupt
+    timeout_flag = true;
+}
+
+static __force_inline void arm_timeout_alarm(uint32_t now_us)
+{
+    // Writing the target into the ALARM register arms the alarm (low 32 bits of the timer)
+    timer_hw->alarm[timeout_alarm_num] = now_us + config.timeout_us;
+}
+
+static void init_timeout_alarm(void)
+{
+    timeout_alarm_num = (uint)hardware_alarm_claim_unused(true);
+    uint irq_num = hardware_alarm_get_irq_num(timeout_alarm_num);
+    irq_set_exclusive_handler(irq_num, timeout_alarm_irq);
+    irq_set_priority(irq_num, CAPTURE_IRQ_PRIORITY);
+    hw_set_bits(&timer_hw->inte, 1u << timeout_alarm_num);
+    irq_set_enabled(irq_num, true);
+}
+
+// Only wakes the main loop (which sends the block), so like USB it may wait for flash operations
+static void block_alarm_irq(void)
+{
+    timer_hw->intr = 1u << block_alarm_num; // Acknowledge alarm interrupt
+}
+
+static void init_block_alarm(void)
+{
+    block_alarm_num = (uint)hardware_alarm_claim_unused(true);
+    uint irq_num = hardware_alarm_get_irq_num(block_alarm_num);
+    irq_set_exclusive_handler(irq_num, block_alarm_irq);
+    hw_set_bits(&timer_hw->inte, 1u << block_alarm_num);
+    irq_set_enabled(irq_num, true);
+}
+
+static void __not_in_flash_func(uart_rx_irq)(void)
+{
+    while (uart_is_readable(UART_ID))
+    {
+        uint8_t b = (uint8_t)uart_getc(UART_ID);
+        uint8_t next_head = (rx_head + 1) % sizeof(rx_ring);
+        if (next_head != rx_tail)
+        {
+            rx_ring[rx_head] = b;
+            rx_head = next_head;
+        }
+    }
+}
+
+// All writes of the data stream, the time blocked in the UART FIFO is instrumented
+static void write_stream(const uint8_t *buf, size_t len)
+{
+    if (session_output & OUTPUT_UART)
+    {
+        INSTR_START(write_start);
+        uart_write_blocking(UART_ID, buf, len);
+        INSTR_RECORD_SINCE(INSTR_UART_STALL, write_start);
+    }
+    if (session_output & OUTPUT_FLASH)
+    {
+        kc87_store_write(buf, len);
+    }
+}
 
 void send_header_block()
 {
     printf("[DEBUG] Sending header block\n");
     // Header block format:
-    // START-BLOCK (0x0000), BLOCK_TYPE (0x00), VERSION (0x01), END-BLOCK (0x8000)
+    // START-BLOCK (0x0000), BLOCK_TYPE (0x00), VERSION (0x01 / 0x02), END-BLOCK (0x8000)
     uint8_t header_buf[6] = {
         0x00, 0x00,  // START-BLOCK
         0x00,        // BLOCK_TYPE: Header-Block
-        0x01,        // VERSION: 0x01
+        session_block_max > BLOCK_SAMPLES_SHORT ? 0x02 : 0x01, // VERSION: Long Sample Blocks from 0x02
         0x00, 0x80   // END-BLOCK
     };
-    uart_write_blocking(UART_ID, header_buf, 6);
+    write_stream(header_buf, 6);
 }
-    
-void gpio_callback(uint gpio, uint32_t events)
+
+static void send_sample_block(void)
+{
+    // Send block format:
+    // START-BLOCK (0x0000), BLOCK_TYPE (0x01), SAMPLE_COUNT (N), SAMPLES..., END-BLOCK (0x8000)
+    // or above 255 samples:
+    // START-BLOCK (0x0000), BLOCK_TYPE (0x81), SAMPLE_COUNT (N, uint16 LE), SAMPLES..., END-BLOCK (0x8000)
+    uint8_t *block = &block_buf[1]; // Short header: 4 bytes in front of the samples
+    if (sample_count > BLOCK_SAMPLES_SHORT)
+    {
+        block = &block_buf[0];
+        block[2] = BLOCK_TYPE_SAMPLES_LONG;
+        block[3] = sample_count & 0xFF; // SAMPLE_COUNT LSB
+        block[4] = sample_count >> 8;   // SAMPLE_COUNT MSB
+    }
+    else
+    {
+        block[2] = 0x01; // BLOCK_TYPE: Sample-Block
+        block[3] = sample_count & 0xFF; // SAMPLE_COUNT
+    }
+    block[0] = 0x00; // START-BLOCK LSB
+    block[1] = 0x00; // START-BLOCK MSB
+
+    uint8_t *end = &block_buf[BLOCK_HEAD_MAX + sample_count * 2];
+    end[0] = 0x00; // END-BLOCK LSB
+    end[1] = 0x80; // END-BLOCK MSB
+
+    write_stream(block, end + 2 - block);
+    printf("[DEBUG] Sent data block (%d samples)\n", sample_count);
+
+    sample_count = 0; // Reset sample count for next block
+    timer_hw->armed = 1u << block_alarm_num; // Disarm the block window alarm (write 1 to clear)
+}
+
+// Size the next block from the rate of this one: the samples expected within BLOCK_WINDOW_MS,
+// averaged with the previous target so single bursts or pauses do not swing it
+static void adapt_block_target(void)
+{
+    uint32_t span_us = time_us_32() - block_start_us;
+    uint32_t expected = span_us ? sample_count * (BLOCK_WINDOW_MS * 1000u) / span_us : session_block_max;
+    uint32_t target = (block_target + expected) / 2;
+    uint32_t target_min = session_block_max < BLOCK_SAMPLES_MIN ? session_block_max : BLOCK_SAMPLES_MIN;
+    if (target < target_min)
+    {
+        target = target_min;
+    }
+    if (target > session_block_max)
+    {
+        target = session_block_max;
+    }
+    block_target = (uint16_t)target;
+}
+
+static inline void queue_sample(uint16_t sample)
 {
-    if (gpio != GPIO_RECORD_PIN)
+    if (sample_count == 0)
+    {
+        block_start_us = time_us_32();
+        timer_hw->alarm[block_alarm_num] = block_start_us + BLOCK_WINDOW_MS * 1000u;
+    }
+    block_buf[BLOCK_HEAD_MAX + sample_count * 2] = sample & 0xFF;      // Sample LSB
+    block_buf[BLOCK_HEAD_MAX + sample_count * 2 + 1] = sample >> 8;    // Sample MSB
+    sample_count++;
+    if (sample_count >= block_target)
+    {
+        adapt_block_target();
+        send_sample_block();
+    }
+}
+
+static void decoder_emit_raw(const uint16_t *samples, uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++)
+    {
+        queue_sample(samples[i]);
+    }
+}
+
+static void decoder_emit_block(const kc87_tape_block_t *block)
+{
+    // Keep stream order: raw samples before this block go out first
+    if (sample_count > 0)
+    {
+        send_sample_block();
+    }
+
+    // START(2) + TYPE(1) + LENGTH(1) + STATUS(1) + BLOCK_NR(1) + LEADER(2) + DATA(128) + CHECKSUM(1) + END(2)
+    uint8_t block_buf[4 + 5 + KC87_BLOCK_DATA_SIZE + 2];
+    block_buf[0] = 0x00; // START-BLOCK LSB
+    block_buf[1] = 0x00; // START-BLOCK MSB
+    block_buf[2] = BLOCK_TYPE_TAPE;
+    block_buf[3] = 5 + KC87_BLOCK_DATA_SIZE; // PAYLOAD_LENGTH
+    block_buf[4] = block->status;
+    block_buf[5] = block->block_nr;
+    block_buf[6] = block->leader_periods & 0xFF;
+    block_buf[7] = (block->leader_periods >> 8) & 0xFF;
+    memcpy(&block_buf[8], block->data, KC87_BLOCK_DATA_SIZE);
+    block_buf[8 + KC87_BLOCK_DATA_SIZE] = block->checksum;
+    block_buf[9 + KC87_BLOCK_DATA_SIZE] = 0x00; // END-BLOCK LSB
+    block_buf[10 + KC87_BLOCK_DATA_SIZE] = 0x80; // END-BLOCK MSB
+
+    write_stream(block_buf, sizeof(block_buf));
+    printf("[DEBUG] Sent tape block %u (%s)\n", block->block_nr,
+           block->status == KC87_BLOCK_STATUS_OK ? "OK" : "checksum error");
+}
+
+static void send_sync_block(uint32_t index, uint64_t time_us)
+{
+    uint8_t sync_buf[18] = {
+        0x00, 0x00,             // START-BLOCK
+        BLOCK_TYPE_SYNC,        // BLOCK_TYPE: Sync-Block
+        12,                     // PAYLOAD_LENGTH
+        index & 0xFF, (index >> 8) & 0xFF, (index >> 16) & 0xFF, (index >> 24) & 0xFF,
+        0, 0, 0, 0, 0, 0, 0, 0, // TIMESTAMP_US
+        0x00, 0x80              // END-BLOCK
+    };
+    for (int i = 0; i < 8; i++)
+    {
+        sync_buf[8 + i] = (time_us >> (8 * i)) & 0xFF;
+    }
+    write_stream(sync_buf, sizeof(sync_buf));
+}
+
+// Extend a recent 32-bit capture time to the 64-bit timer value
+static inline uint64_t extend_timestamp(uint32_t time32)
+{
+    uint64_t now = time_us_64();
+    return now - (uint32_t)((uint32_t)now - time32);
+}
+
+static inline void process_ring_entry(uint16_t pos)
+{
+    uint16_t sample = ring_buffer[pos];
+
+    // Samples lost by overflow are always older than the sample at the ring tail
+    uint32_t index = processed_count + drop_count;
+    bool first = (processed_count == 0);
+    processed_count++;
+
+    if (session_decode)
+    {
+        kc87_decoder_feed(&decoder, sample);
         return;
+    }
 
-    if (!recording) 
+    // Sync Blocks are placed in front of a Sample Block and refer to its first sample
+    if (sample_count == 0)
     {
-        // Start recording on first trigger
-        recording = true;
-        send_header_flag = true; // Flag to send header block on next sample
-        printf("[DEBUG] Recording started\n");
+        uint64_t time_us = extend_timestamp(ring_time[pos]);
+        if (first ||
+            (config.sync_samples != 0 && index - last_sync_index >= config.sync_samples) ||
+            (config.sync_us != 0 && time_us - last_sync_time >= config.sync_us))
+        {
+            send_sync_block(index, time_us);
+            last_sync_index = index;
+            last_sync_time = time_us;
+        }
     }
+    queue_sample(sample);
+}
 
-    timestamp = time_us_32();
+static void apply_edge_events(uint32_t edge_events)
+{
+    // Reconfigure the GPIO interrupt for the new edge selection (tape channel only,
+    // control lines are always captured with both edges)
+    gpio_set_irq_enabled(GPIO_RECORD_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, false);
+    config.edge_events = edge_events;
+    gpio_set_irq_enabled(GPIO_RECORD_PIN, edge_events, true);
+}
+
+static void apply_channel_mask(uint32_t channel_mask)
+{
+    config.channel_mask = channel_mask;
+    for (uint ch = 1; ch < CAPTURE_CHANNELS; ch++)
+    {
+        gpio_set_irq_enabled(capture_channel_pins[ch], GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL,
+                             (channel_mask & (1u << ch)) != 0);
+    }
+}
+
+static void send_channel_block(uint8_t channel_mask)
+{
+    uint8_t channel_buf[7] = {
+        0x00, 0x00,             // START-BLOCK
+        BLOCK_TYPE_CHANNELS,    // BLOCK_TYPE: Channel-Block
+        1,                      // PAYLOAD_LENGTH
+        channel_mask,           // CHANNEL_MASK
+        0x00, 0x80              // END-BLOCK
+    };
+    write_stream(channel_buf, sizeof(channel_buf));
+}
+
+static void handle_command(const uint8_t *frame, uint len)
+{
+    if (len == 6 && frame[0] == CMD_SET_PARAM)
+    {
+        uint32_t value = frame[2] | (frame[3] << 8) | (frame[4] << 16) | ((uint32_t)frame[5] << 24);
+        switch (frame[1])
+        {
+            case PARAM_TIMEOUT_MS:
+                if (value < 10 || value > 60000)
+                {
+                    printf("[DEBUG] Invalid timeout: %lu ms\n", (unsigned long)value);
+                    return;
+                }
+                config.timeout_us = value * 1000u;
+                printf("[DEBUG] Timeout set to %lu ms\n", (unsigned long)value);
+                return;
+            case PARAM_GLITCH_US:
+                if (value > 1000)
+                {
+                    printf("[DEBUG] Invalid glitch filter width: %lu us\n", (unsigned long)value);
+                    return;
+                }
+                config.glitch_us = value;
+                printf("[DEBUG] Glitch filter set to %lu us\n", (unsigned long)value);
+                return;
+            case PARAM_DECODE_MODE:
+                if (value > 1)
+                {
+                    printf("[DEBUG] Invalid decode mode: %lu\n", (unsigned long)value);
+                    return;
+                }
+                config.decode_mode = value;
+                printf("[DEBUG] Decode mode set to %lu (from next session)\n", (unsigned long)value);
+                return;
+            case PARAM_SYNC_SAMPLES:
+                config.sync_samples = value;
+                printf("[DEBUG] Sync interval set to %lu samples\n", (unsigned long)value);
+                return;
+            case PARAM_SYNC_MS:
+                if (value > 60000)
+                {
+                    printf("[DEBUG] Invalid sync interval: %lu ms\n", (unsigned long)value);
+                    return;
+                }
+                config.sync_us = value * 1000u;
+                printf("[DEBUG] Sync interval set to %lu ms\n", (unsigned long)value);
+                return;
+            case PARAM_CHANNEL_MASK:
+                if ((value & 0x01) == 0 || value >= (1u << CAPTURE_CHANNELS))
+                {
+                    printf("[DEBUG] Invalid channel mask: 0x%02lx (channel 0 is required)\n", (unsigned long)value);
+                    return;
+                }
+                apply_channel_mask(value);
+                printf("[DEBUG] Channel mask set to 0x%02lx (from next session)\n", (unsigned long)value);
+                return;
+            case PARAM_TRIGGER_EDGES:
+                if (value < 1 || value > 1000)
+                {
+                    printf("[DEBUG] Invalid trigger edge count: %lu\n", (unsigned long)value);
+                    return;
+                }
+                config.trigger_edges = value;
+                printf("[DEBUG] Session trigger set to %lu edges\n", (unsigned long)value);
+                return;
+            case PARAM_PRETRIGGER:
+                if (value < 1 || value > 512)
+                {
+                    printf("[DEBUG] Invalid pre-trigger history: %lu samples\n", (unsigned long)value);
+                    return;
+                }
+                config.pretrigger = value;
+                printf("[DEBUG] Pre-trigger history set to %lu samples\n", (unsigned long)value);
+                return;
+            case PARAM_OUTPUT:
+                if (value == 0 || value > (OUTPUT_UART | OUTPUT_FLASH))
+                {
+                    printf("[DEBUG] Invalid output: 0x%02lx\n", (unsigned long)value);
+                    return;
+                }
+                config.output = value;
+                printf("[DEBUG] Output set to 0x%02lx (from next session)\n", (unsigned long)value);
+                return;
+            case PARAM_BLOCK_SAMPLES:
+                if (value < 1 || value > BLOCK_SAMPLES_LIMIT)
+                {
+                    printf("[DEBUG] Invalid block size: %lu samples\n", (unsigned long)value);
+                    return;
+                }
+                config.block_samples = value;
+                printf("[DEBUG] Block size set to %lu samples (from next session)\n", (unsigned long)value);
+                return;
+            case PARAM_EDGE_MASK:
+            {
+                uint32_t edge_events = 0;
+                if (value & EDGE_MASK_FALL) edge_events |= GPIO_IRQ_EDGE_FALL;
+                if (value & EDGE_MASK_RISE) edge_events |= GPIO_IRQ_EDGE_RISE;
+                if (edge_events == 0)
+                {
+                    printf("[DEBUG] Invalid edge mask: 0x%02lx\n", (unsigned long)value);
+                    return;
+                }
+                apply_edge_events(edge_events);
+                printf("[DEBUG] Edge mask set to 0x%02lx\n", (unsigned long)value);
+                return;
+            }
+            default:
+                break;
+        }
+    }
+    if (len == 3 && frame[0] == CMD_HISTOGRAMS)
+    {
+#if INSTRUMENTATION
+        if (frame[1] & HISTOGRAMS_DUMP)
+        {
+            instr_dump();
+        }
+        if (frame[1] & HISTOGRAMS_CLEAR)
+        {
+            instr_reset();
+            printf("[DEBUG] Histograms cleared\n");
+        }
+#else
+        printf("[DEBUG] Histograms not available (firmware built without INSTRUMENTATION)\n");
+#endif
+        return;
+    }
+    if (len == 6 && frame[0] == CMD_STORE)
+    {
+        uint32_t seq = frame[2] | (frame[3] << 8) | (frame[4] << 16) | ((uint32_t)frame[5] << 24);
+        switch (frame[1])
+        {
+            case STORE_LIST:
+                kc87_store_list();
+                return;
+            case STORE_READ:
+            case STORE_CLEAR:
+                // Both block the main loop, a running session would overflow the ring buffer
+                if (recording)
+                {
+                    printf("[STORE] BUSY\n");
+                }
+                else if (frame[1] == STORE_READ)
+                {
+                    kc87_store_read(seq);
+                }
+                else
+                {
+                    kc87_store_clear();
+                }
+                return;
+            default:
+                break;
+        }
+    }
+    printf("[DEBUG] Unknown command (%u bytes, CMD 0x%02x)\n", len, len > 0 ? frame[0] : 0);
+}
+
+static void slip_feed(slip_decoder_t *slip, uint8_t b)
+{
+    if (b == SLIP_END)
+    {
+        if (slip->len > 0 && !slip->overflow)
+        {
+            handle_command(slip->frame, slip->len);
+        }
+        slip->len = 0;
+        slip->escaped = false;
+        slip->overflow = false;
+        return;
+    }
+
+    if (slip->escaped)
+    {
+        b = (b == SLIP_ESC_END) ? SLIP_END : (b == SLIP_ESC_ESC) ? SLIP_ESC : b;
+        slip->escaped = false;
+    }
+    else if (b == SLIP_ESC)
+    {
+        slip->escaped = true;
+        return;
+    }
+
+    if (slip->len < CMD_FRAME_MAX)
+    {
+        slip->frame[slip->len++] = b;
+    }
+    else
+    {
+        slip->overflow = true;
+    }
+}
+
+static void process_host_commands(void)
+{
+    while (rx_tail != rx_head)
+    {
+        uint8_t b = rx_ring[rx_tail];
+        rx_tail = (rx_tail + 1) % sizeof(rx_ring);
+        slip_feed(&uart_slip, b);
+    }
+
+    // Commands over USB stdio, so stored sessions can be fetched through the USB port alone
+    int c;
+    while ((c = getchar_timeout_us(0)) >= 0)
+    {
+        slip_feed(&usb_slip, (uint8_t)c);
+    }
+}
     
-    // Calculate delta from last timestamp
-    uint32_t delta_us;
-    if (timestamp >= last_timestamp) 
+// Pre-trigger history bookkeeping for an edge outside of a session, about to be stored at ring_head
+static __force_inline void track_history(uint32_t delta_us)
+{
+    if (delta_us >= TRIGGER_GAP_US)
     {
-        delta_us = timestamp - last_timestamp;
-    } else 
+        // Gap: this edge starts a new run, older edges are not part of the signal
+        history_start = ring_head;
+        trigger_run = 0;
+    }
+    trigger_run++;
+    if ((uint16_t)((ring_head + 1024 - history_start) % 1024) >= config.pretrigger)
     {
-        // Timer overflow handling 
-        delta_us = (UINT32_MAX - last_timestamp) + timestamp + 1;
+        history_start = (history_start + 1) % 1024;
+    }
+}
+
+static __force_inline void commit_sample(uint32_t edge_timestamp, uint16_t edge_bit)
+{
+    // Calculate delta from last timestamp (unsigned arithmetic handles timer wrap-around)
+    uint32_t delta_us = edge_timestamp - last_timestamp;
+
+    bool in_session = recording;
+    if (!in_session)
+    {
+        track_history(delta_us);
     }
     
-    // Limit delta to 15-bit range (32767 μs = ~32ms max)
-    if (delta_us > 32767) 
+    // Limit delta to 15-bit range (32767 μs = ~32ms max), less if channel bits are used
+    if (delta_us > session_delta_max) 
     {
-        delta_us = 32767;
+        delta_us = session_delta_max;
     }
     
-    // Encode: Edge-Bit in MSB (Rise=1, Fall=0), Delta in lower 15 bits
-    uint16_t edge_bit = (events & GPIO_IRQ_EDGE_RISE) ? 0x8000 : 0x0000;
+    // Encode: Edge-Bit in MSB (Rise=1, Fall=0), channel bits (if any), Delta in lower bits
+    // (edge_bit already contains the channel code)
     uint16_t next_head = (ring_head + 1) % 1024;
     if (next_head == ring_tail) {
         // Drop oldest sample on overflow to keep ring buffer consistent.
         ring_tail = (ring_tail + 1) % 1024;
+        drop_count++;
     }
     ring_buffer[ring_head] = (uint16_t)delta_us | edge_bit;
+    ring_time[ring_head] = edge_timestamp;
     ring_head = next_head;
+    if (in_session)
+    {
+        INSTR_RECORD(INSTR_RING_DEPTH, (ring_head + 1024 - ring_tail) % 1024);
+    }
     
-    last_timestamp = timestamp;
+    last_timestamp = edge_timestamp;
+}
+
+// Latch the channel configuration for a new session (capture path only)
+static __force_inline void start_session_channels(void)
+{
+    uint8_t mask = config.decode_mode ? 0x01 : (uint8_t)config.channel_mask; // Decoder only handles the tape channel
+    uint8_t count = 0;
+    for (uint ch = 0; ch < CAPTURE_CHANNELS; ch++)
+    {
+        if (mask & (1u << ch))
+        {
+            count++;
+        }
+    }
+    uint8_t bits = 0;
+    while ((1u << bits) < count)
+    {
+        bits++;
+    }
+
+    uint8_t ordinal = 0;
+    for (uint ch = 0; ch < CAPTURE_CHANNELS; ch++)
+    {
+        channel_code[ch] = (mask & (1u << ch)) ? (uint16_t)(ordinal++ << (15 - bits)) : 0;
+    }
+    session_channel_mask = mask;
+    session_channel_bits = bits;
+    session_delta_max = (uint16_t)((1u << (15 - bits)) - 1);
+}
+
+// Start a session with the pre-trigger history (capture path)
+static __force_inline void start_session(void)
+{
+    recording = true;
+    send_header_flag = true; // Flag to send header block on next sample
+    glitch_count = 0;
+    drop_count = 0;
+    session_decode = config.decode_mode != 0;
+    start_session_channels();
+    trigger_run = 0;
+    ring_tail = history_start; // Older edges are dropped, the main loop never drains outside a session
+
+    if (history_start == ring_head)
+    {
+        last_timestamp = timestamp; // No history (control line trigger): the current edge comes first
+        return;
+    }
+    // The first delta refers to an edge before the session: make it session-relative
+    ring_buffer[history_start] &= 0x8000;
+    if (session_channel_bits > 0)
+    {
+        // History was stored with the 15-bit delta limit (tape channel, channel code 0)
+        for (uint16_t pos = (history_start + 1) % 1024; pos != ring_head; pos = (pos + 1) % 1024)
+        {
+            if ((ring_buffer[pos] & 0x7FFF) > session_delta_max)
+            {
+                ring_buffer[pos] = (ring_buffer[pos] & 0x8000) | session_delta_max;
+            }
+        }
+    }
+}
+
+static __force_inline void check_trigger(void)
+{
+    if (!recording && trigger_run >= config.trigger_edges)
+    {
+        start_session();
+    }
+}
+
+// Commit the edge held back by the glitch filter (called with the GPIO interrupt blocked)
+static __force_inline void commit_pending_sample(void)
+{
+    if (pending_valid)
+    {
+        pending_valid = false;
+        commit_sample(pending_timestamp, pending_edge_bit);
+    }
+}
+
+static __force_inline void capture_edge(uint gpio, uint32_t events)
+{
+    uint channel = 0;
+    while (channel < CAPTURE_CHANNELS && capture_channel_pins[channel] != gpio)
+    {
+        channel++;
+    }
+    if (channel == CAPTURE_CHANNELS)
+        return;
+    if (recording && !(session_channel_mask & (1u << channel)))
+        return; // Channel was enabled after the session started
+
+    timestamp = time_us_32();
+    arm_timeout_alarm(timestamp);
+
+    if (!recording && channel != 0)
+    {
+        // A control line edge starts the session at once, behind the tape history
+        commit_pending_sample();
+        start_session();
+        if (!(session_channel_mask & (1u << channel)))
+            return; // Control line edge starts the session but is not captured in decode mode
+    }
+
+    uint16_t edge_bit = ((events & GPIO_IRQ_EDGE_RISE) ? 0x8000 : 0x0000) | channel_code[channel];
+
+    if (channel != 0)
+    {
+        // Control lines are not glitch filtered; keep samples in time order
+        commit_pending_sample();
+        commit_sample(timestamp, edge_bit);
+        return;
+    }
+
+    uint32_t glitch_us = config.glitch_us;
+
+    if (glitch_us == 0)
+    {
+        commit_pending_sample(); // Filter was just switched off
+        commit_sample(timestamp, edge_bit);
+        check_trigger();
+        return;
+    }
+
+    if (pending_valid && (timestamp - pending_timestamp) < glitch_us)
+    {
+        // Pulse between the held-back edge and this edge is too short: drop both,
+        // the line is back in the state it had before the glitch.
+        pending_valid = false;
+        glitch_count++;
+        return;
+    }
+
+    commit_pending_sample();
+    check_trigger();
+    pending_timestamp = timestamp;
+    pending_edge_bit = edge_bit;
+    pending_valid = true;
+}
+
+void __not_in_flash_func(gpio_callback)(uint gpio, uint32_t events)
+{
+    INSTR_START(isr_start);
+    capture_edge(gpio, events);
+    INSTR_RECORD_SINCE(INSTR_ISR_DURATION, isr_start);
+}
+
+// Raw IO_BANK0 handler instead of the SDK's GPIO callback dispatch: gpio_default_irq_handler and
+// gpio_acknowledge_irq live in flash and would run with XIP off while the flash store erases or
+// programs. Reads and acknowledges the edge events of the capture pins directly.
+static void __not_in_flash_func(gpio_bank_irq)(void)
+{
+    io_bank0_irq_ctrl_hw_t *irq_ctrl = get_core_num() ? &io_bank0_hw->proc1_irq_ctrl
+                                                      : &io_bank0_hw->proc0_irq_ctrl;
+    for (uint ch = 0; ch < CAPTURE_CHANNELS; ch++)
+    {
+        uint gpio = capture_channel_pins[ch];
+        uint shift = 4 * (gpio % 8);
+        uint32_t events = (irq_ctrl->ints[gpio / 8] >> shift) & (GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+        if (events)
+        {
+            io_bank0_hw->intr[gpio / 8] = events << shift;
+            gpio_callback(gpio, events);
+        }
+    }
+}
+
+static void send_stats_block(uint32_t glitches, uint32_t drops)
+{
+    uint8_t stats_buf[14] = {
+        0x00, 0x00,             // START-BLOCK
+        BLOCK_TYPE_STATS,       // BLOCK_TYPE: Statistics-Block
+        8,                      // PAYLOAD_LENGTH
+        glitches & 0xFF, (glitches >> 8) & 0xFF, (glitches >> 16) & 0xFF, (glitches >> 24) & 0xFF,
+        drops & 0xFF, (drops >> 8) & 0xFF, (drops >> 16) & 0xFF, (drops >> 24) & 0xFF,
+        0x00, 0x80              // END-BLOCK
+    };
+    write_stream(stats_buf, sizeof(stats_buf));
+    printf("[DEBUG] Session statistics: %lu glitches suppressed, %lu samples dropped\n",
+           (unsigned long)glitches, (unsigned long)drops);
+}
+
+static void handle_session_timeout(void)
+{
+    // The alarm may race with a new edge: decide with interrupts disabled and
+    // freeze the ring position that belongs to the ending session.
+    uint32_t irq_state = save_and_disable_interrupts();
+    timeout_flag = false;
+    uint32_t idle_us = time_us_32() - timestamp;
+    if (!recording || idle_us < config.timeout_us)
+    {
+        restore_interrupts(irq_state);
+        return;
+    }
+    commit_pending_sample(); // Last edge of the session can no longer be a glitch
+    recording = false; // Following edges go into the pre-trigger history
+    uint16_t session_head = ring_head;
+    uint16_t pos = ring_tail;
+    history_start = session_head;
+    trigger_run = 0;
+    session_delta_max = 0x7FFF; // History is stored with the 15-bit delta limit
+    uint32_t glitches = glitch_count;
+    uint32_t drops = drop_count;
+    restore_interrupts(irq_state);
+
+    // Send remaining samples of this session. A new session may start meanwhile and
+    // move ring_tail to its history, so the drain keeps its own position.
+    while (pos != session_head) 
+    {
+        process_ring_entry(pos);
+        pos = (pos + 1) % 1024;
+    }
+    if (session_decode)
+    {
+        kc87_decoder_flush(&decoder);
+    }
+    if (sample_count > 0)
+    {
+        send_sample_block();
+    }
+
+    send_stats_block(glitches, drops);
+
+    // Send End of Stream marker (two consecutive END-BLOCKs)
+    uint8_t end_stream[2] = {0x00, 0x80};
+    write_stream(end_stream, 2);
+    kc87_store_end();
+    printf("[DEBUG] Recording stopped (timeout after %lu us inactivity)\n", (unsigned long)idle_us);
 }
 
 int main() 
@@ -122,131 +1054,117 @@ int main()
     uart_init(UART_ID, UART_BAUD_RATE);
     gpio_set_function(UART_TX_PIN, GPIO_FUNC_UART);
     gpio_set_function(UART_RX_PIN, GPIO_FUNC_UART);
+
+    // UART RX interrupt for host commands
+    irq_set_exclusive_handler(UART0_IRQ, uart_rx_irq);
+    irq_set_priority(UART0_IRQ, CAPTURE_IRQ_PRIORITY);
+    irq_set_enabled(UART0_IRQ, true);
+    uart_set_irq_enables(UART_ID, true, false);
+
+    init_timeout_alarm();
+    init_block_alarm();
+    INSTR_INIT();
+    kc87_store_init();
     
-    // GPIO-Pins konfigurieren (nur Recording)
-    gpio_init(GPIO_RECORD_PIN);
-    gpio_set_dir(GPIO_RECORD_PIN, GPIO_IN);
+    // GPIO-Pins konfigurieren (Recording + optionale Steuerleitungen)
+    for (uint ch = 0; ch < CAPTURE_CHANNELS; ch++)
+    {
+        gpio_init(capture_channel_pins[ch]);
+        gpio_set_dir(capture_channel_pins[ch], GPIO_IN);
+    }
     
     // IRQ für Recording-GPIO konfigurieren
     timestamp = last_timestamp = time_us_32();
     sleep_us(2);
-    gpio_set_irq_enabled_with_callback(GPIO_RECORD_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, gpio_callback);
+    gpio_set_irq_enabled(GPIO_RECORD_PIN, config.edge_events, true);
+    irq_set_exclusive_handler(IO_IRQ_BANK0, gpio_bank_irq);
+    irq_set_priority(IO_IRQ_BANK0, CAPTURE_IRQ_PRIORITY);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+    apply_channel_mask(config.channel_mask);
 
     printf("[DEBUG] KC87 Pico Recorder started\n");
     printf("[DEBUG] UART: %d baud on GPIO%d/GPIO%d\n", UART_BAUD_RATE, UART_TX_PIN, UART_RX_PIN);
     printf("[DEBUG] Waiting for signal on GPIO%d...\n", GPIO_RECORD_PIN);
 
-    uint32_t delta_us;
-    uint32_t last_timeout_check = 0;
+    bool session_active = false;
 
     // Hauptschleife
     while (true) 
     {
+        INSTR_START(loop_start);
+        process_host_commands();
+
         if(send_header_flag) 
         {
-            send_header_block();
             send_header_flag = false;
+            printf("[DEBUG] Recording started\n");
+            session_output = config.output;
+            if ((session_output & OUTPUT_FLASH) && !kc87_store_begin())
+            {
+                session_output &= ~OUTPUT_FLASH;
+                printf("[DEBUG] Flash store not available, session is not stored\n");
+            }
+            session_block_max = (uint16_t)config.block_samples;
+            block_target = session_block_max;
+            send_header_block();
             sample_count = 0; // Reset sample count for new recording session
-            last_timeout_check = time_us_32(); // Reset timeout check timer
+            session_active = true;
+            processed_count = 0;
+
+            if (session_channel_bits > 0)
+            {
+                send_channel_block(session_channel_mask);
+            }
+
+            // Decode mode is latched per session; periods end on rising edges unless only falling edges are captured
+            if (session_decode)
+            {
+                uint16_t period_edge_bit = (config.edge_events & GPIO_IRQ_EDGE_RISE) ? 0x8000 : 0x0000;
+                kc87_decoder_init(&decoder, period_edge_bit, decoder_emit_raw, decoder_emit_block);
+            }
         }
 
-        if(recording)
+        if(session_active && recording)
         {
-            // Drain ring buffer in batch (up to 255 samples at once)
-            while (ring_tail != ring_head && sample_count < 255) 
+            // Drain ring buffer in batch, full blocks are sent from queue_sample()
+            while (ring_tail != ring_head) 
             {
-                sample_buffer[sample_count++] = ring_buffer[ring_tail];
+                process_ring_entry(ring_tail);
                 ring_tail = (ring_tail + 1) % 1024;
             }
 
-            // If we have 255 samples, send a block
-            if (sample_count == 255) 
+            // Sparse stream: a started block goes out after BLOCK_WINDOW_MS at the latest (the block
+            // alarm wakes the loop for it)
+            if (sample_count > 0 && time_us_32() - block_start_us >= BLOCK_WINDOW_MS * 1000u)
             {
-                    // Send block format:
-                    // START-BLOCK (0x0000), BLOCK_TYPE (0x01), SAMPLE_COUNT (0xFF), SAMPLES..., END-BLOCK (0x8000)
-                    // Total: 4 bytes header + 510 bytes samples + 2 bytes end = 516 bytes
-                    uint8_t block_buf[516];
-                    block_buf[0] = 0x00; // START-BLOCK LSB
-                    block_buf[1] = 0x00; // START-BLOCK MSB
-                    block_buf[2] = 0x01; // BLOCK_TYPE: Sample-Block
-                    block_buf[3] = 0xFF; // SAMPLE_COUNT: 255
-
-                    for (int i = 0; i < 255; i++) 
-                    {
-                        block_buf[4 + i * 2] = sample_buffer[i] & 0xFF;       // Sample LSB
-                        block_buf[4 + i * 2 + 1] = (sample_buffer[i] >> 8) & 0xFF; // Sample MSB
-                    }
-
-                    block_buf[514] = 0x00; // END-BLOCK LSB
-                    block_buf[515] = 0x80; // END-BLOCK MSB
-                    
-                    uart_write_blocking(UART_ID, block_buf, 516);
-                    printf("[DEBUG] Sent data block (255 samples)\n");
-
-                    sample_count = 0; // Reset sample count for next block
-            }
-            
-            // Check timeout periodically (every 100ms) even if ring buffer is not empty
-            uint32_t current_time = time_us_32();
-            uint32_t time_since_last_check;
-            if (current_time >= last_timeout_check) {
-                time_since_last_check = current_time - last_timeout_check;
-            } else {
-                time_since_last_check = (UINT32_MAX - last_timeout_check) + current_time + 1;
+                adapt_block_target();
+                send_sample_block();
             }
-            
-            if (time_since_last_check >= 100000) // Check every 100ms
-            {
-                last_timeout_check = current_time;
-                
-                // Calculate delta from last edge event to check for inactivity
-                // Handle timer overflow
-                if (current_time >= timestamp) {
-                    delta_us = current_time - timestamp;
-                } else {
-                    delta_us = (UINT32_MAX - timestamp) + current_time + 1;
-                }
+        }
 
-                if(delta_us > RECORDING_TIMEOUT_US) // inactivity timeout
-                {
-                    if(sample_count > 0) // If there are remaining samples, send them in a final block
-                    {
-                        // Send remaining samples in a final block
-                        uint8_t final_block_buf[4 + sample_count * 2 + 2];
-                        final_block_buf[0] = 0x00; // START-BLOCK LSB
-                        final_block_buf[1] = 0x00; // START-BLOCK MSB
-                        final_block_buf[2] = 0x01; // BLOCK_TYPE: Sample-Block
-                        final_block_buf[3] = sample_count & 0xFF; // SAMPLE_COUNT
-
-                        for (int i = 0; i < sample_count; i++) 
-                        {
-                            final_block_buf[4 + i * 2] = sample_buffer[i] & 0xFF; // Sample LSB
-                            final_block_buf[4 + i * 2 + 1] = (sample_buffer[i] >> 8) & 0xFF; // Sample MSB
-                        }
-
-                        final_block_buf[4 + sample_count * 2] = 0x00; // END-BLOCK LSB
-                        final_block_buf[4 + sample_count * 2 + 1] = 0x80; // END-BLOCK MSB
-                        
-                        uart_write_blocking(UART_ID, final_block_buf, 4 + sample_count * 2 + 2);
-                        printf("[DEBUG] Sent final block (%d samples)\n", sample_count);
-                    }
-                    
-                    // Send End of Stream marker (two consecutive END-BLOCKs)
-                    uint8_t end_stream[2] = {0x00, 0x80};
-                    uart_write_blocking(UART_ID, end_stream, 2);
-                    printf("[DEBUG] Recording stopped (timeout after %d us inactivity)\n", delta_us);
-
-                    recording = false; // Stop recording until next trigger
-                    sample_count = 0; // Reset sample count
-                    ring_head = ring_tail = 0; // Clear ring buffer
-                }
-            }
+        if (timeout_flag)
+        {
+            handle_session_timeout();
+            session_active = recording && !send_header_flag;
         }
-        
-        if (!recording || ring_tail == ring_head) {
-            sleep_us(100); // Short sleep to service USB stack (printf) when no data pending
+
+        // Flash erases ahead between sessions, and during a stored session only with the ring buffer
+        // drained: the whole ring absorbs the edges captured while the main loop waits for the erase
+        bool store_idle = session_active ? (session_output & OUTPUT_FLASH) && ring_tail == ring_head : !recording;
+        bool store_pending = store_idle && kc87_store_idle();
+
+        INSTR_RECORD_SINCE(INSTR_LOOP_TIME, loop_start);
+
+        // Sleep until the next interrupt (edge, timeout or block alarm, UART RX or USB) when there is nothing to do.
+        // Interrupts are disabled around the check so a wake-up event cannot slip in before __wfi().
+        uint32_t irq_state = save_and_disable_interrupts();
+        if (!send_header_flag && !timeout_flag && !store_pending && rx_tail == rx_head &&
+            (!recording || ring_tail == ring_head))
+        {
+            __wfi();
         }
+        restore_interrupts(irq_state);
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,161 @@
+#include <string.h>
+#include "kc87_tape_decoder.h"
+#include "config.h"
+
+// The decoder keeps every sample of the current section in dec->raw until the section
+// is either decoded (raw samples are discarded) or found undecodable (raw samples are
+// emitted unchanged). Leader periods are only counted, of a long leader just the last
+// KC87_LEADER_KEEP samples are kept so a failing block can be sent with its lead-in.
+
+static void flush_raw(kc87_decoder_t *dec)
+{
+    if (dec->raw_len > 0)
+    {
+        dec->emit_raw(dec->raw, dec->raw_len);
+        dec->raw_len = 0;
+    }
+}
+
+static void restart_hunt(kc87_decoder_t *dec)
+{
+    dec->state = KC87_STATE_HUNT;
+    dec->leader_periods = 0;
+}
+
+static void finish_block(kc87_decoder_t *dec)
+{
+    kc87_tape_block_t block;
+    uint8_t sum = 0;
+
+    block.block_nr = dec->bytes[0];
+    memcpy(block.data, &dec->bytes[1], KC87_BLOCK_DATA_SIZE);
+    block.checksum = dec->bytes[KC87_BLOCK_BYTES - 1];
+    block.leader_periods = dec->leader_periods;
+
+    for (int i = 0; i < KC87_BLOCK_DATA_SIZE; i++)
+    {
+        sum += block.data[i];
+    }
+    block.status = (sum == block.checksum) ? KC87_BLOCK_STATUS_OK : KC87_BLOCK_STATUS_CHECKSUM;
+
+    if (block.status == KC87_BLOCK_STATUS_OK)
+    {
+        dec->raw_len = 0; // Block is fully represented by the decoded data
+    }
+    else
+    {
+        flush_raw(dec); // Keep the edges so the host can retry the block
+    }
+    dec->emit_block(&block);
+    restart_hunt(dec);
+}
+
+static void handle_period(kc87_decoder_t *dec, kc87_period_t period)
+{
+    if (dec->state == KC87_STATE_HUNT)
+    {
+        if (period == KC87_PERIOD_ONE)
+        {
+            if (dec->leader_periods < UINT16_MAX)
+            {
+                dec->leader_periods++;
+            }
+            // Only leader samples are buffered here, trim them in batches
+            if (dec->raw_len >= 2 * KC87_LEADER_KEEP)
+            {
+                memmove(dec->raw, &dec->raw[dec->raw_len - KC87_LEADER_KEEP], KC87_LEADER_KEEP * sizeof(uint16_t));
+                dec->raw_len = KC87_LEADER_KEEP;
+            }
+        }
+        else if (period == KC87_PERIOD_SEPARATOR && dec->leader_periods >= KC87_LEADER_MIN)
+        {
+            dec->state = KC87_STATE_DATA;
+            dec->bit_count = 0;
+            dec->current_byte = 0;
+            dec->byte_count = 0;
+        }
+        else
+        {
+            flush_raw(dec);
+            restart_hunt(dec);
+        }
+        return;
+    }
+
+    // KC87_STATE_DATA: 8 data bits (LSB first) followed by a separator
+    if (dec->bit_count < 8)
+    {
+        if (period == KC87_PERIOD_ZERO || period == KC87_PERIOD_ONE)
+        {
+            if (period == KC87_PERIOD_ONE)
+            {
+                dec->current_byte |= (uint8_t)(1u << dec->bit_count);
+            }
+            dec->bit_count++;
+            return;
+        }
+    }
+    else if (period == KC87_PERIOD_SEPARATOR)
+    {
+        dec->bytes[dec->byte_count++] = dec->current_byte;
+        dec->current_byte = 0;
+        dec->bit_count = 0;
+        if (dec->byte_count == KC87_BLOCK_BYTES)
+        {
+            finish_block(dec);
+        }
+        return;
+    }
+
+    // Framing error inside the block: send the section as raw edges
+    flush_raw(dec);
+    restart_hunt(dec);
+}
+
+void kc87_decoder_init(kc87_decoder_t *dec, uint16_t period_edge_bit,
+                       kc87_raw_fn emit_raw, kc87_block_fn emit_block)
+{
+    dec->emit_raw = emit_raw;
+    dec->emit_block = emit_block;
+    dec->period_edge_bit = period_edge_bit;
+    dec->period_us = 0;
+    dec->raw_len = 0;
+    restart_hunt(dec);
+}
+
+kc87_period_t kc87_classify_period(uint32_t period_us)
+{
+    if (period_us < KC87_PERIOD_MIN_US || period_us >= KC87_PERIOD_MAX_US)
+        return KC87_PERIOD_INVALID;
+    if (period_us < KC87_PERIOD_ZERO_ONE_US)
+        return KC87_PERIOD_ZERO;
+    if (period_us < KC87_PERIOD_ONE_SEP_US)
+        return KC87_PERIOD_ONE;
+    return KC87_PERIOD_SEPARATOR;
+}
+
+void kc87_decoder_feed(kc87_decoder_t *dec, uint16_t sample)
+{
+    if (dec->raw_len == KC87_RAW_MAX)
+    {
+        // Cannot happen for a well-formed block, give up on this section
+        flush_raw(dec);
+        restart_hunt(dec);
+    }
+    dec->raw[dec->raw_len++] = sample;
+    dec->period_us += sample & 0x7FFF;
+
+    if ((sample & 0x8000) != dec->period_edge_bit)
+        return;
+
+    uint32_t period_us = dec->period_us;
+    dec->period_us = 0;
+    handle_period(dec, kc87_classify_period(period_us));
+}
+
+void kc87_decoder_flush(kc87_decoder_t *dec)
+{
+    flush_raw(dec);
+    restart_hunt(dec);
+    dec->period_us = 0;
+}
@@ -0,0 +1,66 @@
+#ifndef KC87_TAPE_DECODER_H
+#define KC87_TAPE_DECODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// KC87 tape format (same physical format as KC85/1, KC85/2..4):
+// Every bit is one full signal period, LSB first:
+//   "0"-Bit        ~ 2400 Hz (period ~417 µs)
+//   "1"-Bit        ~ 1200 Hz (period ~833 µs)
+//   Separator      ~  600 Hz (period ~1667 µs)
+// Block: Leader ("1"-periods) - Separator - BLOCK_NR - 128 data bytes - CHECKSUM
+// Every byte is followed by a separator. CHECKSUM = sum of the 128 data bytes (mod 256).
+
+#define KC87_BLOCK_DATA_SIZE  128
+#define KC87_BLOCK_BYTES      (1 + KC87_BLOCK_DATA_SIZE + 1)  // BLOCK_NR + DATA + CHECKSUM
+
+// Raw sample buffer of one block attempt: kept leader tail + 130 bytes * 9 periods * 2 edges
+#define KC87_RAW_MAX          3072
+
+#define KC87_BLOCK_STATUS_OK        0x00
+#define KC87_BLOCK_STATUS_CHECKSUM  0x01
+
+typedef enum {
+    KC87_PERIOD_INVALID = 0,
+    KC87_PERIOD_ZERO,
+    KC87_PERIOD_ONE,
+    KC87_PERIOD_SEPARATOR
+} kc87_period_t;
+
+typedef struct {
+    uint8_t status;                         // KC87_BLOCK_STATUS_*
+    uint8_t block_nr;
+    uint16_t leader_periods;                // Length of the leader before the block (saturated)
+    uint8_t data[KC87_BLOCK_DATA_SIZE];
+    uint8_t checksum;                       // Checksum as read from tape
+} kc87_tape_block_t;
+
+// Output callbacks: raw samples of undecodable sections and decoded blocks, in stream order
+typedef void (*kc87_raw_fn)(const uint16_t *samples, uint16_t count);
+typedef void (*kc87_block_fn)(const kc87_tape_block_t *block);
+
+typedef struct {
+    kc87_raw_fn emit_raw;
+    kc87_block_fn emit_block;
+    uint16_t period_edge_bit;               // Edge bit (0x8000 = rising) that ends a period
+
+    enum { KC87_STATE_HUNT, KC87_STATE_DATA } state;
+    uint32_t period_us;                     // Accumulated deltas of the current period
+    uint16_t leader_periods;
+    uint8_t bit_count;
+    uint8_t current_byte;
+    uint16_t byte_count;
+    uint8_t bytes[KC87_BLOCK_BYTES];
+
+    uint16_t raw_len;                       // Samples of the current (not yet decoded) section
+    uint16_t raw[KC87_RAW_MAX];
+} kc87_decoder_t;
+
+void kc87_decoder_init(kc87_decoder_t *dec, uint16_t period_edge_bit,
+                       kc87_raw_fn emit_raw, kc87_block_fn emit_block);
+kc87_period_t kc87_classify_period(uint32_t period_us);
+void kc87_decoder_feed(kc87_decoder_t *dec, uint16_t sample);
+void kc87_decoder_flush(kc87_decoder_t *dec);
+
+#endif // KC87_TAPE_DECODER_H
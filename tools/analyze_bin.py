@@ -1,179 +1,491 @@
 #!/usr/bin/env python3
 """
 Analysiert .bin Dateien vom KC87 Pico Recorder für Signalqualität
+
+Die Datei wird blockweise in Chunks fester Größe (kc87.CHUNK_SAMPLES) als NumPy-Arrays
+ausgewertet. Der Speicherbedarf hängt nur von der Chunk-Größe ab, nicht von der Länge
+der Aufnahme.
+
+Mit --batch wird ein ganzes Verzeichnis (rekursiv) parallel ausgewertet und in einer
+Übersichtstabelle (CSV/JSON) mit Qualitätswert je Datei zusammengefasst. Ergebnisse werden
+über den SHA-256 des Dateiinhalts zwischengespeichert, erneute Läufe werten nur neue oder
+geänderte Aufnahmen aus.
 """
-import struct
+import bisect
+import csv
+import hashlib
+import json
+import multiprocessing
 import sys
 import os
 
-# Block protocol constants
-BLOCK_START = 0x0000
-BLOCK_END = 0x8000
-BLOCK_TYPE_HEADER = 0x00
-BLOCK_TYPE_SAMPLES = 0x01
-
-def parse_bin_file(data):
-    """Parst eine .bin Datei im Block-Format und extrahiert Samples"""
-    samples = []
-    pos = 0
-    header_found = False
-    
-    while pos < len(data):
-        # Need at least 6 bytes for minimum block
-        if pos + 6 > len(data):
-            break
-        
-        # Check for START-BLOCK
-        start_marker = struct.unpack('<H', data[pos:pos+2])[0]
-        if start_marker != BLOCK_START:
-            # Skip invalid data
-            pos += 1
+import numpy as np
+
+import kc87
+import kc87_tape
+
+PATTERN_ERRORS_SHOWN = 5
+PERIODS_SHOWN = 10
+HEAD_SAMPLES = 2 * PERIODS_SHOWN + 2    # Samples für die Perioden-Tabelle
+DELTA_LIMIT = 32767                     # Maximalwert eines 15-Bit-Deltas
+LARGE_DELTA_US = 10000
+
+ANALYSIS_VERSION = 2                    # Bei geänderten Ergebnissen erhöhen (verwirft den Cache)
+CACHE_NAME = '.kc87_analysis_cache.json'
+HASH_BLOCK = 1 << 20
+WORST_SHOWN = 10
+SUMMARY_FIELDS = ['file', 'sha256', 'size', 'samples', 'duration_s', 'channels',
+                  'glitches', 'drops', 'lost_samples', 'sync_errors', 'max_sync_error_us',
+                  'pattern_errors', 'pattern_error_rate', 'avg_freq_hz', 'jitter_percent',
+                  'tape_ok', 'tape_bad', 'tape_source', 'tape_deviation_percent',
+                  'speed', 'speed_drift_percent', 'wow_percent', 'flutter_percent',
+                  'score', 'error']
+
+class BinAnalysis:
+    """Sammelt die Statistiken einer Aufnahme Chunk für Chunk
+
+    Ausgewertet wird Kanal 0 (Bandsignal); bei Mehrkanal-Aufnahmen sind die Deltas der
+    übrigen Kanäle darin aufaddiert, deren Flanken landen mit absoluter Zeit in channels.
+    Kennwerte, die das erste oder letzte Sample ausschließen, werden erst berechnet,
+    wenn genügend nachfolgende Samples bekannt sind; dafür bleiben nur die letzten
+    Samples eines Chunks (tail_*) bis zum nächsten Chunk erhalten.
+    """
+
+    def __init__(self):
+        self.layout = kc87.Layout()
+        self.header_found = False
+        self.version = None         # VERSION aus dem Header-Block
+        self.raw_count = 0          # Samples aller Kanäle
+        self.stream_time = 0        # Summe aller Deltas (µs)
+        self.last_time0 = 0         # Zeit des letzten Samples von Kanal 0
+        self.channels = {}          # Steuerleitungen: {Kanal: [(Flanke, Zeit in µs)]}
+        self.stats = {}             # 'glitches', 'drops', 'tape_ok', 'tape_bad'
+        self.syncs = []             # [Position im Strom, Sample-Index, Zeit, Datei-Offset, Delta-Summe bis inkl. Position]
+        self.tape = kc87_tape.TapeDecoder()     # KC87-Blöcke in den Rohflanken
+        self.speed = None                       # Bandgeschwindigkeit (kc87.SpeedEstimator, nur mit libkc87)
+
+        # Kanal 0
+        self.count = 0
+        self.delta_min = None
+        self.delta_max = None
+        self.delta_sum = 0
+        self.histogram = np.zeros(DELTA_LIMIT + 1, dtype=np.int64)
+        self.overflows = 0
+        self.large_deltas = 0
+        self.head = []              # Erste HEAD_SAMPLES Samples als (Flanke, Delta)
+
+        self.tail_start = 0
+        self.tail_edges = np.zeros(0, dtype=bool)
+        self.tail_deltas = np.zeros(0, dtype=np.int64)
+
+        self.pattern_next = 1       # Nächstes noch nicht geprüftes Sample
+        self.pattern_start = None   # Erwartete Flanke bei Sample 1
+        self.pattern_errors = 0
+        self.pattern_error_list = []
+
+        self.period_next = 2        # Nächstes Sample, das eine Periode abschließt
+        self.freq_count = 0
+        self.freq_sum = 0.0
+        self.freq_sumsq = 0.0
+        self.freq_min = None
+        self.freq_max = None
+        self.freq_head = []
+
+    def feed_block(self, block):
+        """Verarbeitet einen Nicht-Sample-Block"""
+        if block.type == kc87.BLOCK_TYPE_HEADER:
+            self.header_found = True
+            self.version = block.length
+            return
+        if not self.header_found:
+            return
+        if block.type == kc87.BLOCK_TYPE_CHANNELS:
+            self.layout = kc87.read_channels(block) or self.layout
+            return
+        block_stats = kc87.read_stats(block)
+        sync = kc87.read_sync(block)
+        tape = kc87.read_tape(block)
+        if block_stats:
+            self.stats['glitches'] = self.stats.get('glitches', 0) + block_stats.glitches
+            self.stats['drops'] = self.stats.get('drops', 0) + block_stats.drops
+        elif sync:
+            self.syncs.append([self.raw_count, sync.sample_index, sync.time_us, block.offset, None])
+        elif tape:
+            key = 'tape_ok' if tape.status == kc87.TAPE_STATUS_OK else 'tape_bad'
+            self.stats[key] = self.stats.get(key, 0) + 1
+
+    def feed_words(self, words):
+        """Verarbeitet einen Chunk Sample-Worte (uint16, alle Kanäle)"""
+        if not self.header_found or len(words) == 0:
+            return
+        layout = self.layout
+        deltas = (words & layout.delta_max).astype(np.int64)
+        edges = (words & 0x8000) != 0
+        times = self.stream_time + np.cumsum(deltas)
+
+        # Delta-Summen an den Sync-Positionen (für den Vergleich mit den Zeitstempeln)
+        end = self.raw_count + len(words)
+        for sync in self.syncs:
+            if sync[4] is None and self.raw_count <= sync[0] < end:
+                sync[4] = int(times[sync[0] - self.raw_count])
+
+        if layout.bits > 0:
+            ordinals = (words & 0x7FFF) >> layout.delta_bits
+            channel_map = np.array(layout.channels, dtype=np.uint8)
+            channels = channel_map[ordinals]
+            tape = channels == 0
+            for k in np.nonzero(~tape)[0]:
+                self.channels.setdefault(int(channels[k]), []).append((bool(edges[k]), int(times[k])))
+            times0 = times[tape]
+            edges0 = edges[tape]
+        else:
+            times0 = times
+            edges0 = edges
+
+        if self.speed is None and kc87.lib is not None and len(edges0):
+            self.speed = kc87.SpeedEstimator(bool(edges0.any()))
+        if self.speed is not None:
+            self.speed.feed(words, layout)
+
+        deltas0 = np.diff(times0, prepend=self.last_time0)
+        if len(times0):
+            self.last_time0 = int(times0[-1])
+        self.stream_time = int(times[-1])
+        self.raw_count = end
+        self._feed_tape(edges0, deltas0)
+
+    def _feed_tape(self, edges, deltas):
+        if len(deltas) == 0:
+            return
+        self.tape.feed(edges, deltas)
+        chunk_min = int(deltas.min())
+        chunk_max = int(deltas.max())
+        self.delta_min = chunk_min if self.delta_min is None else min(self.delta_min, chunk_min)
+        self.delta_max = chunk_max if self.delta_max is None else max(self.delta_max, chunk_max)
+        self.delta_sum += int(deltas.sum())
+        self.histogram += np.bincount(np.minimum(deltas, DELTA_LIMIT), minlength=DELTA_LIMIT + 1)
+        self.overflows += int(np.count_nonzero(deltas >= DELTA_LIMIT))
+        if len(self.head) < HEAD_SAMPLES:
+            n = HEAD_SAMPLES - len(self.head)
+            self.head.extend(zip(edges[:n].tolist(), deltas[:n].tolist()))
+
+        e = np.concatenate((self.tail_edges, edges))
+        d = np.concatenate((self.tail_deltas, deltas))
+        base = self.tail_start
+        self.count += len(deltas)
+        total = self.count
+
+        # Flanken-Pattern und große Werte: Samples 1 .. n-2
+        if self.pattern_start is None and total >= 2:
+            self.pattern_start = bool(e[1 - base])
+        hi = total - 1
+        if self.pattern_start is not None and hi > self.pattern_next:
+            idx = np.arange(self.pattern_next, hi)
+            found = e[idx - base]
+            expected = ((idx - 1) & 1).astype(bool) ^ self.pattern_start
+            errors = np.nonzero(found != expected)[0]
+            self.pattern_errors += len(errors)
+            for k in errors[:PATTERN_ERRORS_SHOWN - len(self.pattern_error_list)]:
+                self.pattern_error_list.append((int(idx[k]), bool(expected[k]), bool(found[k])))
+            self.large_deltas += int(np.count_nonzero(d[idx - base] > LARGE_DELTA_US))
+            self.pattern_next = hi
+
+        # Perioden aus je zwei Deltas (Sample i-1 und i, i gerade), ohne erste/letzte
+        hi = total - 2
+        if hi > self.period_next:
+            idx = np.arange(self.period_next, hi, 2)
+            periods = d[idx - 1 - base] + d[idx - base]
+            periods = periods[periods > 0]
+            if len(periods):
+                freqs = 1000000 / periods
+                self.freq_count += len(freqs)
+                self.freq_sum += float(freqs.sum())
+                self.freq_sumsq += float(np.square(freqs).sum())
+                chunk_min = float(freqs.min())
+                chunk_max = float(freqs.max())
+                self.freq_min = chunk_min if self.freq_min is None else min(self.freq_min, chunk_min)
+                self.freq_max = chunk_max if self.freq_max is None else max(self.freq_max, chunk_max)
+                if len(self.freq_head) < PERIODS_SHOWN:
+                    self.freq_head.extend(freqs[:PERIODS_SHOWN - len(self.freq_head)].tolist())
+            self.period_next = int(idx[-1]) + 2
+
+        keep = min(self.pattern_next, self.period_next - 1)
+        self.tail_edges = e[keep - base:]
+        self.tail_deltas = d[keep - base:]
+        self.tail_start = keep
+
+    def finish(self):
+        """Schließt die Auswertung ab (Sonderfall sehr kurzer Aufnahmen)"""
+        if self.count <= 2:
+            edges = [edge for edge, _ in self.head]
+            expected = edges[1] if len(edges) > 1 else True
+            self.pattern_errors = 0
+            self.pattern_error_list = []
+            for i, edge in enumerate(edges):
+                if edge != expected:
+                    self.pattern_errors += 1
+                    if self.pattern_errors <= PATTERN_ERRORS_SHOWN:
+                        self.pattern_error_list.append((i + 1, expected, edge))
+                expected = not expected
+
+    @property
+    def pattern_samples(self):
+        return self.count - 2 if self.count > 2 else self.count
+
+    @property
+    def resolved_syncs(self):
+        """Sync-Punkte, deren Sample empfangen wurde"""
+        return [s for s in self.syncs if s[4] is not None]
+
+    def frequency(self):
+        """(Durchschnitt Hz, Standardabweichung Hz, Jitter %) oder None
+
+        Nur bei weniger als 10% Pattern-Fehlern, sonst sind die Perioden nicht aussagekräftig.
+        """
+        if not self.freq_count or self.pattern_errors >= self.pattern_samples * 0.1:
+            return None
+        avg_freq = self.freq_sum / self.freq_count
+        freq_std = max(self.freq_sumsq / self.freq_count - avg_freq**2, 0.0) ** 0.5
+        jitter_percent = (freq_std / avg_freq) * 100 if avg_freq > 0 else 0
+        return avg_freq, freq_std, jitter_percent
+
+    def tape_blocks(self):
+        """(OK, Prüfsummenfehler, Herkunft) der KC87-Blöcke
+
+        Tape-Blöcke des Pico (Dekodier-Modus) haben Vorrang: die Rohflanken solcher
+        Aufnahmen enthalten nur noch die dort nicht dekodierbaren Abschnitte.
+        """
+        if 'tape_ok' in self.stats or 'tape_bad' in self.stats:
+            return self.stats.get('tape_ok', 0), self.stats.get('tape_bad', 0), 'pico'
+        if self.tape.blocks:
+            return self.tape.ok, self.tape.bad, 'host'
+        return 0, 0, ''
+
+    def speed_result(self):
+        """kc87.SpeedResult, nur für Aufnahmen mit auf dem Host dekodierten KC87-Blöcken
+
+        Der Schätzer bezieht sich auf die KC87-Nennperioden; bei Testtönen oder den wenigen
+        Rohflanken einer Aufnahme im Dekodier-Modus ist das Ergebnis nicht aussagekräftig.
+        """
+        if self.speed is None or self.tape_blocks()[2] != 'host':
+            return None
+        return self.speed.result()
+
+def analyze_data(data, chunk_samples=kc87.CHUNK_SAMPLES):
+    """Wertet einen Puffer (bytes oder mmap) chunkweise aus und liefert eine BinAnalysis"""
+    analysis = BinAnalysis()
+    for item in kc87.iter_chunks(data, chunk_samples):
+        if isinstance(item, kc87.Block):
+            analysis.feed_block(item)
+        else:
+            analysis.feed_words(item)
+    analysis.finish()
+    return analysis
+
+def analyze_sync(syncs):
+    """Prüft die Samples gegen die Sync-Blöcke
+
+    Liefert (verlorene Samples, Liste der Zeitfehler als (Sample-Index, Fehler in µs)).
+    Ein Zeitfehler ist die Differenz zwischen der absoluten Zeit zweier Sync-Punkte
+    und der Summe der Delta-Zeiten dazwischen (z.B. durch begrenzte Deltas oder Verluste).
+    """
+    lost = 0
+    errors = []
+    prev = None
+    for pos, index, time_us, _, delta_time in syncs:
+        if delta_time is None:
             continue
-        
-        block_type = data[pos + 2]
-        
-        if block_type == BLOCK_TYPE_HEADER:
-            version = data[pos + 3]
-            end_marker = struct.unpack('<H', data[pos+4:pos+6])[0]
-            if end_marker == BLOCK_END:
-                header_found = True
-                pos += 6
-                continue
-        elif block_type == BLOCK_TYPE_SAMPLES and header_found:
-            sample_count = data[pos + 3]
-            expected_size = 6 + (sample_count * 2)
-            
-            if pos + expected_size > len(data):
-                break
-            
-            end_marker = struct.unpack('<H', data[pos+expected_size-2:pos+expected_size])[0]
-            if end_marker == BLOCK_END:
-                # Extract samples
-                for i in range(sample_count):
-                    sample_pos = pos + 4 + (i * 2)
-                    sample = struct.unpack('<H', data[sample_pos:sample_pos+2])[0]
-                    edge = (sample & 0x8000) != 0
-                    delta_us = sample & 0x7FFF
-                    samples.append((edge, delta_us))
-                
-                pos += expected_size
+        lost = max(lost, index - pos)
+        if prev is not None:
+            prev_time, prev_delta_time = prev
+            error = (time_us - prev_time) - (delta_time - prev_delta_time)
+            if error != 0:
+                errors.append((index, error))
+        prev = (time_us, delta_time)
+    return lost, errors
+
+def samples_at_time(data, analysis, offset_us, count=10):
+    """Sucht das erste Sample ab offset_us nach Session-Beginn
+
+    Springt zum letzten Sync-Punkt davor und liest die Datei nur ab dessen Block. Archive
+    ohne Sync-Blöcke springen über den Frame-Index (Zeit ab Aufnahmebeginn).
+    Liefert (Position im Sample-Strom, absolute Zeit des Samples in µs,
+    Liste der folgenden Samples als (Kanal, Flanke, Delta)) oder None.
+    """
+    syncs = analysis.resolved_syncs
+    if syncs:
+        target = syncs[0][2] + offset_us
+        i = bisect.bisect_right([s[2] for s in syncs], target) - 1
+        pos, _, time_us, offset, _ = syncs[max(i, 0)]
+        first = True
+    elif isinstance(data, kc87.Archive) and data.frames:
+        target = offset_us
+        frame = data.frames[data.frame_at_time(offset_us)]
+        pos, time_us, offset = frame.sample_index, frame.time_us, frame.bin_offset
+        first = False   # Die Frame-Zeit liegt vor dem ersten Sample
+    else:
+        return None
+
+    layout = analysis.layout
+    found = None
+    result = []
+    last_word = None
+    for item in kc87.iter_chunks(data, start=offset):
+        if isinstance(item, kc87.Block):
+            continue
+        start = 0
+        if found is None:
+            steps = (item & layout.delta_max).astype(np.int64)
+            if first:
+                steps[0] = 0  # Die Sync-Zeit gilt für das erste Sample selbst
+            times = time_us + np.cumsum(steps)
+            hits = np.nonzero(times >= target)[0]
+            if len(hits) == 0:
+                pos += len(item)
+                time_us = int(times[-1])
+                last_word = int(item[-1])
+                first = False
                 continue
-        
-        # Check for End-of-Stream (0x8000 0x8000)
-        if pos + 4 <= len(data):
-            marker1 = struct.unpack('<H', data[pos:pos+2])[0]
-            marker2 = struct.unpack('<H', data[pos+2:pos+4])[0]
-            if marker1 == BLOCK_END and marker2 == BLOCK_END:
-                # End of stream reached
-                break
-        
-        # Skip unknown data
-        pos += 1
-    
-    return samples
+            start = int(hits[0])
+            found = (pos + start, int(times[start]))
+        first = False
+        for word in item[start:start + count - len(result)].tolist():
+            result.append(layout.decode(word))
+        if len(result) >= count:
+            break
+    if found is None:
+        if last_word is None:
+            return None
+        # Ziel hinter dem letzten Sample: letztes Sample liefern
+        return pos - 1, time_us, [layout.decode(last_word)]
+    return found[0], found[1], result
+
+def print_sync_analysis(syncs):
+    """Gibt die Auswertung der Sync-Blöcke aus"""
+    lost, errors = analyze_sync(syncs)
+    duration_s = (syncs[-1][2] - syncs[0][2]) / 1e6
+    print(f"\nZeitsynchronisation ({len(syncs)} Sync-Blöcke, {duration_s:.1f} s):")
+    if lost > 0:
+        print(f"  VERLUSTE:      {lost} Samples laut Sample-Index nicht empfangen")
+    else:
+        print(f"  Sample-Index:  lückenlos")
+    if errors:
+        worst = max(errors, key=lambda e: abs(e[1]))
+        print(f"  ZEITFEHLER:    {len(errors)} Abschnitte, max. {worst[1]:+d} μs bei Sample {worst[0]}")
+        for index, error in errors[:5]:
+            print(f"    Sample {index}: {error:+d} μs")
+    else:
+        print(f"  Zeitbasis:     Delta-Summen stimmen mit den Sync-Zeitstempeln überein")
 
-def analyze_bin_file(filename):
+def analyze_bin_file(filename, at_seconds=None):
     """Analysiert eine .bin Datei und gibt detaillierte Statistiken aus"""
     
     if not os.path.exists(filename):
         print(f"Fehler: Datei {filename} nicht gefunden")
         return
     
-    with open(filename, 'rb') as f:
-        data = f.read()
-    
-    if len(data) == 0:
+    size = os.path.getsize(filename)
+    if size == 0:
         print(f"Fehler: {filename} ist leer")
         return
     
-    # Parse block format
-    samples = parse_bin_file(data)
+    # Block-Format chunkweise auswerten (Datei als mmap, ohne Kopie)
+    data = kc87.open_file(filename)
+    a = analyze_data(data)
+    stats = a.stats
     
     print(f"\n{'='*60}")
     print(f"ANALYSE: {filename}")
     print(f"{'='*60}")
-    print(f"Dateigröße:     {len(data)} Bytes")
-    print(f"Anzahl Samples: {len(samples)}")
+    print(f"Dateigröße:     {size} Bytes")
+    if isinstance(data, kc87.Archive):
+        print(f"                Archiv mit {len(data.frames)} Frames, {len(data)} Bytes als .bin "
+              f"(Faktor {len(data) / size:.1f})")
+    if a.version is not None:
+        blocks = "lange Sample-Blöcke" if a.version >= 2 else "Sample-Blöcke bis 255 Samples"
+        print(f"Protokoll:      Version {a.version} ({blocks})")
+        if a.version > kc87.PROTOCOL_VERSION:
+            print(f"                WARNUNG: neuere Version als unterstützt ({kc87.PROTOCOL_VERSION}), "
+                  f"unbekannte Blöcke werden übersprungen")
+    print(f"Anzahl Samples: {a.count}")
+    tape_ok, tape_bad, tape_source = a.tape_blocks()
+    if tape_source:
+        where = "auf dem Pico" if tape_source == 'pico' else "aus den Rohflanken"
+        print(f"Tape-Blöcke:    {tape_ok} OK, {tape_bad} mit Prüfsummenfehler ({where} dekodiert)")
+        if tape_source == 'host':
+            print(f"                Periodenabweichung vom Nennwert: {a.tape.deviation * 100:.1f}%")
+    speed = a.speed_result()
+    if speed:
+        print(f"\nBandgeschwindigkeit ({speed.periods} Perioden, bezogen auf KC87-Nennwerte):")
+        print(f"  Durchschnitt:  {speed.speed * 100:.2f}% ({(speed.speed - 1) * 100:+.2f}%)")
+        print(f"  Drift:         {speed.speed_min * 100:.2f}% - {speed.speed_max * 100:.2f}%")
+        print(f"  Gleichlauf:    Wow {speed.wow_percent:.2f}%, Flutter {speed.flutter_percent:.2f}%, "
+              f"gesamt {speed.total_percent:.2f}% (RMS)")
+    elif tape_source == 'host' and kc87.lib is None:
+        print(f"                (Bandgeschwindigkeit/Gleichlauf benötigen libkc87)")
+    if 'glitches' in stats:
+        print(f"Glitches:       {stats['glitches']} unterdrückt (Glitch-Filter der Firmware)")
+        if stats['drops'] > 0:
+            print(f"VERLUSTE:       {stats['drops']} Samples durch Ringpuffer-Überlauf verworfen")
     
-    if len(samples) == 0:
+    if a.count == 0:
         print("Keine Samples gefunden!")
         return
     
-    # Grundlegende Statistiken
-    deltas = [s[1] for s in samples]
-    edges = [s[0] for s in samples]
+    if a.channels:
+        print(f"\nSteuerleitungen (gemeinsame Zeitbasis mit Kanal 0):")
+        for channel, events in sorted(a.channels.items()):
+            first = ", ".join(f"{'↑' if edge else '↓'} {t / 1e6:.6f} s" for edge, t in events[:4])
+            print(f"  Kanal {channel}:       {len(events)} Flanken ({first}{', ...' if len(events) > 4 else ''})")
+    
+    if a.syncs:
+        print_sync_analysis(a.syncs)
+    if at_seconds is not None:
+        found = samples_at_time(data, a, int(at_seconds * 1e6))
+        if found:
+            pos, time_us, following = found
+            print(f"\nSamples ab {at_seconds:.3f} s (Sample {pos}, t = {time_us} μs):")
+            for channel, edge, delta in following:
+                print(f"  K{channel} {'STEIGEND' if edge else 'FALLEND ':8s}  {delta:5d} μs")
+        elif not a.syncs:
+            print(f"\nKeine Sync-Blöcke vorhanden, --at nicht möglich")
     
+    # Grundlegende Statistiken
     print(f"\nDelta-Zeit Statistiken:")
-    print(f"  Min:           {min(deltas)} μs")
-    print(f"  Max:           {max(deltas)} μs") 
-    print(f"  Durchschnitt:  {sum(deltas)/len(deltas):.1f} μs")
+    print(f"  Min:           {a.delta_min} μs")
+    print(f"  Max:           {a.delta_max} μs") 
+    print(f"  Durchschnitt:  {a.delta_sum/a.count:.1f} μs")
     
     # Overflow-Erkennung (32767 ist Maximum für 15 Bits)
-    overflows = [d for d in deltas if d >= 32767]
-    if overflows:
-        print(f"  OVERFLOWS:     {len(overflows)} Samples mit Maximalwert (Timer-Overflow)")
-    
-    # Sehr große Werte (verdächtig für Audio-Signale) - aber erste/letzte Samples ignorieren
-    large_deltas = []
-    for i, d in enumerate(deltas):
-        if d > 10000 and i != 0 and i != len(deltas)-1:  # Erste und letzte Samples ausschließen
-            large_deltas.append((i, d))
-    if large_deltas:
-        print(f"  GROSSE WERTE:  {len(large_deltas)} Samples > 10ms (ohne erstes/letztes Sample)")
+    if a.overflows:
+        print(f"  OVERFLOWS:     {a.overflows} Samples mit Maximalwert (Timer-Overflow)")
+    
+    # Sehr große Werte (verdächtig für Audio-Signale) - erste/letzte Samples ignoriert
+    if a.large_deltas:
+        print(f"  GROSSE WERTE:  {a.large_deltas} Samples > 10ms (ohne erstes/letztes Sample)")
     
     # Pattern-Analyse (sollte alternieren: True, False, True, False...)
-    # Ignoriere erstes und letztes Sample bei Pattern-Prüfung
+    # Erstes und letztes Sample werden bei der Pattern-Prüfung ignoriert
     print(f"\nFlanken-Pattern Analyse (ohne erstes/letztes Sample):")
-    pattern_samples = edges[1:-1] if len(edges) > 2 else edges  # Erstes und letztes ausschließen
-    start_expected = edges[1] if len(edges) > 1 else True  # Pattern vom zweiten Sample ableiten
-    
-    expected_pattern = start_expected
-    pattern_errors = 0
-    
-    for i, edge in enumerate(pattern_samples):
-        if edge != expected_pattern:
-            pattern_errors += 1
-            if pattern_errors <= 5:  # Zeige nur erste 5 Fehler
-                actual_index = i + 1  # +1 weil wir das erste übersprungen haben
-                print(f"  Pattern-Fehler bei Sample {actual_index}: erwartet {expected_pattern}, gefunden {edge}")
-        expected_pattern = not expected_pattern
-    
-    if pattern_errors == 0:
-        print(f"  Pattern perfekt: {len(pattern_samples)} Samples alternieren korrekt")
+    for index, expected, edge in a.pattern_error_list:
+        print(f"  Pattern-Fehler bei Sample {index}: erwartet {expected}, gefunden {edge}")
+    
+    pattern_samples = a.pattern_samples
+    if a.pattern_errors == 0:
+        print(f"  Pattern perfekt: {pattern_samples} Samples alternieren korrekt")
     else:
-        print(f"  Pattern-Fehler: {pattern_errors}/{len(pattern_samples)} Samples nicht alternierend")
+        print(f"  Pattern-Fehler: {a.pattern_errors}/{pattern_samples} Samples nicht alternierend")
     
     # Frequenz-Analyse (nur für korrekte Pattern)
-    # Ignoriere erste und letzte Periode bei Frequenzberechnung da unvollständig
-    if pattern_errors < len(pattern_samples) * 0.1:  # Weniger als 10% Fehler
-        frequencies = []
-        periods_us = []
-        
-        # Berechne Frequenz für jedes HIGH-LOW Paar, aber überspringe erste und letzte
-        start_idx = 1  # Überspringe erste Periode
-        end_idx = len(samples) - 2  # Überspringe letzte Periode
-        
-        for i in range(start_idx + 1, end_idx, 2):
-            if i < len(samples):
-                high_time = samples[i-1][1]  # Steigende Flanke
-                low_time = samples[i][1]     # Fallende Flanke
-                period_us = high_time + low_time
-                if period_us > 0:
-                    freq_hz = 1000000 / period_us
-                    frequencies.append(freq_hz)
-                    periods_us.append(period_us)
-        
-        if frequencies:
-            avg_freq = sum(frequencies) / len(frequencies)
-            min_freq = min(frequencies)
-            max_freq = max(frequencies)
-            
-            # Jitter-Berechnung
-            freq_variance = sum((f - avg_freq)**2 for f in frequencies) / len(frequencies)
-            freq_std = freq_variance ** 0.5
-            jitter_percent = (freq_std / avg_freq) * 100 if avg_freq > 0 else 0
+    # Erste und letzte Periode sind unvollständig und werden ignoriert
+    if a.pattern_errors < pattern_samples * 0.1:  # Weniger als 10% Fehler
+        frequency = a.frequency()
+        if frequency:
+            avg_freq, freq_std, jitter_percent = frequency
+            min_freq = a.freq_min
+            max_freq = a.freq_max
             
-            print(f"\nFrequenz-Analyse ({len(frequencies)} Perioden, ohne erste/letzte):")
+            print(f"\nFrequenz-Analyse ({a.freq_count} Perioden, ohne erste/letzte):")
             print(f"  Durchschnitt:  {avg_freq:.1f} Hz")
             print(f"  Bereich:       {min_freq:.1f} - {max_freq:.1f} Hz")
             print(f"  Jitter:        ±{freq_std:.1f} Hz ({jitter_percent:.2f}%)")
@@ -212,34 +524,278 @@ def analyze_bin_file(filename):
             
             # Zeige Perioden 2-11 (skip erste)
             period_start = 1  # Beginne mit zweiter Periode
-            for i in range(10):  # Zeige 10 Perioden
-                freq_idx = i
+            for i in range(PERIODS_SHOWN):
                 sample_idx = period_start + (i * 2)
-                
-                if freq_idx < len(frequencies) and sample_idx + 1 < len(samples):
-                    high_time = samples[sample_idx][1]
-                    low_time = samples[sample_idx + 1][1] if sample_idx + 1 < len(samples) else 0
+                if i < len(a.freq_head) and sample_idx + 1 < a.count:
+                    high_time = a.head[sample_idx][1]
+                    low_time = a.head[sample_idx + 1][1]
                     total_time = high_time + low_time
-                    freq = frequencies[freq_idx]
-                    print(f"{period_start + i + 1:7d} | {high_time:9d} | {low_time:8d} | {total_time:8d} | {freq:9.1f}")
+                    print(f"{period_start + i + 1:7d} | {high_time:9d} | {low_time:8d} | {total_time:8d} | {a.freq_head[i]:9.1f}")
     
     else:
         print(f"\nFrequenz-Analyse übersprungen (zu viele Pattern-Fehler)")
     
     print(f"\n{'='*60}")
 
+def summarize(a):
+    """Kennwerte einer BinAnalysis als flaches dict (eine Zeile der Batch-Übersicht)"""
+    lost, errors = analyze_sync(a.syncs)
+    frequency = a.frequency()
+    tape_ok, tape_bad, tape_source = a.tape_blocks()
+    deviation = a.tape.deviation if tape_source == 'host' else None
+    summary = {
+        'samples': a.count,
+        'duration_s': round(a.stream_time / 1e6, 3),
+        'channels': f"0x{a.layout.mask:02X}",
+        'glitches': a.stats.get('glitches', 0),
+        'drops': a.stats.get('drops', 0),
+        'lost_samples': lost,
+        'sync_errors': len(errors),
+        'max_sync_error_us': max((abs(e) for _, e in errors), default=0),
+        'pattern_errors': a.pattern_errors,
+        'pattern_error_rate': round(a.pattern_errors / a.pattern_samples, 6) if a.pattern_samples else 0,
+        'avg_freq_hz': round(frequency[0], 1) if frequency else None,
+        'jitter_percent': round(frequency[2], 3) if frequency else None,
+        'tape_ok': tape_ok,
+        'tape_bad': tape_bad,
+        'tape_source': tape_source,
+        'tape_deviation_percent': round(deviation * 100, 2) if deviation is not None else None,
+    }
+    speed = a.speed_result()
+    summary['speed'] = round(speed.speed, 4) if speed else None
+    summary['speed_drift_percent'] = round((speed.speed_max - speed.speed_min) * 100, 2) if speed else None
+    summary['wow_percent'] = round(speed.wow_percent, 3) if speed else None
+    summary['flutter_percent'] = round(speed.flutter_percent, 3) if speed else None
+    summary['score'] = quality_score(summary)
+    return summary
+
+def quality_score(summary):
+    """Qualitätswert 0..100 aus den Kennwerten einer Aufnahme
+
+    Vollständigkeit (keine verworfenen/verlorenen Samples, keine Zeitfehler) zählt immer 30%.
+    Mit KC87-Blöcken: Anteil fehlerfreier Blöcke 40%, Periodenabweichung vom Nennwert 20%
+    (25% Abweichung = 0), Flanken-Pattern 10%. Ohne Blöcke (z.B. Testtöne): Jitter 40%
+    (10% Jitter = 0), Flanken-Pattern 30%. 10% Pattern-Fehler ergeben dabei 0.
+    """
+    if summary['samples'] == 0 and summary['tape_source'] != 'pico':
+        return 0.0
+    integrity = 1.0
+    if summary['drops'] or summary['lost_samples']:
+        integrity -= 0.5
+    if summary['sync_errors']:
+        integrity -= 0.5
+    pattern = max(0.0, 1.0 - 10 * summary['pattern_error_rate'])
+
+    blocks = summary['tape_ok'] + summary['tape_bad']
+    if blocks:
+        deviation = summary['tape_deviation_percent']
+        timing = 1.0 if deviation is None else max(0.0, 1.0 - deviation / 25)
+        score = 0.3 * integrity + 0.4 * summary['tape_ok'] / blocks + 0.2 * timing + 0.1 * pattern
+    else:
+        jitter = summary['jitter_percent']
+        signal = 0.0 if jitter is None else max(0.0, 1.0 - jitter / 10)
+        score = 0.3 * integrity + 0.4 * signal + 0.3 * pattern
+    return round(100 * score, 1)
+
+def file_hash(filename):
+    """SHA-256 des Dateiinhalts (Cache-Schlüssel)"""
+    h = hashlib.sha256()
+    with open(filename, 'rb') as f:
+        for block in iter(lambda: f.read(HASH_BLOCK), b''):
+            h.update(block)
+    return h.hexdigest()
+
+_known_hashes = frozenset()
+
+def _batch_init(known_hashes):
+    global _known_hashes
+    _known_hashes = known_hashes
+
+def _batch_worker(filename):
+    """Wertet eine Datei im Worker-Prozess aus: (Dateiname, SHA-256, Kennwerte oder None)
+
+    None bedeutet: Inhalt ist bereits im Cache (z.B. umbenannte oder kopierte Aufnahme).
+    """
+    try:
+        sha = file_hash(filename)
+        if sha in _known_hashes:
+            return filename, sha, None
+        return filename, sha, summarize(analyze_data(kc87.open_file(filename)))
+    except Exception as e:  # Eine defekte Datei darf den Batch nicht abbrechen
+        return filename, None, {'error': f"{type(e).__name__}: {e}", 'score': 0.0}
+
+def load_cache(cache_file):
+    try:
+        with open(cache_file) as f:
+            cache = json.load(f)
+        if cache.get('version') == ANALYSIS_VERSION:
+            return cache
+    except (OSError, ValueError):
+        pass
+    return {'version': ANALYSIS_VERSION, 'files': {}, 'results': {}}
+
+def save_cache(cache_file, cache):
+    tmp = cache_file + '.tmp'
+    with open(tmp, 'w') as f:
+        json.dump(cache, f)
+    os.replace(tmp, cache_file)
+
+def find_captures(directory):
+    """Alle .bin Dateien und Archive (.kca) unterhalb von directory, sortiert"""
+    found = []
+    for root, dirs, files in os.walk(directory):
+        dirs.sort()
+        found.extend(os.path.join(root, name) for name in sorted(files)
+                     if name.lower().endswith(('.bin', '.kca')))
+    return found
+
+def analyze_batch(directory, jobs=None, csv_file=None, json_file=None):
+    """Wertet alle Aufnahmen unter directory parallel aus und schreibt die Übersicht"""
+    if not os.path.isdir(directory):
+        print(f"Fehler: Verzeichnis {directory} nicht gefunden")
+        return False
+    cache_file = os.path.join(directory, CACHE_NAME)
+    cache = load_cache(cache_file)
+    files = find_captures(directory)
+
+    # Unveränderte Dateien (Größe, Änderungszeit) ohne erneutes Hashen aus dem Cache
+    rows = {}
+    errors = {}
+    pending = []
+    for filename in files:
+        rel = os.path.relpath(filename, directory)
+        try:
+            st = os.stat(filename)
+        except OSError as e:
+            errors[rel] = {'error': f"{type(e).__name__}: {e}", 'score': 0.0}
+            continue
+        entry = cache['files'].get(rel)
+        if entry and entry[0] == st.st_size and entry[1] == st.st_mtime_ns and entry[2] in cache['results']:
+            rows[rel] = entry[2]
+        else:
+            pending.append(filename)
+
+    jobs = jobs or os.cpu_count() or 1
+    print(f"{len(files)} Aufnahmen, {len(rows)} unverändert (Cache), {len(pending)} auszuwerten"
+          + (f" mit {min(jobs, len(pending))} Prozessen" if pending else ""))
+    analyzed = 0
+    if pending:
+        with multiprocessing.Pool(min(jobs, len(pending)), _batch_init,
+                                  (frozenset(cache['results']),)) as pool:
+            for n, (filename, sha, summary) in enumerate(pool.imap_unordered(_batch_worker, pending), 1):
+                rel = os.path.relpath(filename, directory)
+                if sha is None:
+                    errors[rel] = summary
+                    print(f"  [{n}/{len(pending)}] {rel}: {summary['error']}")
+                    continue
+                if summary is not None:
+                    cache['results'][sha] = summary
+                    analyzed += 1
+                st = os.stat(filename)
+                cache['files'][rel] = [st.st_size, st.st_mtime_ns, sha]
+                rows[rel] = sha
+                print(f"  [{n}/{len(pending)}] {rel}: Score {cache['results'][sha]['score']:.1f}")
+
+    # Einträge gelöschter Dateien entfernen
+    files_before, results_before = len(cache['files']), len(cache['results'])
+    cache['files'] = {rel: e for rel, e in cache['files'].items() if rel in rows}
+    used = {e[2] for e in cache['files'].values()}
+    cache['results'] = {sha: r for sha, r in cache['results'].items() if sha in used}
+    if pending or len(cache['files']) != files_before or len(cache['results']) != results_before:
+        save_cache(cache_file, cache)
+
+    table = []
+    for rel in sorted(set(rows) | set(errors)):
+        if rel in errors:
+            row = dict(errors[rel], file=rel)
+        else:
+            row = dict(cache['results'][rows[rel]], file=rel, sha256=rows[rel])
+            row['size'] = cache['files'][rel][0]
+        table.append({field: row.get(field) for field in SUMMARY_FIELDS})
+
+    if csv_file:
+        with open(csv_file, 'w', newline='') as f:
+            writer = csv.DictWriter(f, fieldnames=SUMMARY_FIELDS)
+            writer.writeheader()
+            writer.writerows(table)
+    if json_file:
+        with open(json_file, 'w') as f:
+            json.dump(table, f, indent=1)
+
+    scores = [row['score'] for row in table if row['error'] is None]
+    print(f"\n{'='*60}")
+    print(f"BATCH: {directory}")
+    print(f"{'='*60}")
+    print(f"Aufnahmen:        {len(table)} ({analyzed} neu ausgewertet, {len(errors)} Fehler)")
+    if scores:
+        print(f"Qualität:         Durchschnitt {sum(scores) / len(scores):.1f}, Minimum {min(scores):.1f}")
+    tape_ok = sum(row['tape_ok'] or 0 for row in table)
+    tape_bad = sum(row['tape_bad'] or 0 for row in table)
+    if tape_ok or tape_bad:
+        print(f"Tape-Blöcke:      {tape_ok} OK, {tape_bad} mit Prüfsummenfehler")
+    worst = sorted(table, key=lambda row: row['score'])[:WORST_SHOWN]
+    if worst:
+        print(f"\nSchlechteste Aufnahmen:")
+        for row in worst:
+            if row['error']:
+                note = row['error']
+            elif row['tape_source']:
+                note = f"{row['tape_ok']} OK / {row['tape_bad']} Fehler"
+            elif row['jitter_percent'] is not None:
+                note = f"Jitter {row['jitter_percent']}%"
+            else:
+                note = f"{row['samples']} Samples"
+            print(f"  {row['score']:5.1f}  {row['file']}  ({note})")
+    for name in (csv_file, json_file):
+        if name:
+            print(f"Übersicht:        {name}")
+    return True
+
+def take_option(args, name):
+    """Entfernt '<name> <wert>' aus args und liefert den Wert (None wenn nicht vorhanden)"""
+    if name not in args:
+        return None
+    i = args.index(name)
+    if i + 1 >= len(args):
+        raise ValueError(f"{name} ohne Wert")
+    value = args[i + 1]
+    del args[i:i + 2]
+    return value
+
 def main():
     """Hauptfunktion"""
-    if len(sys.argv) < 2:
-        print("Usage: python3 analyze_bin.py <file1.bin> [file2.bin] ...")
+    args = sys.argv[1:]
+    try:
+        at_seconds = take_option(args, '--at')
+        at_seconds = float(at_seconds) if at_seconds is not None else None
+        batch_dir = take_option(args, '--batch')
+        jobs = take_option(args, '--jobs')
+        jobs = int(jobs) if jobs is not None else None
+        csv_file = take_option(args, '--csv')
+        json_file = take_option(args, '--json')
+    except ValueError:
+        args = []
+        batch_dir = None
+    
+    if batch_dir is not None and not args:
+        if not analyze_batch(batch_dir, jobs, csv_file, json_file):
+            sys.exit(1)
+        return
+    
+    if len(args) < 1:
+        print("Usage: python3 analyze_bin.py [--at <sekunden>] <file1.bin> [file2.bin] ...")
+        print("       python3 analyze_bin.py --batch <verzeichnis> [--jobs N] [--csv datei] [--json datei]")
         print("\nBeispiel:")
         print("  python3 analyze_bin.py 1khz.bin 2khz.bin 3khz.bin 4khz.bin")
+        print("  python3 analyze_bin.py --at 12.5 aufnahme.bin   # Samples ab 12,5 s (über Sync-Blöcke)")
+        print("  python3 analyze_bin.py --at 12.5 aufnahme.kca   # Archiv (archive_bin.py), Frame-Index")
+        print("  python3 analyze_bin.py --batch archiv/ --csv archiv.csv   # ganzes Archiv, parallel")
         sys.exit(1)
     
-    for filename in sys.argv[1:]:
-        analyze_bin_file(filename)
+    for filename in args:
+        analyze_bin_file(filename, at_seconds)
         
-    print(f"\nAnalyse abgeschlossen für {len(sys.argv)-1} Dateien.")
+    print(f"\nAnalyse abgeschlossen für {len(args)} Dateien.")
 
 if __name__ == "__main__":
     main()
\ No newline at end of file
@@ -2,33 +2,36 @@
 """
 Analysiere die ersten Samples einer .bin Datei im Detail
 """
-import struct
 import sys
 
+import kc87
+
 def analyze_first_samples(filename, count=20):
     print(f"Erste {count} Samples aus {filename}:")
     print("=" * 60)
-    
-    with open(filename, 'rb') as f:
-        for i in range(count):
-            data = f.read(2)
-            if len(data) < 2:
-                print(f"Sample {i+1}: EOF erreicht")
-                break
-                
-            # Little-endian decode
-            word = struct.unpack('<H', data)[0]
-            
-            # Extract edge and delta
-            edge = (word & 0x8000) != 0
-            delta_us = word & 0x7FFF
-            
+
+    # Blockweise lesen: Header-, Sync- und andere Blöcke sind keine Samples
+    layout = kc87.Layout()
+    i = 0
+    for block in kc87.iter_blocks(kc87.open_file(filename)):
+        if block.type == kc87.BLOCK_TYPE_CHANNELS:
+            layout = kc87.read_channels(block) or layout
+            continue
+        if block.type != kc87.BLOCK_TYPE_SAMPLES:
+            continue
+        for word in kc87.sample_words(block):
+            channel, edge, delta_us = layout.decode(word)
             edge_str = "STEIGEND" if edge else "FALLEND"
-            print(f"Sample {i+1:2d}: Delta={delta_us:4d}μs  Edge={edge_str:8s}  (0x{word:04X})")
-            
+            channel_str = f"  Kanal={channel}" if layout.bits else ""
+            print(f"Sample {i+1:2d}: Delta={delta_us:4d}μs  Edge={edge_str:8s}  (0x{word:04X}){channel_str}")
+            i += 1
+            if i == count:
+                return
+    print(f"Sample {i+1}: EOF erreicht")
+
 if __name__ == "__main__":
     if len(sys.argv) != 2:
         print("Usage: ./analyze_first_samples.py <filename>")
         sys.exit(1)
-    
-    analyze_first_samples(sys.argv[1])
\ No newline at end of file
+
+    analyze_first_samples(sys.argv[1])
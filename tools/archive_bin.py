@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""
+Archiv für .bin Aufnahmen (Langzeitspeicherung, libkc87)
+
+Das Archiv (.kca) teilt den Strom an Blockgrenzen in Frames, die sich einzeln dekodieren
+lassen; ein Index am Dateiende enthält zu jedem Frame .bin-Offset, Aufnahmezeit und
+Sample-Index. Die Sample-Worte werden pro Kanal modelliert (Flankenwechsel, Intervall
+mit der vorigen Halbperiode als Kontext) und arithmetisch kodiert, alle übrigen Bytes
+verlustfrei mitgeführt: unpack liefert die .bin Datei Byte für Byte zurück.
+
+Die übrigen Werkzeuge (analyze_bin, kc87_tape, tape_consensus, normalize_bin,
+serial_transmit) lesen Archive direkt, Frame für Frame, ohne die .bin Datei zu erzeugen.
+"""
+import os
+import sys
+import time
+
+import kc87
+
+
+def pack(bin_file, archive_file, frame_samples):
+    start = time.time()
+    try:
+        kc87.pack_archive(bin_file, archive_file, frame_samples)
+    except OSError as e:
+        print(f"Fehler: {e}")
+        sys.exit(1)
+    elapsed = time.time() - start
+    size = os.path.getsize(bin_file)
+    packed = os.path.getsize(archive_file)
+    print(f"Archiv:      {archive_file}")
+    print(f"Größe:       {size} -> {packed} Bytes (Faktor {size / max(packed, 1):.2f})")
+    print(f"Dauer:       {elapsed:.2f} s ({size / 1e6 / max(elapsed, 1e-6):.1f} MB/s)")
+
+
+def unpack(archive_file, bin_file, from_s=None, to_s=None):
+    """Schreibt das ganze Archiv oder die Frames eines Zeitbereichs als .bin
+
+    Ein Ausschnitt erhält Header- und ggf. Kanal-Block sowie die Ende-Markierung, damit
+    er für sich gelesen werden kann. Der Header trägt die VERSION der Quelle, mindestens 2,
+    wenn der Ausschnitt lange Sample-Blöcke enthält.
+    """
+    archive = kc87.open_file(archive_file)
+    frames = archive.frames
+    first = 0
+    last = len(frames) - 1
+    if from_s is not None:
+        first = archive.frame_at_time(int(from_s * 1e6))
+    if to_s is not None:
+        last = archive.frame_at_time(int(to_s * 1e6))
+    partial = first > 0 or last < len(frames) - 1
+    version = 1
+    if first > 0:
+        head = archive.read_frame(0)[:4]
+        if head[:3] == bytes([0x00, 0x00, kc87.BLOCK_TYPE_HEADER]) and len(head) == 4:
+            version = head[3]
+    with open(bin_file, 'wb') as out:
+        if first > 0:
+            out.write(kc87.encode_header(version))
+            if frames[first].mask != 0x01:
+                out.write(kc87.encode_block(kc87.BLOCK_TYPE_CHANNELS, bytes([frames[first].mask])))
+        long_blocks = False
+        for index in range(first, last + 1):
+            data = archive.read_frame(index)
+            if first > 0 and version < 2 and not long_blocks:
+                long_blocks = any(data[b.offset + 2] == kc87.BLOCK_TYPE_SAMPLES_LONG
+                                  for b in kc87.iter_blocks(data))
+            out.write(data)
+        if last < len(frames) - 1:
+            out.write(kc87.encode_end())
+        if long_blocks:
+            # Lange Blöcke sind erst ab Header-Version 2 definiert
+            out.seek(3)
+            out.write(bytes([2]))
+    if partial:
+        start = frames[first].time_us / 1e6
+        end = (frames[last + 1].time_us if last + 1 < len(frames) else None)
+        until = f"{end / 1e6:.3f} s" if end is not None else "Ende"
+        print(f"Frames {first}-{last} ({start:.3f} s - {until}) geschrieben: {bin_file}")
+    else:
+        print(f"Entpackt: {bin_file} ({len(archive)} Bytes)")
+
+
+def info(archive_file):
+    archive = kc87.open_file(archive_file)
+    frames = archive.frames
+    packed = os.path.getsize(archive_file)
+    samples = sum(f.samples for f in frames)
+    print(f"Archiv:      {archive_file}")
+    print(f"Frames:      {len(frames)}")
+    print(f"Größe:       {packed} Bytes, als .bin {len(archive)} Bytes "
+          f"(Faktor {len(archive) / max(packed, 1):.2f})")
+    if samples:
+        print(f"Samples:     {samples} ({packed * 8 / samples:.2f} Bit pro Sample)")
+    print()
+    print("Frame  Zeit (s)      Sample    .bin-Offset   .bin-Bytes  Archiv-Bytes")
+    for i, f in enumerate(frames):
+        stored = "  (ungepackt)" if f.flags & 0x01 else ""
+        print(f"{i:5d}  {f.time_us / 1e6:8.3f}  {f.sample_index:10d}  {f.bin_offset:13d}  "
+              f"{f.bin_size:11d}  {f.packed_size:12d}{stored}")
+
+
+def main():
+    args = sys.argv[1:]
+    options = {}
+    for name in ('--frame-samples', '--from', '--to'):
+        if name in args:
+            i = args.index(name)
+            if i + 1 >= len(args):
+                args = []
+                break
+            options[name] = args[i + 1]
+            del args[i:i + 2]
+    if len(args) < 2 or args[0] not in ('pack', 'unpack', 'info'):
+        print("Usage: python3 archive_bin.py pack <aufnahme.bin> [archiv.kca] [--frame-samples N]")
+        print("       python3 archive_bin.py unpack <archiv.kca> [aufnahme.bin] [--from s] [--to s]")
+        print("       python3 archive_bin.py info <archiv.kca>")
+        sys.exit(1)
+    if kc87.lib is None:
+        print("Fehler: libkc87 nicht gefunden (tools bauen oder KC87_LIB setzen)")
+        sys.exit(1)
+
+    command, source = args[0], args[1]
+    if not os.path.exists(source):
+        print(f"Fehler: Datei {source} nicht gefunden")
+        sys.exit(1)
+    if (command == 'pack') == kc87.is_archive(source):
+        print(f"Fehler: {source} ist {'bereits ein' if command == 'pack' else 'kein'} Archiv")
+        sys.exit(1)
+    if command == 'info':
+        info(source)
+        return
+
+    target = args[2] if len(args) > 2 else os.path.splitext(source)[0] + ('.kca' if command == 'pack' else '.bin')
+    if len(args) <= 2 and os.path.exists(target):
+        # Ohne ausdrücklichen Namen nie eine vorhandene Datei (etwa das Original) überschreiben
+        print(f"Fehler: {target} existiert bereits (Zieldatei angeben)")
+        sys.exit(1)
+    if command == 'pack':
+        pack(source, target, int(options.get('--frame-samples', kc87.ARCHIVE_FRAME_SAMPLES)))
+    else:
+        from_s = float(options['--from']) if '--from' in options else None
+        to_s = float(options['--to']) if '--to' in options else None
+        unpack(source, target, from_s, to_s)
+
+if __name__ == "__main__":
+    main()
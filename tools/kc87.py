@@ -0,0 +1,692 @@
+#!/usr/bin/env python3
+"""
+Python-Anbindung an libkc87 (Blockprotokoll des KC87 Pico Recorders, siehe PROTOCOL.md)
+
+Die Bibliothek wird per ctypes geladen (Suchreihenfolge: Umgebungsvariable KC87_LIB,
+tools/build*/, Verzeichnis dieses Skripts, Systempfad). Ist sie nicht vorhanden, wird ein
+gleichwertiger Python-Parser verwendet, damit die Skripte auch ohne Build laufen.
+
+Blöcke werden ohne Kopie geliefert: payload ist ein memoryview in den übergebenen Puffer.
+Archivdateien (.kca, archive_bin.py) öffnet open_file als Archive; iter_blocks und
+iter_chunks dekodieren sie Frame für Frame, ohne die .bin-Datei zu erzeugen.
+"""
+import bisect
+import ctypes
+import glob
+import mmap
+import os
+import struct
+import sys
+from collections import namedtuple
+
+# Block protocol constants (libkc87/kc87.h)
+BLOCK_TYPE_HEADER = 0x00
+BLOCK_TYPE_SAMPLES = 0x01
+BLOCK_TYPE_STATS = 0x02
+BLOCK_TYPE_TAPE = 0x03
+BLOCK_TYPE_SYNC = 0x04
+BLOCK_TYPE_CHANNELS = 0x05
+BLOCK_TYPE_SAMPLES_LONG = 0x81  # Sample-Block mit 16-Bit-COUNT (Header-Version 2)
+PROTOCOL_VERSION = 0x02
+
+TAPE_PAYLOAD = 133
+TAPE_DATA_SIZE = 128
+TAPE_STATUS_OK = 0x00
+
+NEED_MORE = 0
+BLOCK = 1
+END_OF_STREAM = 2
+CHUNK_FULL = 3
+
+MAX_SAMPLES_PER_BLOCK = 255
+MAX_SAMPLES_PER_LONG_BLOCK = 4096
+CHUNK_SAMPLES = 1 << 18         # Sample-Worte pro Chunk (512 KiB)
+
+ABI_VERSION = 2
+
+ARCHIVE_MAGIC = b'KC87ARC\x01'
+ARCHIVE_FRAME_SAMPLES = 65536
+
+# type, len (VERSION/COUNT/Payload-Länge), offset, size, payload (memoryview oder None);
+# lange Sample-Blöcke (0x81) kommen als BLOCK_TYPE_SAMPLES
+Block = namedtuple('Block', 'type length offset size payload')
+Sync = namedtuple('Sync', 'sample_index time_us')
+Stats = namedtuple('Stats', 'glitches drops')
+Tape = namedtuple('Tape', 'status block_nr leader_periods data checksum')
+# Archiv-Frame: Lage in Archiv und .bin-Strom, Zeit und Sample-Index am Frame-Anfang
+Frame = namedtuple('Frame', 'file_offset bin_offset time_us sample_index packed_size bin_size '
+                            'samples mask flags')
+SpeedResult = namedtuple('SpeedResult', 'speed speed_min speed_max wow_percent flutter_percent '
+                                        'total_percent periods')
+
+
+class _Block(ctypes.Structure):
+    _fields_ = [('data', ctypes.c_void_p),
+                ('payload', ctypes.c_void_p),
+                ('offset', ctypes.c_uint64),
+                ('size', ctypes.c_uint32),
+                ('type', ctypes.c_uint8),
+                ('reserved', ctypes.c_uint8),
+                ('len', ctypes.c_uint16)]
+
+
+class _Iter(ctypes.Structure):
+    _fields_ = [('data', ctypes.c_void_p),
+                ('size', ctypes.c_uint64),
+                ('pos', ctypes.c_uint64),
+                ('skipped', ctypes.c_uint64),
+                ('blocks', ctypes.c_uint32),
+                ('ended', ctypes.c_uint8),
+                ('reserved', ctypes.c_uint8 * 3)]
+
+
+class _Frame(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_uint64) for name in Frame._fields[:4]] + \
+               [(name, ctypes.c_uint32) for name in Frame._fields[4:7]] + \
+               [('mask', ctypes.c_uint8),
+                ('flags', ctypes.c_uint8),
+                ('reserved', ctypes.c_uint8 * 2)]
+
+
+class _Layout(ctypes.Structure):
+    _fields_ = [('mask', ctypes.c_uint8),
+                ('bits', ctypes.c_uint8),
+                ('count', ctypes.c_uint8),
+                ('channel', ctypes.c_uint8 * 8),
+                ('reserved', ctypes.c_uint8),
+                ('delta_max', ctypes.c_uint16)]
+
+
+class _Speed(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_double) for name in
+                ('fast', 'mid', 'slow', 'speed_min', 'speed_max', 'speed_sum',
+                 'wow_sumsq', 'flutter_sumsq', 'total_sumsq', 'carry')] + \
+               [('periods', ctypes.c_uint64),
+                ('stat_periods', ctypes.c_uint64),
+                ('measured_us', ctypes.c_uint64),
+                ('period_us', ctypes.c_uint32),
+                ('period_edge', ctypes.c_uint8),
+                ('started', ctypes.c_uint8),
+                ('reserved', ctypes.c_uint8 * 2)]
+
+
+class _SpeedResult(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_double) for name in SpeedResult._fields[:-1]] + \
+               [('periods', ctypes.c_uint64)]
+
+
+def _library_candidates():
+    env = os.environ.get('KC87_LIB')
+    if env:
+        yield env
+    here = os.path.dirname(os.path.abspath(__file__))
+    names = {'win32': ['kc87.dll', 'libkc87.dll'], 'darwin': ['libkc87.dylib']}.get(sys.platform, ['libkc87.so'])
+    for name in names:
+        for directory in sorted(glob.glob(os.path.join(here, 'build*'))) + [here]:
+            for sub in ('', 'Release', 'Debug'):
+                yield os.path.join(directory, sub, name)
+        yield name
+
+
+def _load_library():
+    for path in _library_candidates():
+        if os.path.sep in path and not os.path.exists(path):
+            continue
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+        try:
+            if lib.kc87_abi_version() != ABI_VERSION:
+                continue
+            _declare(lib)
+        except AttributeError:
+            continue  # Älterer Build ohne alle Funktionen
+        return lib
+    return None
+
+
+def _declare(lib):
+    lib.kc87_iter_init.argtypes = [ctypes.POINTER(_Iter), ctypes.c_void_p, ctypes.c_uint64]
+    lib.kc87_iter_init.restype = None
+    lib.kc87_iter_next.argtypes = [ctypes.POINTER(_Iter), ctypes.POINTER(_Block)]
+    lib.kc87_iter_next.restype = ctypes.c_int
+    lib.kc87_iter_samples.argtypes = [ctypes.POINTER(_Iter), ctypes.c_void_p, ctypes.c_size_t,
+                                      ctypes.POINTER(_Block), ctypes.POINTER(ctypes.c_int)]
+    lib.kc87_iter_samples.restype = ctypes.c_size_t
+    lib.kc87_layout_init.argtypes = [ctypes.POINTER(_Layout), ctypes.c_uint8]
+    lib.kc87_layout_init.restype = None
+    lib.kc87_speed_init.argtypes = [ctypes.POINTER(_Speed), ctypes.c_int]
+    lib.kc87_speed_init.restype = None
+    lib.kc87_speed_samples.argtypes = [ctypes.POINTER(_Speed), ctypes.POINTER(_Layout),
+                                       ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p]
+    lib.kc87_speed_samples.restype = None
+    lib.kc87_speed_result.argtypes = [ctypes.POINTER(_Speed), ctypes.POINTER(_SpeedResult)]
+    lib.kc87_speed_result.restype = None
+    lib.kc87_wav_open.argtypes = [ctypes.c_char_p, ctypes.c_uint32]
+    lib.kc87_wav_open.restype = ctypes.c_void_p
+    lib.kc87_wav_edge.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int]
+    lib.kc87_wav_edge.restype = None
+    lib.kc87_wav_frames.argtypes = [ctypes.c_void_p]
+    lib.kc87_wav_frames.restype = ctypes.c_uint64
+    lib.kc87_wav_close.argtypes = [ctypes.c_void_p]
+    lib.kc87_wav_close.restype = ctypes.c_int
+    lib.kc87_archive_pack.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_uint32]
+    lib.kc87_archive_pack.restype = ctypes.c_int
+    lib.kc87_archive_open.argtypes = [ctypes.c_char_p]
+    lib.kc87_archive_open.restype = ctypes.c_void_p
+    lib.kc87_archive_close.argtypes = [ctypes.c_void_p]
+    lib.kc87_archive_close.restype = None
+    lib.kc87_archive_frames.argtypes = [ctypes.c_void_p]
+    lib.kc87_archive_frames.restype = ctypes.c_uint32
+    lib.kc87_archive_frame.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.POINTER(_Frame)]
+    lib.kc87_archive_frame.restype = ctypes.c_int
+    lib.kc87_archive_find_time.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.kc87_archive_find_time.restype = ctypes.c_uint32
+    lib.kc87_archive_read.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_void_p, ctypes.c_size_t]
+    lib.kc87_archive_read.restype = ctypes.c_size_t
+
+
+lib = _load_library()
+
+
+def _buffer_address(data):
+    """Adresse des Puffers ohne Kopie (bytes, bytearray, beschreibbares mmap)
+
+    Liefert (Adresse, Objekt das den Puffer während der Iteration festhält).
+    """
+    if isinstance(data, bytes):
+        ref = ctypes.c_char_p(data)
+        return ctypes.cast(ref, ctypes.c_void_p).value, ref
+    ref = ctypes.c_char.from_buffer(data)
+    return ctypes.addressof(ref), ref
+
+
+def _c_iter(data, start, blocks=0):
+    """Initialisierter C-Iterator ab Byte start, dazu ein Objekt das den Puffer festhält
+
+    blocks: Anzahl der Blöcke davor (Fortsetzung im nächsten Archiv-Frame; ab dem ersten
+    Block gilt 00 80 als Ende des Stroms).
+    """
+    base, keepalive = _buffer_address(data) if len(data) > start else (0, None)
+    it = _Iter()
+    lib.kc87_iter_init(ctypes.byref(it), (base + start) if base else None, max(len(data) - start, 0))
+    it.blocks = blocks
+    return it, keepalive
+
+
+def _c_block(view, block, start):
+    offset = start + block.offset
+    payload = None
+    if block.type != BLOCK_TYPE_HEADER:
+        payload = view[offset + block.payload - block.data:offset + block.size - 2]
+    return Block(block.type, block.len, offset, block.size, payload)
+
+
+def _iter_state(state, it, start):
+    state['skipped'] = it.skipped
+    state['ended'] = bool(it.ended)
+    state['blocks'] = it.blocks
+    state['pos'] = start + it.pos
+
+
+def _iter_blocks_c(data, state, start=0, blocks=0):
+    view = memoryview(data)
+    it, keepalive = _c_iter(data, start, blocks)
+    block = _Block()
+    while True:
+        result = lib.kc87_iter_next(ctypes.byref(it), ctypes.byref(block))
+        if result != BLOCK:
+            break
+        yield _c_block(view, block, start)
+    _iter_state(state, it, start)
+
+
+def _frame_size(data, pos):
+    """Blockgröße ab pos, 0 wenn unvollständig, -1 wenn dort kein gültiger Block beginnt"""
+    if data[pos] != 0 or data[pos + 1] != 0:
+        return -1
+    if pos + 4 > len(data):
+        return 0
+    block_type = data[pos + 2]
+    if block_type == BLOCK_TYPE_HEADER:
+        size = 6
+    elif block_type == BLOCK_TYPE_SAMPLES:
+        size = 6 + 2 * data[pos + 3]
+    elif block_type == BLOCK_TYPE_SAMPLES_LONG:
+        if pos + 5 > len(data):
+            return 0
+        count = data[pos + 3] | (data[pos + 4] << 8)
+        if not MAX_SAMPLES_PER_BLOCK < count <= MAX_SAMPLES_PER_LONG_BLOCK:
+            return -1
+        size = 7 + 2 * count
+    else:
+        size = 6 + data[pos + 3]
+    if pos + size > len(data):
+        return 0
+    if data[pos + size - 2] != 0x00 or data[pos + size - 1] != 0x80:
+        return -1
+    return size
+
+
+def _iter_blocks_py(data, state, start=0):
+    view = memoryview(data)
+    pos = start
+    blocks = 0
+    skipped = 0
+    ended = False
+    while pos + 2 <= len(data):
+        if blocks > 0 and data[pos] == 0x00 and data[pos + 1] == 0x80:
+            ended = True
+            break
+        size = _frame_size(data, pos)
+        if size > 0:
+            block_type = data[pos + 2]
+            length = data[pos + 3]
+            payload = None if block_type == BLOCK_TYPE_HEADER else view[pos + 4:pos + size - 2]
+            if block_type == BLOCK_TYPE_SAMPLES_LONG:
+                block_type = BLOCK_TYPE_SAMPLES
+                length = (size - 7) // 2
+                payload = view[pos + 5:pos + size - 2]
+            yield Block(block_type, length, pos, size, payload)
+            blocks += 1
+            pos += size
+            continue
+        if size == 0:
+            break
+        pos += 1
+        skipped += 1
+    state['skipped'] = skipped
+    state['ended'] = ended
+
+
+def iter_blocks(data, state=None, start=0):
+    """Iteriert über alle gültigen Blöcke in data (bytes, bytearray oder mmap) ab Byte start
+
+    Ist state ein dict, enthält es danach 'skipped' (übersprungene Bytes) und
+    'ended' (End-of-Stream erreicht).
+    """
+    if state is None:
+        state = {}
+    if isinstance(data, Archive):
+        return _iter_archive(data, start, state, _iter_blocks_archive)
+    if lib is not None:
+        return _iter_blocks_c(data, state, start)
+    return _iter_blocks_py(data, state, start)
+
+
+def _iter_chunks_c(data, chunk_samples, start, state=None, blocks=0):
+    import numpy as np
+    view = memoryview(data)
+    it, keepalive = _c_iter(data, start, blocks)
+    block = _Block()
+    result = ctypes.c_int()
+    out = np.empty(chunk_samples, dtype=np.uint16)
+    while True:
+        pos = start + it.pos
+        count = lib.kc87_iter_samples(ctypes.byref(it), out.ctypes.data, chunk_samples,
+                                      ctypes.byref(block), ctypes.byref(result))
+        if count:
+            yield pos, out[:count].copy()
+        if result.value == BLOCK:
+            b = _c_block(view, block, start)
+            yield b.offset, b
+        elif result.value != CHUNK_FULL:
+            break
+    if state is not None:
+        _iter_state(state, it, start)
+
+
+def _iter_chunks_py(data, chunk_samples, start):
+    import numpy as np
+    parts = []
+    count = 0
+    pos = start
+    for block in _iter_blocks_py(data, {}, start):
+        if block.type == BLOCK_TYPE_SAMPLES:
+            if count + block.length > chunk_samples:
+                yield pos, np.concatenate(parts)
+                parts, count = [], 0
+            if not parts:
+                pos = block.offset
+            parts.append(np.frombuffer(block.payload, dtype='<u2').astype(np.uint16))
+            count += block.length
+            continue
+        if parts:
+            yield pos, np.concatenate(parts)
+            parts, count = [], 0
+        yield block.offset, block
+    if parts:
+        yield pos, np.concatenate(parts)
+
+
+def iter_chunks(data, chunk_samples=CHUNK_SAMPLES, start=0, offsets=False):
+    """Iteriert in Stromreihenfolge über Sample-Worte und übrige Blöcke ab Byte start
+
+    Aufeinanderfolgende Sample-Blöcke werden zu NumPy-Arrays (uint16) mit höchstens
+    chunk_samples Worten zusammengefasst, alle anderen Blöcke als Block geliefert.
+    Der Speicherbedarf hängt nur von chunk_samples ab, nicht von der Dateigröße.
+    Mit offsets=True werden Paare (Byte-Offset, Element) geliefert; ein Chunk beginnt an
+    einer Blockgrenze, dort kann die Auswertung eines Abschnitts ansetzen.
+    """
+    chunk_samples = max(chunk_samples, MAX_SAMPLES_PER_LONG_BLOCK)
+    if isinstance(data, Archive):
+        items = _iter_archive(data, start, {}, _iter_chunks_archive(chunk_samples))
+    elif lib is not None:
+        items = _iter_chunks_c(data, chunk_samples, start)
+    else:
+        items = _iter_chunks_py(data, chunk_samples, start)
+    if offsets:
+        return items
+    return (item for _, item in items)
+
+
+def _iter_blocks_archive(data, start, state, blocks):
+    return _iter_blocks_c(data, state, start, blocks)
+
+
+def _iter_chunks_archive(chunk_samples):
+    def items(data, start, state, blocks):
+        return _iter_chunks_c(data, chunk_samples, start, state, blocks)
+    return items
+
+
+def _shift(item, offset):
+    if isinstance(item, Block):
+        return item._replace(offset=item.offset + offset)
+    if isinstance(item, tuple):
+        return item[0] + offset, _shift(item[1], offset)
+    return item
+
+
+def _iter_archive(archive, start, state, items):
+    """Setzt die Iteration Frame für Frame fort, Offsets beziehen sich auf den .bin-Strom
+
+    Frames beginnen an Blockgrenzen, an denen auch die Iteration über den ganzen Strom
+    weiterliest. Endet ein Frame in ungültigen Bytes (der Packer schneidet dort nur, wenn
+    bis zum Dateiende kein Block mehr folgt), zählen sie als übersprungen.
+    """
+    blocks = 0
+    skipped = 0
+    ended = False
+    last = len(archive.frames) - 1
+    for index in range(archive.frame_index(start), last + 1):
+        frame = archive.frames[index]
+        data = archive.read_frame(index)
+        part = {}
+        for item in items(data, max(start - frame.bin_offset, 0), part, blocks):
+            yield _shift(item, frame.bin_offset)
+        blocks = part['blocks']
+        skipped += part['skipped']
+        ended = part['ended']
+        if ended:
+            break
+        if index < last:
+            skipped += len(data) - part['pos']
+    state['skipped'] = skipped
+    state['ended'] = ended
+
+
+class Archive:
+    """Archivdatei (.kca): der .bin-Strom in einzeln dekodierbaren Frames mit Index
+
+    Verhält sich beim Lesen wie die .bin-Daten (len, Indizierung und Slices in
+    .bin-Offsets); dekodiert wird nur der jeweils benötigte Frame (der letzte bleibt im
+    Speicher). iter_blocks und iter_chunks laufen Frame für Frame.
+    """
+
+    def __init__(self, filename):
+        if lib is None:
+            raise RuntimeError("libkc87 nicht gefunden (tools bauen oder KC87_LIB setzen)")
+        self.filename = filename
+        self._archive = lib.kc87_archive_open(os.fsencode(filename))
+        if not self._archive:
+            raise OSError(f"Archiv kann nicht gelesen werden: {filename}")
+        self.frames = []
+        frame = _Frame()
+        for index in range(lib.kc87_archive_frames(self._archive)):
+            lib.kc87_archive_frame(self._archive, index, ctypes.byref(frame))
+            self.frames.append(Frame(*(getattr(frame, name) for name in Frame._fields)))
+        self._offsets = [f.bin_offset for f in self.frames]
+        self._cached = (None, None)
+
+    def __len__(self):
+        return self.frames[-1].bin_offset + self.frames[-1].bin_size if self.frames else 0
+
+    def frame_index(self, offset):
+        """Frame, der das Byte offset des .bin-Stroms enthält"""
+        return max(bisect.bisect_right(self._offsets, offset) - 1, 0)
+
+    def frame_at_time(self, time_us):
+        """Frame, in dem die Aufnahmezeit time_us (ab Aufnahmebeginn) liegt"""
+        return lib.kc87_archive_find_time(self._archive, time_us)
+
+    def read_frame(self, index):
+        """Dekodierte .bin-Bytes eines Frames (bytearray)"""
+        if self._cached[0] == index:
+            return self._cached[1]
+        size = self.frames[index].bin_size
+        data = bytearray(size)
+        if size:
+            buffer = (ctypes.c_char * size).from_buffer(data)
+            if lib.kc87_archive_read(self._archive, index, buffer, size) != size:
+                raise OSError(f"Archiv beschädigt: {self.filename}, Frame {index}")
+            del buffer
+        self._cached = (index, data)
+        return data
+
+    def __getitem__(self, key):
+        if isinstance(key, int):
+            if key < 0:
+                key += len(self)
+            if not 0 <= key < len(self):
+                raise IndexError(key)
+            index = self.frame_index(key)
+            return self.read_frame(index)[key - self.frames[index].bin_offset]
+        start, stop, step = key.indices(len(self))
+        if step != 1:
+            raise ValueError("Archive unterstützt nur Slices ohne Schrittweite")
+        parts = []
+        while start < stop:
+            index = self.frame_index(start)
+            frame = self.frames[index]
+            end = min(stop, frame.bin_offset + frame.bin_size)
+            parts.append(bytes(self.read_frame(index)[start - frame.bin_offset:end - frame.bin_offset]))
+            start = end
+        return b''.join(parts)
+
+    def close(self):
+        if self._archive:
+            lib.kc87_archive_close(self._archive)
+            self._archive = None
+
+    def __del__(self):
+        self.close()
+
+
+def is_archive(filename):
+    with open(filename, 'rb') as f:
+        return f.read(len(ARCHIVE_MAGIC)) == ARCHIVE_MAGIC
+
+
+def pack_archive(bin_file, archive_file, frame_samples=ARCHIVE_FRAME_SAMPLES):
+    """Schreibt eine .bin-Aufnahme als Archiv (libkc87)"""
+    if lib is None:
+        raise RuntimeError("libkc87 nicht gefunden (tools bauen oder KC87_LIB setzen)")
+    if lib.kc87_archive_pack(os.fsencode(bin_file), os.fsencode(archive_file), frame_samples) != 0:
+        raise OSError(f"Archiv konnte nicht geschrieben werden: {archive_file}")
+
+
+def open_file(filename):
+    """Bildet eine Datei ohne Kopie in den Speicher ab (Copy-on-Write, für iter_blocks)
+
+    Archivdateien werden als Archive geöffnet (Frames werden bei Bedarf dekodiert).
+    """
+    if is_archive(filename):
+        return Archive(filename)
+    with open(filename, 'rb') as f:
+        if os.fstat(f.fileno()).st_size == 0:
+            return b''
+        return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+
+
+def sample_words(block):
+    """Sample-Worte eines Sample-Blocks als Sequenz von int (ohne Kopie auf Little-Endian-Hosts)"""
+    if sys.byteorder == 'little':
+        return block.payload.cast('H')
+    return struct.unpack(f'<{block.length}H', block.payload)
+
+
+class Layout:
+    """Kanalbelegung der Sample-Worte (Kanal-Block 0x05)"""
+
+    def __init__(self, mask=0x01):
+        mask |= 0x01
+        self.mask = mask
+        self.channels = [ch for ch in range(8) if mask & (1 << ch)]
+        self.bits = 0
+        while (1 << self.bits) < len(self.channels):
+            self.bits += 1
+        self.delta_bits = 15 - self.bits
+        self.delta_max = (1 << self.delta_bits) - 1
+
+    def decode(self, word):
+        """Liefert (Kanal, Flanke, Delta in µs)"""
+        return (self.channels[(word & 0x7FFF) >> self.delta_bits],
+                (word & 0x8000) != 0,
+                word & self.delta_max)
+
+    def encode(self, channel, edge, delta_us):
+        ordinal = self.channels.index(channel)
+        return (0x8000 if edge else 0) | (ordinal << self.delta_bits) | min(delta_us, self.delta_max)
+
+
+def read_stats(block):
+    if block.type != BLOCK_TYPE_STATS or block.length < 8:
+        return None
+    return Stats(*struct.unpack_from('<II', block.payload))
+
+
+def read_sync(block):
+    if block.type != BLOCK_TYPE_SYNC or block.length < 12:
+        return None
+    return Sync(*struct.unpack_from('<IQ', block.payload))
+
+
+def read_tape(block):
+    if block.type != BLOCK_TYPE_TAPE or block.length < TAPE_PAYLOAD:
+        return None
+    p = block.payload
+    return Tape(p[0], p[1], p[2] | (p[3] << 8), bytes(p[4:132]), p[132])
+
+
+def read_channels(block):
+    if block.type != BLOCK_TYPE_CHANNELS or block.length < 1:
+        return None
+    return Layout(block.payload[0])
+
+
+def encode_header(version=1):
+    return bytes([0x00, 0x00, BLOCK_TYPE_HEADER, version, 0x00, 0x80])
+
+
+def encode_samples(words):
+    """Sample-Block, mit mehr als MAX_SAMPLES_PER_BLOCK Worten ein langer Block (nur Header-Version 2)"""
+    if len(words) > MAX_SAMPLES_PER_BLOCK:
+        head = bytes([0x00, 0x00, BLOCK_TYPE_SAMPLES_LONG]) + struct.pack('<H', len(words))
+    else:
+        head = bytes([0x00, 0x00, BLOCK_TYPE_SAMPLES, len(words)])
+    return head + struct.pack(f'<{len(words)}H', *words) + b'\x00\x80'
+
+
+def encode_block(block_type, payload):
+    return bytes([0x00, 0x00, block_type, len(payload)]) + bytes(payload) + b'\x00\x80'
+
+
+def encode_end():
+    return b'\x00\x80'
+
+
+class SpeedEstimator:
+    """Bandgeschwindigkeit, Wow und Flutter über libkc87 (gleicher Schätzer wie serial_capture)
+
+    period_edge: True, wenn eine steigende Flanke eine Periode abschließt (wie im Dekoder).
+    """
+
+    def __init__(self, period_edge=True):
+        if lib is None:
+            raise RuntimeError("libkc87 nicht gefunden (tools bauen oder KC87_LIB setzen)")
+        self._speed = _Speed()
+        lib.kc87_speed_init(ctypes.byref(self._speed), int(period_edge))
+        self._layout = None
+
+    def feed(self, words, layout, normalize=False):
+        """Verarbeitet Sample-Worte (NumPy uint16, alle Kanäle)
+
+        Mit normalize=True werden die auf Nenn-Timing umgerechneten Worte geliefert.
+        """
+        import numpy as np
+        if self._layout is None or self._layout.mask != layout.mask:
+            self._layout = _Layout()
+            lib.kc87_layout_init(ctypes.byref(self._layout), layout.mask)
+        words = np.ascontiguousarray(words, dtype=np.uint16)
+        out = np.empty_like(words) if normalize else None
+        lib.kc87_speed_samples(ctypes.byref(self._speed), ctypes.byref(self._layout),
+                               words.ctypes.data, len(words), out.ctypes.data if normalize else None)
+        return out
+
+    @property
+    def speed(self):
+        """Aktuelle Schätzung (für Normalisierung)"""
+        return self._speed.mid
+
+    def result(self):
+        r = _SpeedResult()
+        lib.kc87_speed_result(ctypes.byref(self._speed), ctypes.byref(r))
+        return SpeedResult(*(getattr(r, name) for name in SpeedResult._fields))
+
+
+class WavWriter:
+    """WAV-Ausgabe über libkc87 (16 Bit Mono PCM, Rechtecksignal aus den Flanken)"""
+
+    def __init__(self, filename, sample_rate=44100):
+        if lib is None:
+            raise RuntimeError("libkc87 nicht gefunden (tools bauen oder KC87_LIB setzen)")
+        self._wav = lib.kc87_wav_open(os.fsencode(filename), sample_rate)
+        if not self._wav:
+            raise OSError(f"WAV-Datei kann nicht angelegt werden: {filename}")
+
+    def edge(self, delta_us, edge):
+        """edge: True/False, oder None für ein Ereignis ohne Pegelwechsel"""
+        lib.kc87_wav_edge(self._wav, delta_us, -1 if edge is None else int(edge))
+
+    @property
+    def frames(self):
+        return lib.kc87_wav_frames(self._wav)
+
+    def close(self):
+        if self._wav:
+            result = lib.kc87_wav_close(self._wav)
+            self._wav = None
+            if result != 0:
+                raise OSError("WAV-Datei konnte nicht geschrieben werden")
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        print("Usage: ./kc87.py <filename.bin>")
+        sys.exit(1)
+    state = {}
+    counts = {}
+    for block in iter_blocks(open_file(sys.argv[1]), state):
+        counts[block.type] = counts.get(block.type, 0) + 1
+    print(f"libkc87: {'ja' if lib is not None else 'nein (Python-Parser)'}")
+    for block_type, count in sorted(counts.items()):
+        print(f"  Blocktyp 0x{block_type:02X}: {count}")
+    print(f"  Übersprungen: {state['skipped']} Bytes, End-of-Stream: {'ja' if state['ended'] else 'nein'}")
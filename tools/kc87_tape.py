@@ -0,0 +1,403 @@
+#!/usr/bin/env python3
+"""
+KC87 Band-Dekoder für Rohaufnahmen (Host-Seite des Firmware-Dekoders, siehe
+firmware/kc87_tape_decoder.h)
+
+Jede volle Periode des Bandsignals wird wie in der Firmware klassifiziert und als Symbol
+abgelegt ('0', '1', 'S' = Trennzeichen, 'x' = ungültig). Blöcke (Vorton, Trennzeichen,
+Blocknummer, 128 Datenbytes, Prüfsumme; jedes Byte LSB zuerst mit folgendem Trennzeichen)
+werden dann per regulärem Ausdruck in der Symbolfolge gesucht. Die Perioden werden
+chunkweise mit NumPy berechnet, der Speicherbedarf ist unabhängig von der Aufnahmedauer.
+
+Lange Aufnahmen werden mit --jobs in Abschnitte geteilt und parallel dekodiert. Ein
+schneller Vorlauf sucht die Trennstellen (bevorzugt Pausen oder Vortöne zwischen den
+Blöcken) samt Zeitbasis; Blöcke, die über eine Trennstelle reichen, werden beim
+Zusammenführen aus den Randsymbolen der Nachbarabschnitte dekodiert. Das Ergebnis ist
+identisch mit der sequentiellen Dekodierung.
+"""
+import multiprocessing
+import os
+import re
+import sys
+from collections import namedtuple
+
+import numpy as np
+
+import kc87
+
+# Full period thresholds in µs (firmware/config.h)
+PERIOD_MIN_US = 280
+PERIOD_ZERO_ONE_US = 625
+PERIOD_ONE_SEP_US = 1250
+PERIOD_MAX_US = 2500
+LEADER_MIN = 64
+
+PERIOD_NOMINAL_US = {ord('0'): 417, ord('1'): 833, ord('S'): 1667}
+BLOCK_BYTES = 1 + kc87.TAPE_DATA_SIZE + 1    # BLOCK_NR + DATA + CHECKSUM
+TAPE_STATUS_CHECKSUM = 0x01
+CARRY_LIMIT = 1 << 17                       # Max. Perioden, die auf den nächsten Chunk warten
+SCAN_CHUNK_MIN = 4096                       # Chunk-Größe des Vorlaufs (Samples)
+SEAM_SYMBOLS = LEADER_MIN + 1 + 9 * BLOCK_BYTES  # Längster Rest eines Blocks hinter einer Trennstelle
+
+# Vorton nur ab dem Anfang einer '1'-Folge, sonst würde jede Position einer langen Folge neu probiert
+_BLOCK_RE = re.compile(rb'(?<!1)(1{%d,})S((?:[01]{8}S){%d})' % (LEADER_MIN, BLOCK_BYTES))
+_BIT_VALUES = 1 << np.arange(8)
+
+# Wie kc87.Tape, dazu Zeit von Vorton-Beginn und Blockende (µs ab Aufnahmebeginn),
+# mittlere relative Abweichung der Perioden vom Nennwert und Herkunft ('host' oder 'pico')
+TapeBlock = namedtuple('TapeBlock', 'status block_nr leader_periods data checksum '
+                                    'start_us end_us deviation source')
+
+# Beginn eines Abschnitts: Byte-Offset (Blockgrenze) und Zustand des Stroms davor
+Split = namedtuple('Split', 'offset time_us last_time0 last_boundary period_edge mask')
+
+# Ergebnis eines Abschnitts. head: Symbole am Anfang (bis zum Ende des ersten Blocks, wenn
+# head_complete; sonst die ersten SEAM_SYMBOLS), None wenn alle Symbole in tail sind;
+# tail: nicht verbrauchte Symbole nach dem letzten Block
+Segment = namedtuple('Segment', 'blocks pico head head_complete tail')
+
+
+class TapeDecoder:
+    """Dekodiert KC87-Blöcke aus den Flanken von Kanal 0, Chunk für Chunk
+
+    feed() erhält Flanken (bool, True = steigend) und Deltas (µs) als NumPy-Arrays.
+    Eine Periode endet wie in der Firmware an jeder steigenden Flanke; enthält die
+    Aufnahme nur fallende Flanken (Flankenmaske), an jeder fallenden.
+    """
+
+    def __init__(self, time=0, last_boundary=None, period_edge=None):
+        self.blocks = []
+        self.period_edge = period_edge
+        self.time = time            # Zeit der letzten verarbeiteten Flanke
+        self.last_boundary = last_boundary  # Zeit des letzten Periodenendes
+        self.symbols = bytearray()
+        self.ends = np.zeros(0, dtype=np.int64)      # Ende jeder Periode (µs)
+        self.periods = np.zeros(0, dtype=np.int64)   # Länge jeder Periode (µs)
+        self.head = None            # Symbole am Anfang (für Abschnitte, siehe Segment)
+        self.head_complete = False
+
+    def feed(self, edges, deltas):
+        if len(deltas) == 0:
+            return
+        times = self.time + np.cumsum(deltas)
+        self.time = int(times[-1])
+        if self.period_edge is None:
+            self.period_edge = bool(edges.any())
+        bounds = times[edges == self.period_edge]
+        if len(bounds) == 0:
+            return
+        if self.last_boundary is None:
+            self.last_boundary = int(bounds[0])     # Erste Periode ist unvollständig
+            bounds = bounds[1:]
+        periods = np.diff(bounds, prepend=self.last_boundary)
+        if len(bounds):
+            self.last_boundary = int(bounds[-1])
+
+        symbols = np.select([periods < PERIOD_MIN_US, periods < PERIOD_ZERO_ONE_US,
+                             periods < PERIOD_ONE_SEP_US, periods < PERIOD_MAX_US],
+                            [ord('x'), ord('0'), ord('1'), ord('S')], ord('x')).astype(np.uint8)
+        self.feed_symbols(symbols.tobytes(), bounds, periods)
+
+    def feed_symbols(self, symbols, ends, periods):
+        """Hängt klassifizierte Perioden an und sucht darin nach Blöcken"""
+        self.symbols += symbols
+        self.ends = np.concatenate((self.ends, ends))
+        self.periods = np.concatenate((self.periods, periods))
+        self._scan()
+
+    def skip(self, duration):
+        """Überspringt duration µs (auf dem Pico dekodierter Block, dessen Flanken fehlen)"""
+        self.time += duration
+        if self.last_boundary is not None:
+            self.last_boundary += duration
+
+    @property
+    def state(self):
+        """Noch nicht verbrauchte Symbole als (Symbole, Enden, Längen)"""
+        return bytes(self.symbols), self.ends, self.periods
+
+    def _scan(self):
+        done = 0
+        for m in _BLOCK_RE.finditer(self.symbols):
+            if self.head is None:
+                self._keep_head(m.end())
+                self.head_complete = True
+            self.blocks.append(self._decode(m))
+            done = m.end()
+        # Unfertige Blockversuche bleiben für den nächsten Chunk stehen (begrenzt)
+        if len(self.symbols) - CARRY_LIMIT > done:
+            done = len(self.symbols) - CARRY_LIMIT
+            if self.head is None:
+                self._keep_head(SEAM_SYMBOLS)
+        if done > 0:
+            del self.symbols[:done]
+            self.ends = self.ends[done:]
+            self.periods = self.periods[done:]
+
+    def _keep_head(self, count):
+        self.head = (bytes(self.symbols[:count]), self.ends[:count], self.periods[:count])
+
+    def _decode(self, m):
+        bits = np.frombuffer(m.group(2), dtype=np.uint8).reshape(BLOCK_BYTES, 9)[:, :8] == ord('1')
+        values = (bits * _BIT_VALUES).sum(axis=1).astype(np.uint8)
+        data = values[1:-1].tobytes()
+        checksum = int(values[-1])
+        status = kc87.TAPE_STATUS_OK if sum(data) & 0xFF == checksum else TAPE_STATUS_CHECKSUM
+
+        symbols = np.frombuffer(self.symbols, dtype=np.uint8)[m.start():m.end()]
+        periods = self.periods[m.start():m.end()]
+        nominal = np.select([symbols == code for code in PERIOD_NOMINAL_US],
+                            list(PERIOD_NOMINAL_US.values()))
+        deviation = float(np.mean(np.abs(periods - nominal) / nominal))
+        start_us = int(self.ends[m.start()] - self.periods[m.start()])
+        end_us = int(self.ends[m.end() - 1])
+        leader = min(m.end(1) - m.start(1), 0xFFFF)
+        return TapeBlock(status, int(values[0]), leader, data, checksum,
+                         start_us, end_us, deviation, 'host')
+
+    @property
+    def ok(self):
+        return sum(1 for b in self.blocks if b.status == kc87.TAPE_STATUS_OK)
+
+    @property
+    def bad(self):
+        return len(self.blocks) - self.ok
+
+    @property
+    def deviation(self):
+        """Mittlere relative Periodenabweichung aller dekodierten Blöcke (None ohne Blöcke)"""
+        if not self.blocks:
+            return None
+        return sum(b.deviation for b in self.blocks) / len(self.blocks)
+
+
+def nominal_duration(tape):
+    """Nenndauer eines Blocks in µs (Vorton, Trennzeichen, 130 Bytes mit Trennzeichen)"""
+    values = bytes([tape.block_nr]) + bytes(tape.data) + bytes([tape.checksum])
+    ones = int(np.unpackbits(np.frombuffer(values, dtype=np.uint8)).sum())
+    zeros = 8 * BLOCK_BYTES - ones
+    nominal = PERIOD_NOMINAL_US
+    return ((tape.leader_periods + ones) * nominal[ord('1')] + zeros * nominal[ord('0')] +
+            (1 + BLOCK_BYTES) * nominal[ord('S')])
+
+
+def pico_skip(tape):
+    """Zeit, die ein Pico-Block im Rohstrom fehlt: die Flanken fehlerfreier Blöcke werden
+    verworfen, die Flanken von Blöcken mit Prüfsummenfehler stehen davor im Strom"""
+    return nominal_duration(tape) if tape.status == kc87.TAPE_STATUS_OK else 0
+
+
+def _with_pico(blocks, pico):
+    """Host- und Pico-Blöcke in Stromreihenfolge
+
+    Einen Pico-Block mit Prüfsummenfehler hat der Host aus den mitgesendeten Flanken
+    ebenfalls dekodiert; es bleibt nur der Host-Block (mit Zeiten und Abweichung).
+    """
+    ends = {}
+    for b in blocks:
+        ends.setdefault(b.data, []).append(b.end_us)
+    pico = [p for p in pico if p.status == kc87.TAPE_STATUS_OK or
+            not any(abs(p.start_us - end) < PERIOD_MAX_US for end in ends.get(p.data, ()))]
+    return sorted(blocks + pico, key=lambda b: b.start_us)
+
+
+def _decode_range(data, split, chunk_samples):
+    """Dekodiert data ab split.offset bis zum Ende; liefert (TapeDecoder, Pico-Blöcke)"""
+    decoder = TapeDecoder(split.last_time0, split.last_boundary, split.period_edge)
+    layout = kc87.Layout(split.mask)
+    pico = []
+    time = split.time_us
+    last_time0 = split.last_time0
+    for item in kc87.iter_chunks(data, chunk_samples, split.offset):
+        if isinstance(item, kc87.Block):
+            if item.type == kc87.BLOCK_TYPE_CHANNELS:
+                layout = kc87.read_channels(item) or layout
+            tape = kc87.read_tape(item)
+            if tape:
+                skip = pico_skip(tape)
+                pico.append(TapeBlock(*tape, time, time + skip, None, 'pico'))
+                time += skip
+                last_time0 += skip
+                decoder.skip(skip)
+            continue
+        times = time + np.cumsum((item & layout.delta_max).astype(np.int64))
+        time = int(times[-1])
+        edges = (item & 0x8000) != 0
+        if layout.bits > 0:
+            tape0 = ((item & 0x7FFF) >> layout.delta_bits) == 0
+            times = times[tape0]
+            edges = edges[tape0]
+        decoder.feed(edges, np.diff(times, prepend=last_time0))
+        if len(times):
+            last_time0 = int(times[-1])
+    return decoder, pico
+
+
+def decode_data(data, chunk_samples=kc87.CHUNK_SAMPLES):
+    """Dekodiert alle Blöcke einer Aufnahme (bytes oder mmap)
+
+    Liefert die Blöcke in Stromreihenfolge: auf dem Host dekodierte Blöcke aus den
+    Rohflanken und die bereits auf dem Pico dekodierten Tape-Blöcke (Dekodier-Modus).
+    Die Zeitbasis enthält die Nenndauer der Pico-Blöcke, deren Flanken im Strom fehlen.
+    """
+    decoder, pico = _decode_range(data, Split(0, 0, 0, None, None, 0x01), chunk_samples)
+    return _with_pico(decoder.blocks, pico)
+
+
+def _split_index(deltas0, index0):
+    """Bevorzugte Trennstelle in einem Chunk (Index des Sample-Worts)
+
+    Eine Pause (Periode ungültig, der Dekoder beginnt danach ohnehin neu) oder die Mitte
+    des längsten Vortons; sonst der Chunk-Anfang.
+    """
+    gaps = np.nonzero(deltas0 >= PERIOD_MAX_US)[0]
+    if len(gaps):
+        return int(index0[gaps[0]])
+    leader = (deltas0 >= PERIOD_ZERO_ONE_US // 2) & (deltas0 < PERIOD_ONE_SEP_US // 2)
+    edges = np.diff(leader.astype(np.int8), prepend=0, append=0)
+    starts = np.nonzero(edges == 1)[0]
+    ends = np.nonzero(edges == -1)[0]
+    if len(starts):
+        longest = int(np.argmax(ends - starts))
+        if ends[longest] - starts[longest] >= 2 * LEADER_MIN:
+            return int(index0[(starts[longest] + ends[longest]) // 2])
+    return 0
+
+
+def find_splits(data, parts):
+    """Schneller Vorlauf: bis zu parts Abschnitte etwa gleicher Größe
+
+    Summiert nur die Deltas (NumPy, ohne Dekodierung) und merkt sich an jeder Trennstelle
+    Zeitbasis, Periodenende und Kanalbelegung, damit der Abschnitt für sich dekodiert
+    werden kann.
+    """
+    splits = [Split(0, 0, 0, None, None, 0x01)]
+    targets = [len(data) * k // parts for k in range(1, parts)]
+    chunk_samples = max(SCAN_CHUNK_MIN, min(kc87.CHUNK_SAMPLES, len(data) // (16 * parts)))
+    layout = kc87.Layout()
+    time = 0
+    last_time0 = 0
+    last_boundary = None
+    period_edge = None
+    for offset, item in kc87.iter_chunks(data, chunk_samples, offsets=True):
+        if isinstance(item, kc87.Block):
+            if item.type == kc87.BLOCK_TYPE_CHANNELS:
+                layout = kc87.read_channels(item) or layout
+            tape = kc87.read_tape(item)
+            if tape:
+                skip = pico_skip(tape)
+                time += skip
+                last_time0 += skip
+                if last_boundary is not None:
+                    last_boundary += skip
+            continue
+        times = time + np.cumsum((item & layout.delta_max).astype(np.int64))
+        edges = (item & 0x8000) != 0
+        index0 = np.arange(len(item))
+        if layout.bits > 0:
+            index0 = np.nonzero(((item & 0x7FFF) >> layout.delta_bits) == 0)[0]
+        times0 = times[index0]
+        edges0 = edges[index0]
+        if period_edge is None and len(index0):
+            period_edge = bool(edges0.any())
+
+        if targets and offset >= targets[0] and offset > splits[-1].offset:
+            while targets and targets[0] <= offset:
+                targets.pop(0)
+            split = _split_index(np.diff(times0, prepend=last_time0), index0)
+            if split > 0:
+                # Blockgrenze vor dem gewählten Sample suchen
+                count = 0
+                for block in kc87.iter_blocks(data, start=offset):
+                    if count + block.length > split:
+                        offset = block.offset
+                        break
+                    count += block.length
+                split = count
+            before = index0 < split
+            bounds = times0[before & (edges0 == period_edge)]
+            splits.append(Split(offset, int(times[split - 1]) if split else time,
+                                int(times0[before][-1]) if before.any() else last_time0,
+                                int(bounds[-1]) if len(bounds) else last_boundary,
+                                period_edge, layout.mask))
+
+        bounds = times0[edges0 == period_edge]
+        if len(bounds):
+            last_boundary = int(bounds[-1])
+        if len(times0):
+            last_time0 = int(times0[-1])
+        time = int(times[-1])
+    return splits
+
+
+def _decode_segment(args):
+    filename, split, end, chunk_samples = args
+    data = memoryview(kc87.open_file(filename))[:end]
+    decoder, pico = _decode_range(data, split, chunk_samples)
+    return Segment(decoder.blocks, pico, decoder.head, decoder.head_complete, decoder.state)
+
+
+def merge_segments(segments):
+    """Führt die Abschnitte in Reihenfolge zusammen
+
+    Die Randsymbole (tail des vorigen, head des nächsten Abschnitts) werden noch einmal
+    gemeinsam durchsucht: so werden Blöcke über die Trennstelle gefunden und der erste
+    Block eines Abschnitts erhält seinen vollständigen Vorton.
+    """
+    blocks = []
+    pico = []
+    stitch = None
+    for segment in segments:
+        pico += segment.pico
+        if stitch is None:
+            blocks += segment.blocks
+        elif segment.head is None:
+            # Abschnitt ohne Block: alle Symbole gehören zum Rand
+            stitch.feed_symbols(*segment.tail)
+            blocks += stitch.blocks
+            stitch.blocks = []
+            continue
+        else:
+            stitch.feed_symbols(*segment.head)
+            blocks += stitch.blocks
+            # Der erste Block des Abschnitts wurde eben mit vollständigem Vorton dekodiert
+            blocks += segment.blocks[1:] if segment.head_complete else segment.blocks
+        stitch = TapeDecoder()
+        stitch.feed_symbols(*segment.tail)
+    return _with_pico(blocks, pico)
+
+
+def decode_file(filename, jobs=None, chunk_samples=kc87.CHUNK_SAMPLES):
+    """Dekodiert eine Aufnahme, in Abschnitten parallel auf jobs Prozessen (Standard: alle Kerne)
+
+    Archive (.kca) werden in einem Durchlauf Frame für Frame dekodiert.
+    """
+    jobs = jobs or os.cpu_count() or 1
+    data = kc87.open_file(filename)
+    if jobs == 1 or len(data) < jobs * chunk_samples or isinstance(data, kc87.Archive):
+        return decode_data(data, chunk_samples)
+    splits = find_splits(data, jobs)
+    ends = [s.offset for s in splits[1:]] + [len(data)]
+    args = [(filename, split, end, chunk_samples) for split, end in zip(splits, ends)]
+    with multiprocessing.Pool(min(jobs, len(args))) as pool:
+        segments = pool.map(_decode_segment, args)
+    return merge_segments(segments)
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    jobs = None
+    if len(args) == 3 and args[0] == '--jobs':
+        jobs = int(args[1])
+        args = args[2:]
+    if len(args) != 1:
+        print("Usage: ./kc87_tape.py [--jobs N] <filename.bin>")
+        sys.exit(1)
+    blocks = decode_file(args[0], jobs)
+    for b in blocks:
+        status = "OK" if b.status == kc87.TAPE_STATUS_OK else "PRÜFSUMMENFEHLER"
+        deviation = f"{b.deviation * 100:5.1f}%" if b.deviation is not None else "    -"
+        print(f"{b.start_us / 1e6:10.3f} s  Block {b.block_nr:3d}  Vorton {b.leader_periods:5d}  "
+              f"Abweichung {deviation}  {b.source:4s}  {status}")
+    ok = sum(1 for b in blocks if b.status == kc87.TAPE_STATUS_OK)
+    print(f"{len(blocks)} Blöcke, {ok} OK, {len(blocks) - ok} mit Prüfsummenfehler")
@@ -0,0 +1,345 @@
+#ifndef KC87_H
+#define KC87_H
+
+// libkc87 - KC87 Pico Recorder block protocol (see PROTOCOL.md)
+//
+// Shared by serial_capture, serial_transmit and the Python tools (via ctypes, see kc87.py).
+// The ABI is plain C: fixed-width integers, structs without padding surprises and
+// opaque handles for stateful objects. Any incompatible change bumps KC87_ABI_VERSION.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(KC87_BUILD_SHARED)
+#define KC87_API __declspec(dllexport)
+#else
+#define KC87_API
+#endif
+
+#define KC87_ABI_VERSION 2
+
+// Block Protocol Constants
+#define KC87_BLOCK_START          0x0000
+#define KC87_BLOCK_END            0x8000
+#define KC87_BLOCK_TYPE_HEADER    0x00
+#define KC87_BLOCK_TYPE_SAMPLES   0x01
+#define KC87_BLOCK_TYPE_STATS     0x02
+#define KC87_BLOCK_TYPE_TAPE      0x03
+#define KC87_BLOCK_TYPE_SYNC      0x04
+#define KC87_BLOCK_TYPE_CHANNELS  0x05
+#define KC87_BLOCK_TYPE_SAMPLES_LONG 0x81   // Sample block with 16-bit COUNT (header VERSION 2)
+#define KC87_PROTOCOL_VERSION     0x02      // Highest header VERSION understood
+
+#define KC87_MAX_SAMPLES_PER_BLOCK 255
+#define KC87_MAX_SAMPLES_PER_LONG_BLOCK 4096
+#define KC87_MAX_BLOCK_SIZE       (7 + 2 * KC87_MAX_SAMPLES_PER_LONG_BLOCK)
+
+// Tape block payload (decode mode): STATUS, BLOCK_NR, LEADER_PERIODS(2), DATA(128), CHECKSUM
+#define KC87_TAPE_PAYLOAD         133
+#define KC87_TAPE_DATA_SIZE       128
+#define KC87_TAPE_STATUS_OK       0x00
+
+// Nominal KC87 half periods in microseconds (tape synthesis)
+#define KC87_HALF_ZERO_US         208
+#define KC87_HALF_ONE_US          417
+#define KC87_HALF_SEP_US          833
+
+// KC87 full period classification in microseconds (same thresholds as firmware/config.h)
+#define KC87_PERIOD_MIN_US        280
+#define KC87_PERIOD_ZERO_ONE_US   625
+#define KC87_PERIOD_ONE_SEP_US    1250
+#define KC87_PERIOD_MAX_US        2500
+
+// Tape speed estimation: time constants of the three speed estimates in microseconds
+#define KC87_SPEED_FAST_US        2000      // Follows flutter
+#define KC87_SPEED_MID_US         25000     // Follows wow, used for normalisation
+#define KC87_SPEED_SLOW_US        2000000   // Speed drift along the tape
+#define KC87_SPEED_WARMUP_US      100000    // Measured time before statistics start
+
+// Playback words (serial_transmit, tape_deck): bit 15 = level after the edge, bits 14..0 = delta
+#define KC87_PLAYBACK_DELTA_MAX   0x7FFF
+
+// Capture archive (.kca): independently decodable frames with an index (see PROTOCOL.md)
+#define KC87_ARCHIVE_MAGIC        "KC87ARC\x01"
+#define KC87_ARCHIVE_FRAME_HEADER 48
+#define KC87_ARCHIVE_FRAME_SAMPLES 65536    // Default frame size in sample words
+
+// Host commands (SLIP framed)
+#define KC87_SLIP_END             0xC0
+#define KC87_SLIP_ESC             0xDB
+#define KC87_SLIP_ESC_END         0xDC
+#define KC87_SLIP_ESC_ESC         0xDD
+
+#define KC87_CMD_SET_PARAM        0x01
+#define KC87_PARAM_TIMEOUT_MS     0x01
+#define KC87_PARAM_EDGE_MASK      0x02
+#define KC87_PARAM_GLITCH_US      0x03
+#define KC87_PARAM_DECODE_MODE    0x04
+#define KC87_PARAM_SYNC_SAMPLES   0x05
+#define KC87_PARAM_SYNC_MS        0x06
+#define KC87_PARAM_CHANNEL_MASK   0x07
+#define KC87_PARAM_TRIGGER_EDGES  0x08
+#define KC87_PARAM_PRETRIGGER     0x09
+#define KC87_PARAM_OUTPUT         0x0A
+#define KC87_OUTPUT_UART          0x01  // Live stream over UART
+#define KC87_OUTPUT_FLASH         0x02  // Store in the Pico's flash (CMD_STORE)
+#define KC87_PARAM_BLOCK_SAMPLES  0x0B  // Largest sample block, above 255 header VERSION 2
+
+#define KC87_CMD_HISTOGRAMS       0x02  // Firmware built with INSTRUMENTATION only
+#define KC87_HISTOGRAMS_DUMP      0x01  // Print on the USB debug output
+#define KC87_HISTOGRAMS_CLEAR     0x02
+
+#define KC87_CMD_STORE            0x03  // Flash session store, replies on USB stdio
+#define KC87_STORE_LIST           0x01
+#define KC87_STORE_READ           0x02
+#define KC87_STORE_CLEAR          0x03
+
+// Result codes of kc87_iter_next / kc87_parser_feed
+#define KC87_NEED_MORE            0   // Iterator: end of buffer, parser: feed more bytes
+#define KC87_BLOCK                1   // A complete block was returned
+#define KC87_END_OF_STREAM        2   // END marker following a block (session end)
+#define KC87_CHUNK_FULL           3   // kc87_iter_samples: output buffer full
+
+// One block of the stream. payload points into the caller's buffer (iterator) or into
+// the parser (valid until the next kc87_parser_feed call), nothing is copied.
+// Long sample blocks (0x81) are returned as KC87_BLOCK_TYPE_SAMPLES, data[2] tells them apart.
+typedef struct {
+    const uint8_t *data;        // Start of the block (START marker), size bytes
+    const uint8_t *payload;     // Samples (sample block), payload bytes (extended block), NULL (header)
+    uint64_t offset;            // Offset of the START marker in the stream
+    uint32_t size;              // Total block size in bytes including markers
+    uint8_t type;               // KC87_BLOCK_TYPE_*
+    uint8_t reserved;
+    uint16_t len;               // VERSION (header), COUNT (sample block) or payload length
+} kc87_block_t;
+
+// Zero-copy iterator over a memory buffer (e.g. a whole file or an mmap)
+typedef struct {
+    const uint8_t *data;
+    uint64_t size;
+    uint64_t pos;
+    uint64_t skipped;           // Bytes skipped while searching for a valid block
+    uint32_t blocks;
+    uint8_t ended;              // End-of-stream marker seen
+    uint8_t reserved[3];
+} kc87_iter_t;
+
+// Channel layout of the sample words (see channel block 0x05)
+typedef struct {
+    uint8_t mask;               // Enabled channels (bit n = channel n)
+    uint8_t bits;               // Channel bits below the edge bit
+    uint8_t count;              // Number of enabled channels
+    uint8_t channel[8];         // Channel number for each ordinal
+    uint8_t reserved;
+    uint16_t delta_max;         // Largest representable delta in microseconds
+} kc87_layout_t;
+
+typedef struct {
+    uint16_t delta_us;
+    uint8_t channel;
+    uint8_t edge;               // 1 = rising
+} kc87_sample_t;
+
+typedef struct {
+    uint32_t glitches;
+    uint32_t drops;
+} kc87_stats_t;
+
+typedef struct {
+    uint64_t time_us;
+    uint32_t sample_index;
+    uint32_t reserved;
+} kc87_sync_t;
+
+typedef struct {
+    uint8_t status;             // KC87_TAPE_STATUS_OK or checksum error
+    uint8_t block_nr;
+    uint16_t leader_periods;
+    uint8_t data[KC87_TAPE_DATA_SIZE];
+    uint8_t checksum;
+    uint8_t reserved[3];
+} kc87_tape_t;
+
+// Streaming tape speed estimator (speed = nominal / measured period, 1.0 = nominal).
+// Every classified KC87 period (0-bit, 1-bit, separator) updates exponential averages
+// with three time constants; the differences between them give wow and flutter.
+typedef struct {
+    double fast;
+    double mid;
+    double slow;
+    double speed_min;           // Range of the slow estimate
+    double speed_max;
+    double speed_sum;           // Sum of the slow estimate per period (average)
+    double wow_sumsq;           // (mid - slow)^2
+    double flutter_sumsq;       // (fast - mid)^2
+    double total_sumsq;         // (fast - slow)^2
+    double carry;               // Rounding remainder of kc87_speed_normalize
+    uint64_t periods;           // Measured periods
+    uint64_t stat_periods;      // Periods in the statistics (after warm-up)
+    uint64_t measured_us;       // Sum of the measured periods
+    uint32_t period_us;         // Time since the last period boundary
+    uint8_t period_edge;        // 1 = a rising edge ends a period, 0 = a falling edge
+    uint8_t started;            // First period boundary seen
+    uint8_t reserved[2];
+} kc87_speed_t;
+
+typedef struct {
+    double speed;               // Average speed
+    double speed_min;
+    double speed_max;
+    double wow_percent;         // RMS deviation, slow variations (mid vs. slow estimate)
+    double flutter_percent;     // RMS deviation, fast variations (fast vs. mid estimate)
+    double total_percent;       // RMS deviation of the fast estimate from the slow one
+    uint64_t periods;
+} kc87_speed_result_t;
+
+// One archive frame: a range of the .bin stream starting at a block boundary
+typedef struct {
+    uint64_t file_offset;       // Frame header in the archive
+    uint64_t bin_offset;        // First byte of the frame in the .bin stream
+    uint64_t time_us;           // Capture time at the frame start (sum of all deltas before)
+    uint64_t sample_index;      // Sample words before the frame
+    uint32_t packed_size;       // Frame size in the archive including the header
+    uint32_t bin_size;          // Frame size in the .bin stream
+    uint32_t samples;           // Sample words in the frame
+    uint8_t mask;               // Channel mask in effect at the frame start
+    uint8_t flags;              // 0x01: stored uncoded (did not compress)
+    uint8_t reserved[2];
+} kc87_frame_t;
+
+// Playback conversion state, carried from block to block (and across archive frames).
+// Only tape channel edges are played, the deltas of the other channels are added to the next
+// one; decoded tape blocks are re-synthesized with nominal timing, all other blocks are skipped.
+typedef struct {
+    uint64_t words;             // Playback words produced
+    uint64_t time_us;           // Sum of their deltas
+    uint32_t pending_us;        // Deltas of skipped channel edges carried into the next edge
+    kc87_layout_t layout;       // Channel layout in effect
+    uint8_t ended;              // End-of-stream marker seen (kc87_playback_blocks)
+    uint8_t reserved[5];
+} kc87_playback_t;
+
+typedef struct kc87_parser kc87_parser_t;
+typedef struct kc87_wav kc87_wav_t;
+typedef struct kc87_archive kc87_archive_t;
+
+KC87_API int kc87_abi_version(void);
+
+// Block iteration
+KC87_API void kc87_iter_init(kc87_iter_t *it, const uint8_t *data, uint64_t size);
+KC87_API int kc87_iter_next(kc87_iter_t *it, kc87_block_t *block);
+// Whether data starts with a header block (captures without one are plain sample words)
+KC87_API int kc87_has_header(const uint8_t *data, size_t size);
+// Bulk copy of the sample words of consecutive sample blocks into out (chunked analysis).
+// Stops at the first other block (returned in block, *result = KC87_BLOCK), when the next
+// sample block does not fit (*result = KC87_CHUNK_FULL) or at the end of the data.
+// Returns the number of words written.
+KC87_API size_t kc87_iter_samples(kc87_iter_t *it, uint16_t *out, size_t max,
+                                  kc87_block_t *block, int *result);
+
+// Incremental parser for streamed input (serial port); resynchronizes on garbage
+KC87_API kc87_parser_t *kc87_parser_new(void);
+KC87_API void kc87_parser_free(kc87_parser_t *p);
+KC87_API void kc87_parser_reset(kc87_parser_t *p);
+KC87_API int kc87_parser_feed(kc87_parser_t *p, const uint8_t *data, size_t len,
+                              size_t *consumed, kc87_block_t *block);
+KC87_API uint64_t kc87_parser_skipped(const kc87_parser_t *p);
+
+// Sample words and payloads
+static inline uint16_t kc87_block_sample(const kc87_block_t *block, unsigned index)
+{
+    return (uint16_t)(block->payload[2 * index] | (block->payload[2 * index + 1] << 8));
+}
+
+KC87_API void kc87_layout_init(kc87_layout_t *layout, uint8_t mask);
+KC87_API void kc87_decode_sample(const kc87_layout_t *layout, uint16_t word, kc87_sample_t *sample);
+KC87_API size_t kc87_decode_samples(const kc87_layout_t *layout, const kc87_block_t *block,
+                                    kc87_sample_t *out);
+KC87_API uint16_t kc87_encode_sample(const kc87_layout_t *layout, uint8_t channel, int edge, uint32_t delta_us);
+KC87_API int kc87_read_stats(const kc87_block_t *block, kc87_stats_t *stats);
+KC87_API int kc87_read_sync(const kc87_block_t *block, kc87_sync_t *sync);
+KC87_API int kc87_read_tape(const kc87_block_t *block, kc87_tape_t *tape);
+KC87_API int kc87_read_channels(const kc87_block_t *block, kc87_layout_t *layout);
+
+// Block encoders, return the number of bytes written to out. kc87_encode_samples writes a
+// long sample block for more than KC87_MAX_SAMPLES_PER_BLOCK samples (header VERSION 2 only).
+KC87_API size_t kc87_encode_header(uint8_t *out, uint8_t version);
+KC87_API size_t kc87_encode_samples(uint8_t *out, const uint16_t *samples, uint16_t count);
+KC87_API size_t kc87_encode_block(uint8_t *out, uint8_t type, const uint8_t *payload, uint8_t len);
+KC87_API size_t kc87_encode_end(uint8_t *out);
+
+// Tape synthesis: nominal sample words (half period low, half period high) of a tape block.
+// Returns the number of words of the whole block, at most max are written.
+KC87_API size_t kc87_tape_to_samples(const kc87_tape_t *tape, uint16_t *out, size_t max);
+KC87_API uint64_t kc87_tape_duration_us(const kc87_tape_t *tape);
+
+// Playback conversion. out NULL counts words and time only; otherwise kc87_playback_block and
+// kc87_playback_tape need room for kc87_playback_words / kc87_tape_to_samples words.
+// All return the number of words produced.
+KC87_API void kc87_playback_init(kc87_playback_t *pb, uint8_t mask);
+// Words kc87_playback_block produces for block in the current state
+KC87_API size_t kc87_playback_words(const kc87_playback_t *pb, const kc87_block_t *block);
+KC87_API size_t kc87_playback_block(kc87_playback_t *pb, const kc87_block_t *block, uint16_t *out);
+KC87_API size_t kc87_playback_tape(kc87_playback_t *pb, const kc87_tape_t *tape, uint16_t *out);
+// Converts the blocks from it on. Stops at the end of the data (*result = KC87_NEED_MORE or
+// KC87_END_OF_STREAM) or before a block whose words do not fit (*result = KC87_CHUNK_FULL).
+KC87_API size_t kc87_playback_blocks(kc87_playback_t *pb, kc87_iter_t *it, uint16_t *out, size_t max,
+                                     int *result);
+
+// Tape speed estimation and timing normalisation
+KC87_API void kc87_speed_init(kc87_speed_t *speed, int period_edge);
+// One sample of the stream; edge: 1 = rising, 0 = falling, -1 = time only (other channel).
+// Returns 1 when a period was measured.
+KC87_API int kc87_speed_feed(kc87_speed_t *speed, uint32_t delta_us, int edge);
+// Delta rescaled to nominal timing with the current estimate (call before kc87_speed_feed)
+KC87_API uint32_t kc87_speed_normalize(kc87_speed_t *speed, uint32_t delta_us);
+// Feeds count sample words; if out is not NULL (may equal words), the normalised words are
+// written there (channel and edge bits unchanged, deltas clamped to the layout)
+KC87_API void kc87_speed_samples(kc87_speed_t *speed, const kc87_layout_t *layout,
+                                 const uint16_t *words, size_t count, uint16_t *out);
+KC87_API void kc87_speed_result(const kc87_speed_t *speed, kc87_speed_result_t *result);
+
+// WAV encoder (16 bit mono PCM, square wave from the edges)
+KC87_API kc87_wav_t *kc87_wav_open(const char *path, uint32_t sample_rate);
+// edge: 1 = rising, 0 = falling, -1 = time only (edge on another channel, level unchanged)
+KC87_API void kc87_wav_edge(kc87_wav_t *wav, uint32_t delta_us, int edge);
+KC87_API void kc87_wav_tape(kc87_wav_t *wav, const kc87_tape_t *tape);
+KC87_API uint64_t kc87_wav_frames(const kc87_wav_t *wav);
+KC87_API int kc87_wav_close(kc87_wav_t *wav);
+
+// Capture archive. A frame packs size bytes of the stream (any bytes, losslessly) into
+// out; frame->mask and the offsets are taken from the caller, the sizes and flags are filled
+// in. Frames that do not compress are stored uncoded, kc87_frame_bound(size) always suffices.
+// Both return the number of bytes written, 0 on error (out too small, corrupt frame).
+KC87_API size_t kc87_frame_bound(size_t size);
+KC87_API size_t kc87_pack_frame(const uint8_t *data, size_t size, kc87_frame_t *frame,
+                                uint8_t *out, size_t max);
+KC87_API size_t kc87_unpack_frame(const uint8_t *in, size_t size, uint8_t *out, size_t max);
+KC87_API int kc87_is_archive(const uint8_t *data, size_t size);
+// Packs a whole .bin file (frame_samples 0 = default), returns 0 on success
+KC87_API int kc87_archive_pack(const char *bin_path, const char *archive_path, uint32_t frame_samples);
+KC87_API kc87_archive_t *kc87_archive_open(const char *path);
+KC87_API void kc87_archive_close(kc87_archive_t *a);
+KC87_API uint32_t kc87_archive_frames(const kc87_archive_t *a);
+KC87_API uint64_t kc87_archive_bin_size(const kc87_archive_t *a);
+KC87_API int kc87_archive_frame(const kc87_archive_t *a, uint32_t index, kc87_frame_t *frame);
+// Index of the frame containing time_us (0 if before the first frame)
+KC87_API uint32_t kc87_archive_find_time(const kc87_archive_t *a, uint64_t time_us);
+// Decodes frame index into out (needs frame.bin_size bytes), returns bytes written or 0
+KC87_API size_t kc87_archive_read(kc87_archive_t *a, uint32_t index, uint8_t *out, size_t max);
+
+// SLIP host commands. out needs 2 * len + 2 bytes.
+KC87_API size_t kc87_slip_encode(uint8_t *out, const uint8_t *data, size_t len);
+KC87_API size_t kc87_encode_set_param(uint8_t *out, uint8_t param, uint32_t value);
+KC87_API size_t kc87_encode_histograms(uint8_t *out, uint8_t action);
+KC87_API size_t kc87_encode_store(uint8_t *out, uint8_t op, uint32_t seq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KC87_H
@@ -0,0 +1,956 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "kc87.h"
+
+// Capture archive: the .bin stream split into frames at block boundaries. Each frame is
+// coded on its own with an adaptive binary range coder (LZMA style). Sample words are
+// modelled per channel: the edge is predicted to alternate and the interval since the
+// last sample of the channel is coded as a logarithmic bucket (context: edge and bucket
+// of the previous interval, so the half periods of a KC87 bit predict each other)
+// followed by its low bits (the upper ones adaptive per bucket, they carry the jitter).
+
+#define PROB_BITS       11
+#define PROB_INIT       (1u << (PROB_BITS - 1))
+#define MOVE_BITS       4
+#define RANGE_TOP       (1u << 24)
+
+#define BUCKET_EXACT    8       // Intervals below are their own bucket
+#define BUCKET_CONTEXTS 64      // Previous bucket (clamped), per edge
+#define LOW_BUCKETS     64      // Buckets with adaptive low bits
+#define LOW_BITS        6       // Adaptive low bits below the bucket
+
+#define KIND_SAMPLES    0       // Sample block
+#define KIND_BLOCK      1       // Any other valid block
+#define KIND_RAW        2       // Bytes outside of valid blocks (END marker, garbage, truncated tail)
+#define KIND_END        3       // End of the frame
+#define RAW_MAX         0xFFFF
+
+#define FRAME_STORED    0x01    // Frame flag: the .bin bytes follow uncoded (incompressible)
+
+#define FILE_HEADER     16
+#define TRAILER_SIZE    16
+#define INDEX_ENTRY     (8 + KC87_ARCHIVE_FRAME_HEADER)
+
+typedef struct {
+    uint16_t kind[4][4];                    // 2 bit tree, context = previous kind
+    uint16_t count_same;                    // COUNT of a sample block equals the previous one
+    uint16_t count[256];
+    uint16_t type[256];
+    uint16_t len[256];
+    uint16_t payload[256];
+    uint16_t ordinal[8][8];                 // Channel ordinal, context = previous ordinal
+    uint16_t edge[8];                       // Edge does not alternate (per channel)
+    uint16_t bucket[2][BUCKET_CONTEXTS][256];
+    uint16_t low[LOW_BUCKETS][1 << LOW_BITS];
+} model_t;
+
+typedef struct {
+    uint64_t last_time;                     // Time of the last sample of the channel
+    uint8_t edge;
+    uint8_t bucket;                         // Bucket of its interval
+} channel_t;
+
+// Coder state shared by encoder and decoder (identical updates on both sides)
+typedef struct {
+    model_t m;
+    channel_t ch[8];
+    kc87_layout_t layout;
+    uint64_t time;
+    uint8_t kind;
+    uint8_t count;
+    uint8_t ordinal;
+} codec_t;
+
+typedef struct {
+    uint64_t low;
+    uint32_t range;
+    uint8_t cache;
+    uint64_t cache_size;
+    uint8_t *out;
+    size_t pos;
+    size_t max;
+    int overflow;
+} encoder_t;
+
+typedef struct {
+    uint32_t range;
+    uint32_t code;
+    const uint8_t *in;
+    size_t pos;
+    size_t size;
+} decoder_t;
+
+struct kc87_archive {
+    FILE *file;
+    uint32_t frames;
+    uint64_t bin_size;
+    kc87_frame_t *index;
+    uint8_t *buffer;                        // Packed frame
+    size_t buffer_size;
+};
+
+// ---------------------------------------------------------------------------------------
+// Little-endian helpers and CRC-32 (same polynomial as zlib)
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+static void put_u64(uint8_t *p, uint64_t v)
+{
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Range coder
+
+static void enc_init(encoder_t *e, uint8_t *out, size_t max)
+{
+    memset(e, 0, sizeof(*e));
+    e->range = 0xFFFFFFFFu;
+    e->cache_size = 1;
+    e->out = out;
+    e->max = max;
+}
+
+static void enc_byte(encoder_t *e, uint8_t b)
+{
+    if (e->pos < e->max) {
+        e->out[e->pos++] = b;
+    } else {
+        e->overflow = 1;
+    }
+}
+
+static void enc_shift_low(encoder_t *e)
+{
+    if ((uint32_t)e->low < 0xFF000000u || (e->low >> 32) != 0) {
+        uint8_t carry = (uint8_t)(e->low >> 32);
+        uint8_t temp = e->cache;
+        do {
+            enc_byte(e, (uint8_t)(temp + carry));
+            temp = 0xFF;
+        } while (--e->cache_size != 0);
+        e->cache = (uint8_t)(e->low >> 24);
+    }
+    e->cache_size++;
+    e->low = (e->low & 0x00FFFFFFu) << 8;
+}
+
+static void enc_bit(encoder_t *e, uint16_t *prob, unsigned bit)
+{
+    uint32_t bound = (e->range >> PROB_BITS) * *prob;
+    if (bit == 0) {
+        e->range = bound;
+        *prob += ((1u << PROB_BITS) - *prob) >> MOVE_BITS;
+    } else {
+        e->low += bound;
+        e->range -= bound;
+        *prob -= *prob >> MOVE_BITS;
+    }
+    while (e->range < RANGE_TOP) {
+        e->range <<= 8;
+        enc_shift_low(e);
+    }
+}
+
+static void enc_direct(encoder_t *e, uint64_t value, unsigned bits)
+{
+    while (bits-- > 0) {
+        e->range >>= 1;
+        if ((value >> bits) & 1) {
+            e->low += e->range;
+        }
+        while (e->range < RANGE_TOP) {
+            e->range <<= 8;
+            enc_shift_low(e);
+        }
+    }
+}
+
+static void enc_flush(encoder_t *e)
+{
+    for (int i = 0; i < 5; i++) {
+        enc_shift_low(e);
+    }
+}
+
+static uint8_t dec_byte(decoder_t *d)
+{
+    return d->pos < d->size ? d->in[d->pos++] : 0;
+}
+
+static void dec_init(decoder_t *d, const uint8_t *in, size_t size)
+{
+    d->in = in;
+    d->size = size;
+    d->pos = 0;
+    d->range = 0xFFFFFFFFu;
+    d->code = 0;
+    for (int i = 0; i < 5; i++) {
+        d->code = (d->code << 8) | dec_byte(d);
+    }
+}
+
+static unsigned dec_bit(decoder_t *d, uint16_t *prob)
+{
+    uint32_t bound = (d->range >> PROB_BITS) * *prob;
+    unsigned bit;
+    if (d->code < bound) {
+        d->range = bound;
+        *prob += ((1u << PROB_BITS) - *prob) >> MOVE_BITS;
+        bit = 0;
+    } else {
+        d->code -= bound;
+        d->range -= bound;
+        *prob -= *prob >> MOVE_BITS;
+        bit = 1;
+    }
+    while (d->range < RANGE_TOP) {
+        d->range <<= 8;
+        d->code = (d->code << 8) | dec_byte(d);
+    }
+    return bit;
+}
+
+static uint64_t dec_direct(decoder_t *d, unsigned bits)
+{
+    uint64_t value = 0;
+    while (bits-- > 0) {
+        d->range >>= 1;
+        unsigned bit = d->code >= d->range;
+        if (bit) {
+            d->code -= d->range;
+        }
+        value = (value << 1) | bit;
+        while (d->range < RANGE_TOP) {
+            d->range <<= 8;
+            d->code = (d->code << 8) | dec_byte(d);
+        }
+    }
+    return value;
+}
+
+// Bit trees: probs[1 .. 2^bits - 1], most significant bit first
+static void enc_tree(encoder_t *e, uint16_t *probs, unsigned bits, unsigned value)
+{
+    unsigned node = 1;
+    while (bits-- > 0) {
+        unsigned bit = (value >> bits) & 1;
+        enc_bit(e, &probs[node], bit);
+        node = (node << 1) | bit;
+    }
+}
+
+static unsigned dec_tree(decoder_t *d, uint16_t *probs, unsigned bits)
+{
+    unsigned node = 1;
+    for (unsigned i = 0; i < bits; i++) {
+        node = (node << 1) | dec_bit(d, &probs[node]);
+    }
+    return node - (1u << bits);
+}
+
+// ---------------------------------------------------------------------------------------
+// Model
+
+static void codec_init(codec_t *c, uint8_t mask)
+{
+    uint16_t *probs = (uint16_t *)&c->m;
+    for (size_t i = 0; i < sizeof(c->m) / sizeof(uint16_t); i++) {
+        probs[i] = PROB_INIT;
+    }
+    memset(c->ch, 0, sizeof(c->ch));
+    kc87_layout_init(&c->layout, mask);
+    c->time = 0;
+    c->kind = KIND_SAMPLES;
+    c->count = KC87_MAX_SAMPLES_PER_BLOCK;
+    c->ordinal = 0;
+}
+
+static unsigned bit_length(uint64_t v)
+{
+    unsigned n = 0;
+    while (v) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+// Bucket: the value itself below BUCKET_EXACT, else bit length and the two bits below
+// the leading one (four buckets per octave)
+static unsigned bucket_of(uint64_t v, unsigned *low_bits)
+{
+    if (v < BUCKET_EXACT) {
+        *low_bits = 0;
+        return (unsigned)v;
+    }
+    unsigned n = bit_length(v);
+    *low_bits = n - 3;
+    return BUCKET_EXACT + (n - 4) * 4 + (unsigned)((v >> (n - 3)) & 3);
+}
+
+static uint64_t bucket_base(unsigned bucket, unsigned *low_bits)
+{
+    if (bucket < BUCKET_EXACT) {
+        *low_bits = 0;
+        return bucket;
+    }
+    unsigned n = (bucket - BUCKET_EXACT) / 4 + 4;
+    *low_bits = n - 3;
+    return (uint64_t)(4 + (bucket - BUCKET_EXACT) % 4) << (n - 3);
+}
+
+static uint16_t *bucket_probs(codec_t *c, const channel_t *ch, unsigned edge)
+{
+    return c->m.bucket[edge][ch->bucket < BUCKET_CONTEXTS ? ch->bucket : BUCKET_CONTEXTS - 1];
+}
+
+static void enc_interval(encoder_t *e, codec_t *c, channel_t *ch, unsigned edge, uint64_t interval)
+{
+    unsigned low_bits;
+    unsigned bucket = bucket_of(interval, &low_bits);
+    enc_tree(e, bucket_probs(c, ch, edge), 8, bucket);
+    unsigned modelled = bucket < LOW_BUCKETS ? (low_bits < LOW_BITS ? low_bits : LOW_BITS) : 0;
+    enc_tree(e, c->m.low[bucket < LOW_BUCKETS ? bucket : 0], modelled,
+             (unsigned)(interval >> (low_bits - modelled)) & ((1u << modelled) - 1));
+    enc_direct(e, interval, low_bits - modelled);
+    ch->bucket = (uint8_t)bucket;
+}
+
+static uint64_t dec_interval(decoder_t *d, codec_t *c, channel_t *ch, unsigned edge)
+{
+    unsigned low_bits;
+    unsigned bucket = dec_tree(d, bucket_probs(c, ch, edge), 8);
+    uint64_t interval = bucket_base(bucket, &low_bits);
+    unsigned modelled = bucket < LOW_BUCKETS ? (low_bits < LOW_BITS ? low_bits : LOW_BITS) : 0;
+    uint64_t low = dec_tree(d, c->m.low[bucket < LOW_BUCKETS ? bucket : 0], modelled);
+    low = (low << (low_bits - modelled)) | dec_direct(d, low_bits - modelled);
+    ch->bucket = (uint8_t)bucket;
+    return interval | low;
+}
+
+static void enc_sample(encoder_t *e, codec_t *c, uint16_t word)
+{
+    unsigned delta_bits = 15 - c->layout.bits;
+    unsigned ordinal = (word & 0x7FFF) >> delta_bits;
+    unsigned edge = word >> 15;
+    if (c->layout.bits) {
+        enc_tree(e, c->m.ordinal[c->ordinal], c->layout.bits, ordinal);
+        c->ordinal = (uint8_t)ordinal;
+    }
+    channel_t *ch = &c->ch[ordinal];
+    enc_bit(e, &c->m.edge[ordinal], edge == ch->edge);
+    c->time += word & c->layout.delta_max;
+    enc_interval(e, c, ch, edge, c->time - ch->last_time);
+    ch->last_time = c->time;
+    ch->edge = (uint8_t)edge;
+}
+
+static uint16_t dec_sample(decoder_t *d, codec_t *c)
+{
+    unsigned delta_bits = 15 - c->layout.bits;
+    unsigned ordinal = 0;
+    if (c->layout.bits) {
+        ordinal = dec_tree(d, c->m.ordinal[c->ordinal], c->layout.bits);
+        c->ordinal = (uint8_t)ordinal;
+    }
+    channel_t *ch = &c->ch[ordinal];
+    unsigned edge = dec_bit(d, &c->m.edge[ordinal]) ? ch->edge : !ch->edge;
+    uint64_t time = ch->last_time + dec_interval(d, c, ch, edge);
+    uint16_t delta = (uint16_t)((time - c->time) & c->layout.delta_max);
+    c->time += delta;
+    ch->last_time = c->time;
+    ch->edge = (uint8_t)edge;
+    return (uint16_t)((edge << 15) | (ordinal << delta_bits) | delta);
+}
+
+static void enc_kind(encoder_t *e, codec_t *c, unsigned kind)
+{
+    enc_tree(e, c->m.kind[c->kind], 2, kind);
+    c->kind = (uint8_t)kind;
+}
+
+static unsigned dec_kind(decoder_t *d, codec_t *c)
+{
+    c->kind = (uint8_t)dec_tree(d, c->m.kind[c->kind], 2);
+    return c->kind;
+}
+
+static void enc_raw(encoder_t *e, codec_t *c, const uint8_t *p, size_t len)
+{
+    while (len > 0) {
+        size_t n = len < RAW_MAX ? len : RAW_MAX;
+        enc_kind(e, c, KIND_RAW);
+        enc_direct(e, n, 16);
+        for (size_t i = 0; i < n; i++) {
+            enc_tree(e, c->m.payload, 8, p[i]);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+// ---------------------------------------------------------------------------------------
+// Frames
+
+static void write_frame_header(uint8_t *h, const kc87_frame_t *f, uint32_t crc)
+{
+    memcpy(h, "KCFR", 4);
+    put_u32(h + 4, f->packed_size - KC87_ARCHIVE_FRAME_HEADER);
+    put_u32(h + 8, f->bin_size);
+    put_u32(h + 12, f->samples);
+    put_u32(h + 16, crc);
+    h[20] = f->mask;
+    h[21] = f->flags;
+    h[22] = h[23] = 0;
+    put_u64(h + 24, f->bin_offset);
+    put_u64(h + 32, f->time_us);
+    put_u64(h + 40, f->sample_index);
+}
+
+static int read_frame_header(const uint8_t *h, kc87_frame_t *f, uint32_t *crc)
+{
+    if (memcmp(h, "KCFR", 4) != 0) {
+        return -1;
+    }
+    memset(f, 0, sizeof(*f));
+    f->packed_size = get_u32(h + 4) + KC87_ARCHIVE_FRAME_HEADER;
+    f->bin_size = get_u32(h + 8);
+    f->samples = get_u32(h + 12);
+    *crc = get_u32(h + 16);
+    f->mask = h[20];
+    f->flags = h[21];
+    f->bin_offset = get_u64(h + 24);
+    f->time_us = get_u64(h + 32);
+    f->sample_index = get_u64(h + 40);
+    return 0;
+}
+
+size_t kc87_frame_bound(size_t size)
+{
+    // Frames the model does not shrink are stored as they are
+    return KC87_ARCHIVE_FRAME_HEADER + size;
+}
+
+size_t kc87_pack_frame(const uint8_t *data, size_t size, kc87_frame_t *frame, uint8_t *out, size_t max)
+{
+    codec_t c;
+    encoder_t e;
+    size_t pos = 0;
+    uint32_t samples = 0;
+
+    if (max < KC87_ARCHIVE_FRAME_HEADER) {
+        return 0;
+    }
+    codec_init(&c, frame->mask);
+    enc_init(&e, out + KC87_ARCHIVE_FRAME_HEADER, max - KC87_ARCHIVE_FRAME_HEADER);
+
+    while (pos < size) {
+        // Next valid block; the bytes in front of it (if any) are stored as they are
+        kc87_iter_t it;
+        kc87_block_t block;
+        kc87_iter_init(&it, data + pos, size - pos);
+        if (kc87_iter_next(&it, &block) != KC87_BLOCK) {
+            enc_raw(&e, &c, data + pos, size - pos);
+            break;
+        }
+        enc_raw(&e, &c, data + pos, (size_t)block.offset);
+        if (block.type == KC87_BLOCK_TYPE_SAMPLES && block.data[2] == KC87_BLOCK_TYPE_SAMPLES_LONG) {
+            // Long sample block: rare enough for a plain 16-bit COUNT, samples as usual
+            enc_kind(&e, &c, KIND_BLOCK);
+            enc_tree(&e, c.m.type, 8, KC87_BLOCK_TYPE_SAMPLES_LONG);
+            enc_direct(&e, block.len, 16);
+            for (unsigned i = 0; i < block.len; i++) {
+                enc_sample(&e, &c, kc87_block_sample(&block, i));
+            }
+            samples += block.len;
+        } else if (block.type == KC87_BLOCK_TYPE_SAMPLES) {
+            enc_kind(&e, &c, KIND_SAMPLES);
+            enc_bit(&e, &c.m.count_same, block.len != c.count);
+            if (block.len != c.count) {
+                enc_tree(&e, c.m.count, 8, block.len);
+                c.count = block.len;
+            }
+            for (unsigned i = 0; i < block.len; i++) {
+                enc_sample(&e, &c, kc87_block_sample(&block, i));
+            }
+            samples += block.len;
+        } else {
+            enc_kind(&e, &c, KIND_BLOCK);
+            enc_tree(&e, c.m.type, 8, block.type);
+            enc_tree(&e, c.m.len, 8, block.len);
+            for (uint32_t i = 4; i + 2 < block.size; i++) {
+                enc_tree(&e, c.m.payload, 8, block.data[i]);
+            }
+            if (block.type == KC87_BLOCK_TYPE_CHANNELS) {
+                kc87_read_channels(&block, &c.layout);
+            }
+        }
+        pos += (size_t)block.offset + block.size;
+    }
+    enc_kind(&e, &c, KIND_END);
+    enc_flush(&e);
+
+    // Noisy deltas (control lines) can code larger than they are: store such frames
+    frame->flags = 0;
+    if (e.overflow || e.pos >= size) {
+        if (max < KC87_ARCHIVE_FRAME_HEADER + size) {
+            return 0;
+        }
+        memcpy(out + KC87_ARCHIVE_FRAME_HEADER, data, size);
+        e.pos = size;
+        frame->flags = FRAME_STORED;
+    }
+
+    frame->packed_size = (uint32_t)(KC87_ARCHIVE_FRAME_HEADER + e.pos);
+    frame->bin_size = (uint32_t)size;
+    frame->samples = samples;
+    write_frame_header(out, frame, crc32_update(0, data, size));
+    return frame->packed_size;
+}
+
+size_t kc87_unpack_frame(const uint8_t *in, size_t size, uint8_t *out, size_t max)
+{
+    kc87_frame_t frame;
+    uint32_t crc;
+    codec_t c;
+    decoder_t d;
+    size_t pos = 0;
+
+    if (size < KC87_ARCHIVE_FRAME_HEADER || read_frame_header(in, &frame, &crc) != 0 ||
+        frame.packed_size > size || frame.bin_size > max) {
+        return 0;
+    }
+    if (frame.flags & FRAME_STORED) {
+        if (frame.packed_size - KC87_ARCHIVE_FRAME_HEADER != frame.bin_size) {
+            return 0;
+        }
+        memcpy(out, in + KC87_ARCHIVE_FRAME_HEADER, frame.bin_size);
+        return crc32_update(0, out, frame.bin_size) == crc ? frame.bin_size : 0;
+    }
+    codec_init(&c, frame.mask);
+    dec_init(&d, in + KC87_ARCHIVE_FRAME_HEADER, frame.packed_size - KC87_ARCHIVE_FRAME_HEADER);
+
+    for (;;) {
+        unsigned kind = dec_kind(&d, &c);
+        if (kind == KIND_END) {
+            break;
+        }
+        if (kind == KIND_RAW) {
+            size_t n = (size_t)dec_direct(&d, 16);
+            if (pos + n > frame.bin_size) {
+                return 0;
+            }
+            for (size_t i = 0; i < n; i++) {
+                out[pos++] = (uint8_t)dec_tree(&d, c.m.payload, 8);
+            }
+            continue;
+        }
+
+        uint8_t type = KC87_BLOCK_TYPE_SAMPLES;
+        uint16_t len;
+        if (kind == KIND_SAMPLES) {
+            if (dec_bit(&d, &c.m.count_same)) {
+                c.count = (uint8_t)dec_tree(&d, c.m.count, 8);
+            }
+            len = c.count;
+        } else {
+            type = (uint8_t)dec_tree(&d, c.m.type, 8);
+            if (type == KC87_BLOCK_TYPE_SAMPLES_LONG) {
+                len = (uint16_t)dec_direct(&d, 16);
+                if (len <= KC87_MAX_SAMPLES_PER_BLOCK || len > KC87_MAX_SAMPLES_PER_LONG_BLOCK) {
+                    return 0;
+                }
+            } else {
+                len = (uint16_t)dec_tree(&d, c.m.len, 8);
+            }
+        }
+        int samples = type == KC87_BLOCK_TYPE_SAMPLES || type == KC87_BLOCK_TYPE_SAMPLES_LONG;
+        size_t head = type == KC87_BLOCK_TYPE_SAMPLES_LONG ? 5 : 4;
+        size_t block_size = type == KC87_BLOCK_TYPE_HEADER ? 6 :
+                            samples ? head + 2 + 2u * len : 6 + (size_t)len;
+        if (pos + block_size > frame.bin_size) {
+            return 0;
+        }
+        uint8_t *p = out + pos;
+        p[0] = p[1] = 0x00;
+        p[2] = type;
+        p[3] = len & 0xFF;
+        if (samples) {
+            if (type == KC87_BLOCK_TYPE_SAMPLES_LONG) {
+                p[4] = len >> 8;
+            }
+            for (unsigned i = 0; i < len; i++) {
+                uint16_t word = dec_sample(&d, &c);
+                p[head + 2 * i] = word & 0xFF;
+                p[head + 2 * i + 1] = word >> 8;
+            }
+        } else {
+            for (size_t i = 4; i + 2 < block_size; i++) {
+                p[i] = (uint8_t)dec_tree(&d, c.m.payload, 8);
+            }
+        }
+        p[block_size - 2] = 0x00;
+        p[block_size - 1] = 0x80;
+        if (type == KC87_BLOCK_TYPE_CHANNELS) {
+            kc87_block_t block;
+            block.type = type;
+            block.len = len;
+            block.payload = p + 4;
+            kc87_read_channels(&block, &c.layout);
+        }
+        pos += block_size;
+    }
+
+    if (pos != frame.bin_size || crc32_update(0, out, pos) != crc) {
+        return 0;
+    }
+    return pos;
+}
+
+// ---------------------------------------------------------------------------------------
+// Archive files
+
+int kc87_is_archive(const uint8_t *data, size_t size)
+{
+    return size >= 8 && memcmp(data, KC87_ARCHIVE_MAGIC, 8) == 0;
+}
+
+// Frame ranges: cut after the block that completes frame_samples sample words (or after
+// 4 * frame_samples bytes of other blocks). Cuts are only made where a reader walking the
+// whole stream continues, so iterating frame by frame gives the same blocks. time and
+// samples advance by the sample words the reader sees.
+static uint64_t next_cut(const uint8_t *data, uint64_t size, uint64_t start, uint32_t frame_samples,
+                         kc87_iter_t *state, kc87_layout_t *layout, uint64_t *time, uint64_t *samples)
+{
+    kc87_iter_t it;
+    kc87_block_t block;
+    uint64_t count = 0;
+    uint64_t clean = 0;             // Start of the blocks following the last skipped bytes
+    uint64_t parsed = 0;            // End of the last block the reader takes
+
+    kc87_iter_init(&it, data + start, size - start);
+    it.blocks = state->blocks;
+    it.ended = state->ended;
+    for (;;) {
+        uint64_t skipped = it.skipped;
+        if (kc87_iter_next(&it, &block) != KC87_BLOCK) {
+            break;
+        }
+        if (it.skipped != skipped) {
+            clean = block.offset;
+        }
+        parsed = it.pos;
+        if (block.type == KC87_BLOCK_TYPE_SAMPLES) {
+            for (unsigned i = 0; i < block.len; i++) {
+                *time += kc87_block_sample(&block, i) & layout->delta_max;
+            }
+            count += block.len;
+        } else if (block.type == KC87_BLOCK_TYPE_CHANNELS) {
+            kc87_read_channels(&block, layout);
+        }
+        // A reader scanning skipped bytes near the frame end would see a truncated block
+        // where the whole stream has an invalid one, so cut only well after them
+        if ((count >= frame_samples || it.pos >= 4ull * frame_samples) &&
+            it.pos - clean >= KC87_MAX_BLOCK_SIZE) {
+            state->blocks = it.blocks;
+            *samples += count;
+            return start + it.pos;
+        }
+    }
+    state->ended = it.ended;
+    *samples += count;
+    // End marker or no further block: what follows the last block is never parsed, cut
+    // there at the byte limit at the earliest
+    uint64_t end = it.ended ? it.pos : parsed;
+    if (end < 4ull * frame_samples) {
+        end = 4ull * frame_samples;
+    }
+    return size - start > end ? start + end : size;
+}
+
+int kc87_archive_pack(const char *bin_path, const char *archive_path, uint32_t frame_samples)
+{
+    FILE *in = fopen(bin_path, "rb");
+    if (!in) {
+        return -1;
+    }
+    fseek(in, 0, SEEK_END);
+    long file_size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    uint8_t *data = malloc(file_size > 0 ? (size_t)file_size : 1);
+    if (!data || fread(data, 1, (size_t)file_size, in) != (size_t)file_size) {
+        free(data);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    FILE *out = fopen(archive_path, "wb");
+    if (!out) {
+        free(data);
+        return -1;
+    }
+    if (frame_samples == 0) {
+        frame_samples = KC87_ARCHIVE_FRAME_SAMPLES;
+    }
+
+    uint8_t header[FILE_HEADER] = { 0 };
+    memcpy(header, KC87_ARCHIVE_MAGIC, 8);
+    put_u32(header + 8, frame_samples);
+    int result = fwrite(header, sizeof(header), 1, out) == 1 ? 0 : -1;
+
+    kc87_frame_t *index = NULL;
+    uint32_t frames = 0;
+    uint8_t *packed = NULL;
+    size_t packed_max = 0;
+    uint64_t file_pos = FILE_HEADER;
+    uint64_t pos = 0;
+    uint64_t time = 0;
+    uint64_t sample_index = 0;
+    kc87_iter_t state = { 0 };
+    kc87_layout_t layout;
+    kc87_layout_init(&layout, 0x01);
+
+    while (result == 0 && pos < (uint64_t)file_size) {
+        kc87_layout_t start_layout = layout;
+        uint64_t frame_time = time;
+        uint64_t frame_index = sample_index;
+        uint64_t end = next_cut(data, (uint64_t)file_size, pos, frame_samples, &state, &layout,
+                                &time, &sample_index);
+        size_t size = (size_t)(end - pos);
+
+        kc87_frame_t *grown = realloc(index, (frames + 1) * sizeof(*index));
+        if (!grown) {
+            result = -1;
+            break;
+        }
+        index = grown;
+        if (kc87_frame_bound(size) > packed_max) {
+            packed_max = kc87_frame_bound(size);
+            free(packed);
+            packed = malloc(packed_max);
+            if (!packed) {
+                result = -1;
+                break;
+            }
+        }
+
+        kc87_frame_t *f = &index[frames++];
+        memset(f, 0, sizeof(*f));
+        f->file_offset = file_pos;
+        f->bin_offset = pos;
+        f->time_us = frame_time;
+        f->sample_index = frame_index;
+        f->mask = start_layout.mask;
+        if (kc87_pack_frame(data + pos, size, f, packed, packed_max) == 0 ||
+            fwrite(packed, f->packed_size, 1, out) != 1) {
+            result = -1;
+            break;
+        }
+        file_pos += f->packed_size;
+        pos = end;
+    }
+
+    // Frame index and trailer
+    for (uint32_t i = 0; result == 0 && i < frames; i++) {
+        uint8_t entry[INDEX_ENTRY];
+        put_u64(entry, index[i].file_offset);
+        write_frame_header(entry + 8, &index[i], 0);
+        result = fwrite(entry, sizeof(entry), 1, out) == 1 ? 0 : -1;
+    }
+    if (result == 0) {
+        uint8_t trailer[TRAILER_SIZE];
+        put_u64(trailer, file_pos);
+        put_u32(trailer + 8, frames);
+        memcpy(trailer + 12, "KCIX", 4);
+        result = fwrite(trailer, sizeof(trailer), 1, out) == 1 ? 0 : -1;
+    }
+    if (fclose(out) != 0) {
+        result = -1;
+    }
+    struct stat st;
+    if (result != 0 && stat(archive_path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG) {
+        // A partial archive would pass for an unfinished one and hide the missing frames
+        remove(archive_path);
+    }
+    free(packed);
+    free(index);
+    free(data);
+    return result;
+}
+
+// Index from the trailer; without one (archive not finished) the frame headers are scanned
+static int load_index(kc87_archive_t *a)
+{
+    uint8_t buf[INDEX_ENTRY];
+    uint32_t crc;
+
+    if (fseek(a->file, -TRAILER_SIZE, SEEK_END) == 0 && fread(buf, TRAILER_SIZE, 1, a->file) == 1 &&
+        memcmp(buf + 12, "KCIX", 4) == 0) {
+        uint64_t offset = get_u64(buf);
+        a->frames = get_u32(buf + 8);
+        a->index = calloc(a->frames ? a->frames : 1, sizeof(*a->index));
+        if (!a->index || fseek(a->file, (long)offset, SEEK_SET) != 0) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < a->frames; i++) {
+            if (fread(buf, INDEX_ENTRY, 1, a->file) != 1 ||
+                read_frame_header(buf + 8, &a->index[i], &crc) != 0) {
+                return -1;
+            }
+            a->index[i].file_offset = get_u64(buf);
+        }
+        return 0;
+    }
+
+    uint64_t offset = FILE_HEADER;
+    a->frames = 0;
+    for (;;) {
+        kc87_frame_t frame;
+        if (fseek(a->file, (long)offset, SEEK_SET) != 0 ||
+            fread(buf, KC87_ARCHIVE_FRAME_HEADER, 1, a->file) != 1 ||
+            read_frame_header(buf, &frame, &crc) != 0) {
+            break;
+        }
+        if (fseek(a->file, (long)(offset + frame.packed_size - 1), SEEK_SET) != 0 ||
+            fread(buf, 1, 1, a->file) != 1) {
+            break;  // Truncated frame
+        }
+        kc87_frame_t *grown = realloc(a->index, (a->frames + 1) * sizeof(*a->index));
+        if (!grown) {
+            return -1;
+        }
+        a->index = grown;
+        frame.file_offset = offset;
+        a->index[a->frames++] = frame;
+        offset += frame.packed_size;
+    }
+    return 0;
+}
+
+kc87_archive_t *kc87_archive_open(const char *path)
+{
+    uint8_t header[FILE_HEADER];
+    kc87_archive_t *a = calloc(1, sizeof(*a));
+    if (!a) {
+        return NULL;
+    }
+    a->file = fopen(path, "rb");
+    if (!a->file || fread(header, sizeof(header), 1, a->file) != 1 ||
+        !kc87_is_archive(header, sizeof(header)) || load_index(a) != 0) {
+        kc87_archive_close(a);
+        return NULL;
+    }
+    if (a->frames > 0) {
+        const kc87_frame_t *last = &a->index[a->frames - 1];
+        a->bin_size = last->bin_offset + last->bin_size;
+    }
+    return a;
+}
+
+void kc87_archive_close(kc87_archive_t *a)
+{
+    if (!a) {
+        return;
+    }
+    if (a->file) {
+        fclose(a->file);
+    }
+    free(a->index);
+    free(a->buffer);
+    free(a);
+}
+
+uint32_t kc87_archive_frames(const kc87_archive_t *a)
+{
+    return a->frames;
+}
+
+uint64_t kc87_archive_bin_size(const kc87_archive_t *a)
+{
+    return a->bin_size;
+}
+
+int kc87_archive_frame(const kc87_archive_t *a, uint32_t index, kc87_frame_t *frame)
+{
+    if (index >= a->frames) {
+        return -1;
+    }
+    *frame = a->index[index];
+    return 0;
+}
+
+uint32_t kc87_archive_find_time(const kc87_archive_t *a, uint64_t time_us)
+{
+    uint32_t lo = 0;
+    uint32_t hi = a->frames;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (a->index[mid].time_us <= time_us) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+size_t kc87_archive_read(kc87_archive_t *a, uint32_t index, uint8_t *out, size_t max)
+{
+    if (index >= a->frames) {
+        return 0;
+    }
+    const kc87_frame_t *f = &a->index[index];
+    if (f->packed_size > a->buffer_size) {
+        free(a->buffer);
+        a->buffer = malloc(f->packed_size);
+        a->buffer_size = a->buffer ? f->packed_size : 0;
+        if (!a->buffer) {
+            return 0;
+        }
+    }
+    if (fseek(a->file, (long)f->file_offset, SEEK_SET) != 0 ||
+        fread(a->buffer, f->packed_size, 1, a->file) != 1) {
+        return 0;
+    }
+    return kc87_unpack_frame(a->buffer, f->packed_size, out, max);
+}
@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kc87.h"
+
+#define FRAME_INVALID (-1)
+
+struct kc87_parser {
+    uint8_t buf[KC87_MAX_BLOCK_SIZE];
+    size_t len;
+    uint64_t offset;            // Stream offset of buf[0]
+    uint64_t skipped;
+    uint8_t have_block;         // At least one block seen (end-of-stream is only valid after a block)
+    uint32_t release;           // Size of the block returned last, dropped on the next feed
+};
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Check whether p starts a block: KC87_BLOCK (complete, END marker verified, size set),
+// KC87_NEED_MORE (valid so far but incomplete, size = bytes needed for the next decision)
+// or FRAME_INVALID
+static int check_frame(const uint8_t *p, size_t avail, uint32_t *size)
+{
+    if ((avail >= 1 && p[0] != 0x00) || (avail >= 2 && p[1] != 0x00)) {
+        return FRAME_INVALID;
+    }
+    if (avail < 4) {
+        *size = 4;
+        return KC87_NEED_MORE;
+    }
+
+    uint32_t s;
+    if (p[2] == KC87_BLOCK_TYPE_HEADER) {
+        s = 6;  // START + TYPE + VERSION + END
+    } else if (p[2] == KC87_BLOCK_TYPE_SAMPLES) {
+        s = 6 + 2u * p[3];
+    } else if (p[2] == KC87_BLOCK_TYPE_SAMPLES_LONG) {
+        if (avail < 5) {
+            *size = 5;
+            return KC87_NEED_MORE;
+        }
+        // Only used beyond the short block, the limit bounds the wait on a false START
+        uint32_t count = p[3] | (p[4] << 8);
+        if (count <= KC87_MAX_SAMPLES_PER_BLOCK || count > KC87_MAX_SAMPLES_PER_LONG_BLOCK) {
+            return FRAME_INVALID;
+        }
+        s = 7 + 2u * count;
+    } else {
+        s = 6 + p[3];  // Extended block: generic layout, unknown types are skipped by the caller
+    }
+    *size = s;
+    if (avail < s) {
+        return KC87_NEED_MORE;
+    }
+    if (p[s - 2] != 0x00 || p[s - 1] != 0x80) {
+        return FRAME_INVALID;
+    }
+    return KC87_BLOCK;
+}
+
+static void fill_block(kc87_block_t *block, const uint8_t *p, uint32_t size, uint64_t offset)
+{
+    block->data = p;
+    block->type = p[2];
+    block->len = p[3];
+    block->size = size;
+    block->offset = offset;
+    block->payload = (p[2] == KC87_BLOCK_TYPE_HEADER) ? NULL : p + 4;
+    block->reserved = 0;
+    if (p[2] == KC87_BLOCK_TYPE_SAMPLES_LONG) {
+        block->type = KC87_BLOCK_TYPE_SAMPLES;
+        block->len = (uint16_t)(p[3] | (p[4] << 8));
+        block->payload = p + 5;
+    }
+}
+
+int kc87_abi_version(void)
+{
+    return KC87_ABI_VERSION;
+}
+
+void kc87_iter_init(kc87_iter_t *it, const uint8_t *data, uint64_t size)
+{
+    memset(it, 0, sizeof(*it));
+    it->data = data;
+    it->size = size;
+}
+
+int kc87_iter_next(kc87_iter_t *it, kc87_block_t *block)
+{
+    while (!it->ended && it->pos + 2 <= it->size) {
+        const uint8_t *p = it->data + it->pos;
+        uint64_t avail = it->size - it->pos;
+
+        if (it->blocks > 0 && p[0] == 0x00 && p[1] == 0x80) {
+            it->ended = 1;
+            it->pos += 2;
+            return KC87_END_OF_STREAM;
+        }
+
+        uint32_t size;
+        int r = check_frame(p, avail > KC87_MAX_BLOCK_SIZE ? KC87_MAX_BLOCK_SIZE : (size_t)avail, &size);
+        if (r == KC87_BLOCK) {
+            fill_block(block, p, size, it->pos);
+            it->pos += size;
+            it->blocks++;
+            return KC87_BLOCK;
+        }
+        if (r == KC87_NEED_MORE) {
+            break;  // Truncated block at the end of the buffer
+        }
+        it->pos++;
+        it->skipped++;
+    }
+    return it->ended ? KC87_END_OF_STREAM : KC87_NEED_MORE;
+}
+
+size_t kc87_iter_samples(kc87_iter_t *it, uint16_t *out, size_t max,
+                         kc87_block_t *block, int *result)
+{
+    size_t count = 0;
+
+    for (;;) {
+        kc87_iter_t saved = *it;
+        int r = kc87_iter_next(it, block);
+        if (r != KC87_BLOCK || block->type != KC87_BLOCK_TYPE_SAMPLES) {
+            *result = r;
+            return count;
+        }
+        if (count + block->len > max) {
+            *it = saved;  // Leave the block for the next chunk
+            *result = KC87_CHUNK_FULL;
+            return count;
+        }
+        for (unsigned i = 0; i < block->len; i++) {
+            out[count++] = kc87_block_sample(block, i);
+        }
+    }
+}
+
+int kc87_has_header(const uint8_t *data, size_t size)
+{
+    kc87_iter_t it;
+    kc87_block_t block;
+    kc87_iter_init(&it, data, size);
+    return kc87_iter_next(&it, &block) == KC87_BLOCK && block.type == KC87_BLOCK_TYPE_HEADER &&
+           block.offset == 0;
+}
+
+kc87_parser_t *kc87_parser_new(void)
+{
+    kc87_parser_t *p = malloc(sizeof(*p));
+    if (p) {
+        kc87_parser_reset(p);
+    }
+    return p;
+}
+
+void kc87_parser_free(kc87_parser_t *p)
+{
+    free(p);
+}
+
+void kc87_parser_reset(kc87_parser_t *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+uint64_t kc87_parser_skipped(const kc87_parser_t *p)
+{
+    return p->skipped;
+}
+
+// Drop n bytes from the front of the parser buffer
+static void parser_drop(kc87_parser_t *p, size_t n)
+{
+    memmove(p->buf, p->buf + n, p->len - n);
+    p->len -= n;
+    p->offset += n;
+}
+
+int kc87_parser_feed(kc87_parser_t *p, const uint8_t *data, size_t len,
+                     size_t *consumed, kc87_block_t *block)
+{
+    size_t used = 0;
+
+    if (p->release) {
+        parser_drop(p, p->release);
+        p->release = 0;
+    }
+
+    for (;;) {
+        uint32_t size = 1;
+
+        // Resynchronize: discard bytes until the buffer starts with a possible block
+        while (p->len > 0) {
+            if (p->have_block && p->len >= 2 && p->buf[0] == 0x00 && p->buf[1] == 0x80) {
+                parser_drop(p, 2);
+                p->have_block = 0;
+                *consumed = used;
+                return KC87_END_OF_STREAM;
+            }
+            int r = check_frame(p->buf, p->len, &size);
+            if (r == KC87_BLOCK) {
+                // After a resync bytes of the next block may follow in buf, they stay buffered
+                fill_block(block, p->buf, size, p->offset);
+                p->have_block = 1;
+                p->release = size;
+                *consumed = used;
+                return KC87_BLOCK;
+            }
+            if (r == KC87_NEED_MORE) {
+                break;
+            }
+            parser_drop(p, 1);
+            p->skipped++;
+            size = 1;
+        }
+
+        if (used == len) {
+            *consumed = used;
+            return KC87_NEED_MORE;
+        }
+        // Copy what the pending block still needs in one go (the samples of a large block),
+        // a single byte while the buffer is empty or before an END marker can be recognized
+        size_t n = (size > p->len && p->len >= 2) ? size - p->len : 1;
+        if (n > len - used) {
+            n = len - used;
+        }
+        memcpy(p->buf + p->len, data + used, n);
+        p->len += n;
+        used += n;
+    }
+}
+
+void kc87_layout_init(kc87_layout_t *layout, uint8_t mask)
+{
+    memset(layout, 0, sizeof(*layout));
+    mask |= 0x01;  // The tape channel is always present
+    for (uint8_t ch = 0; ch < 8; ch++) {
+        if (mask & (1u << ch)) {
+            layout->channel[layout->count++] = ch;
+        }
+    }
+    layout->mask = mask;
+    while ((1u << layout->bits) < layout->count) {
+        layout->bits++;
+    }
+    layout->delta_max = (uint16_t)((1u << (15 - layout->bits)) - 1);
+}
+
+void kc87_decode_sample(const kc87_layout_t *layout, uint16_t word, kc87_sample_t *sample)
+{
+    uint8_t delta_bits = 15 - layout->bits;
+    sample->edge = (word & 0x8000) != 0;
+    sample->delta_us = word & layout->delta_max;
+    sample->channel = layout->channel[(word & 0x7FFF) >> delta_bits];
+}
+
+size_t kc87_decode_samples(const kc87_layout_t *layout, const kc87_block_t *block, kc87_sample_t *out)
+{
+    if (block->type != KC87_BLOCK_TYPE_SAMPLES) {
+        return 0;
+    }
+    for (unsigned i = 0; i < block->len; i++) {
+        kc87_decode_sample(layout, kc87_block_sample(block, i), &out[i]);
+    }
+    return block->len;
+}
+
+uint16_t kc87_encode_sample(const kc87_layout_t *layout, uint8_t channel, int edge, uint32_t delta_us)
+{
+    uint16_t ordinal = 0;
+    for (uint8_t i = 0; i < layout->count; i++) {
+        if (layout->channel[i] == channel) {
+            ordinal = i;
+            break;
+        }
+    }
+    if (delta_us > layout->delta_max) {
+        delta_us = layout->delta_max;
+    }
+    return (uint16_t)((edge ? 0x8000 : 0) | (ordinal << (15 - layout->bits)) | delta_us);
+}
+
+int kc87_read_stats(const kc87_block_t *block, kc87_stats_t *stats)
+{
+    if (block->type != KC87_BLOCK_TYPE_STATS || block->len < 8) {
+        return -1;
+    }
+    stats->glitches = read_u32(block->payload);
+    stats->drops = read_u32(block->payload + 4);
+    return 0;
+}
+
+int kc87_read_sync(const kc87_block_t *block, kc87_sync_t *sync)
+{
+    if (block->type != KC87_BLOCK_TYPE_SYNC || block->len < 12) {
+        return -1;
+    }
+    sync->sample_index = read_u32(block->payload);
+    sync->time_us = read_u32(block->payload + 4) | ((uint64_t)read_u32(block->payload + 8) << 32);
+    sync->reserved = 0;
+    return 0;
+}
+
+int kc87_read_tape(const kc87_block_t *block, kc87_tape_t *tape)
+{
+    if (block->type != KC87_BLOCK_TYPE_TAPE || block->len < KC87_TAPE_PAYLOAD) {
+        return -1;
+    }
+    const uint8_t *p = block->payload;
+    memset(tape, 0, sizeof(*tape));
+    tape->status = p[0];
+    tape->block_nr = p[1];
+    tape->leader_periods = (uint16_t)(p[2] | (p[3] << 8));
+    memcpy(tape->data, p + 4, KC87_TAPE_DATA_SIZE);
+    tape->checksum = p[4 + KC87_TAPE_DATA_SIZE];
+    return 0;
+}
+
+int kc87_read_channels(const kc87_block_t *block, kc87_layout_t *layout)
+{
+    if (block->type != KC87_BLOCK_TYPE_CHANNELS || block->len < 1) {
+        return -1;
+    }
+    kc87_layout_init(layout, block->payload[0]);
+    return 0;
+}
+
+size_t kc87_encode_header(uint8_t *out, uint8_t version)
+{
+    out[0] = 0x00;
+    out[1] = 0x00;
+    out[2] = KC87_BLOCK_TYPE_HEADER;
+    out[3] = version;
+    out[4] = 0x00;
+    out[5] = 0x80;
+    return 6;
+}
+
+size_t kc87_encode_samples(uint8_t *out, const uint16_t *samples, uint16_t count)
+{
+    size_t head = 4;
+    out[0] = 0x00;
+    out[1] = 0x00;
+    out[2] = KC87_BLOCK_TYPE_SAMPLES;
+    out[3] = count & 0xFF;
+    if (count > KC87_MAX_SAMPLES_PER_BLOCK) {
+        out[2] = KC87_BLOCK_TYPE_SAMPLES_LONG;
+        out[4] = count >> 8;
+        head = 5;
+    }
+    uint8_t *p = out + head;
+    for (unsigned i = 0; i < count; i++) {
+        p[2 * i] = samples[i] & 0xFF;
+        p[2 * i + 1] = samples[i] >> 8;
+    }
+    p[2 * count] = 0x00;
+    p[2 * count + 1] = 0x80;
+    return head + 2 + 2u * count;
+}
+
+size_t kc87_encode_block(uint8_t *out, uint8_t type, const uint8_t *payload, uint8_t len)
+{
+    out[0] = 0x00;
+    out[1] = 0x00;
+    out[2] = type;
+    out[3] = len;
+    memcpy(out + 4, payload, len);
+    out[4 + len] = 0x00;
+    out[5 + len] = 0x80;
+    return 6 + (size_t)len;
+}
+
+size_t kc87_encode_end(uint8_t *out)
+{
+    out[0] = 0x00;
+    out[1] = 0x80;
+    return 2;
+}
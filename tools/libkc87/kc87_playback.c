@@ -0,0 +1,91 @@
+#include <string.h>
+#include "kc87.h"
+
+void kc87_playback_init(kc87_playback_t *pb, uint8_t mask)
+{
+    memset(pb, 0, sizeof(*pb));
+    kc87_layout_init(&pb->layout, mask);
+}
+
+// Blocks with a checksum error are already contained as raw samples
+static int playable_tape(const kc87_block_t *block, kc87_tape_t *tape)
+{
+    return block->type == KC87_BLOCK_TYPE_TAPE && kc87_read_tape(block, tape) == 0 &&
+           tape->status == KC87_TAPE_STATUS_OK;
+}
+
+size_t kc87_playback_words(const kc87_playback_t *pb, const kc87_block_t *block)
+{
+    kc87_tape_t tape;
+    size_t n = 0;
+
+    if (block->type == KC87_BLOCK_TYPE_SAMPLES) {
+        for (unsigned i = 0; i < block->len; i++) {
+            kc87_sample_t sample;
+            kc87_decode_sample(&pb->layout, kc87_block_sample(block, i), &sample);
+            n += sample.channel == 0;
+        }
+        return n;
+    }
+    return playable_tape(block, &tape) ? kc87_tape_to_samples(&tape, NULL, 0) : 0;
+}
+
+size_t kc87_playback_tape(kc87_playback_t *pb, const kc87_tape_t *tape, uint16_t *out)
+{
+    size_t n = kc87_tape_to_samples(tape, out, out ? SIZE_MAX : 0);
+    pb->words += n;
+    pb->time_us += kc87_tape_duration_us(tape);
+    return n;
+}
+
+size_t kc87_playback_block(kc87_playback_t *pb, const kc87_block_t *block, uint16_t *out)
+{
+    size_t n = 0;
+    kc87_tape_t tape;
+
+    if (block->type == KC87_BLOCK_TYPE_SAMPLES) {
+        for (unsigned i = 0; i < block->len; i++) {
+            kc87_sample_t sample;
+            kc87_decode_sample(&pb->layout, kc87_block_sample(block, i), &sample);
+            pb->pending_us += sample.delta_us;
+            if (sample.channel != 0) {
+                continue;
+            }
+            uint32_t delta_us = pb->pending_us < KC87_PLAYBACK_DELTA_MAX ? pb->pending_us : KC87_PLAYBACK_DELTA_MAX;
+            if (out) {
+                out[n] = (uint16_t)((sample.edge ? 0x8000 : 0) | delta_us);
+            }
+            n++;
+            pb->time_us += delta_us;
+            pb->pending_us = 0;
+        }
+        pb->words += n;
+    } else if (block->type == KC87_BLOCK_TYPE_CHANNELS) {
+        kc87_read_channels(block, &pb->layout);
+    } else if (playable_tape(block, &tape)) {
+        n = kc87_playback_tape(pb, &tape, out);
+    }
+    return n;
+}
+
+size_t kc87_playback_blocks(kc87_playback_t *pb, kc87_iter_t *it, uint16_t *out, size_t max, int *result)
+{
+    size_t count = 0;
+    kc87_block_t block;
+
+    for (;;) {
+        kc87_iter_t saved = *it;
+        int r = kc87_iter_next(it, &block);
+        if (r != KC87_BLOCK) {
+            pb->ended = it->ended;
+            *result = r;
+            return count;
+        }
+        if (out && count + kc87_playback_words(pb, &block) > max) {
+            *it = saved;  // Leave the block for the next call
+            *result = KC87_CHUNK_FULL;
+            return count;
+        }
+        count += kc87_playback_block(pb, &block, out ? out + count : NULL);
+    }
+}
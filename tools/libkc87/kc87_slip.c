@@ -0,0 +1,57 @@
+#include "kc87.h"
+
+size_t kc87_slip_encode(uint8_t *out, const uint8_t *data, size_t len)
+{
+    size_t pos = 0;
+
+    out[pos++] = KC87_SLIP_END;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == KC87_SLIP_END) {
+            out[pos++] = KC87_SLIP_ESC;
+            out[pos++] = KC87_SLIP_ESC_END;
+        } else if (data[i] == KC87_SLIP_ESC) {
+            out[pos++] = KC87_SLIP_ESC;
+            out[pos++] = KC87_SLIP_ESC_ESC;
+        } else {
+            out[pos++] = data[i];
+        }
+    }
+    out[pos++] = KC87_SLIP_END;
+    return pos;
+}
+
+// Complete SLIP frame of a CMD_SET_PARAM command, out needs 14 bytes
+size_t kc87_encode_set_param(uint8_t *out, uint8_t param, uint32_t value)
+{
+    uint8_t cmd[6] = {
+        KC87_CMD_SET_PARAM,
+        param,
+        (uint8_t)(value & 0xFF),
+        (uint8_t)((value >> 8) & 0xFF),
+        (uint8_t)((value >> 16) & 0xFF),
+        (uint8_t)((value >> 24) & 0xFF)
+    };
+    return kc87_slip_encode(out, cmd, sizeof(cmd));
+}
+
+// Complete SLIP frame of a CMD_HISTOGRAMS command (KC87_HISTOGRAMS_*), out needs 8 bytes
+size_t kc87_encode_histograms(uint8_t *out, uint8_t action)
+{
+    // Padding byte: 2-byte frames are playback samples
+    uint8_t cmd[3] = { KC87_CMD_HISTOGRAMS, action, 0x00 };
+    return kc87_slip_encode(out, cmd, sizeof(cmd));
+}
+
+// Complete SLIP frame of a CMD_STORE command (KC87_STORE_*, seq for KC87_STORE_READ), out needs 14 bytes
+size_t kc87_encode_store(uint8_t *out, uint8_t op, uint32_t seq)
+{
+    uint8_t cmd[6] = {
+        KC87_CMD_STORE,
+        op,
+        (uint8_t)(seq & 0xFF),
+        (uint8_t)((seq >> 8) & 0xFF),
+        (uint8_t)((seq >> 16) & 0xFF),
+        (uint8_t)((seq >> 24) & 0xFF)
+    };
+    return kc87_slip_encode(out, cmd, sizeof(cmd));
+}
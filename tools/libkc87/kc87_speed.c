@@ -0,0 +1,129 @@
+#include <math.h>
+#include <string.h>
+#include "kc87.h"
+
+// Nominal full period of a classified period, 0 if the period is invalid
+static uint32_t nominal_period(double period_us)
+{
+    if (period_us < KC87_PERIOD_MIN_US || period_us >= KC87_PERIOD_MAX_US) {
+        return 0;
+    }
+    if (period_us < KC87_PERIOD_ZERO_ONE_US) {
+        return 2 * KC87_HALF_ZERO_US;
+    }
+    if (period_us < KC87_PERIOD_ONE_SEP_US) {
+        return 2 * KC87_HALF_ONE_US;
+    }
+    return 2 * KC87_HALF_SEP_US;
+}
+
+// Exponential average over time: the weight of a sample grows with the period length.
+// The first samples are averaged cumulatively, so the estimates start without a ramp.
+static double average(double value, double sample, double period_us, double tau_us, uint64_t n)
+{
+    double alpha = period_us / (tau_us + period_us);
+    if (alpha * (double)(n + 1) < 1.0) {
+        alpha = 1.0 / (double)(n + 1);
+    }
+    return value + alpha * (sample - value);
+}
+
+static void measure(kc87_speed_t *s, uint32_t period_us)
+{
+    // Classify with the current estimate, so a constant speed offset does not shift the classes
+    uint32_t nominal = nominal_period(period_us * s->mid);
+    if (nominal == 0) {
+        return;
+    }
+    double sample = (double)nominal / (double)period_us;
+    s->fast = average(s->fast, sample, period_us, KC87_SPEED_FAST_US, s->periods);
+    s->mid = average(s->mid, sample, period_us, KC87_SPEED_MID_US, s->periods);
+    s->slow = average(s->slow, sample, period_us, KC87_SPEED_SLOW_US, s->periods);
+    s->periods++;
+    s->measured_us += period_us;
+    if (s->measured_us < KC87_SPEED_WARMUP_US) {
+        return;
+    }
+
+    if (s->stat_periods == 0 || s->slow < s->speed_min) {
+        s->speed_min = s->slow;
+    }
+    if (s->stat_periods == 0 || s->slow > s->speed_max) {
+        s->speed_max = s->slow;
+    }
+    s->speed_sum += s->slow;
+    s->wow_sumsq += (s->mid - s->slow) * (s->mid - s->slow);
+    s->flutter_sumsq += (s->fast - s->mid) * (s->fast - s->mid);
+    s->total_sumsq += (s->fast - s->slow) * (s->fast - s->slow);
+    s->stat_periods++;
+}
+
+void kc87_speed_init(kc87_speed_t *speed, int period_edge)
+{
+    memset(speed, 0, sizeof(*speed));
+    speed->fast = 1.0;
+    speed->mid = 1.0;
+    speed->slow = 1.0;
+    speed->period_edge = period_edge ? 1 : 0;
+}
+
+int kc87_speed_feed(kc87_speed_t *speed, uint32_t delta_us, int edge)
+{
+    speed->period_us += delta_us;
+    if (edge != (int)speed->period_edge) {
+        return 0;
+    }
+    uint32_t period_us = speed->period_us;
+    speed->period_us = 0;
+    if (!speed->started) {
+        speed->started = 1; // Time before the first boundary is not a full period
+        return 0;
+    }
+    uint64_t before = speed->periods;
+    measure(speed, period_us);
+    return speed->periods != before;
+}
+
+uint32_t kc87_speed_normalize(kc87_speed_t *speed, uint32_t delta_us)
+{
+    double exact = delta_us * speed->mid + speed->carry;
+    double rounded = floor(exact + 0.5);
+    if (rounded < 0.0) {
+        rounded = 0.0;
+    }
+    speed->carry = exact - rounded;
+    return (uint32_t)rounded;
+}
+
+void kc87_speed_samples(kc87_speed_t *speed, const kc87_layout_t *layout,
+                        const uint16_t *words, size_t count, uint16_t *out)
+{
+    for (size_t i = 0; i < count; i++) {
+        kc87_sample_t sample;
+        kc87_decode_sample(layout, words[i], &sample);
+        if (out) {
+            uint32_t delta = kc87_speed_normalize(speed, sample.delta_us);
+            out[i] = kc87_encode_sample(layout, sample.channel, sample.edge, delta);
+        }
+        kc87_speed_feed(speed, sample.delta_us, sample.channel == 0 ? sample.edge : -1);
+    }
+}
+
+void kc87_speed_result(const kc87_speed_t *speed, kc87_speed_result_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->periods = speed->periods;
+    if (speed->stat_periods == 0) {
+        result->speed = speed->periods ? speed->slow : 1.0;
+        result->speed_min = result->speed;
+        result->speed_max = result->speed;
+        return;
+    }
+    double n = (double)speed->stat_periods;
+    result->speed = speed->speed_sum / n;
+    result->speed_min = speed->speed_min;
+    result->speed_max = speed->speed_max;
+    result->wow_percent = 100.0 * sqrt(speed->wow_sumsq / n) / result->speed;
+    result->flutter_percent = 100.0 * sqrt(speed->flutter_sumsq / n) / result->speed;
+    result->total_percent = 100.0 * sqrt(speed->total_sumsq / n) / result->speed;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kc87.h"
+
+#define WAV_HEADER_SIZE  44
+#define WAV_BUFFER_SIZE  4096
+#define WAV_LEVEL        16383  // ~50% of max int16
+
+struct kc87_wav {
+    FILE *file;
+    uint32_t sample_rate;
+    int level;                  // Current line state (1 = high)
+    uint64_t time_us;           // Stream time of the last edge
+    uint64_t frames;            // PCM frames written so far
+    size_t buffer_pos;
+    int16_t buffer[WAV_BUFFER_SIZE];
+};
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, v & 0xFFFF);
+    put_u16(p + 2, v >> 16);
+}
+
+static int write_header(kc87_wav_t *wav, uint32_t data_size)
+{
+    uint8_t h[WAV_HEADER_SIZE];
+    memcpy(h, "RIFF", 4);
+    put_u32(h + 4, 36 + data_size);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_u32(h + 16, 16);                    // fmt chunk size
+    put_u16(h + 20, 1);                     // PCM
+    put_u16(h + 22, 1);                     // Mono
+    put_u32(h + 24, wav->sample_rate);
+    put_u32(h + 28, wav->sample_rate * 2);  // Byte rate
+    put_u16(h + 32, 2);                     // Block align
+    put_u16(h + 34, 16);                    // Bits per sample
+    memcpy(h + 36, "data", 4);
+    put_u32(h + 40, data_size);
+
+    fseek(wav->file, 0, SEEK_SET);
+    return fwrite(h, sizeof(h), 1, wav->file) == 1 ? 0 : -1;
+}
+
+static void flush_buffer(kc87_wav_t *wav)
+{
+    if (wav->buffer_pos > 0) {
+        fwrite(wav->buffer, sizeof(int16_t), wav->buffer_pos, wav->file);
+        wav->buffer_pos = 0;
+    }
+}
+
+kc87_wav_t *kc87_wav_open(const char *path, uint32_t sample_rate)
+{
+    kc87_wav_t *wav = calloc(1, sizeof(*wav));
+    if (!wav) {
+        return NULL;
+    }
+    wav->sample_rate = sample_rate;
+    wav->file = fopen(path, "wb");
+    if (!wav->file || write_header(wav, 0) != 0) {
+        if (wav->file) {
+            fclose(wav->file);
+        }
+        free(wav);
+        return NULL;
+    }
+    return wav;
+}
+
+void kc87_wav_edge(kc87_wav_t *wav, uint32_t delta_us, int edge)
+{
+    // Frames are derived from the absolute stream time, so rounding never accumulates
+    wav->time_us += delta_us;
+    uint64_t target = wav->time_us * wav->sample_rate / 1000000u;
+    int16_t value = wav->level ? WAV_LEVEL : -WAV_LEVEL;
+
+    while (wav->frames < target) {
+        wav->buffer[wav->buffer_pos++] = value;
+        wav->frames++;
+        if (wav->buffer_pos == WAV_BUFFER_SIZE) {
+            flush_buffer(wav);
+        }
+    }
+    if (edge >= 0) {
+        wav->level = edge != 0;
+    }
+}
+
+// Tape synthesis: every period is a low half followed by a high half of nominal length.
+// Layout: leader ("1"-periods), separator, BLOCK_NR, DATA, CHECKSUM, each byte LSB first
+// followed by a separator (same as the firmware decoder expects).
+typedef void (*tape_emit_fn)(void *ctx, uint16_t word);
+
+static void tape_period(tape_emit_fn emit, void *ctx, uint16_t half_us)
+{
+    emit(ctx, half_us);
+    emit(ctx, 0x8000 | half_us);
+}
+
+static void tape_byte(tape_emit_fn emit, void *ctx, uint8_t value)
+{
+    for (int bit = 0; bit < 8; bit++) {
+        tape_period(emit, ctx, ((value >> bit) & 1) ? KC87_HALF_ONE_US : KC87_HALF_ZERO_US);
+    }
+    tape_period(emit, ctx, KC87_HALF_SEP_US);
+}
+
+static void tape_walk(const kc87_tape_t *tape, tape_emit_fn emit, void *ctx)
+{
+    for (uint16_t i = 0; i < tape->leader_periods; i++) {
+        tape_period(emit, ctx, KC87_HALF_ONE_US);
+    }
+    tape_period(emit, ctx, KC87_HALF_SEP_US);
+    tape_byte(emit, ctx, tape->block_nr);
+    for (int i = 0; i < KC87_TAPE_DATA_SIZE; i++) {
+        tape_byte(emit, ctx, tape->data[i]);
+    }
+    tape_byte(emit, ctx, tape->checksum);
+}
+
+typedef struct {
+    uint16_t *out;
+    size_t max;
+    size_t count;
+} tape_buffer_t;
+
+static void emit_to_buffer(void *ctx, uint16_t word)
+{
+    tape_buffer_t *tb = ctx;
+    if (tb->count < tb->max) {
+        tb->out[tb->count] = word;
+    }
+    tb->count++;
+}
+
+static void emit_to_wav(void *ctx, uint16_t word)
+{
+    kc87_wav_edge(ctx, word & 0x7FFF, (word & 0x8000) != 0);
+}
+
+size_t kc87_tape_to_samples(const kc87_tape_t *tape, uint16_t *out, size_t max)
+{
+    tape_buffer_t tb = { out, out ? max : 0, 0 };
+    tape_walk(tape, emit_to_buffer, &tb);
+    return tb.count;
+}
+
+static void emit_duration(void *ctx, uint16_t word)
+{
+    *(uint64_t *)ctx += word & 0x7FFF;
+}
+
+uint64_t kc87_tape_duration_us(const kc87_tape_t *tape)
+{
+    uint64_t duration_us = 0;
+    tape_walk(tape, emit_duration, &duration_us);
+    return duration_us;
+}
+
+void kc87_wav_tape(kc87_wav_t *wav, const kc87_tape_t *tape)
+{
+    tape_walk(tape, emit_to_wav, wav);
+}
+
+uint64_t kc87_wav_frames(const kc87_wav_t *wav)
+{
+    return wav->frames;
+}
+
+int kc87_wav_close(kc87_wav_t *wav)
+{
+    int result = 0;
+    flush_buffer(wav);
+    uint64_t data_size = wav->frames * 2;
+    if (write_header(wav, data_size > UINT32_MAX - 36 ? UINT32_MAX - 36 : (uint32_t)data_size) != 0) {
+        result = -1;
+    }
+    if (fclose(wav->file) != 0) {
+        result = -1;
+    }
+    free(wav);
+    return result;
+}
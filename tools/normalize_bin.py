@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""
+Normalisiert eine .bin Aufnahme auf Nenn-Timing
+
+Die Bandgeschwindigkeit wird fortlaufend aus den KC87-Perioden geschätzt (libkc87, gleicher
+Schätzer wie serial_capture -n) und jedes Delta damit auf Nenn-Timing umgerechnet.
+Gleichlaufschwankungen und Geschwindigkeitsabweichungen des Kassettenrekorders sind danach
+weitgehend entfernt; die Aufnahme dekodiert sicherer und lässt sich zuverlässiger mit
+serial_transmit abspielen.
+
+Sync-Blöcke werden nicht übernommen: ihre Zeitstempel beschreiben die Originalzeit.
+"""
+import sys
+
+import numpy as np
+
+import kc87
+
+def normalize_file(in_file, out_file):
+    """Schreibt die normalisierte Aufnahme, liefert kc87.SpeedResult"""
+    data = kc87.open_file(in_file)
+    layout = kc87.Layout()
+    speed = None
+    with open(out_file, 'wb') as out:
+        for item in kc87.iter_chunks(data):
+            if isinstance(item, kc87.Block):
+                if item.type == kc87.BLOCK_TYPE_CHANNELS:
+                    layout = kc87.read_channels(item) or layout
+                if item.type != kc87.BLOCK_TYPE_SYNC:
+                    out.write(data[item.offset:item.offset + item.size])
+                continue
+            if speed is None:
+                # Wie im Dekoder: eine steigende Flanke schließt die Periode ab, sofern vorhanden
+                speed = kc87.SpeedEstimator(bool((item & 0x8000).any()))
+            words = speed.feed(item, layout, normalize=True)
+            for i in range(0, len(words), kc87.MAX_SAMPLES_PER_BLOCK):
+                out.write(kc87.encode_samples(words[i:i + kc87.MAX_SAMPLES_PER_BLOCK].tolist()))
+        out.write(kc87.encode_end())
+    return speed.result() if speed else None
+
+def main():
+    if len(sys.argv) != 3:
+        print("Usage: python3 normalize_bin.py <aufnahme.bin> <normalisiert.bin>")
+        sys.exit(1)
+    if kc87.lib is None:
+        print("Fehler: libkc87 nicht gefunden (tools bauen oder KC87_LIB setzen)")
+        sys.exit(1)
+    result = normalize_file(sys.argv[1], sys.argv[2])
+    if result is None or result.periods == 0:
+        print("Keine KC87-Perioden gefunden, Deltas unverändert")
+        return
+    print(f"Bandgeschwindigkeit: {result.speed * 100:.2f}% "
+          f"(Drift {result.speed_min * 100:.2f}% - {result.speed_max * 100:.2f}%)")
+    print(f"Gleichlauf:          Wow {result.wow_percent:.2f}%, Flutter {result.flutter_percent:.2f}%, "
+          f"gesamt {result.total_percent:.2f}% (RMS)")
+    print(f"Normalisiert:        {sys.argv[2]}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,537 @@
+#!/usr/bin/env python3
+"""
+Mehrstufige Übersicht (Min/Max-Pyramide) für lange Aufnahmen
+
+Neben der Aufnahme wird ein Verzeichnis <aufnahme.bin>.overview angelegt. Ebene 0 fasst
+die Flanken von Kanal 0 in Buckets zu BASE_BUCKET_US zusammen: Anzahl der Flanken,
+kürzeste und längste Pulsbreite (Zeit seit der vorigen Flanke) und die Zeit mit hohem
+Pegel (Tastverhältnis). Jede weitere Ebene fasst FANOUT Buckets der darunterliegenden
+zusammen. Jede Ebene ist eine Datei mit Datensätzen fester Größe (BUCKET_DTYPE, 10 Bytes),
+die nur angehängt wird; state.json hält den Lesestand in der Aufnahme und den angefangenen
+Bucket, seek.dat Zeit und Zustand am Anfang jedes gelesenen Chunks.
+
+Der Aufbau ist ein Durchlauf über die Aufnahme (chunkweise mit NumPy); ein erneuter
+Aufruf verarbeitet nur die seither angehängten Blöcke, auch während serial_capture noch
+schreibt (--follow). Bilder (PNG) und JSON-Ausschnitte lesen für jeden Zoom nur die Ebene,
+deren Buckets knapp feiner als eine Bildspalte sind. Feinere Zooms als Ebene 0 werden
+direkt aus der Aufnahme berechnet (ab dem Chunk vor dem Ausschnitt, siehe seek.dat), so
+bleibt die Übersicht klein gegenüber der Aufnahme.
+"""
+import json
+import os
+import struct
+import sys
+import time
+import zlib
+
+import numpy as np
+
+import kc87
+import kc87_tape
+
+BASE_BUCKET_US = 64000          # Bucket-Dauer auf Ebene 0
+FANOUT = 4                      # Buckets einer Ebene pro Bucket der nächsten
+FORMAT_VERSION = 2
+FOLLOW_INTERVAL_S = 1.0
+WIDTH_NONE = 0xFFFF             # min_us eines Buckets ohne Pulse
+WIDTH_SCALE_US = 1000           # Pulsbreite am oberen Bildrand (KC87-Trennzeichen: 833 µs)
+KC87_HALF_US = (208, 417, 833)  # Nennpulsbreiten, als Hilfslinien im Bild
+
+# Gespeicherte Buckets: 'high' zählt auf Ebene n in Einheiten von FANOUT ** n µs und bleibt
+# damit unter BASE_BUCKET_US (16 Bit). Ausschnitte (COLUMN_DTYPE) rechnen in µs.
+BUCKET_DTYPE = np.dtype([('edges', '<u4'), ('min_us', '<u2'), ('max_us', '<u2'),
+                         ('high', '<u2')])
+COLUMN_DTYPE = np.dtype([('edges', '<u4'), ('min_us', '<u2'), ('max_us', '<u2'),
+                         ('high', '<u8')])
+SEEK_DTYPE = np.dtype([('offset', '<u8'), ('time_us', '<u8'), ('last_time0', '<i8'),
+                       ('mask', 'u1'), ('level', 'i1')])
+
+
+def _empty(count, dtype=BUCKET_DTYPE):
+    buckets = np.zeros(count, dtype=dtype)
+    buckets['min_us'] = WIDTH_NONE
+    return buckets
+
+
+def _aggregate(buckets, starts, fanout=1):
+    """Fasst buckets ab den Indizes starts (aufsteigend) jeweils bis zum nächsten Start zusammen;
+    mit fanout > 1 zählt 'high' danach in der Einheit der nächsthöheren Ebene"""
+    out = np.zeros(len(starts), dtype=buckets.dtype)
+    if len(starts) == 0:
+        return out
+    for field, reduce in (('edges', np.add), ('min_us', np.minimum), ('max_us', np.maximum)):
+        out[field] = reduce.reduceat(buckets[field], starts)
+    high = np.add.reduceat(buckets['high'].astype(np.int64), starts)
+    out['high'] = (high + fanout // 2) // fanout
+    return out
+
+
+def _tape_edges(words, layout, time_us):
+    """Flanken von Kanal 0 eines Chunks: (Zeiten, Pegel danach, Zeit am Chunk-Ende)"""
+    times = time_us + np.cumsum((words & layout.delta_max).astype(np.int64))
+    end_us = int(times[-1]) if len(times) else time_us
+    edges = (words & 0x8000) != 0
+    if layout.bits > 0:
+        tape0 = ((words & 0x7FFF) >> layout.delta_bits) == 0
+        times = times[tape0]
+        edges = edges[tape0]
+    return times, edges, end_us
+
+
+def _bucketize(times, edges, last_time, level, first, count, bucket_us, until):
+    """Buckets first..first+count-1 zu bucket_us aus den Flanken times (Pegel danach: edges)
+
+    times liegen ab dem ersten Bucket. last_time und level: vorige Flanke (None: keine) und
+    Pegel seit ihr. Die Zeit mit hohem Pegel zählt ab der vorigen Flanke (ohne sie ab der
+    ersten), frühestens ab dem ersten Bucket und bis until; Flanken hinter dem letzten
+    Bucket werden nicht gezählt.
+    """
+    buckets = _empty(count, COLUMN_DTYPE)
+    widths = np.diff(times, prepend=last_time if last_time is not None else times[:1])
+    widths = np.minimum(widths, WIDTH_NONE - 1).astype(np.uint16)
+    min_widths = widths.copy()
+    max_widths = widths.copy()
+    if last_time is None and len(times):
+        # Vor der ersten Flanke gibt es keinen Puls
+        min_widths[0] = WIDTH_NONE
+        max_widths[0] = 0
+        last_time = int(times[0])
+
+    # Zeit mit hohem Pegel kumulativ ab origin, ausgewertet an den Bucket-Grenzen
+    start = first * bucket_us
+    origin = max(last_time, start) if last_time is not None else until
+    seg_t = np.concatenate(([origin], times))
+    seg_l = np.concatenate(([level], edges.astype(np.int64)))
+    high = np.concatenate(([0], np.cumsum(np.diff(seg_t) * seg_l[:-1])))
+    bounds = np.minimum(start + np.arange(count + 1, dtype=np.int64) * bucket_us, until)
+    k = np.searchsorted(seg_t, bounds, side='right') - 1
+    at_bounds = np.where(k >= 0, high[np.maximum(k, 0)] +
+                         (bounds - seg_t[np.maximum(k, 0)]) * seg_l[np.maximum(k, 0)], 0)
+    buckets['high'] = np.diff(at_bounds)
+
+    rel = times // bucket_us - first
+    inside = (rel >= 0) & (rel < count)
+    rel = rel[inside]
+    if len(rel):
+        starts = np.flatnonzero(np.diff(rel, prepend=-1))
+        used = rel[starts]
+        buckets['edges'][used] = np.add.reduceat(np.ones(len(rel), dtype=np.uint32), starts)
+        buckets['min_us'][used] = np.minimum.reduceat(min_widths[inside], starts)
+        buckets['max_us'][used] = np.maximum.reduceat(max_widths[inside], starts)
+    return buckets
+
+
+class Pyramid:
+    """Übersichts-Pyramide einer Aufnahme (Verzeichnis <filename>.overview)"""
+
+    def __init__(self, filename):
+        self.filename = filename
+        self.path = filename + '.overview'
+        self.state = self._load_state()
+        if self.state is None:
+            self.reset()                        # Älteres Format oder andere Bucket-Größe
+
+    def _new_state(self):
+        return {'version': FORMAT_VERSION, 'base_us': BASE_BUCKET_US, 'fanout': FANOUT,
+                'offset': 0, 'time_us': 0, 'last_time0': None, 'level': None,
+                'mask': 0x01, 'bucket': 0, 'partial': [0, WIDTH_NONE, 0, 0], 'ended': False}
+
+    def _load_state(self):
+        try:
+            with open(os.path.join(self.path, 'state.json')) as f:
+                state = json.load(f)
+        except (OSError, ValueError):
+            return None
+        if (state.get('version') != FORMAT_VERSION or state.get('base_us') != BASE_BUCKET_US or
+                state.get('fanout') != FANOUT):
+            return None
+        return state
+
+    def _level_file(self, level):
+        return os.path.join(self.path, f'level{level:02d}.dat')
+
+    def count(self, level):
+        """Anzahl der abgeschlossenen Buckets einer Ebene"""
+        try:
+            return os.path.getsize(self._level_file(level)) // BUCKET_DTYPE.itemsize
+        except OSError:
+            return 0
+
+    @property
+    def levels(self):
+        level = 0
+        while self.count(level) > 0:
+            level += 1
+        return max(level, 1)
+
+    def read(self, level, first, last):
+        """Abgeschlossene Buckets first..last-1 einer Ebene"""
+        last = min(last, self.count(level))
+        if last <= first:
+            return np.zeros(0, dtype=BUCKET_DTYPE)
+        with open(self._level_file(level), 'rb') as f:
+            f.seek(first * BUCKET_DTYPE.itemsize)
+            return np.fromfile(f, dtype=BUCKET_DTYPE, count=last - first)
+
+    def _append(self, level, buckets):
+        with open(self._level_file(level), 'ab') as f:
+            buckets.tofile(f)
+
+    def _seek_file(self):
+        return os.path.join(self.path, 'seek.dat')
+
+    def _add_seek(self, offset):
+        """Merkt Zeit und Zustand vor dem Chunk ab offset (Einstieg für feine Zooms)"""
+        state = self.state
+        entry = np.zeros(1, dtype=SEEK_DTYPE)
+        entry[0] = (offset, state['time_us'],
+                    -1 if state['last_time0'] is None else state['last_time0'],
+                    state['mask'], -1 if state['level'] is None else state['level'])
+        with open(self._seek_file(), 'ab') as f:
+            entry.tofile(f)
+
+    def _save_state(self):
+        tmp = os.path.join(self.path, 'state.json.tmp')
+        with open(tmp, 'w') as f:
+            json.dump(self.state, f)
+        os.replace(tmp, os.path.join(self.path, 'state.json'))
+
+    def reset(self):
+        if os.path.isdir(self.path):
+            for name in os.listdir(self.path):
+                os.remove(os.path.join(self.path, name))
+        self.state = self._new_state()
+
+    def update(self):
+        """Verarbeitet die seit dem letzten Aufruf angehängten Blöcke; liefert gelesene Bytes"""
+        data = kc87.open_file(self.filename)
+        if len(data) < self.state['offset']:
+            self.reset()                        # Aufnahme wurde neu geschrieben
+        os.makedirs(self.path, exist_ok=True)
+        start = self.state['offset']
+        if start > 0 and bytes(data[start:start + 2]) == b'\x00\x80':
+            self.state['ended'] = True
+        if self.state['ended']:
+            return 0
+
+        layout = kc87.Layout(self.state['mask'])
+        offset = start
+        chunk = None                            # Letzter Chunk: (Offset, Worte), Ende noch offen
+        for item_offset, item in kc87.iter_chunks(data, start=start, offsets=True):
+            offset = item_offset
+            chunk = None
+            if isinstance(item, kc87.Block):
+                if item.type == kc87.BLOCK_TYPE_CHANNELS:
+                    layout = kc87.read_channels(item) or layout
+                    self.state['mask'] = layout.mask
+                tape = kc87.read_tape(item)
+                if tape:
+                    # Gleiche Zeitbasis wie kc87_tape: Flanken dekodierter Blöcke fehlen
+                    self.state['time_us'] += kc87_tape.pico_skip(tape)
+                offset = item.offset + item.size
+                continue
+            self._add_seek(item_offset)
+            self._feed(item, layout)
+            chunk = (item_offset, len(item))
+        if chunk:
+            offset = _chunk_end(data, *chunk)
+        self.state['offset'] = offset
+        self.state['ended'] = bytes(data[offset:offset + 2]) == b'\x00\x80'
+        self._build_levels()
+        self._save_state()
+        return offset - start
+
+    def _feed(self, words, layout):
+        """Ein Chunk Sample-Worte: Buckets von Ebene 0 fortschreiben"""
+        state = self.state
+        times, edges, state['time_us'] = _tape_edges(words, layout, state['time_us'])
+        if len(times) == 0:
+            return
+
+        level = state['level'] if state['level'] is not None else int(not edges[0])
+        first = state['bucket']
+        count = int(times[-1]) // BASE_BUCKET_US - first + 1
+        buckets = _bucketize(times, edges, state['last_time0'], level, first, count,
+                             BASE_BUCKET_US, int(times[-1]))
+
+        # Angefangenen Bucket aus dem vorigen Chunk einrechnen
+        edges0, min0, max0, high0 = state['partial']
+        buckets['edges'][0] += edges0
+        buckets['min_us'][0] = min(int(buckets['min_us'][0]), min0)
+        buckets['max_us'][0] = max(int(buckets['max_us'][0]), max0)
+        buckets['high'][0] += high0
+
+        if count > 1:
+            self._append(0, buckets[:-1].astype(BUCKET_DTYPE))
+        tail = buckets[-1]
+        state['partial'] = [int(tail['edges']), int(tail['min_us']), int(tail['max_us']),
+                            int(tail['high'])]
+        state['bucket'] = int(times[-1]) // BASE_BUCKET_US
+        state['last_time0'] = int(times[-1])
+        state['level'] = int(edges[-1])
+
+    def _build_levels(self):
+        """Hängt an jede höhere Ebene die neu vollständigen Gruppen der Ebene darunter an"""
+        level = 0
+        while self.count(level) >= FANOUT:
+            done = self.count(level + 1)
+            groups = self.count(level) // FANOUT - done
+            if groups > 0:
+                buckets = self.read(level, done * FANOUT, (done + groups) * FANOUT)
+                self._append(level + 1, _aggregate(buckets, np.arange(0, len(buckets), FANOUT), FANOUT))
+            level += 1
+
+    def bucket_us(self, level):
+        return BASE_BUCKET_US * FANOUT ** level
+
+    @property
+    def duration_us(self):
+        return self.state['time_us']
+
+    def buckets(self, level, first, last):
+        """Buckets first..last-1 einer Ebene samt angefangenem Rest (aus den feineren Ebenen)"""
+        done = self.count(level)
+        buckets = self.read(level, first, last)
+        if last <= done:
+            return buckets
+        if level == 0:
+            tail = _empty(0)
+            if self.state['last_time0'] is not None and first <= self.state['bucket'] < last:
+                tail = _empty(self.state['bucket'] - max(first, done) + 1)
+                tail[-1] = tuple(self.state['partial'])
+            return np.concatenate((buckets, tail))
+        finer = self.buckets(level - 1, max(first, done) * FANOUT, last * FANOUT)
+        if len(finer) == 0:
+            return buckets
+        return np.concatenate((buckets, _aggregate(finer, np.arange(0, len(finer), FANOUT), FANOUT)))
+
+    def fine(self, first, last, bucket_us):
+        """Buckets first..last-1 zu bucket_us (feiner als Ebene 0) direkt aus der Aufnahme
+
+        Gelesen wird ab dem letzten Chunk, der vor dem ersten Bucket beginnt, bis zum Ende
+        des letzten (höchstens bis zum Lesestand der Übersicht). 'high' zählt in µs.
+        """
+        start_us = first * bucket_us
+        end_us = last * bucket_us
+        try:
+            seek = np.fromfile(self._seek_file(), dtype=SEEK_DTYPE)
+        except OSError:
+            seek = np.zeros(0, dtype=SEEK_DTYPE)
+        i = int(np.searchsorted(seek['time_us'], start_us, side='right')) - 1
+        if i < 0:
+            return _empty(0, COLUMN_DTYPE)
+        entry = seek[i]
+        layout = kc87.Layout(int(entry['mask']))
+        time_us = int(entry['time_us'])
+        last_time = int(entry['last_time0']) if entry['last_time0'] >= 0 else None
+        level = int(entry['level'])
+        parts = []
+        data = kc87.open_file(self.filename)
+        for offset, item in kc87.iter_chunks(data, start=int(entry['offset']), offsets=True):
+            if offset >= self.state['offset'] or time_us >= end_us:
+                break
+            if isinstance(item, kc87.Block):
+                if item.type == kc87.BLOCK_TYPE_CHANNELS:
+                    layout = kc87.read_channels(item) or layout
+                tape = kc87.read_tape(item)
+                if tape:
+                    time_us += kc87_tape.pico_skip(tape)
+                continue
+            times, edges, time_us = _tape_edges(item, layout, time_us)
+            parts.append((times, edges))
+        times = np.concatenate([t for t, _ in parts] + [np.zeros(0, dtype=np.int64)])
+        edges = np.concatenate([e for _, e in parts] + [np.zeros(0, dtype=bool)])
+
+        # Flanken vor dem ersten Bucket liefern nur die vorige Flanke und den Pegel
+        before = int(np.searchsorted(times, start_us, side='left'))
+        if before > 0:
+            last_time = int(times[before - 1])
+            level = int(edges[before - 1])
+        times = times[before:]
+        edges = edges[before:]
+        if level < 0:
+            level = int(not edges[0]) if len(edges) else 0
+        until = min(time_us, end_us)
+        count = max(min(last, -(-until // bucket_us)) - first, 0)
+        return _bucketize(times, edges, last_time, level, first, count, bucket_us, until)
+
+    def slice(self, start_us, end_us, columns):
+        """Übersicht von start_us bis end_us in columns Spalten
+
+        Liefert (Ebene, Buckets je Spalte als COLUMN_DTYPE-Array, erfasste Dauer je Spalte
+        in µs). Gelesen wird die gröbste Ebene, deren Buckets nicht länger als eine Spalte
+        sind; Spalten unter BASE_BUCKET_US werden aus der Aufnahme berechnet (Ebene -1).
+        """
+        column_us = max((end_us - start_us) / columns, 1)
+        if column_us < BASE_BUCKET_US:
+            level = -1
+            size = int(column_us)
+            first = start_us // size
+            buckets = self.fine(first, -(-end_us // size), size)
+        else:
+            level = 0
+            while self.bucket_us(level + 1) <= column_us and self.count(level + 1) > 0:
+                level += 1
+            size = self.bucket_us(level)
+            first = start_us // size
+            stored = self.buckets(level, first, -(-end_us // size))
+            buckets = np.zeros(len(stored), dtype=COLUMN_DTYPE)
+            for field in BUCKET_DTYPE.names:
+                buckets[field] = stored[field]
+            buckets['high'] *= FANOUT ** level
+        times = (first + np.arange(len(buckets), dtype=np.int64)) * size
+        col = np.clip(((times - start_us) / column_us).astype(np.int64), 0, columns - 1)
+        out = _empty(columns, COLUMN_DTYPE)
+        covered = np.zeros(columns, dtype=np.int64)
+        if len(buckets):
+            starts = np.flatnonzero(np.diff(col, prepend=-1))
+            out[col[starts]] = _aggregate(buckets, starts)
+            covered[col[starts]] = np.diff(np.append(starts, len(col))) * size
+        return level, out, covered
+
+
+def _chunk_end(data, offset, words):
+    """Byte-Offset hinter dem letzten Sample-Block eines Chunks (ab offset, words Worte)"""
+    for block in kc87.iter_blocks(data, start=offset):
+        words -= block.length
+        if words <= 0:
+            return block.offset + block.size
+    return len(data)
+
+
+def _write_png(filename, rgb):
+    """RGB-Bild (H x B x 3, uint8) als PNG ohne weitere Abhängigkeiten"""
+    def chunk(kind, payload):
+        return (struct.pack('>I', len(payload)) + kind + payload +
+                struct.pack('>I', zlib.crc32(kind + payload) & 0xFFFFFFFF))
+
+    height, width, _ = rgb.shape
+    rows = np.concatenate((np.zeros((height, 1), dtype=np.uint8),
+                           rgb.reshape(height, width * 3)), axis=1)
+    with open(filename, 'wb') as f:
+        f.write(b'\x89PNG\r\n\x1a\n')
+        f.write(chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 2, 0, 0, 0)))
+        f.write(chunk(b'IDAT', zlib.compress(rows.tobytes(), 6)))
+        f.write(chunk(b'IEND', b''))
+
+
+def render_png(pyramid, filename, start_us, end_us, width=1600, height=300):
+    """Bild: oben Pulsbreiten (Min bis Max, Hilfslinien bei den KC87-Nennwerten),
+    darunter Flankenrate und Tastverhältnis"""
+    level, buckets, covered = pyramid.slice(start_us, end_us, width)
+    pulse_h = height * 3 // 5
+    rate_h = (height - pulse_h) // 2
+    duty_h = height - pulse_h - rate_h
+    image = np.full((height, width, 3), 24, dtype=np.uint8)
+    rows = np.arange(height)[:, None]
+    active = buckets['edges'] > 0
+
+    def band_y(values, top, h, scale):
+        return top + h - 1 - np.clip(values * (h - 1) / scale, 0, h - 1).astype(np.int64)
+
+    for half in KC87_HALF_US:
+        image[band_y(np.array(half), 0, pulse_h, WIDTH_SCALE_US), :] = (60, 60, 90)
+    y_min = band_y(buckets['min_us'].astype(np.float64), 0, pulse_h, WIDTH_SCALE_US)
+    y_max = band_y(buckets['max_us'].astype(np.float64), 0, pulse_h, WIDTH_SCALE_US)
+    image[(rows >= y_max) & (rows <= y_min) & active] = (120, 220, 120)
+
+    rate = np.divide(buckets['edges'], covered, out=np.zeros(width), where=covered > 0)
+    y_rate = band_y(rate, pulse_h, rate_h, max(rate.max(), 1e-9))
+    image[(rows >= y_rate) & (rows < pulse_h + rate_h) & active] = (220, 180, 80)
+
+    duty = np.divide(buckets['high'], covered, out=np.zeros(width), where=covered > 0)
+    y_duty = band_y(duty, pulse_h + rate_h, duty_h, 1.0)
+    image[(rows >= y_duty) & (rows >= pulse_h + rate_h) & (covered > 0)] = (90, 160, 230)
+    image[[pulse_h, pulse_h + rate_h], :] = (70, 70, 70)
+    _write_png(filename, image)
+    return level
+
+
+def slice_json(pyramid, start_us, end_us, columns):
+    level, buckets, covered = pyramid.slice(start_us, end_us, columns)
+    column_us = (end_us - start_us) / columns
+    result = []
+    for i, (b, span) in enumerate(zip(buckets, covered)):
+        edges = int(b['edges'])
+        result.append({'start_us': int(start_us + i * column_us), 'edges': edges,
+                       'min_us': int(b['min_us']) if edges else None,
+                       'max_us': int(b['max_us']) if edges else None,
+                       'duty': round(int(b['high']) / int(span), 4) if span else None})
+    return {'source': pyramid.filename, 'start_us': int(start_us), 'end_us': int(end_us),
+            'level': level, 'bucket_us': pyramid.bucket_us(level) if level >= 0 else int(column_us),
+            'column_us': column_us, 'columns': result}
+
+
+def _source(level):
+    return f"Ebene {level}" if level >= 0 else "aus der Aufnahme"
+
+
+def take_option(args, name, default=None, convert=str):
+    if name not in args:
+        return default
+    i = args.index(name)
+    value = convert(args[i + 1])
+    del args[i:i + 2]
+    return value
+
+
+def main():
+    args = sys.argv[1:]
+    png = take_option(args, '--png')
+    json_file = take_option(args, '--json')
+    start_s = take_option(args, '--from', 0.0, float)
+    end_s = take_option(args, '--to', None, float)
+    width = take_option(args, '--width', 1600, int)
+    height = take_option(args, '--height', 300, int)
+    follow = '--follow' in args
+    if follow:
+        args.remove('--follow')
+    if len(args) != 1:
+        print("Usage: python3 overview_bin.py <aufnahme.bin> [--follow] "
+              "[--png bild.png] [--json ausschnitt.json|-] [--from s] [--to s] "
+              "[--width n] [--height n]")
+        sys.exit(1)
+
+    pyramid = Pyramid(args[0])
+    t0 = time.time()
+    read = pyramid.update()
+    while follow and not pyramid.state['ended']:
+        # Während serial_capture schreibt: nur die angehängten Blöcke nachtragen
+        time.sleep(FOLLOW_INTERVAL_S)
+        new = pyramid.update()
+        read += new
+        if new:
+            print(f"\r{pyramid.duration_us / 1e6:10.1f} s aufgenommen", end='', flush=True)
+    if follow:
+        print()
+
+    start_us = int(start_s * 1e6)
+    end_us = int(end_s * 1e6) if end_s is not None else pyramid.duration_us
+    if png is None and json_file is None:
+        print(f"Übersicht:  {pyramid.path}")
+        print(f"Gelesen:    {read} Bytes in {time.time() - t0:.2f} s"
+              f"{' (Aufnahme abgeschlossen)' if pyramid.state['ended'] else ''}")
+        print(f"Dauer:      {pyramid.duration_us / 1e6:.3f} s")
+        for level in range(pyramid.levels):
+            size = pyramid.bucket_us(level)
+            size = f"{size / 1000:g} ms" if size < 1000000 else f"{size / 1e6:g} s"
+            print(f"Ebene {level:2d}:   {pyramid.count(level):9d} Buckets zu {size}")
+        return
+    if end_us <= start_us:
+        print("Fehler: leerer Zeitbereich")
+        sys.exit(1)
+    if png:
+        level = render_png(pyramid, png, start_us, end_us, width, height)
+        print(f"Bild: {png} ({width}x{height}, {_source(level)})")
+    if json_file:
+        result = slice_json(pyramid, start_us, end_us, width)
+        if json_file == '-':
+            json.dump(result, sys.stdout, indent=1)
+            print()
+        else:
+            with open(json_file, 'w') as f:
+                json.dump(result, f, indent=1)
+            print(f"JSON: {json_file} ({width} Spalten, {_source(result['level'])})")
+
+if __name__ == "__main__":
+    main()
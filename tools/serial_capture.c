@@ -15,44 +15,57 @@
 #include <unistd.h>
 #endif
 
-// Block Protocol Constants
-#define BLOCK_START      0x0000
-#define BLOCK_END        0x8000
-#define BLOCK_TYPE_HEADER 0x00
-#define BLOCK_TYPE_SAMPLES 0x01
-#define PROTOCOL_VERSION  0x01
+#include "kc87.h"
+
+#define EDGE_MASK_FALL   0x01
+#define EDGE_MASK_RISE   0x02
 
 // WAV file constants
 #define WAV_SAMPLE_RATE 44100
-#define WAV_CHANNELS 1
-#define WAV_BITS_PER_SAMPLE 16
 
+// Sync block tracking: compares the firmware's absolute time and sample index with
+// the received samples to detect lost samples and timing errors (e.g. clamped deltas)
 typedef struct {
-    char riff[4];           // "RIFF"
-    uint32_t chunk_size;    // File size - 8
-    char wave[4];           // "WAVE"
-    char fmt[4];            // "fmt "
-    uint32_t fmt_size;      // 16 for PCM
-    uint16_t audio_format;  // 1 for PCM
-    uint16_t num_channels;  // 1 for mono
-    uint32_t sample_rate;   // 44100
-    uint32_t byte_rate;     // sample_rate * channels * bits_per_sample / 8
-    uint16_t block_align;   // channels * bits_per_sample / 8
-    uint16_t bits_per_sample; // 16
-    char data[4];           // "data"
-    uint32_t data_size;     // Number of bytes in data
-} wav_header_t;
+    bool armed;                 // Sync block received, next sample is the sync sample
+    bool have_reference;        // A previous sync sample exists
+    uint32_t index;             // Sample index announced by the last sync block
+    uint64_t time_us;           // Absolute time announced by the last sync block
+    uint64_t ref_time_us;       // Absolute time of the previous sync sample
+    uint64_t delta_sum;         // Sum of deltas since the previous sync sample
+    uint64_t blocks;
+    uint64_t lost_samples;
+    int64_t max_error_us;
+    uint64_t first_time_us;     // For clock drift estimation against the host clock
+    double first_host_s;
+    uint64_t last_time_us;
+    double last_host_s;
+} sync_state_t;
 
 static void usage(const char *prog)
 {
     fprintf(stderr,
-            "Usage: %s -p <port> -o <out_file> [-b baud] [-w wav_file]\n"
-            "  -p <port>     Serial port (e.g., /dev/ttyACM0, COM3)\n"
-            "  -o <out_file> Binary output file\n"
-            "  -b <baud>     Baud rate (default: 115200)\n"
-            "  -w <wav_file> Optional WAV output file\n"
+            "Usage: %s -p <port> -o <out_file> [-b baud] [-w wav_file] [-t timeout_ms] [-e edges] [-g glitch_us] [-d] [-y sync_ms] [-c channels] [-r edges] [-P samples] [-B samples] [-n norm_file] [-H] [-T trace_file]\n"
+            "  -p <port>       Serial port (e.g., /dev/ttyACM0, COM3)\n"
+            "  -o <out_file>   Binary output file\n"
+            "  -b <baud>       Baud rate (default: 115200)\n"
+            "  -w <wav_file>   Optional WAV output file\n"
+            "  -t <timeout_ms> Set firmware inactivity timeout (10-60000 ms, default: 5000)\n"
+            "  -e <edges>      Set captured edges: rise, fall or both (default: both)\n"
+            "  -g <glitch_us>  Suppress pulses shorter than glitch_us (0-1000 us, 0 = off)\n"
+            "  -d              Enable on-device KC87 tape decoding (decoded blocks + raw fallback)\n"
+            "  -y <sync_ms>    Set sync block interval (0-60000 ms, 0 = sample based only, default: 1000)\n"
+            "  -c <channels>   Set captured channel mask (0x01-0x0F, bit 0 = tape, default: 0x01)\n"
+            "  -r <edges>      Start a session after this many tape edges in a row (1-1000, default: 16)\n"
+            "  -P <samples>    Pre-trigger history a session starts with (1-512 samples, default: 256)\n"
+            "  -B <samples>    Largest sample block (1-1024, default: 255); above 255 the firmware\n"
+            "                  uses protocol version 2 (long sample blocks)\n"
+            "  -n <norm_file>  Also write a capture normalised to nominal KC87 timing (speed, wow/flutter)\n"
+            "  -H              Clear the firmware hot-path histograms now and print them on the Pico's\n"
+            "                  USB debug output at stream end (firmware built with INSTRUMENTATION)\n"
+            "  -T <trace_file> Write capture telemetry (reads, blocks, resyncs, file writes) as CSV,\n"
+            "                  or as Chrome trace events if the name ends in .json\n"
             "\n"
-            "Example: %s -p /dev/ttyACM0 -o capture.bin -b 115200 -w audio.wav\n",
+            "Example: %s -p /dev/ttyACM0 -o capture.bin -b 115200 -w audio.wav -t 500\n",
             prog, prog);
 }
 
@@ -89,7 +102,7 @@ static int open_serial(serial_handle_t *sh, const char *port, int baud)
         snprintf(path, sizeof(path), "\\\\.\\%s", port);
     }
 
-    sh->handle = CreateFileA(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+    sh->handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
     if (sh->handle == INVALID_HANDLE_VALUE) {
         return -1;
     }
@@ -135,10 +148,10 @@ static int open_serial(serial_handle_t *sh, const char *port, int baud)
     return 0;
 }
 
-static int read_serial(serial_handle_t *sh, uint8_t *b)
+static int read_serial(serial_handle_t *sh, uint8_t *buf, size_t len)
 {
     DWORD read = 0;
-    if (!ReadFile(sh->handle, b, 1, &read, NULL)) {
+    if (!ReadFile(sh->handle, buf, (DWORD)len, &read, NULL)) {
         DWORD error = GetLastError();
         if (error == ERROR_IO_PENDING) {
             // This shouldn't happen with synchronous I/O, but handle it
@@ -151,6 +164,15 @@ static int read_serial(serial_handle_t *sh, uint8_t *b)
     return (int)read;
 }
 
+static int write_serial(serial_handle_t *sh, const uint8_t *data, size_t len)
+{
+    DWORD written = 0;
+    if (!WriteFile(sh->handle, data, (DWORD)len, &written, NULL)) {
+        return -1;
+    }
+    return (int)written;
+}
+
 static void close_serial(serial_handle_t *sh)
 {
     if (sh->handle != INVALID_HANDLE_VALUE) {
@@ -184,7 +206,7 @@ static speed_t baud_to_speed(int baud)
 
 static int open_serial(serial_handle_t *sh, const char *port, int baud)
 {
-    sh->fd = open(port, O_RDONLY | O_NOCTTY);
+    sh->fd = open(port, O_RDWR | O_NOCTTY);
     if (sh->fd < 0) {
         return -1;
     }
@@ -214,9 +236,18 @@ static int open_serial(serial_handle_t *sh, const char *port, int baud)
     return 0;
 }
 
-static int read_serial(serial_handle_t *sh, uint8_t *b)
+static int read_serial(serial_handle_t *sh, uint8_t *buf, size_t len)
 {
-    ssize_t n = read(sh->fd, b, 1);
+    ssize_t n = read(sh->fd, buf, len);
+    if (n < 0) {
+        return -1;
+    }
+    return (int)n;
+}
+
+static int write_serial(serial_handle_t *sh, const uint8_t *data, size_t len)
+{
+    ssize_t n = write(sh->fd, data, len);
     if (n < 0) {
         return -1;
     }
@@ -231,52 +262,344 @@ static void close_serial(serial_handle_t *sh)
 }
 #endif
 
-static void write_wav_header(FILE *wav_file, uint32_t data_size)
+static int set_param(serial_handle_t *sh, uint8_t param, uint32_t value)
 {
-    wav_header_t header;
-    memcpy(header.riff, "RIFF", 4);
-    header.chunk_size = 36 + data_size;
-    memcpy(header.wave, "WAVE", 4);
-    memcpy(header.fmt, "fmt ", 4);
-    header.fmt_size = 16;
-    header.audio_format = 1;
-    header.num_channels = WAV_CHANNELS;
-    header.sample_rate = WAV_SAMPLE_RATE;
-    header.byte_rate = WAV_SAMPLE_RATE * WAV_CHANNELS * WAV_BITS_PER_SAMPLE / 8;
-    header.block_align = WAV_CHANNELS * WAV_BITS_PER_SAMPLE / 8;
-    header.bits_per_sample = WAV_BITS_PER_SAMPLE;
-    memcpy(header.data, "data", 4);
-    header.data_size = data_size;
-    
-    fseek(wav_file, 0, SEEK_SET);
-    fwrite(&header, sizeof(header), 1, wav_file);
+    uint8_t frame[14];
+    size_t len = kc87_encode_set_param(frame, param, value);
+    return write_serial(sh, frame, len) == (int)len ? 0 : -1;
 }
 
-static void update_wav_file(FILE *wav_file, uint16_t delta_us, bool edge, 
-                           int16_t *wav_buffer, size_t *wav_buffer_pos, 
-                           size_t wav_buffer_size, bool *current_state)
+static int histograms(serial_handle_t *sh, uint8_t action)
 {
-    if (!wav_file) return;
-    
-    // Calculate number of samples for this time delta
-    double delta_seconds = delta_us / 1000000.0;
-    size_t samples = (size_t)(delta_seconds * WAV_SAMPLE_RATE);
-    
-    // Fill buffer with current state
-    int16_t sample_value = *current_state ? 16383 : -16383;  // ~50% of max int16
-    
-    for (size_t i = 0; i < samples && *wav_buffer_pos < wav_buffer_size; i++) {
-        wav_buffer[(*wav_buffer_pos)++] = sample_value;
-        
-        // Flush buffer when full
-        if (*wav_buffer_pos >= wav_buffer_size) {
-            fwrite(wav_buffer, sizeof(int16_t), wav_buffer_size, wav_file);
-            *wav_buffer_pos = 0;
+    uint8_t frame[8];
+    size_t len = kc87_encode_histograms(frame, action);
+    return write_serial(sh, frame, len) == (int)len ? 0 : -1;
+}
+
+static void sync_on_block(sync_state_t *sync, const kc87_sync_t *block, uint64_t received_samples)
+{
+    sync->index = block->sample_index;
+    sync->time_us = block->time_us;
+    sync->armed = true;
+
+    if (sync->blocks == 0) {
+        sync->first_time_us = sync->time_us;
+        sync->first_host_s = now_seconds();
+    }
+    sync->last_time_us = sync->time_us;
+    sync->last_host_s = now_seconds();
+    sync->blocks++;
+
+    // Samples announced by the firmware but never received
+    if (sync->index > received_samples + sync->lost_samples) {
+        uint64_t lost = sync->index - (received_samples + sync->lost_samples);
+        sync->lost_samples += lost;
+        fprintf(stderr, "Sync: %llu samples lost before sample %lu\n",
+                (unsigned long long)lost, (unsigned long)sync->index);
+    }
+}
+
+static void sync_on_sample(sync_state_t *sync, uint16_t delta_us)
+{
+    sync->delta_sum += delta_us;
+    if (!sync->armed) {
+        return;
+    }
+    sync->armed = false;
+
+    if (sync->have_reference) {
+        int64_t error_us = (int64_t)(sync->time_us - sync->ref_time_us) - (int64_t)sync->delta_sum;
+        if (error_us != 0) {
+            fprintf(stderr, "Sync: timing error %+lld us at sample %lu\n",
+                    (long long)error_us, (unsigned long)sync->index);
+        }
+        if (llabs(error_us) > llabs(sync->max_error_us)) {
+            sync->max_error_us = error_us;
         }
     }
-    
-    // Update state based on edge type
-    *current_state = edge;
+    sync->ref_time_us = sync->time_us;
+    sync->have_reference = true;
+    sync->delta_sum = 0;
+}
+
+static void sync_report(const sync_state_t *sync)
+{
+    if (sync->blocks == 0) {
+        return;
+    }
+    fprintf(stderr, "Sync: %llu sync blocks, %llu samples lost, max timing error %+lld us\n",
+            (unsigned long long)sync->blocks, (unsigned long long)sync->lost_samples,
+            (long long)sync->max_error_us);
+
+    // Pico clock vs host clock (includes USB latency jitter, meaningful for long captures)
+    double host_s = sync->last_host_s - sync->first_host_s;
+    if (host_s >= 10.0) {
+        double pico_s = (sync->last_time_us - sync->first_time_us) / 1e6;
+        fprintf(stderr, "Sync: Pico clock drift vs host %+.1f ppm over %.0f s\n",
+                (pico_s / host_s - 1.0) * 1e6, host_s);
+    }
+}
+
+// Capture telemetry: host timing of serial reads, block arrivals, parser resyncs and
+// output file writes. Every event can be exported to a trace file, the console only
+// gets a compact summary once per second. Together they show whether lost data comes
+// from the USB link (gaps between blocks), the kernel buffer (reads filling the whole
+// buffer, i.e. the host falls behind) or storage (slow writes and flushes).
+typedef enum {
+    TRACE_NONE,
+    TRACE_CSV,                  // One row per event
+    TRACE_JSON                  // Chrome trace events (chrome://tracing, Perfetto), JSON array format
+} trace_format_t;
+
+// Trace threads (JSON "tid")
+#define TRACE_TID_READ    1
+#define TRACE_TID_PARSER  2
+#define TRACE_TID_WRITE   3
+
+typedef struct {
+    FILE *trace;
+    trace_format_t format;
+    double start_s;             // Time origin of all trace timestamps
+    bool first_event;
+
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t full_reads;        // Reads that filled the whole buffer (more data was waiting)
+    uint64_t blocks;
+    uint64_t resyncs;
+    uint64_t resync_bytes;
+    double last_block_s;        // Arrival of the previous block (0 = none yet)
+    double max_gap_s;
+    double max_write_s;
+
+    // Current summary interval
+    double interval_start_s;
+    uint64_t interval_reads;
+    uint64_t interval_bytes;
+    uint64_t interval_full;
+    uint64_t interval_blocks;
+    uint64_t interval_resyncs;
+    uint64_t interval_samples;  // Sample count at the start of the interval
+    double interval_gap_s;
+    double interval_write_s;
+} telemetry_t;
+
+static const char *block_name(uint8_t type)
+{
+    switch (type) {
+        case KC87_BLOCK_TYPE_HEADER: return "header";
+        case KC87_BLOCK_TYPE_SAMPLES: return "samples";
+        case KC87_BLOCK_TYPE_STATS: return "stats";
+        case KC87_BLOCK_TYPE_TAPE: return "tape";
+        case KC87_BLOCK_TYPE_SYNC: return "sync";
+        case KC87_BLOCK_TYPE_CHANNELS: return "channels";
+        default: return "extended";
+    }
+}
+
+static double trace_us(const telemetry_t *tel, double t)
+{
+    return (t - tel->start_s) * 1e6;
+}
+
+static int telemetry_open(telemetry_t *tel, const char *trace_path)
+{
+    memset(tel, 0, sizeof(*tel));
+    tel->start_s = now_seconds();
+    tel->interval_start_s = tel->start_s;
+    tel->first_event = true;
+    if (!trace_path) {
+        return 0;
+    }
+
+    size_t len = strlen(trace_path);
+    tel->format = (len >= 5 && strcmp(trace_path + len - 5, ".json") == 0) ? TRACE_JSON : TRACE_CSV;
+    tel->trace = fopen(trace_path, "w");
+    if (!tel->trace) {
+        return -1;
+    }
+    setvbuf(tel->trace, NULL, _IOFBF, 1 << 16);
+
+    if (tel->format == TRACE_CSV) {
+        fprintf(tel->trace, "time_us,event,bytes,duration_us,gap_us,offset,samples\n");
+    } else {
+        // The closing bracket is optional in the array format, a trace of an aborted capture stays readable
+        static const char *const threads[] = { NULL, "serial read", "parser", "file write" };
+        fprintf(tel->trace, "[\n");
+        for (int tid = TRACE_TID_READ; tid <= TRACE_TID_WRITE; tid++) {
+            fprintf(tel->trace, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}", tel->first_event ? "" : ",\n", tid, threads[tid]);
+            tel->first_event = false;
+        }
+    }
+    return 0;
+}
+
+// JSON: separator and the fields shared by all events
+static void trace_json_begin(telemetry_t *tel, const char *name, const char *ph, double t, int tid)
+{
+    fprintf(tel->trace, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.1f,\"pid\":1,\"tid\":%d",
+            tel->first_event ? "" : ",\n", name, ph, trace_us(tel, t), tid);
+    tel->first_event = false;
+}
+
+static void telemetry_read(telemetry_t *tel, double start, double end, int n, bool full)
+{
+    tel->reads++;
+    tel->read_bytes += (uint64_t)n;
+    tel->interval_reads++;
+    tel->interval_bytes += (uint64_t)n;
+    if (full) {
+        tel->full_reads++;
+        tel->interval_full++;
+    }
+
+    if (tel->format == TRACE_CSV) {
+        fprintf(tel->trace, "%.1f,read,%d,%.1f,,,\n", trace_us(tel, start), n, (end - start) * 1e6);
+    } else if (tel->format == TRACE_JSON) {
+        trace_json_begin(tel, "read", "X", start, TRACE_TID_READ);
+        fprintf(tel->trace, ",\"dur\":%.1f,\"args\":{\"bytes\":%d}}", (end - start) * 1e6, n);
+    }
+}
+
+// Block arrival: time is the end of the read that completed the block
+static void telemetry_block(telemetry_t *tel, double t, const kc87_block_t *block)
+{
+    double gap = tel->last_block_s > 0 ? t - tel->last_block_s : 0.0;
+    tel->last_block_s = t;
+    tel->blocks++;
+    tel->interval_blocks++;
+    if (gap > tel->max_gap_s) {
+        tel->max_gap_s = gap;
+    }
+    if (gap > tel->interval_gap_s) {
+        tel->interval_gap_s = gap;
+    }
+
+    unsigned samples = block->type == KC87_BLOCK_TYPE_SAMPLES ? block->len : 0;
+    if (tel->format == TRACE_CSV) {
+        fprintf(tel->trace, "%.1f,%s,%u,,%.1f,%llu,%u\n", trace_us(tel, t), block_name(block->type),
+                block->size, gap * 1e6, (unsigned long long)block->offset, samples);
+    } else if (tel->format == TRACE_JSON) {
+        trace_json_begin(tel, block_name(block->type), "i", t, TRACE_TID_PARSER);
+        fprintf(tel->trace, ",\"s\":\"t\",\"args\":{\"bytes\":%u,\"samples\":%u,\"gap_us\":%.1f,\"offset\":%llu}}",
+                block->size, samples, gap * 1e6, (unsigned long long)block->offset);
+    }
+}
+
+// Bytes the parser discarded to resynchronize; offset < 0 when no block follows (stream end)
+static void telemetry_resync(telemetry_t *tel, double t, uint64_t bytes, int64_t offset)
+{
+    tel->resyncs++;
+    tel->resync_bytes += bytes;
+    tel->interval_resyncs++;
+
+    if (tel->format == TRACE_CSV) {
+        fprintf(tel->trace, "%.1f,resync,%llu,,,", trace_us(tel, t), (unsigned long long)bytes);
+        if (offset >= 0) {
+            fprintf(tel->trace, "%lld", (long long)offset);
+        }
+        fprintf(tel->trace, ",\n");
+    } else if (tel->format == TRACE_JSON) {
+        trace_json_begin(tel, "resync", "i", t, TRACE_TID_PARSER);
+        fprintf(tel->trace, ",\"s\":\"g\",\"args\":{\"bytes\":%llu,\"offset\":%lld}}",
+                (unsigned long long)bytes, (long long)offset);
+    }
+}
+
+// Output file write or flush ("write" / "flush")
+static void telemetry_write(telemetry_t *tel, const char *name, double start, double end, size_t bytes)
+{
+    double duration = end - start;
+    if (duration > tel->max_write_s) {
+        tel->max_write_s = duration;
+    }
+    if (duration > tel->interval_write_s) {
+        tel->interval_write_s = duration;
+    }
+
+    if (tel->format == TRACE_CSV) {
+        fprintf(tel->trace, "%.1f,%s,%llu,%.1f,,,\n", trace_us(tel, start), name, (unsigned long long)bytes,
+                duration * 1e6);
+    } else if (tel->format == TRACE_JSON) {
+        trace_json_begin(tel, name, "X", start, TRACE_TID_WRITE);
+        fprintf(tel->trace, ",\"dur\":%.1f,\"args\":{\"bytes\":%llu}}", duration * 1e6, (unsigned long long)bytes);
+    }
+}
+
+static size_t write_out(telemetry_t *tel, FILE *out, const uint8_t *data, size_t size)
+{
+    double start = now_seconds();
+    size_t written = fwrite(data, 1, size, out);
+    telemetry_write(tel, "write", start, now_seconds(), size);
+    return written;
+}
+
+static void telemetry_interval(telemetry_t *tel, double now, uint64_t samples)
+{
+    tel->interval_start_s = now;
+    tel->interval_reads = 0;
+    tel->interval_bytes = 0;
+    tel->interval_full = 0;
+    tel->interval_blocks = 0;
+    tel->interval_resyncs = 0;
+    tel->interval_samples = samples;
+    tel->interval_gap_s = 0.0;
+    tel->interval_write_s = 0.0;
+}
+
+static bool telemetry_due(const telemetry_t *tel, double now)
+{
+    return now - tel->interval_start_s >= 1.0;
+}
+
+// Once per second: one console line for the past interval, then a new interval
+static void telemetry_summary(telemetry_t *tel, double now, uint64_t samples, const kc87_speed_t *speed)
+{
+    double elapsed = now - tel->interval_start_s;
+    double rate = (samples - tel->interval_samples) / elapsed;
+
+    fprintf(stderr, "%5.0f s: %llu samples (%.0f/s), %llu blocks, %.1f KB/s in %llu reads",
+            now - tel->start_s, (unsigned long long)samples, rate, (unsigned long long)tel->interval_blocks,
+            tel->interval_bytes / elapsed / 1024.0, (unsigned long long)tel->interval_reads);
+    if (tel->interval_full > 0) {
+        fprintf(stderr, " (%llu full)", (unsigned long long)tel->interval_full);
+    }
+    fprintf(stderr, ", max gap %.0f ms, max write %.1f ms", tel->interval_gap_s * 1e3, tel->interval_write_s * 1e3);
+    if (tel->interval_resyncs > 0) {
+        fprintf(stderr, ", %llu resyncs", (unsigned long long)tel->interval_resyncs);
+    }
+    if (speed->periods > 0) {
+        fprintf(stderr, ", tape speed %.2f%%", speed->mid * 100.0);
+    }
+    fprintf(stderr, "\n");
+
+    if (tel->format == TRACE_CSV) {
+        fprintf(tel->trace, "%.1f,rate,%.0f,,,,%.0f\n", trace_us(tel, now), tel->interval_bytes / elapsed, rate);
+    } else if (tel->format == TRACE_JSON) {
+        trace_json_begin(tel, "rate", "C", now, TRACE_TID_PARSER);
+        fprintf(tel->trace, ",\"args\":{\"samples/s\":%.0f,\"bytes/s\":%.0f}}", rate, tel->interval_bytes / elapsed);
+    }
+
+    telemetry_interval(tel, now, samples);
+}
+
+static int telemetry_close(telemetry_t *tel)
+{
+    if (tel->reads > 0) {
+        fprintf(stderr, "Telemetry: %llu reads (avg %.1f bytes, %llu full), %llu blocks, max gap %.1f ms, "
+                "max write %.2f ms, %llu resyncs (%llu bytes)\n",
+                (unsigned long long)tel->reads, (double)tel->read_bytes / tel->reads,
+                (unsigned long long)tel->full_reads, (unsigned long long)tel->blocks, tel->max_gap_s * 1e3,
+                tel->max_write_s * 1e3, (unsigned long long)tel->resyncs, (unsigned long long)tel->resync_bytes);
+    }
+    if (!tel->trace) {
+        return 0;
+    }
+    if (tel->format == TRACE_JSON) {
+        fprintf(tel->trace, "\n]\n");
+    }
+    return fclose(tel->trace);
 }
 
 int main(int argc, char **argv)
@@ -284,7 +607,19 @@ int main(int argc, char **argv)
     const char *port = NULL;
     const char *out_path = NULL;
     const char *wav_path = NULL;
+    const char *norm_path = NULL;
+    const char *trace_path = NULL;
     int baud = 115200;
+    long timeout_ms = -1;
+    int edge_mask = -1;
+    long glitch_us = -1;
+    bool decode_mode = false;
+    long sync_ms = -1;
+    long channel_mask = -1;
+    long trigger_edges = -1;
+    long pretrigger = -1;
+    long block_samples = -1;
+    bool histogram_dump = false;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
@@ -295,6 +630,68 @@ int main(int argc, char **argv)
             baud = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
             wav_path = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            norm_path = argv[++i];
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timeout_ms = atol(argv[++i]);
+            if (timeout_ms < 10 || timeout_ms > 60000) {
+                fprintf(stderr, "Invalid timeout: %s (10-60000 ms)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            glitch_us = atol(argv[++i]);
+            if (glitch_us < 0 || glitch_us > 1000) {
+                fprintf(stderr, "Invalid glitch filter width: %s (0-1000 us)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-y") == 0 && i + 1 < argc) {
+            sync_ms = atol(argv[++i]);
+            if (sync_ms < 0 || sync_ms > 60000) {
+                fprintf(stderr, "Invalid sync interval: %s (0-60000 ms)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            channel_mask = strtol(argv[++i], NULL, 0);
+            if ((channel_mask & 0x01) == 0 || channel_mask > 0x0F) {
+                fprintf(stderr, "Invalid channel mask: %s (0x01-0x0F, bit 0 required)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            trigger_edges = atol(argv[++i]);
+            if (trigger_edges < 1 || trigger_edges > 1000) {
+                fprintf(stderr, "Invalid trigger edge count: %s (1-1000)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            pretrigger = atol(argv[++i]);
+            if (pretrigger < 1 || pretrigger > 512) {
+                fprintf(stderr, "Invalid pre-trigger history: %s (1-512 samples)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            block_samples = atol(argv[++i]);
+            if (block_samples < 1 || block_samples > 1024) {
+                fprintf(stderr, "Invalid block size: %s (1-1024 samples)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-d") == 0) {
+            decode_mode = true;
+        } else if (strcmp(argv[i], "-H") == 0) {
+            histogram_dump = true;
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            const char *edges = argv[++i];
+            if (strcmp(edges, "rise") == 0) {
+                edge_mask = EDGE_MASK_RISE;
+            } else if (strcmp(edges, "fall") == 0) {
+                edge_mask = EDGE_MASK_FALL;
+            } else if (strcmp(edges, "both") == 0) {
+                edge_mask = EDGE_MASK_RISE | EDGE_MASK_FALL;
+            } else {
+                fprintf(stderr, "Invalid edge selection: %s (rise, fall or both)\n", edges);
+                return 1;
+            }
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             usage(argv[0]);
             return 0;
@@ -323,6 +720,88 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    // Configure firmware recording parameters before the session starts
+    if (timeout_ms >= 0) {
+        if (set_param(&sh, KC87_PARAM_TIMEOUT_MS, (uint32_t)timeout_ms) != 0) {
+            perror("send timeout command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware timeout set to %ld ms\n", timeout_ms);
+    }
+    if (edge_mask >= 0) {
+        if (set_param(&sh, KC87_PARAM_EDGE_MASK, (uint32_t)edge_mask) != 0) {
+            perror("send edge mask command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware edge mask set to 0x%02x\n", edge_mask);
+    }
+    if (glitch_us >= 0) {
+        if (set_param(&sh, KC87_PARAM_GLITCH_US, (uint32_t)glitch_us) != 0) {
+            perror("send glitch filter command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware glitch filter set to %ld us\n", glitch_us);
+    }
+    if (sync_ms >= 0) {
+        if (set_param(&sh, KC87_PARAM_SYNC_MS, (uint32_t)sync_ms) != 0) {
+            perror("send sync interval command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware sync interval set to %ld ms\n", sync_ms);
+    }
+    if (channel_mask >= 0) {
+        if (set_param(&sh, KC87_PARAM_CHANNEL_MASK, (uint32_t)channel_mask) != 0) {
+            perror("send channel mask command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware channel mask set to 0x%02lx\n", channel_mask);
+    }
+    if (trigger_edges >= 0) {
+        if (set_param(&sh, KC87_PARAM_TRIGGER_EDGES, (uint32_t)trigger_edges) != 0) {
+            perror("send trigger command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware session trigger set to %ld edges\n", trigger_edges);
+    }
+    if (pretrigger >= 0) {
+        if (set_param(&sh, KC87_PARAM_PRETRIGGER, (uint32_t)pretrigger) != 0) {
+            perror("send pre-trigger command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware pre-trigger history set to %ld samples\n", pretrigger);
+    }
+    if (block_samples >= 0) {
+        if (set_param(&sh, KC87_PARAM_BLOCK_SAMPLES, (uint32_t)block_samples) != 0) {
+            perror("send block size command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware block size set to %ld samples\n", block_samples);
+    }
+    if (decode_mode) {
+        if (set_param(&sh, KC87_PARAM_DECODE_MODE, 1) != 0) {
+            perror("send decode mode command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware tape decoding enabled\n");
+    }
+    if (histogram_dump) {
+        if (histograms(&sh, KC87_HISTOGRAMS_CLEAR) != 0) {
+            perror("send histogram command");
+            close_serial(&sh);
+            return 1;
+        }
+        fprintf(stderr, "Firmware histograms cleared\n");
+    }
+
     FILE *out = fopen(out_path, "wb");
     if (!out) {
         perror("open output file");
@@ -330,51 +809,77 @@ int main(int argc, char **argv)
         return 1;
     }
     
-    FILE *wav_file = NULL;
-    int16_t *wav_buffer = NULL;
-    size_t wav_buffer_pos = 0;
-    const size_t wav_buffer_size = 4096;
-    bool current_state = false;
+    kc87_wav_t *wav = NULL;
+    FILE *norm = NULL;
+    // Tape speed is estimated live; a period ends with a rising edge unless only falling edges are captured
+    kc87_speed_t speed;
+    kc87_speed_init(&speed, edge_mask != EDGE_MASK_FALL);
+    sync_state_t sync;
+    memset(&sync, 0, sizeof(sync));
+    kc87_layout_t layout;
+    kc87_layout_init(&layout, 0x01);
+    uint64_t stream_time_us = 0;
     
     if (wav_path) {
-        wav_file = fopen(wav_path, "wb");
-        if (!wav_file) {
+        wav = kc87_wav_open(wav_path, WAV_SAMPLE_RATE);
+        if (!wav) {
             perror("open WAV file");
             fclose(out);
             close_serial(&sh);
             return 1;
         }
-        
-        // Allocate WAV buffer
-        wav_buffer = malloc(wav_buffer_size * sizeof(int16_t));
-        if (!wav_buffer) {
-            perror("allocate WAV buffer");
-            fclose(wav_file);
+        fprintf(stderr, "Recording to WAV file: %s\n", wav_path);
+    }
+
+    if (norm_path) {
+        norm = fopen(norm_path, "wb");
+        if (!norm) {
+            perror("open normalised output file");
+            if (wav) kc87_wav_close(wav);
             fclose(out);
             close_serial(&sh);
             return 1;
         }
-        
-        // Write placeholder header (will be updated at end)
-        write_wav_header(wav_file, 0);
-        fprintf(stderr, "Recording to WAV file: %s\n", wav_path);
+        fprintf(stderr, "Writing normalised capture: %s\n", norm_path);
     }
 
-    uint8_t buffer[1024];  // Buffer for reading blocks
-    size_t buffer_pos = 0;
+    telemetry_t tel;
+    if (telemetry_open(&tel, trace_path) != 0) {
+        perror("open trace file");
+        if (wav) kc87_wav_close(wav);
+        if (norm) fclose(norm);
+        fclose(out);
+        close_serial(&sh);
+        return 1;
+    }
+    if (trace_path) {
+        fprintf(stderr, "Writing capture telemetry: %s\n", trace_path);
+    }
+
+    kc87_parser_t *parser = kc87_parser_new();
+    if (!parser) {
+        perror("allocate block parser");
+        telemetry_close(&tel);
+        if (wav) kc87_wav_close(wav);
+        if (norm) fclose(norm);
+        fclose(out);
+        close_serial(&sh);
+        return 1;
+    }
+
+    uint8_t rx[4096];
     uint64_t count = 0;
     uint64_t total_bytes = 0;
-    double start = now_seconds();
+    uint64_t skipped = 0;
     bool recording_started = false;
-    bool expecting_stream_end = false;
-    uint8_t last4[4] = {0}; // Track last 4 bytes for end-of-stream detection
-    int last4_count = 0;
+    bool stream_ended = false;
 
     fprintf(stderr, "Waiting for Header Block...\n");
 
-    for (;;) {
-        uint8_t b;
-        int n = read_serial(&sh, &b);
+    while (!stream_ended) {
+        double read_start = now_seconds();
+        int n = read_serial(&sh, rx, sizeof(rx));
+        double now = now_seconds();
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -382,158 +887,175 @@ int main(int argc, char **argv)
             perror("read");
             break;
         }
+        if (recording_started && telemetry_due(&tel, now)) {
+            // Flush once per second (data safety), timed like the writes
+            fflush(out);
+            telemetry_write(&tel, "flush", now, now_seconds(), 0);
+            telemetry_summary(&tel, now, count, &speed);
+        }
         if (n == 0) {
             // No timeout needed - firmware sends stream-end signal
             continue;
         }
+        telemetry_read(&tel, read_start, now, n, (size_t)n == sizeof(rx));
 
-        // Add byte to buffer
-        if (buffer_pos < sizeof(buffer)) {
-            buffer[buffer_pos++] = b;
-        } else {
-            fprintf(stderr, "Buffer overflow, resetting\n");
-            buffer_pos = 0;
-            continue;
-        }
+        size_t pos = 0;
+        while (pos < (size_t)n && !stream_ended) {
+            kc87_block_t block;
+            size_t used;
+            int result = kc87_parser_feed(parser, rx + pos, (size_t)n - pos, &used, &block);
+            pos += used;
 
-        // Track last 4 bytes for end-of-stream detection (independent of buffer alignment)
-        if (last4_count < 4) {
-            last4[last4_count++] = b;
-        } else {
-            memmove(last4, last4 + 1, 3);
-            last4[3] = b;
-        }
+            if (result == KC87_NEED_MORE) {
+                break;
+            }
+            if (kc87_parser_skipped(parser) > skipped) {
+                telemetry_resync(&tel, now, kc87_parser_skipped(parser) - skipped,
+                                 result == KC87_BLOCK ? (int64_t)block.offset : -1);
+                skipped = kc87_parser_skipped(parser);
+            }
+            if (result == KC87_END_OF_STREAM) {
+                if (recording_started) {
+                    uint8_t end_marker[2];
+                    total_bytes += write_out(&tel, out, end_marker, kc87_encode_end(end_marker));
+                    if (norm) {
+                        fwrite(end_marker, 1, sizeof(end_marker), norm);
+                    }
+                    fprintf(stderr, "Stream end detected. Total samples: %llu, Total bytes: %llu\n", 
+                            (unsigned long long)count, (unsigned long long)total_bytes);
+                    stream_ended = true;
+                }
+                continue;
+            }
+
+            telemetry_block(&tel, now, &block);
 
-        // Detect end-of-stream marker (0x00 0x80 0x00 0x80)
-        if (recording_started && last4_count >= 4 &&
-            last4[0] == 0x00 && last4[1] == 0x80 &&
-            last4[2] == 0x00 && last4[3] == 0x80) {
-            // Write any remaining buffer data + end marker to file
-            if (buffer_pos > 0) {
-                fwrite(buffer, 1, buffer_pos, out);
-                total_bytes += buffer_pos;
+            if (!recording_started) {
+                if (block.type == KC87_BLOCK_TYPE_HEADER) {
+                    fprintf(stderr, "Header Block received (Version: %d) - Recording started\n", block.len);
+                    if (block.len > KC87_PROTOCOL_VERSION) {
+                        fprintf(stderr, "Warning: protocol version %d is newer than supported (%d), "
+                                "unknown blocks are stored but not interpreted\n", block.len, KC87_PROTOCOL_VERSION);
+                    }
+                    total_bytes += write_out(&tel, out, block.data, block.size);
+                    if (norm) {
+                        fwrite(block.data, 1, block.size, norm);
+                    }
+                    recording_started = true;
+                    telemetry_interval(&tel, now, 0);
+                }
+                continue;
             }
-            fprintf(stderr, "Stream end detected. Total samples: %llu, Total bytes: %llu\n", 
-                    (unsigned long long)count, (unsigned long long)total_bytes);
-            break;
-        }
 
-        // Try to align to START-BLOCK (0x0000) if we drifted
-        while (buffer_pos >= 2) {
-            uint16_t start_marker = buffer[0] | (buffer[1] << 8);
-            if (start_marker == BLOCK_START) {
-                break;
+            if (block.type == KC87_BLOCK_TYPE_HEADER) {
+                continue;
             }
-            memmove(buffer, buffer + 1, buffer_pos - 1);
-            buffer_pos--;
-        }
 
-        // Check if we have enough data for a potential block header
-        if (buffer_pos >= 6) {  // Minimum block size
-            // Check for START-BLOCK at beginning
-            uint16_t start_marker = buffer[0] | (buffer[1] << 8);
-            if (start_marker == BLOCK_START) {
-                uint8_t block_type = buffer[2];
-                
-                if (block_type == BLOCK_TYPE_HEADER && !recording_started && buffer_pos >= 6) {
-                    // Process Header Block: START(2) + TYPE(1) + VERSION(1) + END(2)
-                    uint8_t version = buffer[3];
-                    uint16_t end_marker = buffer[4] | (buffer[5] << 8);
-                    
-                    if (end_marker == BLOCK_END) {
-                        fprintf(stderr, "Header Block received (Version: %d) - Recording started\n", version);
-                        
-                        // Write header block to binary file
-                        fwrite(buffer, 1, 6, out);
-                        total_bytes += 6;
-                        
-                        recording_started = true;
-                        start = now_seconds();
-                        
-                        // Reset buffer for next block
-                        buffer_pos = 0;
-                        continue;
+            // Every block of the session is stored unchanged
+            total_bytes += write_out(&tel, out, block.data, block.size);
+
+            if (block.type == KC87_BLOCK_TYPE_SAMPLES) {
+                static uint16_t words[KC87_MAX_SAMPLES_PER_LONG_BLOCK];
+                for (unsigned i = 0; i < block.len; i++) {
+                    words[i] = kc87_block_sample(&block, i);
+                }
+                kc87_speed_samples(&speed, &layout, words, block.len, norm ? words : NULL);
+                if (norm) {
+                    static uint8_t norm_block[KC87_MAX_BLOCK_SIZE];
+                    fwrite(norm_block, 1, kc87_encode_samples(norm_block, words, block.len), norm);
+                }
+
+                for (unsigned i = 0; i < block.len; i++) {
+                    kc87_sample_t sample;
+                    kc87_decode_sample(&layout, kc87_block_sample(&block, i), &sample);
+                    stream_time_us += sample.delta_us;
+
+                    int edge = sample.edge;
+                    if (sample.channel != 0) {
+                        // Control line edges are rare, report them with their stream time
+                        fprintf(stderr, "Channel %u: %s edge at %.6f s\n", sample.channel,
+                                sample.edge ? "rising" : "falling", stream_time_us / 1e6);
+                        edge = -1; // WAV carries the tape channel only
                     }
-                } else if (block_type == BLOCK_TYPE_SAMPLES && recording_started && buffer_pos >= 5) {
-                    // Process Sample Block: START(2) + TYPE(1) + COUNT(1) + SAMPLES + END(2)
-                    uint8_t sample_count = buffer[3];
-                    size_t expected_block_size = 6 + (sample_count * 2);  // 6 byte overhead + samples
-                    
-                    if (buffer_pos >= expected_block_size) {
-                        // Check END-BLOCK marker
-                        uint16_t end_marker = buffer[expected_block_size - 2] | (buffer[expected_block_size - 1] << 8);
-                        
-                        if (end_marker == BLOCK_END) {
-                            fprintf(stderr, "Sample Block: %d samples\n", sample_count);
-                            
-                            // Write entire block to binary file
-                            fwrite(buffer, 1, expected_block_size, out);
-                            total_bytes += expected_block_size;
-                            
-                            // Process samples for WAV file if enabled
-                            for (int i = 0; i < sample_count; i++) {
-                                size_t sample_offset = 4 + (i * 2);
-                                uint16_t sample = buffer[sample_offset] | (buffer[sample_offset + 1] << 8);
-                                
-                                if (wav_file) {
-                                    bool edge = (sample & 0x8000) != 0;
-                                    uint16_t delta_us = sample & 0x7FFF;
-                                    update_wav_file(wav_file, delta_us, edge, wav_buffer, 
-                                                   &wav_buffer_pos, wav_buffer_size, &current_state);
-                                }
-                                
-                                count++;
-                            }
-                            
-                            if (count % 1000 == 0) {
-                                fflush(out);
-                                if (wav_file) fflush(wav_file);
-                                double elapsed = now_seconds() - start;
-                                double rate = elapsed > 0 ? count / elapsed : 0.0;
-                                fprintf(stderr, "%llu samples, %.1f samples/s, %llu bytes written\n",
-                                        (unsigned long long)count, rate, (unsigned long long)total_bytes);
-                            }
-                            
-                            expecting_stream_end = true;
-                            
-                            // Reset buffer for next block
-                            buffer_pos = 0;
-                            continue;
-                        }
+
+                    if (wav) {
+                        kc87_wav_edge(wav, sample.delta_us, edge);
+                    }
+
+                    sync_on_sample(&sync, sample.delta_us);
+                    count++;
+                }
+            } else {
+                // Sync timestamps describe the original timing, the normalised file omits them
+                if (norm && block.type != KC87_BLOCK_TYPE_SYNC) {
+                    fwrite(block.data, 1, block.size, norm);
+                }
+
+                kc87_stats_t stats;
+                kc87_sync_t sync_block;
+                kc87_tape_t tape;
+
+                if (kc87_read_stats(&block, &stats) == 0) {
+                    fprintf(stderr, "Statistics: %lu glitches suppressed, %lu samples dropped\n",
+                            (unsigned long)stats.glitches, (unsigned long)stats.drops);
+                } else if (kc87_read_channels(&block, &layout) == 0) {
+                    fprintf(stderr, "Channels: mask 0x%02x, %u channel bits per sample\n",
+                            layout.mask, layout.bits);
+                } else if (kc87_read_sync(&block, &sync_block) == 0) {
+                    sync_on_block(&sync, &sync_block, count);
+                } else if (kc87_read_tape(&block, &tape) == 0) {
+                    fprintf(stderr, "Tape Block %u: %s\n", tape.block_nr,
+                            tape.status == KC87_TAPE_STATUS_OK ? "OK" : "CHECKSUM ERROR");
+                    // Blocks with a checksum error are preceded by their raw samples in the stream
+                    if (wav && tape.status == KC87_TAPE_STATUS_OK) {
+                        kc87_wav_tape(wav, &tape);
                     }
                 }
             }
-            
-            // Stream end is detected above using the 0x8000 0x8000 sequence
         }
+    }
 
-        // Reset buffer if it gets too large without finding a valid block
-        // Max block size is 516 bytes (4 header + 510 samples + 2 end marker)
-        if (buffer_pos > 600) {
-            if (!recording_started) {
-                // Still waiting for header - continue
-                buffer_pos = 0;
-            } else {
-                fprintf(stderr, "Invalid block detected, resetting\n");
-                buffer_pos = 0;
-            }
+    if (kc87_parser_skipped(parser) > 0) {
+        fprintf(stderr, "Skipped %llu bytes outside of valid blocks\n",
+                (unsigned long long)kc87_parser_skipped(parser));
+    }
+    kc87_parser_free(parser);
+    if (telemetry_close(&tel) != 0) {
+        perror("write trace file");
+    }
+
+    if (histogram_dump && stream_ended) {
+        if (histograms(&sh, KC87_HISTOGRAMS_DUMP) != 0) {
+            perror("send histogram command");
+        } else {
+            fprintf(stderr, "Firmware histograms requested (Pico USB debug output)\n");
+        }
+    }
+
+    sync_report(&sync);
+
+    if (speed.periods > 0) {
+        kc87_speed_result_t result;
+        kc87_speed_result(&speed, &result);
+        fprintf(stderr, "Tape speed: %.2f%% (%.2f%% - %.2f%%), wow %.2f%%, flutter %.2f%%, total %.2f%% RMS "
+                "(%llu KC87 periods)\n", result.speed * 100.0, result.speed_min * 100.0,
+                result.speed_max * 100.0, result.wow_percent, result.flutter_percent,
+                result.total_percent, (unsigned long long)result.periods);
+    }
+    if (norm) {
+        if (fclose(norm) != 0) {
+            perror("write normalised output file");
         }
+        fprintf(stderr, "Normalised capture completed: %s\n", norm_path);
     }
 
     // Finalize WAV file if created
-    if (wav_file) {
-        // Flush remaining buffer
-        if (wav_buffer_pos > 0) {
-            fwrite(wav_buffer, sizeof(int16_t), wav_buffer_pos, wav_file);
+    if (wav) {
+        uint64_t wav_data_size = kc87_wav_frames(wav) * 2;
+        if (kc87_wav_close(wav) != 0) {
+            perror("write WAV file");
         }
-        
-        // Calculate total data size and update header
-        long wav_data_size = ftell(wav_file) - sizeof(wav_header_t);
-        write_wav_header(wav_file, (uint32_t)wav_data_size);
-        
-        fclose(wav_file);
-        free(wav_buffer);
-        fprintf(stderr, "WAV file completed: %ld bytes of audio data\n", wav_data_size);
+        fprintf(stderr, "WAV file completed: %llu bytes of audio data\n", (unsigned long long)wav_data_size);
     }
     
     fclose(out);
@@ -0,0 +1,554 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#include "kc87.h"
+
+// Flash session store of the firmware (store-and-forward capture): commands and replies both go
+// over the Pico's USB port. Replies are "[STORE] ..." lines between the [DEBUG] output, a
+// downloaded session arrives as raw stream bytes between "[STORE] DATA" and "[STORE] END".
+
+#define REPLY_TIMEOUT_S   3.0       // Without any byte from the Pico
+#define LINE_MAX          256
+#define MAX_SESSIONS      1024
+
+typedef struct {
+    uint32_t seq;
+    uint32_t bytes;
+} stored_session_t;
+
+#ifdef _WIN32
+typedef struct {
+    HANDLE handle;
+} serial_handle_t;
+
+static int open_serial(serial_handle_t *sh, const char *port, int baud)
+{
+    char path[64];
+    if (strncmp(port, "\\\\.\\", 4) == 0) {
+        snprintf(path, sizeof(path), "%s", port);
+    } else {
+        snprintf(path, sizeof(path), "\\\\.\\%s", port);
+    }
+
+    sh->handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (sh->handle == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    DCB dcb;
+    memset(&dcb, 0, sizeof(dcb));
+    dcb.DCBlength = sizeof(dcb);
+    if (!GetCommState(sh->handle, &dcb)) {
+        return -1;
+    }
+    dcb.BaudRate = (DWORD)baud;
+    dcb.ByteSize = 8;
+    dcb.Parity = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    dcb.fBinary = TRUE;
+    dcb.fDtrControl = DTR_CONTROL_ENABLE;
+    dcb.fRtsControl = RTS_CONTROL_ENABLE;
+    dcb.fDsrSensitivity = FALSE;
+    dcb.fTXContinueOnXoff = FALSE;
+    dcb.fOutX = FALSE;
+    dcb.fInX = FALSE;
+    dcb.fErrorChar = FALSE;
+    dcb.fNull = FALSE;
+    dcb.fAbortOnError = FALSE;
+    if (!SetCommState(sh->handle, &dcb)) {
+        return -1;
+    }
+
+    COMMTIMEOUTS timeouts;
+    memset(&timeouts, 0, sizeof(timeouts));
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = 100;    // 100ms timeout for read operations
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.WriteTotalTimeoutConstant = 1000;  // 1 second write timeout
+    timeouts.WriteTotalTimeoutMultiplier = 0;
+    if (!SetCommTimeouts(sh->handle, &timeouts)) {
+        return -1;
+    }
+
+    // Discard debug output received before the first command
+    PurgeComm(sh->handle, PURGE_RXCLEAR | PURGE_TXCLEAR);
+
+    return 0;
+}
+
+static int read_serial(serial_handle_t *sh, uint8_t *buf, size_t len)
+{
+    DWORD read = 0;
+    if (!ReadFile(sh->handle, buf, (DWORD)len, &read, NULL)) {
+        errno = EIO;
+        return -1;
+    }
+    return (int)read;
+}
+
+static int write_serial(serial_handle_t *sh, const uint8_t *data, size_t len)
+{
+    DWORD written = 0;
+    if (!WriteFile(sh->handle, data, (DWORD)len, &written, NULL)) {
+        return -1;
+    }
+    return (int)written;
+}
+
+static void close_serial(serial_handle_t *sh)
+{
+    if (sh->handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(sh->handle);
+    }
+}
+
+#else
+typedef struct {
+    int fd;
+} serial_handle_t;
+
+static speed_t baud_to_speed(int baud)
+{
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+#ifdef B460800
+        case 460800: return B460800;
+#endif
+#ifdef B921600
+        case 921600: return B921600;
+#endif
+        default: return 0;
+    }
+}
+
+static int open_serial(serial_handle_t *sh, const char *port, int baud)
+{
+    sh->fd = open(port, O_RDWR | O_NOCTTY);
+    if (sh->fd < 0) {
+        return -1;
+    }
+
+    struct termios tio;
+    if (tcgetattr(sh->fd, &tio) != 0) {
+        return -1;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= (CLOCAL | CREAD);
+
+    speed_t spd = baud_to_speed(baud);
+    if (spd == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    cfsetispeed(&tio, spd);
+    cfsetospeed(&tio, spd);
+
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 1;  // 100ms timeout for read operations
+
+    if (tcsetattr(sh->fd, TCSANOW, &tio) != 0) {
+        return -1;
+    }
+
+    // Discard debug output received before the first command
+    tcflush(sh->fd, TCIFLUSH);
+    return 0;
+}
+
+static int read_serial(serial_handle_t *sh, uint8_t *buf, size_t len)
+{
+    ssize_t n = read(sh->fd, buf, len);
+    if (n < 0) {
+        return -1;
+    }
+    return (int)n;
+}
+
+static int write_serial(serial_handle_t *sh, const uint8_t *data, size_t len)
+{
+    ssize_t n = write(sh->fd, data, len);
+    if (n < 0) {
+        return -1;
+    }
+    return (int)n;
+}
+
+static void close_serial(serial_handle_t *sh)
+{
+    if (sh->fd >= 0) {
+        close(sh->fd);
+    }
+}
+#endif
+
+// Buffered reader over the USB port: reply lines and raw session data share one byte stream
+typedef struct {
+    serial_handle_t *sh;
+    uint8_t buf[65536];
+    size_t pos;
+    size_t len;
+} reader_t;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -p <usb_port> list\n"
+            "       %s -p <usb_port> get <seq|all> [-o out]\n"
+            "       %s -p <usb_port> clear\n"
+            "       %s -p <port> output <live|flash|both> [-b baud]\n"
+            "  -p <port>       Pico USB port (e.g., /dev/ttyACM1, COM7); output also works on the UART port\n"
+            "  -o <out>        Output file (get <seq>, default: session_<seq>.bin)\n"
+            "                  or file name prefix (get all, default: session -> session_<seq>.bin)\n"
+            "  -b <baud>       Baud rate (default: 115200, irrelevant for the USB port)\n"
+            "\n"
+            "Example: %s -p /dev/ttyACM1 get all -o tapes\n",
+            prog, prog, prog, prog, prog);
+}
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    static bool freq_init = false;
+    LARGE_INTEGER counter;
+    if (!freq_init) {
+        QueryPerformanceFrequency(&freq);
+        freq_init = true;
+    }
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static int send_command(serial_handle_t *sh, uint8_t op, uint32_t seq)
+{
+    uint8_t frame[14];
+    size_t len = kc87_encode_store(frame, op, seq);
+    return write_serial(sh, frame, len) == (int)len ? 0 : -1;
+}
+
+// Refill the buffer, fails after REPLY_TIMEOUT_S without data
+static int reader_fill(reader_t *r)
+{
+    double deadline = now_seconds() + REPLY_TIMEOUT_S;
+    while (now_seconds() < deadline) {
+        int n = read_serial(r->sh, r->buf, sizeof(r->buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+        if (n > 0) {
+            r->pos = 0;
+            r->len = (size_t)n;
+            return 0;
+        }
+    }
+    fprintf(stderr, "No reply from the Pico (USB port of the firmware?)\n");
+    return -1;
+}
+
+static int read_line(reader_t *r, char *line, size_t max)
+{
+    size_t n = 0;
+    for (;;) {
+        if (r->pos == r->len && reader_fill(r) != 0) {
+            return -1;
+        }
+        char c = (char)r->buf[r->pos++];
+        if (c == '\n') {
+            line[n] = '\0';
+            return 0;
+        }
+        if (c != '\r' && n + 1 < max) {
+            line[n++] = c;
+        }
+    }
+}
+
+// Next reply line, [DEBUG] output in between is skipped; returns the text after "[STORE] "
+static const char *read_reply(reader_t *r, char *line, size_t max)
+{
+    static const char prefix[] = "[STORE] ";
+    for (;;) {
+        if (read_line(r, line, max) != 0) {
+            return NULL;
+        }
+        if (strncmp(line, prefix, sizeof(prefix) - 1) == 0) {
+            return line + sizeof(prefix) - 1;
+        }
+    }
+}
+
+static int read_data(reader_t *r, FILE *out, uint32_t bytes)
+{
+    while (bytes > 0) {
+        if (r->pos == r->len && reader_fill(r) != 0) {
+            return -1;
+        }
+        size_t n = r->len - r->pos;
+        if (n > bytes) {
+            n = bytes;
+        }
+        if (fwrite(r->buf + r->pos, 1, n, out) != n) {
+            perror("write output file");
+            return -1;
+        }
+        r->pos += n;
+        bytes -= (uint32_t)n;
+    }
+    return 0;
+}
+
+static int list_sessions(reader_t *r, stored_session_t *sessions, size_t *count, unsigned long *used, unsigned long *size)
+{
+    char line[LINE_MAX];
+    if (send_command(r->sh, KC87_STORE_LIST, 0) != 0) {
+        perror("send list command");
+        return -1;
+    }
+    *count = 0;
+    for (;;) {
+        const char *reply = read_reply(r, line, sizeof(line));
+        if (!reply) {
+            return -1;
+        }
+        unsigned long seq, bytes, total;
+        if (sscanf(reply, "SESSION %lu %lu", &seq, &bytes) == 2) {
+            if (*count < MAX_SESSIONS) {
+                sessions[*count].seq = (uint32_t)seq;
+                sessions[*count].bytes = (uint32_t)bytes;
+                (*count)++;
+            }
+        } else if (sscanf(reply, "LIST %lu %lu %lu", &total, used, size) == 3) {
+            return 0;
+        }
+    }
+}
+
+static int get_session(reader_t *r, uint32_t seq, const char *path)
+{
+    char line[LINE_MAX];
+    if (send_command(r->sh, KC87_STORE_READ, seq) != 0) {
+        perror("send read command");
+        return -1;
+    }
+    const char *reply = read_reply(r, line, sizeof(line));
+    unsigned long reply_seq, bytes;
+    if (!reply) {
+        return -1;
+    }
+    if (strcmp(reply, "BUSY") == 0) {
+        fprintf(stderr, "Pico is recording, try again after the session\n");
+        return -1;
+    }
+    if (sscanf(reply, "DATA %lu %lu", &reply_seq, &bytes) != 2 || reply_seq != seq) {
+        fprintf(stderr, "Session %lu not found\n", (unsigned long)seq);
+        return -1;
+    }
+
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        perror("open output file");
+        return -1;
+    }
+    double start = now_seconds();
+    int result = read_data(r, out, (uint32_t)bytes);
+    double elapsed = now_seconds() - start;
+    if (fclose(out) != 0) {
+        perror("close output file");
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Session %lu incomplete: %s\n", (unsigned long)seq, path);
+        return -1;
+    }
+    reply = read_reply(r, line, sizeof(line));
+    if (!reply || sscanf(reply, "END %lu", &reply_seq) != 1 || reply_seq != seq) {
+        fprintf(stderr, "Session %lu: missing end of transfer\n", (unsigned long)seq);
+        return -1;
+    }
+    fprintf(stderr, "Session %lu: %lu bytes -> %s (%.2f s, %.2f MB/s)\n", (unsigned long)seq, bytes, path,
+            elapsed, elapsed > 0 ? (double)bytes / 1e6 / elapsed : 0.0);
+    return 0;
+}
+
+static int clear_sessions(reader_t *r)
+{
+    char line[LINE_MAX];
+    if (send_command(r->sh, KC87_STORE_CLEAR, 0) != 0) {
+        perror("send clear command");
+        return -1;
+    }
+    const char *reply = read_reply(r, line, sizeof(line));
+    unsigned long cleared;
+    if (!reply) {
+        return -1;
+    }
+    if (sscanf(reply, "CLEARED %lu", &cleared) != 1) {
+        fprintf(stderr, "%s\n", strcmp(reply, "BUSY") == 0 ? "Pico is recording, try again after the session" : reply);
+        return -1;
+    }
+    fprintf(stderr, "%lu sessions deleted\n", cleared);
+    return 0;
+}
+
+static int set_output(serial_handle_t *sh, const char *mode)
+{
+    uint32_t output;
+    if (strcmp(mode, "live") == 0) {
+        output = KC87_OUTPUT_UART;
+    } else if (strcmp(mode, "flash") == 0) {
+        output = KC87_OUTPUT_FLASH;
+    } else if (strcmp(mode, "both") == 0) {
+        output = KC87_OUTPUT_UART | KC87_OUTPUT_FLASH;
+    } else {
+        fprintf(stderr, "Invalid output: %s (live, flash or both)\n", mode);
+        return -1;
+    }
+    uint8_t frame[14];
+    size_t len = kc87_encode_set_param(frame, KC87_PARAM_OUTPUT, output);
+    if (write_serial(sh, frame, len) != (int)len) {
+        perror("send output command");
+        return -1;
+    }
+    fprintf(stderr, "Firmware output set to %s (from the next session, until power-off)\n", mode);
+    return 0;
+}
+
+static int run(serial_handle_t *sh, const char *command, const char *arg, const char *out_path)
+{
+    static reader_t reader;
+    static stored_session_t sessions[MAX_SESSIONS];
+    reader.sh = sh;
+    size_t count;
+    unsigned long used, size;
+
+    if (strcmp(command, "output") == 0) {
+        return set_output(sh, arg);
+    }
+    if (strcmp(command, "clear") == 0) {
+        return clear_sessions(&reader);
+    }
+    if (strcmp(command, "list") == 0) {
+        if (list_sessions(&reader, sessions, &count, &used, &size) != 0) {
+            return -1;
+        }
+        printf("  Seq        Bytes\n");
+        for (size_t i = 0; i < count; i++) {
+            printf("%5lu  %11lu\n", (unsigned long)sessions[i].seq, (unsigned long)sessions[i].bytes);
+        }
+        printf("%lu sessions, %lu of %lu KB used\n", (unsigned long)count, used / 1024, size / 1024);
+        return 0;
+    }
+
+    // get
+    char path[1024];
+    if (strcmp(arg, "all") != 0) {
+        char *end;
+        unsigned long seq = strtoul(arg, &end, 0);
+        if (*arg == '\0' || *end != '\0') {
+            fprintf(stderr, "Invalid session: %s (sequence number or all)\n", arg);
+            return -1;
+        }
+        if (!out_path) {
+            snprintf(path, sizeof(path), "session_%lu.bin", seq);
+            out_path = path;
+        }
+        return get_session(&reader, (uint32_t)seq, out_path);
+    }
+    if (list_sessions(&reader, sessions, &count, &used, &size) != 0) {
+        return -1;
+    }
+    int failed = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s_%lu.bin", out_path ? out_path : "session", (unsigned long)sessions[i].seq);
+        if (get_session(&reader, sessions[i].seq, path) != 0) {
+            failed++;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    fprintf(stderr, "%lu sessions, %lu KB in %.2f s%s\n", (unsigned long)count, used / 1024, elapsed,
+            failed ? " (with errors)" : "");
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *port = NULL;
+    const char *out_path = NULL;
+    const char *command = NULL;
+    const char *arg = NULL;
+    int baud = 115200;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baud = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (!command) {
+            command = argv[i];
+        } else if (!arg) {
+            arg = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bool needs_arg = command && (strcmp(command, "get") == 0 || strcmp(command, "output") == 0);
+    bool known = needs_arg || (command && (strcmp(command, "list") == 0 || strcmp(command, "clear") == 0));
+    if (!port || !known || needs_arg != (arg != NULL)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    serial_handle_t sh;
+    memset(&sh, 0, sizeof(sh));
+#ifndef _WIN32
+    sh.fd = -1;
+#else
+    sh.handle = INVALID_HANDLE_VALUE;
+#endif
+
+    if (open_serial(&sh, port, baud) != 0) {
+        perror("open/configure serial");
+        close_serial(&sh);
+        return 1;
+    }
+
+    int result = run(&sh, command, arg, out_path);
+    close_serial(&sh);
+    return result == 0 ? 0 : 1;
+}
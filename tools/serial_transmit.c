@@ -14,10 +14,14 @@
 #include <unistd.h>
 #endif
 
-#define SLIP_END     0xC0
-#define SLIP_ESC     0xDB
-#define SLIP_ESC_END 0xDC
-#define SLIP_ESC_ESC 0xDD
+#include "kc87.h"
+
+// Playback samples use the single channel format: Bit 15 = edge, Bits 14..0 = delta in us
+typedef struct {
+    uint16_t *words;
+    size_t count;
+    size_t capacity;
+} playback_t;
 
 #ifdef _WIN32
 typedef struct {
@@ -173,52 +177,249 @@ static void usage(const char *prog)
     fprintf(stderr,
             "Usage: %s -p <port> -i <input_file> [-b baud]\n"
             "  -p <port>       Serial port (e.g., /dev/ttyACM0, COM3)\n"
-            "  -i <input_file> Binary input file to transmit\n"
+            "  -i <input_file> Binary input file to transmit (.bin or archive .kca)\n"
             "  -b <baud>       Baud rate (default: 115200)\n"
             "\n"
             "Example: %s -p /dev/ttyACM0 -i capture.bin -b 115200\n",
             prog, prog);
 }
 
-static int slip_write_byte(serial_handle_t *sh, uint8_t b)
+static int send_frame(serial_handle_t *sh, const uint8_t *data, size_t len)
 {
-    uint8_t output[2];
-    size_t output_len = 0;
-    
-    if (b == SLIP_END) {
-        output[0] = SLIP_ESC;
-        output[1] = SLIP_ESC_END;
-        output_len = 2;
-    } else if (b == SLIP_ESC) {
-        output[0] = SLIP_ESC;
-        output[1] = SLIP_ESC_ESC;
-        output_len = 2;
-    } else {
-        output[0] = b;
-        output_len = 1;
+    uint8_t frame[2 * 2 + 2];
+    if (len > 2) {
+        return -1;
     }
-    
-    return write_serial(sh, output, output_len);
+    size_t frame_len = kc87_slip_encode(frame, data, len);
+    return write_serial(sh, frame, frame_len) == (int)frame_len ? 0 : -1;
 }
 
-static int send_frame(serial_handle_t *sh, const uint8_t *data, size_t len)
+static int playback_reserve(playback_t *pb, size_t n)
 {
-    uint8_t end_byte = SLIP_END;
-    
-    // Send frame start
-    if (write_serial(sh, &end_byte, 1) < 0) return -1;
-    
-    // Send data with SLIP encoding
-    for (size_t i = 0; i < len; i++) {
-        if (slip_write_byte(sh, data[i]) < 0) return -1;
+    if (pb->count + n > pb->capacity) {
+        size_t capacity = pb->capacity ? pb->capacity : 4096;
+        while (pb->count + n > capacity) {
+            capacity *= 2;
+        }
+        uint16_t *words = realloc(pb->words, capacity * sizeof(uint16_t));
+        if (!words) {
+            return -1;
+        }
+        pb->words = words;
+        pb->capacity = capacity;
     }
-    
-    // Send frame end
-    if (write_serial(sh, &end_byte, 1) < 0) return -1;
-    
     return 0;
 }
 
+static int playback_append(playback_t *pb, uint16_t word)
+{
+    if (playback_reserve(pb, 1) != 0) {
+        return -1;
+    }
+    pb->words[pb->count++] = word;
+    return 0;
+}
+
+// Playback state carried from block to block (and across archive frames)
+typedef struct {
+    kc87_playback_t playback;
+    uint32_t blocks;
+    uint64_t skipped;
+    uint64_t tail;              // Unscanned bytes at the end of the last buffer
+} playback_state_t;
+
+// Walks the blocks of data, continuing the stream described by st (see kc87_playback_t)
+static int playback_blocks(playback_t *pb, playback_state_t *st, const uint8_t *data, size_t size)
+{
+    kc87_iter_t it;
+    int result;
+
+    kc87_iter_init(&it, data, size);
+    it.blocks = st->blocks;
+    for (size_t need = 4096;;) {
+        if (playback_reserve(pb, need) != 0) {
+            return -1;
+        }
+        pb->count += kc87_playback_blocks(&st->playback, &it, pb->words + pb->count,
+                                          pb->capacity - pb->count, &result);
+        if (result != KC87_CHUNK_FULL) {
+            break;
+        }
+        // Room for the block that did not fit (iterated on a copy, it stays pending)
+        kc87_iter_t peek = it;
+        kc87_block_t block;
+        kc87_iter_next(&peek, &block);
+        need = kc87_playback_words(&st->playback, &block);
+    }
+    st->blocks = it.blocks;
+    st->skipped += it.skipped;
+    st->tail = it.ended ? 0 : size - it.pos;
+    return 0;
+}
+
+static void report_skipped(const playback_state_t *st)
+{
+    if (st->skipped > 0) {
+        fprintf(stderr, "Skipped %llu bytes outside of valid blocks\n", (unsigned long long)st->skipped);
+    }
+}
+
+// Convert a recording into playback samples. Files with a header block are walked block
+// by block (see kc87_playback_t). Files without a header are treated as plain 2-byte
+// sample words (old capture format).
+static int build_playback(const uint8_t *data, size_t size, playback_t *pb)
+{
+    playback_state_t st;
+
+    if (!kc87_has_header(data, size)) {
+        for (size_t i = 0; i + 1 < size; i += 2) {
+            if (playback_append(pb, (uint16_t)(data[i] | (data[i + 1] << 8))) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    memset(&st, 0, sizeof(st));
+    kc87_playback_init(&st.playback, 0x01);
+    if (playback_blocks(pb, &st, data, size) != 0) {
+        return -1;
+    }
+    report_skipped(&st);
+    return 0;
+}
+
+// Serial output of playback words; frames is 0 unless an archive is played frame by frame
+typedef struct {
+    serial_handle_t sh;
+    uint64_t sent;
+    uint64_t total;             // Known in advance for .bin input only
+    uint32_t frame;
+    uint32_t frames;
+} transmitter_t;
+
+// Send each 2-byte sample as a SLIP frame
+static int transmit_words(transmitter_t *tx, const uint16_t *words, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint8_t sample[2] = { words[i] & 0xFF, words[i] >> 8 };
+        if (send_frame(&tx->sh, sample, 2) != 0) {
+            perror("send sample");
+            return -1;
+        }
+        
+        tx->sent++;
+        
+        // Progress indicator
+        if (tx->sent % 1000 == 0) {
+            if (tx->frames > 0) {
+                printf("Progress: %llu samples (frame %u/%u)\n", (unsigned long long)tx->sent,
+                       (unsigned)tx->frame + 1, (unsigned)tx->frames);
+            } else {
+                double progress = (double)tx->sent / tx->total * 100.0;
+                printf("Progress: %llu/%llu samples (%.1f%%)\n", 
+                       (unsigned long long)tx->sent, (unsigned long long)tx->total, progress);
+            }
+        }
+        
+        // Small delay to prevent overwhelming the Pico
+        // Adjust this based on your requirements - smaller delay for better timing
+#ifdef _WIN32
+        Sleep(0);  // Yield to other processes but don't sleep
+#else
+        usleep(100);  // 0.1ms - reduced from 1ms
+#endif
+    }
+    return 0;
+}
+
+// Archive input (archive_bin.py): each frame is decoded, converted and sent before the
+// next one is read, so only one frame and its playback words are in memory
+static int transmit_archive(transmitter_t *tx, kc87_archive_t *a, playback_t *pb)
+{
+    playback_state_t st;
+    uint8_t *frame_data = NULL;
+    size_t frame_max = 0;
+    int result = 0;
+
+    memset(&st, 0, sizeof(st));
+    kc87_playback_init(&st.playback, 0x01);
+    for (uint32_t i = 0; i < kc87_archive_frames(a) && !st.playback.ended && result == 0; i++) {
+        kc87_frame_t frame;
+        kc87_archive_frame(a, i, &frame);
+        if (frame.bin_size > frame_max) {
+            free(frame_data);
+            frame_max = frame.bin_size;
+            frame_data = malloc(frame_max);
+        }
+        if (!frame_data || kc87_archive_read(a, i, frame_data, frame_max) != frame.bin_size) {
+            fprintf(stderr, "Archive frame %u is damaged\n", (unsigned)i);
+            result = -1;
+        } else if (i == 0 && !kc87_has_header(frame_data, frame.bin_size)) {
+            fprintf(stderr, "Archive without header block (old capture format), unpack it first\n");
+            result = -1;
+        } else {
+            // The whole stream would have skipped the unscanned end of the previous frame
+            st.skipped += st.tail;
+            pb->count = 0;
+            tx->frame = i;
+            result = playback_blocks(pb, &st, frame_data, frame.bin_size);
+            if (result != 0) {
+                perror("prepare playback samples");
+            } else {
+                result = transmit_words(tx, pb->words, pb->count);
+            }
+        }
+    }
+    if (result == 0) {
+        report_skipped(&st);
+    }
+    free(frame_data);
+    return result;
+}
+
+// Read the input file: a .bin is converted into playback samples as a whole, an archive is
+// only opened (see transmit_archive)
+static int load_playback(const char *input_path, playback_t *pb, kc87_archive_t **archive)
+{
+    FILE *input = fopen(input_path, "rb");
+    if (!input) {
+        perror("open input file");
+        return -1;
+    }
+
+    uint8_t magic[8];
+    if (fread(magic, 1, sizeof(magic), input) == sizeof(magic) && kc87_is_archive(magic, sizeof(magic))) {
+        fclose(input);
+        *archive = kc87_archive_open(input_path);
+        if (!*archive) {
+            fprintf(stderr, "Cannot read archive %s\n", input_path);
+            return -1;
+        }
+        return 0;
+    }
+
+    fseek(input, 0, SEEK_END);
+    long file_size = ftell(input);
+    fseek(input, 0, SEEK_SET);
+
+    uint8_t *data = malloc(file_size > 0 ? (size_t)file_size : 1);
+    if (!data || fread(data, 1, (size_t)file_size, input) != (size_t)file_size) {
+        perror("read input file");
+        free(data);
+        fclose(input);
+        return -1;
+    }
+    fclose(input);
+
+    int result = build_playback(data, (size_t)file_size, pb);
+    if (result != 0) {
+        perror("prepare playback samples");
+    }
+    free(data);
+    return result;
+}
+
 int main(int argc, char **argv)
 {
     const char *port = NULL;
@@ -246,69 +447,47 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    // Open input file
-    FILE *input = fopen(input_path, "rb");
-    if (!input) {
-        perror("open input file");
+    playback_t pb = { NULL, 0, 0 };
+    kc87_archive_t *archive = NULL;
+    if (load_playback(input_path, &pb, &archive) != 0) {
+        free(pb.words);
         return 1;
     }
 
     // Initialize serial connection
-    serial_handle_t sh;
-    memset(&sh, 0, sizeof(sh));
+    transmitter_t tx;
+    memset(&tx, 0, sizeof(tx));
 #ifndef _WIN32
-    sh.fd = -1;
+    tx.sh.fd = -1;
 #else
-    sh.handle = INVALID_HANDLE_VALUE;
+    tx.sh.handle = INVALID_HANDLE_VALUE;
 #endif
 
-    if (open_serial(&sh, port, baud) != 0) {
+    if (open_serial(&tx.sh, port, baud) != 0) {
         perror("open/configure serial");
-        fclose(input);
+        free(pb.words);
+        if (archive) {
+            kc87_archive_close(archive);
+        }
         return 1;
     }
 
     printf("Transmitting %s to %s at %d baud...\n", input_path, port, baud);
-    
-    // Get file size
-    fseek(input, 0, SEEK_END);
-    long file_size = ftell(input);
-    fseek(input, 0, SEEK_SET);
-    
-    printf("File size: %ld bytes (%ld samples)\n", file_size, file_size / 2);
-    
-    uint8_t sample[2];
-    uint64_t samples_sent = 0;
-    uint64_t total_samples = file_size / 2;
-    
-    // Send each 2-byte sample as a SLIP frame
-    while (fread(sample, 1, 2, input) == 2) {
-        if (send_frame(&sh, sample, 2) != 0) {
-            perror("send sample");
-            break;
-        }
-        
-        samples_sent++;
-        
-        // Progress indicator
-        if (samples_sent % 1000 == 0) {
-            double progress = (double)samples_sent / total_samples * 100.0;
-            printf("Progress: %llu/%llu samples (%.1f%%)\n", 
-                   samples_sent, total_samples, progress);
-        }
-        
-        // Small delay to prevent overwhelming the Pico
-        // Adjust this based on your requirements - smaller delay for better timing
-#ifdef _WIN32
-        Sleep(0);  // Yield to other processes but don't sleep
-#else
-        usleep(100);  // 0.1ms - reduced from 1ms
-#endif
+    int result;
+    if (archive) {
+        tx.frames = kc87_archive_frames(archive);
+        printf("Playback: archive with %u frames, converted frame by frame\n", (unsigned)tx.frames);
+        result = transmit_archive(&tx, archive, &pb);
+        kc87_archive_close(archive);
+    } else {
+        tx.total = pb.count;
+        printf("Playback: %llu samples\n", (unsigned long long)pb.count);
+        result = transmit_words(&tx, pb.words, pb.count);
     }
     
-    printf("Transmission complete. Sent %llu samples.\n", samples_sent);
+    printf("Transmission complete. Sent %llu samples.\n", (unsigned long long)tx.sent);
     
-    fclose(input);
-    close_serial(&sh);
-    return 0;
-}
\ No newline at end of file
+    free(pb.words);
+    close_serial(&tx.sh);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,266 @@
+#!/usr/bin/env python3
+"""
+Konsens aus mehreren Aufnahmen desselben Bandes (beschädigte Kassetten)
+
+Jede Aufnahme wird mit kc87_tape dekodiert (parallel auf allen Kernen). Die Blöcke aller
+Durchgänge werden dann in einem Durchlauf einander zugeordnet: fehlerfreie Blöcke, deren
+Inhalt schon bekannt ist, dienen als Landmarken und legen den Zeitversatz zwischen den
+Aufnahmen fest; alle anderen Blöcke landen am nächstgelegenen Platz (Blockende innerhalb
+ALIGN_TOLERANCE_US; das Ende ist genauer als der Vorton-Beginn, dessen Länge schwankt). Der Versatz wird an jedem zugeordneten Block nachgeführt,
+so stören weder unterschiedliche Bandgeschwindigkeiten noch Pausen in einer Aufnahme.
+
+Pro Platz gewinnt ein fehlerfreier Block (bei Widerspruch die Mehrheit). Gibt es nur
+Blöcke mit Prüfsummenfehler, wird bitweise abgestimmt; bleiben wenige Bits strittig,
+werden deren Kombinationen gegen die Prüfsumme getestet.
+
+Das Ergebnis wird als .bin mit Tape-Blöcken geschrieben (Dekodier-Modus, abspielbar mit
+serial_transmit) und optional als KC-TAP-Datei (Emulatoren).
+"""
+import bisect
+import itertools
+import sys
+from collections import Counter
+
+import numpy as np
+
+import kc87
+import kc87_tape
+
+ALIGN_TOLERANCE_US = 300000     # Max. Abstand eines Blocks zum Platz (kürzester Block ~0,7 s)
+SEARCH_BITS_MAX = 10            # Strittige Bits, deren Kombinationen noch getestet werden
+KCTAP_HEADER = b'\xc3KC-TAPE by AF. '
+
+
+class Slot:
+    """Ein Block des Bandes: Blockende (Zeitbasis der Referenzaufnahme) und die Blöcke der Durchgänge"""
+
+    def __init__(self, time):
+        self.time = time
+        self.blocks = {}            # Durchgang -> TapeBlock
+
+
+def _ok(block):
+    return block.status == kc87.TAPE_STATUS_OK
+
+
+def _fits(slot, block):
+    """Passt block zu den fehlerfreien Blöcken des Platzes (Blocknummer)?"""
+    if not _ok(block):
+        return True
+    return all(b.block_nr == block.block_nr for b in slot.blocks.values() if _ok(b))
+
+
+def align(passes):
+    """Ordnet die Blöcke aller Durchgänge Plätzen zu, liefert die Plätze in Bandreihenfolge
+
+    passes: Liste von Blocklisten (je in Stromreihenfolge); die erste ist die Referenz.
+    """
+    slots = []
+    times = []                      # Slot-Zeiten, sortiert (bisect)
+    landmarks = {}                  # (Blocknummer, Daten) -> Plätze
+
+    def insert(slot):
+        i = bisect.bisect(times, slot.time)
+        times.insert(i, slot.time)
+        slots.insert(i, slot)
+
+    def landmark(index, slot, block):
+        slot.blocks[index] = block
+        if _ok(block):
+            key = (block.block_nr, block.data)
+            if slot not in landmarks.setdefault(key, []):
+                landmarks[key].append(slot)
+
+    for index, blocks in enumerate(passes):
+        offset = _first_offset(blocks, landmarks)
+        for block in blocks:
+            est = block.end_us + offset
+            slot = None
+            if _ok(block):
+                # Landmarke: gleicher Inhalt; bei Wiederholungen auf dem Band die nächstgelegene
+                free = [s for s in landmarks.get((block.block_nr, block.data), ())
+                        if index not in s.blocks]
+                if free:
+                    slot = min(free, key=lambda s: abs(s.time - est))
+            if slot is None:
+                i = bisect.bisect(times, est)
+                near = [s for s in slots[max(i - 1, 0):i + 1]
+                        if abs(s.time - est) <= ALIGN_TOLERANCE_US and index not in s.blocks
+                        and _fits(s, block)]
+                if near:
+                    slot = min(near, key=lambda s: abs(s.time - est))
+            if slot is None:
+                slot = Slot(est)
+                insert(slot)
+            landmark(index, slot, block)
+            offset = slot.time - block.end_us
+    return slots
+
+
+def _first_offset(blocks, landmarks):
+    """Startversatz einer Aufnahme: erste Landmarke, sonst Anfang auf Anfang"""
+    for block in blocks:
+        if _ok(block):
+            slots = landmarks.get((block.block_nr, block.data))
+            if slots:
+                return slots[0].time - block.end_us
+    return 0
+
+
+def _values(block):
+    return np.frombuffer(bytes([block.block_nr]) + block.data + bytes([block.checksum]),
+                         dtype=np.uint8)
+
+
+def _checksum_ok(values):
+    return int(values[1:-1].sum()) & 0xFF == int(values[-1])
+
+
+def vote_bits(blocks):
+    """Bitweise Mehrheit über Blöcke mit Prüfsummenfehler
+
+    Liefert (Werte als uint8-Array: Blocknummer, 128 Daten, Prüfsumme; Prüfsumme stimmt).
+    Gleichstand entscheidet der Block mit der geringsten Periodenabweichung; stimmt die
+    Prüfsumme dann nicht, werden die Kombinationen der strittigen Bits getestet und die
+    eindeutig beste (meiste Stimmen) genommen.
+    """
+    blocks = sorted(blocks, key=lambda b: b.deviation or 0.0)
+    bits = np.unpackbits(np.stack([_values(b) for b in blocks]), axis=1)
+    votes = bits.sum(axis=0).astype(np.int64)
+    count = len(blocks)
+    voted = np.where(2 * votes == count, bits[0], 2 * votes > count).astype(np.uint8)
+    values = np.packbits(voted)
+    if _checksum_ok(values):
+        return values, True
+
+    disputed = np.nonzero((votes > 0) & (votes < count))[0]
+    if not 0 < len(disputed) <= SEARCH_BITS_MAX:
+        return values, False
+    best = None
+    best_score = None
+    unique = False
+    for combo in itertools.product((0, 1), repeat=len(disputed)):
+        voted[disputed] = combo
+        candidate = np.packbits(voted)
+        if not _checksum_ok(candidate):
+            continue
+        score = int(np.where(voted[disputed] == 1, votes[disputed], count - votes[disputed]).sum())
+        if best_score is None or score > best_score:
+            best, best_score, unique = candidate, score, True
+        elif score == best_score:
+            unique = False
+    if best is not None and unique:
+        return best, True
+    return values, False
+
+
+def resolve(slot):
+    """Ergebnis eines Platzes: (TapeBlock, Herkunft); Herkunft ist eine Liste von
+    Durchgängen (fehlerfreie Blöcke mit diesem Inhalt) oder 'voted' / 'bad'
+
+    Die Prüfsumme (Summe mod 256) übersieht sich aufhebende Bitfehler; ein einzelner
+    fehlerfreier Block gilt daher nur, wenn keine Mehrheit über mindestens drei
+    Durchgänge möglich ist oder die bitweise Abstimmung keine gültige Prüfsumme ergibt.
+    """
+    blocks = [b for _, b in sorted(slot.blocks.items())]
+    ok = Counter(b.data for b in blocks if _ok(b)).most_common(1)
+    voted = None
+    if ok and (ok[0][1] >= 2 or len(blocks) < 3):
+        data = ok[0][0]
+    else:
+        values, good = vote_bits(blocks) if len(blocks) > 1 else (_values(blocks[0]), False)
+        base = min(blocks, key=lambda b: b.deviation or 0.0)
+        voted = base._replace(status=kc87.TAPE_STATUS_OK if good else kc87_tape.TAPE_STATUS_CHECKSUM,
+                              block_nr=int(values[0]), data=values[1:-1].tobytes(),
+                              checksum=int(values[-1]))
+        data = voted.data if good or not ok else ok[0][0]
+    sources = sorted(i for i, b in slot.blocks.items() if _ok(b) and b.data == data)
+    if sources:
+        return slot.blocks[sources[0]], sources
+    return voted, 'voted' if _ok(voted) else 'bad'
+
+
+def write_bin(filename, blocks):
+    """Aufnahme im Dekodier-Format: Header, ein Tape-Block je Bandblock, Ende"""
+    with open(filename, 'wb') as out:
+        out.write(kc87.encode_header())
+        for b in blocks:
+            payload = (bytes([b.status, b.block_nr, b.leader_periods & 0xFF, b.leader_periods >> 8]) +
+                       b.data + bytes([b.checksum]))
+            out.write(kc87.encode_block(kc87.BLOCK_TYPE_TAPE, payload))
+        out.write(kc87.encode_end())
+
+
+def write_tap(filename, blocks):
+    """KC-TAP-Datei: Kennung, dann je Block Blocknummer und 128 Datenbytes"""
+    with open(filename, 'wb') as out:
+        out.write(KCTAP_HEADER)
+        for b in blocks:
+            out.write(bytes([b.block_nr]) + b.data)
+
+
+def report(files, passes, slots, results):
+    print("Durchgänge:")
+    for i, (filename, blocks) in enumerate(zip(files, passes)):
+        ok = sum(1 for b in blocks if _ok(b))
+        print(f"  {i + 1}: {filename}  {len(blocks)} Blöcke, {ok} OK, {len(blocks) - ok} mit Fehler")
+    print()
+    columns = "".join(f"{i + 1:>5d}" for i in range(len(passes)))
+    print(f"Block  Ende (s)  {columns}   Ergebnis")
+    for slot, (block, source) in zip(slots, results):
+        states = "".join(f"{('OK' if _ok(slot.blocks[i]) else 'ERR') if i in slot.blocks else '-':>5s}"
+                         for i in range(len(passes)))
+        if source == 'voted':
+            result = "OK durch Bit-Voting"
+        elif source == 'bad':
+            result = "PRÜFSUMMENFEHLER"
+        else:
+            result = "OK aus Durchgang " + ", ".join(str(i + 1) for i in source)
+        print(f"{block.block_nr:5d}  {slot.time / 1e6:8.3f}  {states}   {result}")
+
+    ok = sum(1 for block, _ in results if _ok(block))
+    voted = sum(1 for _, source in results if source == 'voted')
+    print()
+    print(f"Ergebnis: {len(results)} Blöcke, {ok} OK ({voted} durch Bit-Voting), "
+          f"{len(results) - ok} mit Prüfsummenfehler")
+    # KC87-Blöcke sind fortlaufend nummeriert, der letzte Block trägt 0xFF
+    gaps = [prev.block_nr for (prev, _), (block, _) in zip(results, results[1:])
+            if block.block_nr not in (prev.block_nr + 1, 0xFF, 1)]
+    if gaps:
+        print("Lücken in der Blocknummerierung nach Block " + ", ".join(str(nr) for nr in gaps))
+
+
+def main():
+    args = sys.argv[1:]
+    jobs = None
+    outputs = {'-o': None, '--tap': None}
+    files = []
+    while args:
+        arg = args.pop(0)
+        if arg in outputs and args:
+            outputs[arg] = args.pop(0)
+        elif arg == '--jobs' and args:
+            jobs = int(args.pop(0))
+        else:
+            files.append(arg)
+    if len(files) < 2:
+        print("Usage: python3 tape_consensus.py [--jobs N] [-o ergebnis.bin] [--tap ergebnis.tap] "
+              "<aufnahme1.bin> <aufnahme2.bin> ...")
+        sys.exit(1)
+
+    # Jede Aufnahme für sich auf allen Kernen dekodieren
+    passes = [kc87_tape.decode_file(filename, jobs) for filename in files]
+    slots = align(passes)
+    results = [resolve(slot) for slot in slots]
+    report(files, passes, slots, results)
+
+    blocks = [block for block, _ in results]
+    if outputs['-o']:
+        write_bin(outputs['-o'], blocks)
+        print(f"Geschrieben: {outputs['-o']}")
+    if outputs['--tap']:
+        write_tap(outputs['--tap'], blocks)
+        print(f"Geschrieben: {outputs['--tap']}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,1202 @@
+#define _DEFAULT_SOURCE     // pread, sockets and PATH_MAX also with -std=c11
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kc87.h"
+
+// Virtual tape deck: serves captures (.bin, archive .kca) and KC-TAP programs (.tap) to
+// emulators over a Unix or TCP socket, without converting them to WAV first.
+//
+// Commands are text lines, replies are text lines starting with OK or ERR:
+//   LIST                  TAPE <format> <bytes> <duration_us|-> <name> per tape, then OK <count>
+//   LOAD <name>           OK <words> <duration_us>; the deck stands at 0
+//   PLAY                  OK PLAY <time_us>, then DATA messages until STOP or EOT <time_us>
+//   STOP                  OK STOP <time_us> (tape time after the last word sent)
+//   SEEK <time_us>        OK SEEK <time_us>; keeps playing if the deck was playing
+//   STATUS                OK <playing|stopped> <time_us> <name|->
+// A DATA message is the line "DATA <count>" followed by count little-endian words in the
+// serial_transmit playback format: bit 15 = level after the edge, bits 14..0 = delta in us.
+// DATA is only produced as fast as the client reads, so STOP and SEEK take effect at an exact
+// position. The playback words are the same serial_transmit sends to the Pico: tape channel
+// edges only, decoded tape blocks and KC-TAP blocks synthesized with nominal timing.
+//
+// Each tape is indexed once on its first LOAD: it is cut into pages of about PAGE_WORDS words
+// at block boundaries, with the tape time and playback state at each page start. Pages are
+// read from the file (pread, no mapping: a file overwritten in place must not crash the server)
+// and decoded on demand into a cache shared by all clients; the page after the one a client is
+// playing is decoded ahead while the server is idle. A file that changed since it was indexed
+// gets ERR on its page reads and is indexed again on the next LOAD.
+
+#define PAGE_WORDS        65536     // Playback words per cache page (block boundaries)
+#define DATA_WORDS_MAX    4096      // Words per DATA message
+#define FILLS_PER_WAKEUP  16        // DATA messages per client and poll round (fairness)
+#define CACHE_MB_DEFAULT  64
+#define COMMAND_MAX       256       // Longest command line
+#define MAX_TAPES         4096
+#define MAX_CLIENTS       256
+#define MAX_ROOTS         64
+#define READAHEAD_MAX     (2 * MAX_CLIENTS)
+
+// KC-TAP: 16 byte signature, then BLOCK_NR and 128 data bytes per block. The file carries no
+// leader lengths, the first block gets the long leader a KC87 writes in front of a program.
+#define KCTAP_HEADER      "\xc3KC-TAPE by AF. "
+#define KCTAP_HEADER_SIZE 16
+#define KCTAP_RECORD      (1 + KC87_TAPE_DATA_SIZE)
+#define KCTAP_LEADER_FIRST 8000
+#define KCTAP_LEADER      160
+
+typedef enum {
+    TAPE_BIN,                   // Capture in block format
+    TAPE_RAW,                   // Old capture format without header block: plain sample words
+    TAPE_ARCHIVE,               // Capture archive (.kca)
+    TAPE_TAP                    // KC-TAP program
+} tape_kind_t;
+
+// Cache page: a range of the tape and the playback state at its start
+typedef struct {
+    uint64_t offset;            // First block / word (.bin), frame index (.kca), record (.tap)
+    uint64_t word;              // Playback words before the page
+    uint64_t time_us;           // Tape time at the page start
+    uint32_t words;
+    uint32_t pending_us;        // Deltas of skipped channel edges carried into the page
+    uint8_t mask;               // Channel mask in effect at the page start
+} page_t;
+
+typedef struct cache_entry cache_entry_t;
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    bool present;               // Found by the last catalog scan
+    bool loaded;
+    tape_kind_t kind;
+    bool stale;                 // File changed since it was indexed, reloaded on the next LOAD
+    unsigned clients;
+    off_t file_size;            // File state when loaded
+    time_t file_mtime;
+    int fd;                     // Open while loaded, -1 otherwise
+    uint64_t size;
+    kc87_archive_t *archive;
+    page_t *pages;
+    uint32_t page_count;
+    uint32_t page_capacity;
+    cache_entry_t **cached;     // Cache entry of each page or NULL
+    uint64_t words;
+    uint64_t duration_us;
+} tape_t;
+
+struct cache_entry {
+    tape_t *tape;
+    uint32_t page;
+    uint16_t *words;
+    size_t bytes;
+    cache_entry_t *prev;        // LRU list, most recently used first
+    cache_entry_t *next;
+};
+
+typedef struct {
+    int fd;
+    char line[COMMAND_MAX];
+    size_t line_len;
+    bool discard;               // Rest of an overlong line
+    tape_t *tape;
+    uint32_t page;              // Page containing word
+    uint64_t word;              // Next playback word
+    uint64_t time_us;           // Tape time before word
+    uint32_t skip_us;           // Part of the next word's delta already passed (SEEK)
+    bool playing;
+    uint8_t *out;               // Replies and DATA not yet sent
+    size_t out_len;
+    size_t out_pos;
+    size_t out_capacity;
+} client_t;
+
+// Playback conversion shared with serial_transmit (kc87_playback_t) into a page buffer
+typedef struct {
+    kc87_playback_t pb;
+    uint16_t *out;              // NULL while indexing (count only), else pb.words index it
+    size_t max;
+} player_t;
+
+static const char *roots[MAX_ROOTS];
+static size_t root_count;
+static tape_t *tapes[MAX_TAPES];
+static size_t tape_count;
+static client_t clients[MAX_CLIENTS];
+
+static cache_entry_t *lru_head;
+static cache_entry_t *lru_tail;
+static size_t cache_bytes;
+static size_t cache_limit = (size_t)CACHE_MB_DEFAULT << 20;
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+
+static struct {
+    tape_t *tape;
+    uint32_t page;
+} readahead[READAHEAD_MAX];
+static size_t readahead_count;
+
+static uint8_t *frame_buf;
+static size_t frame_max;
+static uint8_t *file_buf;
+static size_t file_max;
+
+static volatile sig_atomic_t stop_requested;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-u socket_path] [-t [addr:]port] [-m cache_mb] <dir|file>...\n"
+            "  -u <socket_path>  Listen on a Unix socket\n"
+            "  -t [addr:]port    Listen on TCP (default address 127.0.0.1)\n"
+            "  -m <cache_mb>     Page cache shared by all clients (default: %d MB)\n"
+            "  <dir|file>        Tapes: .bin, .kca and .tap files (directories are rescanned on LIST)\n"
+            "\n"
+            "Example: %s -u /tmp/kc87_deck.sock -t 8787 captures/\n",
+            prog, CACHE_MB_DEFAULT, prog);
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Playback conversion
+
+static int player_emit(player_t *pl, uint16_t word)
+{
+    if (pl->out) {
+        if (pl->pb.words == pl->max) {
+            return -1;
+        }
+        pl->out[pl->pb.words] = word;
+    }
+    pl->pb.words++;
+    pl->pb.time_us += word & KC87_PLAYBACK_DELTA_MAX;
+    return 0;
+}
+
+static int player_tape(player_t *pl, const kc87_tape_t *tape)
+{
+    if (pl->out && pl->pb.words + kc87_tape_to_samples(tape, NULL, 0) > pl->max) {
+        return -1;
+    }
+    kc87_playback_tape(&pl->pb, tape, pl->out ? pl->out + pl->pb.words : NULL);
+    return 0;
+}
+
+static int player_blocks(player_t *pl, const uint8_t *data, size_t size)
+{
+    kc87_iter_t it;
+    int result;
+
+    kc87_iter_init(&it, data, size);
+    kc87_playback_blocks(&pl->pb, &it, pl->out ? pl->out + pl->pb.words : NULL,
+                         pl->out ? pl->max - pl->pb.words : 0, &result);
+    return result == KC87_CHUNK_FULL ? -1 : 0;
+}
+
+// Checked before every read: a file changed since it was indexed is marked stale
+static bool tape_changed(tape_t *t)
+{
+    struct stat st;
+    if (fstat(t->fd, &st) != 0 || st.st_size != t->file_size || st.st_mtime != t->file_mtime) {
+        t->stale = true;
+    }
+    return t->stale;
+}
+
+// Reads [offset, offset + len) of the file into file_buf; NULL if the file changed or is short
+static const uint8_t *read_range(tape_t *t, uint64_t offset, size_t len)
+{
+    if (tape_changed(t)) {
+        return NULL;
+    }
+    if (!file_buf || len > file_max) {
+        size_t max = len > 0 ? len : 1;     // Also an empty range gets a buffer
+        uint8_t *buf = realloc(file_buf, max);
+        if (!buf) {
+            return NULL;
+        }
+        file_buf = buf;
+        file_max = max;
+    }
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pread(t->fd, file_buf + done, len - done, (off_t)(offset + done));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            t->stale = true;
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+    return file_buf;
+}
+
+// Decodes archive frame index into frame_buf, returns its size or 0
+static size_t read_frame(tape_t *t, uint32_t index)
+{
+    kc87_frame_t frame;
+    if (kc87_archive_frame(t->archive, index, &frame) != 0) {
+        return 0;
+    }
+    if (frame.bin_size > frame_max) {
+        uint8_t *buf = realloc(frame_buf, frame.bin_size);
+        if (!buf) {
+            return 0;
+        }
+        frame_buf = buf;
+        frame_max = frame.bin_size;
+    }
+    return kc87_archive_read(t->archive, index, frame_buf, frame_max) == frame.bin_size ? frame.bin_size : 0;
+}
+
+// Plays one tape range into pl: [offset, end) of the file (.bin, raw), archive frame offset
+// or KC-TAP record at offset (.tap)
+static int play_range(tape_t *t, uint64_t offset, uint64_t end, player_t *pl)
+{
+    const uint8_t *data;
+
+    switch (t->kind) {
+    case TAPE_BIN:
+        data = read_range(t, offset, end - offset);
+        return data ? player_blocks(pl, data, end - offset) : -1;
+    case TAPE_RAW:
+        if (!(data = read_range(t, offset, end - offset))) {
+            return -1;
+        }
+        for (uint64_t i = 0; i + 1 < end - offset; i += 2) {
+            if (player_emit(pl, (uint16_t)(data[i] | (data[i + 1] << 8))) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    case TAPE_ARCHIVE: {
+        // The archive reader has its own file handle, only check that the file is unchanged
+        size_t size = !tape_changed(t) ? read_frame(t, (uint32_t)offset) : 0;
+        return size ? player_blocks(pl, frame_buf, size) : -1;
+    }
+    case TAPE_TAP: {
+        kc87_tape_t tape;
+        unsigned sum = 0;
+        if (!(data = read_range(t, offset, KCTAP_RECORD))) {
+            return -1;
+        }
+        memset(&tape, 0, sizeof(tape));
+        tape.status = KC87_TAPE_STATUS_OK;
+        tape.block_nr = data[0];
+        tape.leader_periods = offset == KCTAP_HEADER_SIZE ? KCTAP_LEADER_FIRST : KCTAP_LEADER;
+        memcpy(tape.data, data + 1, KC87_TAPE_DATA_SIZE);
+        for (int i = 0; i < KC87_TAPE_DATA_SIZE; i++) {
+            sum += tape.data[i];
+        }
+        tape.checksum = (uint8_t)sum;
+        return player_tape(pl, &tape);
+    }
+    }
+    return -1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Tape index
+
+static int page_add(tape_t *t, uint64_t offset, const player_t *pl)
+{
+    if (t->page_count == t->page_capacity) {
+        uint32_t capacity = t->page_capacity ? 2 * t->page_capacity : 64;
+        page_t *pages = realloc(t->pages, capacity * sizeof(page_t));
+        if (!pages) {
+            return -1;
+        }
+        t->pages = pages;
+        t->page_capacity = capacity;
+    }
+    page_t *pg = &t->pages[t->page_count++];
+    pg->offset = offset;
+    pg->word = pl->pb.words;
+    pg->time_us = pl->pb.time_us;
+    pg->words = 0;
+    pg->pending_us = pl->pb.pending_us;
+    pg->mask = pl->pb.layout.mask;
+    return 0;
+}
+
+static void page_close(tape_t *t, const player_t *pl)
+{
+    page_t *pg = &t->pages[t->page_count - 1];
+    pg->words = (uint32_t)(pl->pb.words - pg->word);
+}
+
+static uint64_t page_end(const tape_t *t, uint32_t index)
+{
+    return index + 1 < t->page_count ? t->pages[index + 1].offset : t->size;
+}
+
+// Walks the whole tape once, counting words and time; .bin captures are cut before the block
+// that starts after PAGE_WORDS words, the other formats at their natural units
+static int index_tape(tape_t *t)
+{
+    player_t pl;
+    memset(&pl, 0, sizeof(pl));
+    kc87_playback_init(&pl.pb, 0x01);
+
+    if (t->kind == TAPE_BIN) {
+        kc87_iter_t it;
+        kc87_block_t block;
+        const uint8_t *data = read_range(t, 0, t->size);
+        if (!data || page_add(t, 0, &pl) != 0) {
+            return -1;
+        }
+        kc87_iter_init(&it, data, t->size);
+        while (kc87_iter_next(&it, &block) == KC87_BLOCK) {
+            if (pl.pb.words - t->pages[t->page_count - 1].word >= PAGE_WORDS) {
+                page_close(t, &pl);
+                if (page_add(t, block.offset, &pl) != 0) {
+                    return -1;
+                }
+            }
+            kc87_playback_block(&pl.pb, &block, NULL);
+        }
+        page_close(t, &pl);
+    } else if (t->kind == TAPE_RAW) {
+        for (uint64_t offset = 0; offset + 1 < t->size || offset == 0; offset += 2 * PAGE_WORDS) {
+            uint64_t end = offset + 2 * PAGE_WORDS < t->size ? offset + 2 * PAGE_WORDS : t->size;
+            if (page_add(t, offset, &pl) != 0 || play_range(t, offset, end, &pl) != 0) {
+                return -1;
+            }
+            page_close(t, &pl);
+        }
+    } else if (t->kind == TAPE_ARCHIVE) {
+        for (uint32_t i = 0; i < kc87_archive_frames(t->archive) && !pl.pb.ended; i++) {
+            if (page_add(t, i, &pl) != 0 || play_range(t, i, 0, &pl) != 0) {
+                return -1;
+            }
+            page_close(t, &pl);
+        }
+    } else {
+        for (uint64_t offset = KCTAP_HEADER_SIZE; offset + KCTAP_RECORD <= t->size; offset += KCTAP_RECORD) {
+            if (page_add(t, offset, &pl) != 0 || play_range(t, offset, 0, &pl) != 0) {
+                return -1;
+            }
+            page_close(t, &pl);
+        }
+    }
+
+    t->words = pl.pb.words;
+    t->duration_us = pl.pb.time_us;
+    t->cached = calloc(t->page_count ? t->page_count : 1, sizeof(cache_entry_t *));
+    return t->cached ? 0 : -1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Page cache (LRU, shared by all clients)
+
+static void lru_unlink(cache_entry_t *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        lru_tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(cache_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = e;
+    } else {
+        lru_tail = e;
+    }
+    lru_head = e;
+}
+
+static void cache_drop(cache_entry_t *e)
+{
+    lru_unlink(e);
+    e->tape->cached[e->page] = NULL;
+    cache_bytes -= e->bytes;
+    free(e->words);
+    free(e);
+}
+
+static cache_entry_t *cache_get(tape_t *t, uint32_t index)
+{
+    cache_entry_t *e = t->cached[index];
+    if (e) {
+        lru_unlink(e);
+        lru_push_front(e);
+        return e;
+    }
+
+    const page_t *pg = &t->pages[index];
+    player_t pl;
+    memset(&pl, 0, sizeof(pl));
+    kc87_playback_init(&pl.pb, pg->mask);
+    pl.pb.pending_us = pg->pending_us;
+    pl.max = pg->words;
+
+    e = calloc(1, sizeof(*e));
+    pl.out = e ? malloc(pg->words ? pg->words * sizeof(uint16_t) : 1) : NULL;
+    if (!pl.out || play_range(t, pg->offset, page_end(t, index), &pl) != 0 || pl.pb.words != pg->words) {
+        free(pl.out);
+        free(e);
+        return NULL;
+    }
+    e->tape = t;
+    e->page = index;
+    e->words = pl.out;
+    e->bytes = sizeof(*e) + pg->words * sizeof(uint16_t);
+    t->cached[index] = e;
+    cache_bytes += e->bytes;
+    lru_push_front(e);
+    while (cache_bytes > cache_limit && lru_tail != e) {
+        cache_drop(lru_tail);
+    }
+    return e;
+}
+
+static void readahead_queue(tape_t *t, uint32_t index)
+{
+    if (index >= t->page_count || t->cached[index] || readahead_count == READAHEAD_MAX) {
+        return;
+    }
+    for (size_t i = 0; i < readahead_count; i++) {
+        if (readahead[i].tape == t && readahead[i].page == index) {
+            return;
+        }
+    }
+    if (t->kind == TAPE_BIN || t->kind == TAPE_RAW) {
+        // Let the kernel read the file range while the current page is still being played
+        posix_fadvise(t->fd, (off_t)t->pages[index].offset, (off_t)(page_end(t, index) - t->pages[index].offset),
+                      POSIX_FADV_WILLNEED);
+    }
+    readahead[readahead_count].tape = t;
+    readahead[readahead_count].page = index;
+    readahead_count++;
+}
+
+// Decodes one queued page, called when no client is waiting
+static void readahead_step(void)
+{
+    tape_t *t = readahead[0].tape;
+    uint32_t index = readahead[0].page;
+    memmove(&readahead[0], &readahead[1], --readahead_count * sizeof(readahead[0]));
+    if (!t->cached[index]) {
+        cache_get(t, index);
+    }
+}
+
+// Page for a client; pages decoded ahead count as hits
+static cache_entry_t *client_page(tape_t *t, uint32_t index)
+{
+    if (t->cached[index]) {
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+    return cache_get(t, index);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Tape catalog
+
+static void tape_unload(tape_t *t)
+{
+    for (uint32_t i = 0; t->cached && i < t->page_count; i++) {
+        if (t->cached[i]) {
+            cache_drop(t->cached[i]);
+        }
+    }
+    for (size_t i = 0; i < readahead_count;) {
+        if (readahead[i].tape == t) {
+            memmove(&readahead[i], &readahead[i + 1], (--readahead_count - i) * sizeof(readahead[0]));
+        } else {
+            i++;
+        }
+    }
+    if (t->fd >= 0) {
+        close(t->fd);
+    }
+    if (t->archive) {
+        kc87_archive_close(t->archive);
+    }
+    free(t->pages);
+    free(t->cached);
+    t->fd = -1;
+    t->size = 0;
+    t->archive = NULL;
+    t->pages = NULL;
+    t->cached = NULL;
+    t->page_count = t->page_capacity = 0;
+    t->loaded = false;
+}
+
+static int tape_load(tape_t *t)
+{
+    struct stat st;
+    uint8_t magic[KCTAP_HEADER_SIZE];
+    t->fd = open(t->path, O_RDONLY);
+    if (t->fd < 0 || fstat(t->fd, &st) != 0) {
+        tape_unload(t);
+        return -1;
+    }
+    t->stale = false;
+    t->file_size = st.st_size;
+    t->file_mtime = st.st_mtime;
+    t->size = (uint64_t)st.st_size;
+    ssize_t n = pread(t->fd, magic, sizeof(magic), 0);
+    if (n < 0) {
+        tape_unload(t);
+        return -1;
+    }
+    size_t head = (size_t)n;
+
+    if (kc87_is_archive(magic, head)) {
+        // Frames are decoded through the archive reader; the index is its own
+        t->kind = TAPE_ARCHIVE;
+        t->archive = kc87_archive_open(t->path);
+        if (!t->archive) {
+            tape_unload(t);
+            return -1;
+        }
+        size_t first = kc87_archive_frames(t->archive) > 0 ? read_frame(t, 0) : 0;
+        if (kc87_archive_frames(t->archive) > 0 && !kc87_has_header(frame_buf, first)) {
+            fprintf(stderr, "%s: archive without header block (old capture format), unpack it first\n", t->name);
+            tape_unload(t);
+            return -1;
+        }
+    } else if (head == KCTAP_HEADER_SIZE && memcmp(magic, KCTAP_HEADER, KCTAP_HEADER_SIZE) == 0) {
+        t->kind = TAPE_TAP;
+    } else {
+        // A header block at offset 0 is complete within the first bytes
+        t->kind = kc87_has_header(magic, head) ? TAPE_BIN : TAPE_RAW;
+    }
+
+    int result = index_tape(t);
+    // Indexing a .bin reads the whole file, pages only need a fraction of that buffer
+    free(file_buf);
+    file_buf = NULL;
+    file_max = 0;
+    if (result != 0) {
+        tape_unload(t);
+        return -1;
+    }
+    t->loaded = true;
+    printf("Loaded %s: %llu words, %.3f s, %u pages\n", t->name, (unsigned long long)t->words,
+           t->duration_us / 1e6, (unsigned)t->page_count);
+    fflush(stdout);
+    return 0;
+}
+
+static bool tape_file(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    return dot && (strcasecmp(dot, ".bin") == 0 || strcasecmp(dot, ".kca") == 0 || strcasecmp(dot, ".tap") == 0);
+}
+
+static tape_t *tape_find(const char *name)
+{
+    for (size_t i = 0; i < tape_count; i++) {
+        if (strcmp(tapes[i]->name, name) == 0) {
+            return tapes[i];
+        }
+    }
+    return NULL;
+}
+
+static void catalog_add(const char *path, const char *name)
+{
+    struct stat st;
+    if (strlen(name) > NAME_MAX || strlen(path) >= PATH_MAX || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    tape_t *t = tape_find(name);
+    if (t) {
+        // Same name in an earlier root wins
+        if (strcmp(t->path, path) == 0) {
+            t->present = true;
+        }
+        return;
+    }
+    if (tape_count == MAX_TAPES || !(t = calloc(1, sizeof(*t)))) {
+        return;
+    }
+    strcpy(t->name, name);
+    strcpy(t->path, path);
+    t->fd = -1;
+    t->present = true;
+    tapes[tape_count++] = t;
+}
+
+static int compare_tapes(const void *a, const void *b)
+{
+    return strcmp((*(tape_t *const *)a)->name, (*(tape_t *const *)b)->name);
+}
+
+// Rescans all roots; tapes that disappeared stay loaded for their clients but are not listed
+static void catalog_scan(void)
+{
+    for (size_t i = 0; i < tape_count; i++) {
+        tapes[i]->present = false;
+    }
+    for (size_t r = 0; r < root_count; r++) {
+        DIR *dir = opendir(roots[r]);
+        if (!dir) {
+            const char *slash = strrchr(roots[r], '/');
+            catalog_add(roots[r], slash ? slash + 1 : roots[r]);
+            continue;
+        }
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            char path[PATH_MAX];
+            if (de->d_name[0] != '.' && tape_file(de->d_name) &&
+                snprintf(path, sizeof(path), "%s/%s", roots[r], de->d_name) < (int)sizeof(path)) {
+                catalog_add(path, de->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    qsort(tapes, tape_count, sizeof(tapes[0]), compare_tapes);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Clients
+
+static int client_append(client_t *c, const void *data, size_t len)
+{
+    if (c->out_len + len > c->out_capacity) {
+        size_t capacity = c->out_capacity ? c->out_capacity : 4096;
+        while (c->out_len + len > capacity) {
+            capacity *= 2;
+        }
+        uint8_t *out = realloc(c->out, capacity);
+        if (!out) {
+            return -1;
+        }
+        c->out = out;
+        c->out_capacity = capacity;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+static int client_printf(client_t *c, const char *fmt, ...)
+{
+    char line[COMMAND_MAX + NAME_MAX + 64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return -1;
+    }
+    return client_append(c, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+static void client_close(client_t *c)
+{
+    if (c->tape) {
+        c->tape->clients--;
+    }
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+// Positions the client at time_us: the first edge at or after time_us comes next, with the
+// part of its delta before time_us removed
+static void client_seek(client_t *c, uint64_t time_us)
+{
+    tape_t *t = c->tape;
+    uint32_t lo = 0;
+    uint32_t hi = t->page_count;
+
+    c->skip_us = 0;
+    if (time_us > t->duration_us) {
+        c->page = t->page_count;
+        c->word = t->words;
+        c->time_us = t->duration_us;
+        return;
+    }
+    // Last page starting before time_us (an edge at a page start belongs to the page before)
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (t->pages[mid].time_us < time_us) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    for (uint32_t p = lo; p < t->page_count; p++) {
+        const page_t *pg = &t->pages[p];
+        cache_entry_t *e = pg->words ? client_page(t, p) : NULL;
+        uint64_t time = pg->time_us;
+        for (uint32_t i = 0; e && i < pg->words; i++) {
+            uint32_t delta = e->words[i] & KC87_PLAYBACK_DELTA_MAX;
+            if (time + delta >= time_us) {
+                c->page = p;
+                c->word = pg->word + i;
+                c->time_us = time_us;
+                c->skip_us = (uint32_t)(time_us - time);
+                readahead_queue(t, p + 1);
+                return;
+            }
+            time += delta;
+        }
+    }
+    c->page = t->page_count;
+    c->word = t->words;
+    c->time_us = t->duration_us;
+}
+
+// Appends the next DATA message, or EOT at the end of the tape
+static void client_fill(client_t *c)
+{
+    tape_t *t = c->tape;
+    while (c->page < t->page_count && c->word >= t->pages[c->page].word + t->pages[c->page].words) {
+        c->page++;
+    }
+    if (c->page >= t->page_count) {
+        client_printf(c, "EOT %llu\n", (unsigned long long)c->time_us);
+        c->playing = false;
+        return;
+    }
+
+    const page_t *pg = &t->pages[c->page];
+    cache_entry_t *e = client_page(t, c->page);
+    if (!e) {
+        client_printf(c, "ERR cannot read tape\n");
+        c->playing = false;
+        return;
+    }
+    uint32_t first = (uint32_t)(c->word - pg->word);
+    uint32_t n = pg->words - first < DATA_WORDS_MAX ? pg->words - first : DATA_WORDS_MAX;
+    uint8_t data[2 * DATA_WORDS_MAX];
+    for (uint32_t i = 0; i < n; i++) {
+        uint16_t word = e->words[first + i];
+        if (i == 0 && c->skip_us) {
+            word = (uint16_t)((word & 0x8000) | ((word & KC87_PLAYBACK_DELTA_MAX) - c->skip_us));
+            c->skip_us = 0;
+        }
+        c->time_us += word & KC87_PLAYBACK_DELTA_MAX;
+        data[2 * i] = (uint8_t)word;
+        data[2 * i + 1] = (uint8_t)(word >> 8);
+    }
+    c->word += n;
+    client_printf(c, "DATA %u\n", (unsigned)n);
+    client_append(c, data, 2 * n);
+    if (first == 0) {
+        readahead_queue(t, c->page + 1);
+    }
+}
+
+static void command_list(client_t *c)
+{
+    static const char *formats[] = { "bin", "raw", "kca", "tap" };
+    size_t listed = 0;
+
+    catalog_scan();
+    for (size_t i = 0; i < tape_count; i++) {
+        tape_t *t = tapes[i];
+        struct stat st;
+        if (!t->present || stat(t->path, &st) != 0) {
+            continue;
+        }
+        const char *dot = strrchr(t->name, '.');
+        const char *format = t->loaded ? formats[t->kind] : dot ? dot + 1 : "bin";
+        if (t->loaded) {
+            client_printf(c, "TAPE %s %lld %llu %s\n", format, (long long)st.st_size,
+                          (unsigned long long)t->duration_us, t->name);
+        } else {
+            client_printf(c, "TAPE %s %lld - %s\n", format, (long long)st.st_size, t->name);
+        }
+        listed++;
+    }
+    client_printf(c, "OK %zu\n", listed);
+}
+
+static void command_load(client_t *c, const char *name)
+{
+    tape_t *t = tape_find(name);
+    if (!t || !t->present) {
+        catalog_scan();
+        t = tape_find(name);
+    }
+    if (!t || !t->present) {
+        client_printf(c, "ERR unknown tape\n");
+        return;
+    }
+
+    // A file replaced or changed since it was indexed is reloaded once no client plays it
+    struct stat st;
+    if (t->loaded && t->clients == (c->tape == t ? 1u : 0u) && stat(t->path, &st) == 0 &&
+        (t->stale || st.st_size != t->file_size || st.st_mtime != t->file_mtime)) {
+        tape_unload(t);
+    }
+    if (!t->loaded && tape_load(t) != 0) {
+        client_printf(c, "ERR cannot read tape\n");
+        return;
+    }
+
+    if (c->tape) {
+        c->tape->clients--;
+    }
+    c->tape = t;
+    t->clients++;
+    c->playing = false;
+    client_seek(c, 0);
+    client_printf(c, "OK %llu %llu\n", (unsigned long long)t->words, (unsigned long long)t->duration_us);
+}
+
+static void client_command(client_t *c, char *line)
+{
+    char *arg = line;
+    while (*arg && !isspace((unsigned char)*arg)) {
+        arg++;
+    }
+    if (*arg) {
+        *arg++ = '\0';
+        while (isspace((unsigned char)*arg)) {
+            arg++;
+        }
+    }
+
+    if (strcasecmp(line, "LIST") == 0) {
+        command_list(c);
+    } else if (strcasecmp(line, "LOAD") == 0 && *arg) {
+        command_load(c, arg);
+    } else if (strcasecmp(line, "STATUS") == 0) {
+        client_printf(c, "OK %s %llu %s\n", c->playing ? "playing" : "stopped",
+                      (unsigned long long)c->time_us, c->tape ? c->tape->name : "-");
+    } else if (!c->tape && (strcasecmp(line, "PLAY") == 0 || strcasecmp(line, "STOP") == 0 ||
+                            strcasecmp(line, "SEEK") == 0)) {
+        client_printf(c, "ERR no tape loaded\n");
+    } else if (strcasecmp(line, "PLAY") == 0) {
+        client_printf(c, "OK PLAY %llu\n", (unsigned long long)c->time_us);
+        c->playing = true;
+    } else if (strcasecmp(line, "STOP") == 0) {
+        c->playing = false;
+        client_printf(c, "OK STOP %llu\n", (unsigned long long)c->time_us);
+    } else if (strcasecmp(line, "SEEK") == 0 && isdigit((unsigned char)*arg)) {
+        char *end;
+        errno = 0;
+        unsigned long long time_us = strtoull(arg, &end, 10);
+        if (*end || errno) {
+            client_printf(c, "ERR bad time\n");
+            return;
+        }
+        client_seek(c, time_us);
+        client_printf(c, "OK SEEK %llu\n", (unsigned long long)c->time_us);
+    } else {
+        client_printf(c, "ERR unknown command\n");
+    }
+}
+
+static int client_read(client_t *c)
+{
+    char buf[1024];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        return -1;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] == '\n') {
+            if (c->discard) {
+                client_printf(c, "ERR line too long\n");
+            } else {
+                if (c->line_len > 0 && c->line[c->line_len - 1] == '\r') {
+                    c->line_len--;
+                }
+                c->line[c->line_len] = '\0';
+                if (c->line_len > 0) {
+                    client_command(c, c->line);
+                }
+            }
+            c->line_len = 0;
+            c->discard = false;
+        } else if (c->line_len < COMMAND_MAX - 1) {
+            c->line[c->line_len++] = buf[i];
+        } else {
+            c->discard = true;
+        }
+    }
+    return 0;
+}
+
+static int client_write(client_t *c)
+{
+    for (int fills = 0;;) {
+        if (c->out_pos == c->out_len) {
+            c->out_pos = c->out_len = 0;
+            if (!c->playing || fills++ == FILLS_PER_WAKEUP) {
+                return 0;
+            }
+            client_fill(c);
+        }
+        ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, 0);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        c->out_pos += (size_t)n;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Server
+
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // Only a stale socket is replaced, never a file that happens to have the name
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(const char *spec)
+{
+    char host[64] = "127.0.0.1";
+    const char *colon = strrchr(spec, ':');
+    const char *port = spec;
+    if (colon) {
+        if ((size_t)(colon - spec) >= sizeof(host)) {
+            fprintf(stderr, "Bad address: %s\n", spec);
+            return -1;
+        }
+        memcpy(host, spec, (size_t)(colon - spec));
+        host[colon - spec] = '\0';
+        port = colon + 1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(port));
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || atoi(port) <= 0 || atoi(port) > 65535) {
+        fprintf(stderr, "Bad address: %s\n", spec);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror(spec);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_client(int listen_fd, bool tcp)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            int one = 1;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if (tcp) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            clients[i].fd = fd;
+            return;
+        }
+    }
+    fprintf(stderr, "Too many clients, connection refused\n");
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    const char *unix_path = NULL;
+    const char *tcp_spec = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tcp_spec = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            int mb = atoi(argv[++i]);
+            if (mb < 1) {
+                fprintf(stderr, "Cache size must be at least 1 MB\n");
+                return 1;
+            }
+            cache_limit = (size_t)mb << 20;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] != '-' && root_count < MAX_ROOTS) {
+            roots[root_count++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (root_count == 0 || (!unix_path && !tcp_spec)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int unix_fd = unix_path ? listen_unix(unix_path) : -1;
+    int tcp_fd = tcp_spec ? listen_tcp(tcp_spec) : -1;
+    if ((unix_path && unix_fd < 0) || (tcp_spec && tcp_fd < 0)) {
+        if (unix_fd >= 0) {
+            close(unix_fd);
+            unlink(unix_path);
+        }
+        return 1;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+
+    catalog_scan();
+    printf("Serving %zu tapes on%s%s%s%s, cache %zu MB\n", tape_count, unix_path ? " " : "",
+           unix_path ? unix_path : "", tcp_spec ? " tcp:" : "", tcp_spec ? tcp_spec : "", cache_limit >> 20);
+    fflush(stdout);
+
+    struct pollfd fds[2 + MAX_CLIENTS];
+    int owner[2 + MAX_CLIENTS];
+    while (!stop_requested) {
+        nfds_t n = 0;
+        if (unix_fd >= 0) {
+            fds[n] = (struct pollfd){ unix_fd, POLLIN, 0 };
+            owner[n++] = -1;
+        }
+        if (tcp_fd >= 0) {
+            fds[n] = (struct pollfd){ tcp_fd, POLLIN, 0 };
+            owner[n++] = -2;
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd >= 0) {
+                bool pending = clients[i].out_pos < clients[i].out_len || clients[i].playing;
+                fds[n] = (struct pollfd){ clients[i].fd, (short)(POLLIN | (pending ? POLLOUT : 0)), 0 };
+                owner[n++] = i;
+            }
+        }
+
+        int ready = poll(fds, n, readahead_count > 0 ? 0 : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (ready == 0) {
+            readahead_step();
+            continue;
+        }
+
+        for (nfds_t k = 0; k < n; k++) {
+            if (!fds[k].revents) {
+                continue;
+            }
+            if (owner[k] < 0) {
+                accept_client(fds[k].fd, owner[k] == -2);
+                continue;
+            }
+            client_t *c = &clients[owner[k]];
+            if (((fds[k].revents & (POLLIN | POLLHUP | POLLERR)) && client_read(c) != 0) ||
+                client_write(c) != 0) {
+                client_close(c);
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            client_close(&clients[i]);
+        }
+    }
+    for (size_t i = 0; i < tape_count; i++) {
+        tape_unload(tapes[i]);
+        free(tapes[i]);
+    }
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path);
+    }
+    if (tcp_fd >= 0) {
+        close(tcp_fd);
+    }
+    free(frame_buf);
+    free(file_buf);
+    printf("Page cache: %llu hits, %llu misses\n", (unsigned long long)cache_hits,
+           (unsigned long long)cache_misses);
+    return 0;
+}